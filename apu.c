@@ -0,0 +1,587 @@
+#include <string.h>
+#include "apu.h"
+#include "scheduler.h"
+
+static const uint8_t length_table[32] = {
+    10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+    12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+static const uint8_t duty_table[4][8] = {
+    {0, 1, 0, 0, 0, 0, 0, 0},
+    {0, 1, 1, 0, 0, 0, 0, 0},
+    {0, 1, 1, 1, 1, 0, 0, 0},
+    {1, 0, 0, 1, 1, 1, 1, 1}
+};
+
+static const uint8_t triangle_table[32] = {
+    15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+};
+
+// Noise and DMC timer periods in CPU cycles (NTSC)
+static const uint16_t noise_table[16] = {
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
+};
+
+static const uint16_t dmc_table[16] = {
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54
+};
+
+// Frame counter steps in CPU cycles from the start of the sequence (NTSC)
+static const uint32_t frame_steps[2][4] = {
+    {7457, 14913, 22371, 29829},
+    {7457, 14913, 22371, 37281}
+};
+static const uint32_t frame_period[2] = {29830, 37282};
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static void clock_envelope(struct apu_envelope *envelope)
+{
+    if(envelope->start)
+    {
+        envelope->start = false;
+        envelope->decay = 15;
+        envelope->divider = envelope->period;
+    }
+    else if(envelope->divider == 0)
+    {
+        envelope->divider = envelope->period;
+        if(envelope->decay > 0)
+            envelope->decay -= 1;
+        else if(envelope->loop)
+            envelope->decay = 15;
+    }
+    else
+    {
+        envelope->divider -= 1;
+    }
+}
+
+static inline uint8_t envelope_volume(const struct apu_envelope *envelope)
+{
+    return envelope->constant ? envelope->period : envelope->decay;
+}
+
+static uint16_t sweep_target(const struct apu_pulse *pulse)
+{
+    uint16_t change = pulse->period >> pulse->sweep_shift;
+    if(!pulse->sweep_negate)
+        return pulse->period + change;
+    if(change + pulse->ones_complement > pulse->period)
+        return 0;
+    return pulse->period - change - pulse->ones_complement;
+}
+
+static inline bool pulse_muted(const struct apu_pulse *pulse)
+{
+    return pulse->length == 0 || pulse->period < 8 || sweep_target(pulse) > 0x7FF;
+}
+
+static void clock_sweep(struct apu_pulse *pulse)
+{
+    if(pulse->sweep_divider == 0 && pulse->sweep_enabled && pulse->sweep_shift > 0 && !pulse_muted(pulse))
+        pulse->period = sweep_target(pulse);
+    if(pulse->sweep_divider == 0 || pulse->sweep_reload)
+    {
+        pulse->sweep_divider = pulse->sweep_period;
+        pulse->sweep_reload = false;
+    }
+    else
+    {
+        pulse->sweep_divider -= 1;
+    }
+}
+
+static void clock_quarter_frame(apu_t *apu)
+{
+    clock_envelope(&apu->pulse[0].envelope);
+    clock_envelope(&apu->pulse[1].envelope);
+    clock_envelope(&apu->noise.envelope);
+
+    struct apu_triangle *triangle = &apu->triangle;
+    if(triangle->linear_reload)
+        triangle->linear = triangle->linear_period;
+    else if(triangle->linear > 0)
+        triangle->linear -= 1;
+    if(!triangle->control)
+        triangle->linear_reload = false;
+}
+
+static void clock_half_frame(apu_t *apu)
+{
+    for(int i = 0; i < 2; i++)
+    {
+        if(apu->pulse[i].length > 0 && !apu->pulse[i].envelope.loop)
+            apu->pulse[i].length -= 1;
+        clock_sweep(&apu->pulse[i]);
+    }
+    if(apu->triangle.length > 0 && !apu->triangle.control)
+        apu->triangle.length -= 1;
+    if(apu->noise.length > 0 && !apu->noise.envelope.loop)
+        apu->noise.length -= 1;
+}
+
+static void set_irq(apu_t *apu)
+{
+    cpu_irq(apu->cpu, IRQ_APU_FRAME, apu->frame_irq);
+    cpu_irq(apu->cpu, IRQ_APU_DMC, apu->dmc_irq);
+}
+
+// The memory reader refills the DMC's sample buffer as soon as it empties
+static void dmc_fetch(apu_t *apu)
+{
+    struct apu_dmc *dmc = &apu->dmc;
+    if(dmc->buffer_full || dmc->bytes_remaining == 0)
+        return;
+    dmc->buffer = bus_read(&apu->cpu->bus, dmc->address);
+    dmc->buffer_full = true;
+    dmc->address = (dmc->address == 0xFFFF) ? 0x8000 : dmc->address + 1;
+    dmc->bytes_remaining -= 1;
+    if(dmc->bytes_remaining == 0)
+    {
+        if(dmc->loop)
+        {
+            dmc->address = dmc->sample_address;
+            dmc->bytes_remaining = dmc->sample_length;
+        }
+        else if(dmc->irq_enabled)
+        {
+            apu->dmc_irq = true;
+            set_irq(apu);
+        }
+    }
+}
+
+/*
+ * Channels that cannot change their output stop scheduling timer ticks,
+ * so a quiet APU has no events between frame counter steps. Sequencer
+ * phase is lost while stopped, which is inaudible.
+ */
+static void schedule(apu_t *apu)
+{
+    for(int i = 0; i < 2; i++)
+    {
+        struct apu_pulse *pulse = &apu->pulse[i];
+        if(pulse_muted(pulse))
+            pulse->next_tick = APU_NEVER;
+        else if(pulse->next_tick == APU_NEVER)
+            pulse->next_tick = apu->cycle + (pulse->period + 1) * 2;
+    }
+
+    struct apu_triangle *triangle = &apu->triangle;
+    // Ultrasonic periods are held still rather than aliased
+    if(triangle->length == 0 || triangle->linear == 0 || triangle->period < 2)
+        triangle->next_tick = APU_NEVER;
+    else if(triangle->next_tick == APU_NEVER)
+        triangle->next_tick = apu->cycle + triangle->period + 1;
+
+    if(apu->noise.length == 0)
+        apu->noise.next_tick = APU_NEVER;
+    else if(apu->noise.next_tick == APU_NEVER)
+        apu->noise.next_tick = apu->cycle + apu->noise.period;
+
+    struct apu_dmc *dmc = &apu->dmc;
+    if(dmc->silence && !dmc->buffer_full)
+        dmc->next_tick = APU_NEVER;
+    else if(dmc->next_tick == APU_NEVER)
+        dmc->next_tick = apu->cycle + dmc->rate;
+}
+
+static void tick_dmc(apu_t *apu)
+{
+    struct apu_dmc *dmc = &apu->dmc;
+    if(!dmc->silence)
+    {
+        if(dmc->shift & 1)
+        {
+            if(dmc->output <= 125)
+                dmc->output += 2;
+        }
+        else if(dmc->output >= 2)
+        {
+            dmc->output -= 2;
+        }
+    }
+    dmc->shift >>= 1;
+    dmc->bits -= 1;
+    if(dmc->bits == 0)
+    {
+        dmc->bits = 8;
+        dmc->silence = !dmc->buffer_full;
+        if(dmc->buffer_full)
+        {
+            dmc->shift = dmc->buffer;
+            dmc->buffer_full = false;
+        }
+        dmc_fetch(apu);
+    }
+    if(dmc->silence && !dmc->buffer_full)
+        dmc->next_tick = APU_NEVER;
+    else
+        dmc->next_tick += dmc->rate;
+}
+
+static void tick_noise(struct apu_noise *noise)
+{
+    uint16_t feedback = (noise->shift ^ (noise->shift >> (noise->mode ? 6 : 1))) & 1;
+    noise->shift = (noise->shift >> 1) | (feedback << 14);
+    noise->next_tick += noise->period;
+}
+
+static void frame_step(apu_t *apu)
+{
+    int step = apu->frame_step;
+    clock_quarter_frame(apu);
+    if(step == 1 || step == 3)
+        clock_half_frame(apu);
+    if(step == 3 && !apu->five_step && !apu->irq_inhibit)
+    {
+        apu->frame_irq = true;
+        set_irq(apu);
+    }
+    if(step == 3)
+    {
+        apu->frame_start += frame_period[apu->five_step];
+        apu->frame_step = 0;
+    }
+    else
+    {
+        apu->frame_step += 1;
+    }
+    apu->frame_next = apu->frame_start + frame_steps[apu->five_step][apu->frame_step];
+    schedule(apu);
+}
+
+// Non-linear 2A03 mixer, output in [0, 1)
+static double mix(const apu_t *apu)
+{
+    int pulse_sum = 0;
+    for(int i = 0; i < 2; i++)
+    {
+        const struct apu_pulse *pulse = &apu->pulse[i];
+        if(!pulse_muted(pulse) && duty_table[pulse->duty][pulse->step])
+            pulse_sum += envelope_volume(&pulse->envelope);
+    }
+    int triangle = triangle_table[apu->triangle.step];
+    int noise = (apu->noise.length > 0 && !(apu->noise.shift & 1)) ? envelope_volume(&apu->noise.envelope) : 0;
+    int dmc = apu->dmc.output;
+
+    double out = 0.0;
+    if(pulse_sum > 0)
+        out += 95.88 / (8128.0 / pulse_sum + 100.0);
+    double tnd = triangle / 8227.0 + noise / 12241.0 + dmc / 22638.0;
+    if(tnd > 0.0)
+        out += 159.79 / (1.0 / tnd + 100.0);
+    return out;
+}
+
+/*
+ * The block pass: a DC-blocking high-pass, then scaling and clamping to
+ * 16 bits in a loop with no dependencies between samples.
+ */
+void apu_flush(apu_t *apu)
+{
+    int count = apu->block_count;
+    if(count == 0 || apu->ring == NULL)
+        return;
+    float *block = apu->block;
+    float in = apu->highpass_in;
+    float out = apu->highpass_out;
+    for(int i = 0; i < count; i++)
+    {
+        out = apu->highpass_factor * (out + block[i] - in);
+        in = block[i];
+        block[i] = out;
+    }
+    apu->highpass_in = in;
+    apu->highpass_out = out;
+
+    int16_t samples[APU_BLOCK_SIZE];
+    for(int i = 0; i < count; i++)
+    {
+        float scaled = block[i] * 32767.0f;
+        scaled = scaled > 32767.0f ? 32767.0f : scaled;
+        scaled = scaled < -32768.0f ? -32768.0f : scaled;
+        samples[i] = (int16_t)scaled;
+    }
+    audio_ring_write(apu->ring, samples, count);
+    apu->block_count = 0;
+}
+
+static void emit_sample(apu_t *apu)
+{
+    apu->block[apu->block_count++] = (float)(apu->accumulator / (double)(apu->sample_end - apu->sample_start));
+    apu->accumulator = 0.0;
+    apu->samples += 1;
+    apu->sample_start = apu->sample_end;
+    apu->sample_end = apu->output_start + (apu->samples + 1) * APU_CPU_CLOCK / apu->sample_rate;
+    if(apu->block_count == APU_BLOCK_SIZE)
+        apu_flush(apu);
+}
+
+void apu_catch_up(apu_t *apu)
+{
+    uint64_t target = apu->cpu->cycles;
+    while(apu->cycle < target)
+    {
+        struct apu_pulse *pulse = apu->pulse;
+        uint64_t next = MIN(target, apu->frame_next);
+        next = MIN(next, MIN(pulse[0].next_tick, pulse[1].next_tick));
+        next = MIN(next, MIN(apu->triangle.next_tick, apu->noise.next_tick));
+        next = MIN(next, MIN(apu->dmc.next_tick, apu->sample_end));
+
+        apu->accumulator += apu->level * (double)(next - apu->cycle);
+        apu->cycle = next;
+
+        for(int i = 0; i < 2; i++)
+        {
+            if(pulse[i].next_tick == next)
+            {
+                pulse[i].step = (pulse[i].step + 1) & 7;
+                pulse[i].next_tick += (pulse[i].period + 1) * 2;
+            }
+        }
+        if(apu->triangle.next_tick == next)
+        {
+            apu->triangle.step = (apu->triangle.step + 1) & 31;
+            apu->triangle.next_tick += apu->triangle.period + 1;
+        }
+        if(apu->noise.next_tick == next)
+            tick_noise(&apu->noise);
+        if(apu->dmc.next_tick == next)
+            tick_dmc(apu);
+        if(apu->frame_next == next)
+            frame_step(apu);
+        apu->level = mix(apu);
+        if(apu->sample_end == next)
+            emit_sample(apu);
+    }
+}
+
+uint64_t apu_next_event(const apu_t *apu)
+{
+    uint64_t next = APU_NEVER;
+    if(!apu->five_step && !apu->irq_inhibit && !apu->frame_irq)
+        next = apu->frame_start + frame_steps[0][3];
+    const struct apu_dmc *dmc = &apu->dmc;
+    if(dmc->irq_enabled && !dmc->loop && dmc->bytes_remaining > 0 && dmc->next_tick != APU_NEVER)
+    {
+        // The last byte is fetched when the shifter empties for the bytes_remaining-th time
+        uint64_t last_fetch = dmc->next_tick + (uint64_t)(dmc->bits - 1) * dmc->rate +
+                              (uint64_t)(dmc->bytes_remaining - 1) * 8 * dmc->rate;
+        next = MIN(next, last_fetch);
+    }
+    if(next != APU_NEVER && next <= apu->cycle)
+        next = apu->cycle + 1;
+    return next;
+}
+
+static void write_envelope(struct apu_envelope *envelope, uint8_t data)
+{
+    envelope->loop = data & 0x20;
+    envelope->constant = data & 0x10;
+    envelope->period = data & 0x0F;
+}
+
+static void write_pulse(apu_t *apu, struct apu_pulse *pulse, int reg, uint8_t data, bool enabled)
+{
+    switch(reg)
+    {
+        case 0:
+            pulse->duty = data >> 6;
+            write_envelope(&pulse->envelope, data);
+            break;
+        case 1:
+            pulse->sweep_enabled = data & 0x80;
+            pulse->sweep_period = (data >> 4) & 7;
+            pulse->sweep_negate = data & 0x08;
+            pulse->sweep_shift = data & 7;
+            pulse->sweep_reload = true;
+            break;
+        case 2:
+            pulse->period = (pulse->period & 0x700) | data;
+            break;
+        case 3:
+            pulse->period = (pulse->period & 0xFF) | ((data & 7) << 8);
+            if(enabled)
+                pulse->length = length_table[data >> 3];
+            pulse->step = 0;
+            pulse->envelope.start = true;
+            break;
+    }
+}
+
+void apu_write(apu_t *apu, uint16_t address, uint8_t data)
+{
+    apu_catch_up(apu);
+    switch(address)
+    {
+        case 0x4000: case 0x4001: case 0x4002: case 0x4003:
+            write_pulse(apu, &apu->pulse[0], address & 3, data, apu->enabled & 0x01);
+            break;
+        case 0x4004: case 0x4005: case 0x4006: case 0x4007:
+            write_pulse(apu, &apu->pulse[1], address & 3, data, apu->enabled & 0x02);
+            break;
+        case 0x4008:
+            apu->triangle.control = data & 0x80;
+            apu->triangle.linear_period = data & 0x7F;
+            break;
+        case 0x400A:
+            apu->triangle.period = (apu->triangle.period & 0x700) | data;
+            break;
+        case 0x400B:
+            apu->triangle.period = (apu->triangle.period & 0xFF) | ((data & 7) << 8);
+            if(apu->enabled & 0x04)
+                apu->triangle.length = length_table[data >> 3];
+            apu->triangle.linear_reload = true;
+            break;
+        case 0x400C:
+            write_envelope(&apu->noise.envelope, data);
+            break;
+        case 0x400E:
+            apu->noise.mode = data & 0x80;
+            apu->noise.period = noise_table[data & 0x0F];
+            break;
+        case 0x400F:
+            if(apu->enabled & 0x08)
+                apu->noise.length = length_table[data >> 3];
+            apu->noise.envelope.start = true;
+            break;
+        case 0x4010:
+            apu->dmc.irq_enabled = data & 0x80;
+            apu->dmc.loop = data & 0x40;
+            apu->dmc.rate = dmc_table[data & 0x0F];
+            if(!apu->dmc.irq_enabled)
+            {
+                apu->dmc_irq = false;
+                set_irq(apu);
+            }
+            break;
+        case 0x4011:
+            apu->dmc.output = data & 0x7F;
+            break;
+        case 0x4012:
+            apu->dmc.sample_address = 0xC000 + data * 64;
+            break;
+        case 0x4013:
+            apu->dmc.sample_length = data * 16 + 1;
+            break;
+        case 0x4015:
+            apu->enabled = data & 0x1F;
+            apu->dmc_irq = false;
+            if(!(data & 0x01))
+                apu->pulse[0].length = 0;
+            if(!(data & 0x02))
+                apu->pulse[1].length = 0;
+            if(!(data & 0x04))
+                apu->triangle.length = 0;
+            if(!(data & 0x08))
+                apu->noise.length = 0;
+            if(!(data & 0x10))
+            {
+                apu->dmc.bytes_remaining = 0;
+            }
+            else if(apu->dmc.bytes_remaining == 0)
+            {
+                apu->dmc.address = apu->dmc.sample_address;
+                apu->dmc.bytes_remaining = apu->dmc.sample_length;
+                dmc_fetch(apu);
+            }
+            set_irq(apu);
+            break;
+        case 0x4017:
+            apu->five_step = data & 0x80;
+            apu->irq_inhibit = data & 0x40;
+            if(apu->irq_inhibit)
+            {
+                apu->frame_irq = false;
+                set_irq(apu);
+            }
+            apu->frame_start = apu->cycle;
+            apu->frame_step = 0;
+            apu->frame_next = apu->frame_start + frame_steps[apu->five_step][0];
+            if(apu->five_step)
+            {
+                clock_quarter_frame(apu);
+                clock_half_frame(apu);
+            }
+            break;
+    }
+    schedule(apu);
+    apu->level = mix(apu);
+    // Only these move the frame and DMC IRQs
+    if(address == 0x4010 || address == 0x4015 || address == 0x4017)
+        scheduler_reschedule(apu->cpu->scheduler, SOURCE_APU);
+}
+
+uint8_t apu_read_status(apu_t *apu)
+{
+    apu_catch_up(apu);
+    uint8_t status = 0;
+    status |= apu->pulse[0].length > 0 ? 0x01 : 0;
+    status |= apu->pulse[1].length > 0 ? 0x02 : 0;
+    status |= apu->triangle.length > 0 ? 0x04 : 0;
+    status |= apu->noise.length > 0 ? 0x08 : 0;
+    status |= apu->dmc.bytes_remaining > 0 ? 0x10 : 0;
+    status |= apu->frame_irq ? 0x40 : 0;
+    status |= apu->dmc_irq ? 0x80 : 0;
+    // Reading acknowledges the frame interrupt, bringing the next one due
+    bool acknowledged = apu->frame_irq;
+    apu->frame_irq = false;
+    set_irq(apu);
+    if(acknowledged)
+        scheduler_reschedule(apu->cpu->scheduler, SOURCE_APU);
+    return status;
+}
+
+uint64_t apu_status_stable_until(apu_t *apu)
+{
+    apu_catch_up(apu);
+    // Length counters and the frame IRQ change on frame steps, the DMC bits on its fetches
+    uint64_t next = apu->frame_next;
+    if(apu->dmc.bytes_remaining > 0)
+        next = MIN(next, apu->dmc.next_tick);
+    return next;
+}
+
+void apu_set_output(apu_t *apu, audio_ring_t *ring, uint32_t sample_rate)
+{
+    apu_catch_up(apu);
+    apu_flush(apu);
+    apu->ring = ring;
+    apu->sample_rate = sample_rate;
+    apu->accumulator = 0.0;
+    apu->samples = 0;
+    apu->output_start = apu->cycle;
+    apu->sample_start = apu->cycle;
+    if(ring == NULL)
+    {
+        apu->sample_end = APU_NEVER;
+        return;
+    }
+    apu->sample_end = apu->output_start + APU_CPU_CLOCK / sample_rate;
+    // One-pole DC blocker with its corner around 37 Hz
+    apu->highpass_factor = 1.0f - 2.0f * 3.14159265f * 37.0f / sample_rate;
+}
+
+void apu_init(apu_t *apu, cpu_t *cpu)
+{
+    memset(apu, 0, sizeof(*apu));
+    apu->cpu = cpu;
+    apu->pulse[0].ones_complement = true;
+    apu->noise.shift = 1;
+    apu->noise.period = noise_table[0];
+    apu->dmc.rate = dmc_table[0];
+    apu->dmc.bits = 8;
+    apu->dmc.silence = true;
+    apu->dmc.sample_length = 1;
+    apu->dmc.sample_address = 0xC000;
+    apu->cycle = cpu->cycles;
+    apu->frame_start = apu->cycle;
+    apu->frame_next = apu->frame_start + frame_steps[0][0];
+    apu_set_output(apu, NULL, 0);
+    schedule(apu);
+    apu->level = mix(apu);
+}
@@ -0,0 +1,151 @@
+#ifndef APU_H
+#define APU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "audio_ring.h"
+#include "cpu.h"
+
+#define APU_CPU_CLOCK 1789773
+#define APU_BLOCK_SIZE 256
+#define APU_NEVER UINT64_MAX
+
+struct apu_envelope
+{
+    bool start;
+    bool loop;
+    bool constant;
+    uint8_t period;
+    uint8_t divider;
+    uint8_t decay;
+};
+
+struct apu_pulse
+{
+    struct apu_envelope envelope;
+    uint8_t duty;
+    uint8_t step;
+    uint16_t period;
+    uint8_t length;
+    bool sweep_enabled;
+    bool sweep_negate;
+    bool sweep_reload;
+    uint8_t sweep_period;
+    uint8_t sweep_shift;
+    uint8_t sweep_divider;
+    // Pulse 1 negates its sweep with ones' complement, pulse 2 with two's
+    bool ones_complement;
+    uint64_t next_tick;
+};
+
+struct apu_triangle
+{
+    bool control;
+    bool linear_reload;
+    uint8_t linear_period;
+    uint8_t linear;
+    uint8_t length;
+    uint16_t period;
+    uint8_t step;
+    uint64_t next_tick;
+};
+
+struct apu_noise
+{
+    struct apu_envelope envelope;
+    bool mode;
+    uint16_t period;
+    uint16_t shift;
+    uint8_t length;
+    uint64_t next_tick;
+};
+
+struct apu_dmc
+{
+    bool irq_enabled;
+    bool loop;
+    uint16_t rate;
+    uint16_t sample_address;
+    uint16_t sample_length;
+    uint16_t address;
+    uint16_t bytes_remaining;
+    uint8_t output;
+    uint8_t shift;
+    uint8_t bits;
+    bool silence;
+    uint8_t buffer;
+    bool buffer_full;
+    uint64_t next_tick;
+};
+
+/*
+ * 2A03 audio. Like the PPU it is caught up lazily: apu_catch_up() jumps
+ * from one channel timer or frame counter event to the next instead of
+ * stepping each cycle, integrating the mixer output over every output
+ * sample's span of CPU cycles. Samples collect in a block that is
+ * filtered, converted to 16 bits and pushed to the ring in one pass.
+ */
+struct apu
+{
+    cpu_t *cpu;
+    struct apu_pulse pulse[2];
+    struct apu_triangle triangle;
+    struct apu_noise noise;
+    struct apu_dmc dmc;
+    // $4015 channel enable bits
+    uint8_t enabled;
+
+    bool five_step;
+    bool irq_inhibit;
+    bool frame_irq;
+    bool dmc_irq;
+    int frame_step;
+    uint64_t frame_start;
+    uint64_t frame_next;
+
+    // CPU cycle the APU has run to
+    uint64_t cycle;
+    // Mixer output since the last event, and its integral over the current sample
+    double level;
+    double accumulator;
+
+    // Sample output; ring is NULL when audio is not wanted
+    audio_ring_t *ring;
+    uint32_t sample_rate;
+    uint64_t output_start;
+    uint64_t samples;
+    uint64_t sample_start;
+    uint64_t sample_end;
+    float highpass_in;
+    float highpass_out;
+    float highpass_factor;
+    float block[APU_BLOCK_SIZE];
+    int block_count;
+};
+
+typedef struct apu apu_t;
+
+void apu_init(apu_t *apu, cpu_t *cpu);
+
+// Starts sending samples at sample_rate to ring, or stops when ring is NULL
+void apu_set_output(apu_t *apu, audio_ring_t *ring, uint32_t sample_rate);
+
+// Runs the APU up to the CPU's current cycle
+void apu_catch_up(apu_t *apu);
+
+// Pushes any samples still held in the current block to the ring
+void apu_flush(apu_t *apu);
+
+// CPU cycle of the next frame or DMC IRQ, or APU_NEVER
+uint64_t apu_next_event(const apu_t *apu);
+
+// $4000-$4013, $4015 and $4017
+void apu_write(apu_t *apu, uint16_t address, uint8_t data);
+
+// $4015
+uint8_t apu_read_status(apu_t *apu);
+
+// First CPU cycle at which $4015 may read differently from a read made now; see bus_map_stable()
+uint64_t apu_status_stable_until(apu_t *apu);
+
+#endif
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "apu.h"
+#include "wav.h"
+
+// Runs the APU to an absolute CPU cycle
+static void run_to(apu_t *apu, uint64_t cycle)
+{
+    apu->cpu->cycles = cycle;
+    apu_catch_up(apu);
+}
+
+void test_apu_length_counter()
+{
+    cpu_t *cpu = init_cpu();
+    apu_t apu;
+    apu_init(&apu, cpu);
+    apu_write(&apu, 0x4015, 0x01);
+    // Length index 1 loads 254; the 4-step sequence clocks lengths twice per 29830 cycles
+    apu_write(&apu, 0x4003, 0x08);
+    if(apu_read_status(&apu) != 0x01)
+    {
+        fprintf(stderr, "apu_length_counter failure: pulse 1 not reported active\n");
+        exit(1);
+    }
+    apu_write(&apu, 0x4017, 0x40);
+    run_to(&apu, 127 * 29830 - 2);
+    if(apu.pulse[0].length != 1)
+    {
+        fprintf(stderr, "apu_length_counter failure: length is %d before expiring\n", apu.pulse[0].length);
+        exit(1);
+    }
+    run_to(&apu, 127 * 29830);
+    if(apu_read_status(&apu) != 0x00)
+    {
+        fprintf(stderr, "apu_length_counter failure: length did not expire\n");
+        exit(1);
+    }
+    apu_write(&apu, 0x4003, 0x08);
+    apu_write(&apu, 0x4015, 0x00);
+    if(apu_read_status(&apu) != 0x00)
+    {
+        fprintf(stderr, "apu_length_counter failure: disabling did not clear length\n");
+        exit(1);
+    }
+    free_cpu(cpu);
+}
+
+void test_apu_frame_irq()
+{
+    cpu_t *cpu = init_cpu();
+    apu_t apu;
+    apu_init(&apu, cpu);
+    if(apu_next_event(&apu) != 29829)
+    {
+        fprintf(stderr, "apu_frame_irq failure: next event not at the IRQ step\n");
+        exit(1);
+    }
+    run_to(&apu, 29828);
+    if(cpu->irq_lines != 0)
+    {
+        fprintf(stderr, "apu_frame_irq failure: IRQ raised early\n");
+        exit(1);
+    }
+    run_to(&apu, 29829);
+    if(cpu->irq_lines != IRQ_APU_FRAME)
+    {
+        fprintf(stderr, "apu_frame_irq failure: IRQ not raised\n");
+        exit(1);
+    }
+    if(apu_read_status(&apu) != 0x40 || cpu->irq_lines != 0)
+    {
+        fprintf(stderr, "apu_frame_irq failure: reading $4015 did not acknowledge\n");
+        exit(1);
+    }
+    apu_write(&apu, 0x4017, 0x80);
+    run_to(&apu, 200000);
+    if(cpu->irq_lines != 0 || apu_next_event(&apu) != APU_NEVER)
+    {
+        fprintf(stderr, "apu_frame_irq failure: 5-step mode raised an IRQ\n");
+        exit(1);
+    }
+    free_cpu(cpu);
+}
+
+void test_apu_dmc()
+{
+    cpu_t *cpu = init_cpu();
+    cpu->memory[0xc040] = 0xff;
+    apu_t apu;
+    apu_init(&apu, cpu);
+    // IRQ on, fastest rate, one byte at $C040
+    apu_write(&apu, 0x4010, 0x8f);
+    apu_write(&apu, 0x4012, 0x01);
+    apu_write(&apu, 0x4013, 0x00);
+    apu_write(&apu, 0x4015, 0x10);
+    // The only byte is fetched at once, which ends the sample
+    if(!(cpu->irq_lines & IRQ_APU_DMC) || (apu_read_status(&apu) & 0x90) != 0x80)
+    {
+        fprintf(stderr, "apu_dmc failure: end of sample IRQ not raised\n");
+        exit(1);
+    }
+    // The output unit plays out its silent byte, then the fetched one
+    run_to(&apu, 16 * 54);
+    if(apu.dmc.output != 16)
+    {
+        fprintf(stderr, "apu_dmc failure: output is %d\n", apu.dmc.output);
+        exit(1);
+    }
+    apu_write(&apu, 0x4015, 0x00);
+    if(cpu->irq_lines != 0)
+    {
+        fprintf(stderr, "apu_dmc failure: IRQ not acknowledged\n");
+        exit(1);
+    }
+    free_cpu(cpu);
+}
+
+void test_apu_pulse_to_wav()
+{
+    cpu_t *cpu = init_cpu();
+    apu_t apu;
+    apu_init(&apu, cpu);
+    audio_ring_t *ring = audio_ring_create(1 << 16);
+    apu_set_output(&apu, ring, 44100);
+
+    char path[] = "/tmp/cnes_apu_test_XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    wav_sink_t *wav = wav_open(path, 44100);
+
+    // 50% duty, constant volume 15, halted length, period 253: 440 Hz
+    apu_write(&apu, 0x4015, 0x01);
+    apu_write(&apu, 0x4000, 0xbf);
+    apu_write(&apu, 0x4002, 0xfd);
+    apu_write(&apu, 0x4003, 0x00);
+    for(int i = 1; i <= 60; i++)
+    {
+        run_to(&apu, (uint64_t)i * APU_CPU_CLOCK / 60);
+        apu_flush(&apu);
+        wav_drain(wav, ring);
+    }
+    if(wav->samples_written < 44099 || wav->samples_written > 44100)
+    {
+        fprintf(stderr, "apu_pulse_to_wav failure: %u samples for one second\n", wav->samples_written);
+        exit(1);
+    }
+    wav_close(wav);
+
+    FILE *file = fopen(path, "rb");
+    uint8_t header[44];
+    fread(header, 1, sizeof(header), file);
+    uint32_t data_size = header[40] | header[41] << 8 | header[42] << 16 | (uint32_t)header[43] << 24;
+    int16_t samples[44100];
+    size_t count = fread(samples, 2, 44100, file);
+    fclose(file);
+    unlink(path);
+    if(memcmp(header, "RIFF", 4) != 0 || data_size != count * 2)
+    {
+        fprintf(stderr, "apu_pulse_to_wav failure: WAV header not correct\n");
+        exit(1);
+    }
+    int crossings = 0;
+    for(size_t i = 1; i < count; i++)
+    {
+        if(samples[i - 1] < 0 && samples[i] >= 0)
+            crossings += 1;
+    }
+    if(crossings < 438 || crossings > 442)
+    {
+        fprintf(stderr, "apu_pulse_to_wav failure: %d cycles in one second\n", crossings);
+        exit(1);
+    }
+    audio_ring_free(ring);
+    free_cpu(cpu);
+}
+
+int main()
+{
+    test_apu_length_counter();
+    test_apu_frame_irq();
+    test_apu_dmc();
+    test_apu_pulse_to_wav();
+    printf("All tests passed!\n");
+    return 0;
+}
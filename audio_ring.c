@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include "audio_ring.h"
+
+#if defined(__GNUC__)
+#define LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+#define LOAD_ACQUIRE(p) (*(volatile size_t *)(p))
+#define STORE_RELEASE(p, v) (*(volatile size_t *)(p) = (v))
+#endif
+
+audio_ring_t *audio_ring_create(size_t capacity)
+{
+    size_t size = 1;
+    while(size < capacity)
+        size <<= 1;
+    audio_ring_t *ring = (audio_ring_t *)calloc(1, sizeof(audio_ring_t));
+    if(ring == NULL)
+        return NULL;
+    ring->samples = (int16_t *)malloc(size * sizeof(int16_t));
+    if(ring->samples == NULL)
+    {
+        free(ring);
+        return NULL;
+    }
+    ring->capacity = size;
+    return ring;
+}
+
+void audio_ring_free(audio_ring_t *ring)
+{
+    if(ring == NULL)
+        return;
+    free(ring->samples);
+    free(ring);
+}
+
+// head and tail count samples ever written and read; only their difference is wrapped
+size_t audio_ring_write(audio_ring_t *ring, const int16_t *samples, size_t count)
+{
+    size_t head = ring->head;
+    size_t free_space = ring->capacity - (head - LOAD_ACQUIRE(&ring->tail));
+    if(count > free_space)
+        count = free_space;
+    size_t mask = ring->capacity - 1;
+    for(size_t i = 0; i < count; i++)
+        ring->samples[(head + i) & mask] = samples[i];
+    STORE_RELEASE(&ring->head, head + count);
+    return count;
+}
+
+size_t audio_ring_read(audio_ring_t *ring, int16_t *samples, size_t count)
+{
+    size_t tail = ring->tail;
+    size_t available = LOAD_ACQUIRE(&ring->head) - tail;
+    if(count > available)
+        count = available;
+    size_t mask = ring->capacity - 1;
+    for(size_t i = 0; i < count; i++)
+        samples[i] = ring->samples[(tail + i) & mask];
+    STORE_RELEASE(&ring->tail, tail + count);
+    return count;
+}
+
+size_t audio_ring_available(audio_ring_t *ring)
+{
+    return LOAD_ACQUIRE(&ring->head) - LOAD_ACQUIRE(&ring->tail);
+}
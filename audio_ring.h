@@ -0,0 +1,43 @@
+#ifndef AUDIO_RING_H
+#define AUDIO_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define RING_ALIGNED __attribute__((aligned(64)))
+#else
+#define RING_ALIGNED
+#endif
+
+/*
+ * Single-producer/single-consumer ring of 16-bit samples. The emulator
+ * thread writes and one audio thread reads; neither takes a lock. head is
+ * only written by the producer and tail only by the consumer, each on its
+ * own cache line.
+ */
+struct audio_ring
+{
+    int16_t *samples;
+    // Power of two, so positions wrap with a mask
+    size_t capacity;
+    size_t head RING_ALIGNED;
+    size_t tail RING_ALIGNED;
+};
+
+typedef struct audio_ring audio_ring_t;
+
+// capacity is rounded up to a power of two; returns NULL on allocation failure
+audio_ring_t *audio_ring_create(size_t capacity);
+
+void audio_ring_free(audio_ring_t *ring);
+
+// Writes up to count samples and returns how many fit; the rest are dropped
+size_t audio_ring_write(audio_ring_t *ring, const int16_t *samples, size_t count);
+
+// Reads up to count samples and returns how many were available
+size_t audio_ring_read(audio_ring_t *ring, int16_t *samples, size_t count);
+
+size_t audio_ring_available(audio_ring_t *ring);
+
+#endif
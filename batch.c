@@ -0,0 +1,420 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "nes.h"
+
+#define NTSC_CYCLES_PER_FRAME 29781
+#define DEFAULT_MAX_CYCLES 10000000
+#define RESULT_SIZE 1024
+
+/*
+ * cnes-batch: runs many iNES ROMs or raw 6502 binaries on a pool of worker
+ * threads and prints one JSON object per job, in input order. Each job
+ * owns its own cpu_t/nes_t; workers share only the job counter and the
+ * output cursor.
+ */
+struct job
+{
+    const char *path;
+    char *result;
+    bool failed;
+};
+
+struct batch
+{
+    struct job *jobs;
+    size_t job_count;
+    size_t next_job;
+    uint64_t max_cycles;
+    uint64_t max_frames;
+
+    pthread_mutex_t output_lock;
+    size_t next_output;
+};
+
+static const char *stop_names[] = {
+    [STOP_BRK] = "brk",
+    [STOP_ILLEGAL_OPCODE] = "illegal_opcode",
+    [STOP_INSTRUCTION_LIMIT] = "instruction_limit",
+    [STOP_CYCLE_LIMIT] = "cycle_limit",
+    [STOP_JIT_MISMATCH] = "jit_mismatch",
+};
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// FNV-1a, 64-bit
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *data, size_t size)
+{
+    for(size_t i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+// Writes path as a JSON string body, escaping quotes, backslashes and control characters
+static void json_escape(char *out, size_t out_size, const char *path)
+{
+    size_t used = 0;
+    for(const char *c = path; *c != '\0' && used + 7 < out_size; c++)
+    {
+        if(*c == '"' || *c == '\\')
+        {
+            out[used++] = '\\';
+            out[used++] = *c;
+        }
+        else if((unsigned char)*c < 0x20)
+        {
+            used += snprintf(out + used, out_size - used, "\\u%04x", *c);
+        }
+        else
+        {
+            out[used++] = *c;
+        }
+    }
+    out[used] = '\0';
+}
+
+static bool has_ines_magic(const char *path)
+{
+    uint8_t magic[4];
+    FILE *file = fopen(path, "rb");
+    if(file == NULL)
+        return false;
+    bool ines = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, "NES\x1a", 4) == 0;
+    fclose(file);
+    return ines;
+}
+
+static uint8_t *read_file(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if(file == NULL)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *data = malloc(length > 0 ? length : 1);
+    if(data == NULL || fread(data, 1, length, file) != (size_t)length)
+    {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    *size = length;
+    return data;
+}
+
+static void format_cpu(char *out, size_t out_size, const char *escaped_path, const char *kind,
+                       enum CPUStopReason reason, const cpu_t *cpu, uint64_t frames,
+                       uint64_t memory_hash, double seconds)
+{
+    snprintf(out, out_size,
+             "{\"file\":\"%s\",\"kind\":\"%s\",\"status\":\"ok\",\"stop\":\"%s\","
+             "\"cycles\":%llu,\"frames\":%llu,"
+             "\"a\":%u,\"x\":%u,\"y\":%u,\"p\":%u,\"sp\":%u,\"pc\":%u,"
+             "\"memory_hash\":\"%016llx\",\"seconds\":%.6f}",
+             escaped_path, kind, stop_names[reason],
+             (unsigned long long)cpu->cycles, (unsigned long long)frames,
+             cpu->reg_a, cpu->reg_x, cpu->reg_y, cpu->reg_status, cpu->stack_pointer, cpu->program_counter,
+             (unsigned long long)memory_hash, seconds);
+}
+
+// ROMs hash internal RAM and PRG RAM; frame_hash covers the last completed frame. NULL if out of memory
+static char *run_rom(struct batch *batch, cartridge_t *cart, const char *escaped_path)
+{
+    double start = now_seconds();
+    nes_t *nes = nes_create(cart);
+    if(nes == NULL)
+        return NULL;
+    enum CPUStopReason reason = STOP_CYCLE_LIMIT;
+    // Only the last completed frame is hashed, so the ones before it are not drawn
+    if(batch->max_frames > 0)
+    {
+        for(uint64_t i = 0; i < batch->max_frames && reason == STOP_CYCLE_LIMIT; i++)
+        {
+            nes->ppu.skip_pixels = i + 1 < batch->max_frames;
+            reason = nes_run_frame(nes);
+        }
+    }
+    else
+    {
+        // The last completed frame started drawing less than two frames before the end
+        uint64_t now = nes->cpu->cycles;
+        uint64_t end = (batch->max_cycles > UINT64_MAX - now) ? UINT64_MAX : now + batch->max_cycles;
+        nes->ppu.skip_pixels = true;
+        if(batch->max_cycles > 2 * NTSC_CYCLES_PER_FRAME)
+            reason = nes_run_cycles(nes, batch->max_cycles - 2 * NTSC_CYCLES_PER_FRAME);
+        nes->ppu.skip_pixels = false;
+        if(reason == STOP_CYCLE_LIMIT && nes->cpu->cycles < end)
+            reason = nes_run_cycles(nes, end - nes->cpu->cycles);
+    }
+    double seconds = now_seconds() - start;
+
+    uint64_t memory_hash = hash_bytes(HASH_SEED, nes->cpu->memory, 0x800);
+    if(cart->prg_ram != NULL)
+        memory_hash = hash_bytes(memory_hash, cart->prg_ram, cart->prg_ram_size);
+    uint64_t frame_hash = hash_bytes(HASH_SEED, &nes->ppu.framebuffer[0][0], sizeof(nes->ppu.framebuffer));
+
+    char line[RESULT_SIZE];
+    format_cpu(line, sizeof(line), escaped_path, "ines", reason, nes->cpu, nes->ppu.frames, memory_hash, seconds);
+    // Splice frame_hash in before the closing brace
+    size_t length = strlen(line);
+    snprintf(line + length - 1, sizeof(line) - length + 1, ",\"frame_hash\":\"%016llx\"}",
+             (unsigned long long)frame_hash);
+    nes_free(nes);
+    return strdup(line);
+}
+
+// Raw binaries are loaded at $8000 with the reset vector pointing there and stop at BRK; NULL if out of memory
+static char *run_raw(struct batch *batch, const uint8_t *program, size_t size, const char *escaped_path)
+{
+    double start = now_seconds();
+    cpu_t *cpu = init_cpu();
+    if(cpu == NULL)
+        return NULL;
+    load(cpu, program, size);
+    cpu_reset(cpu);
+    uint64_t max_cycles = batch->max_frames > 0 ? batch->max_frames * NTSC_CYCLES_PER_FRAME : batch->max_cycles;
+    enum CPUStopReason reason = cpu_run_for(cpu, CPU_UNLIMITED, max_cycles);
+    double seconds = now_seconds() - start;
+
+    uint64_t memory_hash = hash_bytes(HASH_SEED, cpu->memory, sizeof(cpu->memory));
+    char line[RESULT_SIZE];
+    format_cpu(line, sizeof(line), escaped_path, "raw", reason, cpu, 0, memory_hash, seconds);
+    free_cpu(cpu);
+    return strdup(line);
+}
+
+// Returns the job's JSON line; job->failed is set if the file could not be run
+static char *run_job(struct batch *batch, struct job *job)
+{
+    char *result = NULL;
+    char escaped_path[RESULT_SIZE / 2];
+    json_escape(escaped_path, sizeof(escaped_path), job->path);
+
+    const char *error = NULL;
+    if(has_ines_magic(job->path))
+    {
+        // Mapped rather than read, so PRG and CHR are only paged in as they are used
+        cartridge_t *cart = cartridge_open(job->path);
+        if(cart == NULL)
+        {
+            error = "invalid iNES image";
+        }
+        else
+        {
+            result = run_rom(batch, cart, escaped_path);
+            cartridge_close(cart);
+            if(result == NULL)
+                error = "out of memory";
+        }
+    }
+    else
+    {
+        size_t size = 0;
+        uint8_t *data = read_file(job->path, &size);
+        if(data == NULL)
+            error = "cannot read file";
+        else if((result = run_raw(batch, data, size, escaped_path)) == NULL)
+            error = "out of memory";
+        free(data);
+    }
+
+    if(error != NULL)
+    {
+        char line[RESULT_SIZE];
+        snprintf(line, sizeof(line), "{\"file\":\"%s\",\"status\":\"error\",\"error\":\"%s\"}", escaped_path, error);
+        result = strdup(line);
+        job->failed = true;
+    }
+    return result;
+}
+
+// Prints every finished result at the output cursor, keeping input order
+static void flush_results(struct batch *batch)
+{
+    while(batch->next_output < batch->job_count && batch->jobs[batch->next_output].result != NULL)
+    {
+        struct job *job = &batch->jobs[batch->next_output];
+        puts(job->result);
+        free(job->result);
+        job->result = NULL;
+        batch->next_output += 1;
+    }
+    fflush(stdout);
+}
+
+static void *worker(void *context)
+{
+    struct batch *batch = context;
+    while(true)
+    {
+        size_t index = __atomic_fetch_add(&batch->next_job, 1, __ATOMIC_RELAXED);
+        if(index >= batch->job_count)
+            return NULL;
+        struct job *job = &batch->jobs[index];
+        char *result = run_job(batch, job);
+        // Results are only published under the lock the printer holds
+        pthread_mutex_lock(&batch->output_lock);
+        job->result = result;
+        flush_results(batch);
+        pthread_mutex_unlock(&batch->output_lock);
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: cnes-batch [-j threads] [--cycles N | --frames N] [--list file] [file...]\n"
+            "  Runs iNES ROMs and raw 6502 binaries (loaded at $8000) in parallel and\n"
+            "  prints one JSON line per file, in input order. --frames counts PPU frames\n"
+            "  for ROMs and %d cycles per frame for raw binaries. Default: --cycles %d.\n"
+            "  --list reads one path per line; \"-\" reads the list from stdin.\n",
+            NTSC_CYCLES_PER_FRAME, DEFAULT_MAX_CYCLES);
+}
+
+// Appends a copy of path to the job list; false if out of memory
+static bool add_path(const char ***paths, size_t *count, size_t *capacity, const char *path)
+{
+    if(*count == *capacity)
+    {
+        size_t grown = *capacity * 2 + 16;
+        const char **resized = realloc(*paths, grown * sizeof(**paths));
+        if(resized == NULL)
+            return false;
+        *paths = resized;
+        *capacity = grown;
+    }
+    char *copy = strdup(path);
+    if(copy == NULL)
+        return false;
+    (*paths)[(*count)++] = copy;
+    return true;
+}
+
+// Appends each non-empty line of list_path to the job list
+static bool read_list(const char *list_path, const char ***paths, size_t *count, size_t *capacity)
+{
+    FILE *file = strcmp(list_path, "-") == 0 ? stdin : fopen(list_path, "r");
+    if(file == NULL)
+        return false;
+    char line[4096];
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if(line[0] == '\0')
+            continue;
+        if(!add_path(paths, count, capacity, line))
+        {
+            if(file != stdin)
+                fclose(file);
+            return false;
+        }
+    }
+    if(file != stdin)
+        fclose(file);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t max_cycles = DEFAULT_MAX_CYCLES;
+    uint64_t max_frames = 0;
+    const char **paths = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+
+    for(int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if(strcmp(arg, "-j") == 0 && has_value)
+        {
+            threads = strtol(argv[++i], NULL, 0);
+        }
+        else if(strcmp(arg, "--cycles") == 0 && has_value)
+        {
+            max_cycles = strtoull(argv[++i], NULL, 0);
+        }
+        else if(strcmp(arg, "--frames") == 0 && has_value)
+        {
+            max_frames = strtoull(argv[++i], NULL, 0);
+        }
+        else if(strcmp(arg, "--list") == 0 && has_value)
+        {
+            if(!read_list(argv[++i], &paths, &count, &capacity))
+            {
+                fprintf(stderr, "cnes-batch: cannot read list %s\n", argv[i]);
+                return 2;
+            }
+        }
+        else if(arg[0] == '-' && arg[1] != '\0')
+        {
+            usage();
+            return 2;
+        }
+        else if(!add_path(&paths, &count, &capacity, arg))
+        {
+            fprintf(stderr, "cnes-batch: out of memory\n");
+            return 2;
+        }
+    }
+    if(count == 0)
+    {
+        usage();
+        return 2;
+    }
+    if(threads < 1)
+        threads = 1;
+    if((size_t)threads > count)
+        threads = count;
+
+    struct batch batch = {0};
+    batch.jobs = calloc(count, sizeof(struct job));
+    pthread_t *pool = malloc(threads * sizeof(pthread_t));
+    if(batch.jobs == NULL || pool == NULL)
+    {
+        fprintf(stderr, "cnes-batch: out of memory\n");
+        return 2;
+    }
+    batch.job_count = count;
+    batch.max_cycles = max_cycles;
+    batch.max_frames = max_frames;
+    pthread_mutex_init(&batch.output_lock, NULL);
+    for(size_t i = 0; i < count; i++)
+        batch.jobs[i].path = paths[i];
+
+    double start = now_seconds();
+    for(long i = 0; i < threads; i++)
+        pthread_create(&pool[i], NULL, worker, &batch);
+    for(long i = 0; i < threads; i++)
+        pthread_join(pool[i], NULL);
+    double elapsed = now_seconds() - start;
+
+    size_t failed = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        failed += batch.jobs[i].failed;
+        free((char *)paths[i]);
+    }
+    fprintf(stderr, "cnes-batch: %zu jobs, %zu failed, %ld threads, %.3f s\n", count, failed, threads, elapsed);
+    pthread_mutex_destroy(&batch.output_lock);
+    free(pool);
+    free(batch.jobs);
+    free(paths);
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,232 @@
+#include <string.h>
+#include "bus.h"
+
+void bus_init(bus_t *bus)
+{
+    for(int page = 0; page < BUS_PAGE_COUNT; page++)
+    {
+        bus->read_pages[page] = NULL;
+        bus->write_pages[page] = NULL;
+        bus->tracked_pages[page] = NULL;
+        bus->page_handler[page] = 0;
+    }
+    bus->tracked_memory = NULL;
+    bus->tracked_size = 0;
+    memset(bus->dirty, 0, sizeof(bus->dirty));
+    bus->watched_memory = NULL;
+    bus->watched_size = 0;
+    memset(bus->watched, 0, sizeof(bus->watched));
+    bus->watch = NULL;
+    bus->watch_context = NULL;
+    bus->handlers[0].read = NULL;
+    bus->handlers[0].write = NULL;
+    bus->handlers[0].stable = NULL;
+    bus->handlers[0].context = NULL;
+    bus->handler_count = 1;
+}
+
+static inline bool is_tracked(const bus_t *bus, const uint8_t *page)
+{
+    return bus->tracked_memory != NULL && page >= bus->tracked_memory &&
+           page < bus->tracked_memory + bus->tracked_size;
+}
+
+static inline bool is_watched(const bus_t *bus, const uint8_t *page)
+{
+    if(bus->watched_memory == NULL || page < bus->watched_memory || page >= bus->watched_memory + bus->watched_size)
+        return false;
+    size_t index = (page - bus->watched_memory) / BUS_PAGE_SIZE;
+    return (bus->watched[index >> 6] >> (index & 63)) & 1;
+}
+
+// Sets a page's write pointer, trapping it instead if it points into tracked memory or an armed watch
+static void set_write_page(bus_t *bus, int page, uint8_t *memory)
+{
+    if(memory != NULL && (is_tracked(bus, memory) || is_watched(bus, memory)))
+    {
+        bus->write_pages[page] = NULL;
+        bus->tracked_pages[page] = memory;
+    }
+    else
+    {
+        bus->write_pages[page] = memory;
+        bus->tracked_pages[page] = NULL;
+    }
+}
+
+void bus_map_memory(bus_t *bus, uint16_t start, size_t length, uint8_t *memory, size_t memory_size, bool writable)
+{
+    int first_page = start / BUS_PAGE_SIZE;
+    int page_count = length / BUS_PAGE_SIZE;
+    for(int i = 0; i < page_count && first_page + i < BUS_PAGE_COUNT; i++)
+    {
+        uint8_t *page = memory + ((size_t)i * BUS_PAGE_SIZE) % memory_size;
+        bus->read_pages[first_page + i] = page;
+        set_write_page(bus, first_page + i, writable ? page : NULL);
+    }
+}
+
+// Returns -1 when the table is full
+static int find_handler(bus_t *bus, bus_read_handler_t read, bus_write_handler_t write, void *context)
+{
+    for(int i = 0; i < bus->handler_count; i++)
+    {
+        struct bus_handler *handler = &bus->handlers[i];
+        if(handler->read == read && handler->write == write && handler->context == context)
+            return i;
+    }
+    if(bus->handler_count == BUS_MAX_HANDLERS)
+        return -1;
+    struct bus_handler *handler = &bus->handlers[bus->handler_count];
+    handler->read = read;
+    handler->write = write;
+    handler->stable = NULL;
+    handler->context = context;
+    return bus->handler_count++;
+}
+
+bool bus_map_handler(bus_t *bus, uint16_t start, size_t length,
+                     bus_read_handler_t read, bus_write_handler_t write, void *context)
+{
+    int index = find_handler(bus, read, write, context);
+    if(index < 0)
+        return false;
+    int first_page = start / BUS_PAGE_SIZE;
+    int page_count = length / BUS_PAGE_SIZE;
+    for(int i = 0; i < page_count && first_page + i < BUS_PAGE_COUNT; i++)
+    {
+        bus->read_pages[first_page + i] = NULL;
+        bus->write_pages[first_page + i] = NULL;
+        bus->tracked_pages[first_page + i] = NULL;
+        bus->page_handler[first_page + i] = index;
+    }
+    return true;
+}
+
+void bus_map_stable(bus_t *bus, uint16_t start, size_t length, bus_stable_handler_t stable)
+{
+    int first_page = start / BUS_PAGE_SIZE;
+    int page_count = length / BUS_PAGE_SIZE;
+    for(int i = 0; i < page_count && first_page + i < BUS_PAGE_COUNT; i++)
+    {
+        uint8_t index = bus->page_handler[first_page + i];
+        if(index != 0)
+            bus->handlers[index].stable = stable;
+    }
+}
+
+uint64_t bus_stable_until(const bus_t *bus, uint16_t address)
+{
+    if(bus->read_pages[address >> 8] != NULL)
+        return UINT64_MAX;
+    const struct bus_handler *handler = &bus->handlers[bus->page_handler[address >> 8]];
+    if(handler->read == NULL)
+        return UINT64_MAX;
+    if(handler->stable == NULL)
+        return 0;
+    return handler->stable(handler->context, address);
+}
+
+bool bus_writes_page(const bus_t *bus, const uint8_t *page)
+{
+    for(int i = 0; i < BUS_PAGE_COUNT; i++)
+    {
+        const uint8_t *write = bus->write_pages[i] != NULL ? bus->write_pages[i] : bus->tracked_pages[i];
+        if(write != NULL && write < page + BUS_PAGE_SIZE && page < write + BUS_PAGE_SIZE)
+            return true;
+    }
+    return false;
+}
+
+uint8_t bus_read_slow(bus_t *bus, uint16_t address)
+{
+    struct bus_handler *handler = &bus->handlers[bus->page_handler[address >> 8]];
+    if(handler->read == NULL)
+        return 0;
+    return handler->read(handler->context, address);
+}
+
+// Gives every trapped page its write pointer back
+static void release_pages(bus_t *bus)
+{
+    for(int page = 0; page < BUS_PAGE_COUNT; page++)
+    {
+        if(bus->tracked_pages[page] != NULL)
+        {
+            bus->write_pages[page] = bus->tracked_pages[page];
+            bus->tracked_pages[page] = NULL;
+        }
+    }
+}
+
+void bus_track_writes(bus_t *bus, uint8_t *memory, size_t size)
+{
+    release_pages(bus);
+    bus->tracked_memory = memory;
+    bus->tracked_size = memory != NULL ? size : 0;
+    for(int page = 0; page < BUS_PAGE_COUNT; page++)
+        set_write_page(bus, page, bus->write_pages[page]);
+    memset(bus->dirty, 0, sizeof(bus->dirty));
+}
+
+void bus_watch_writes(bus_t *bus, uint8_t *memory, size_t size, bus_watch_handler_t watch, void *context)
+{
+    release_pages(bus);
+    bus->watched_memory = memory;
+    bus->watched_size = memory != NULL ? size : 0;
+    memset(bus->watched, 0, sizeof(bus->watched));
+    bus->watch = watch;
+    bus->watch_context = context;
+    for(int page = 0; page < BUS_PAGE_COUNT; page++)
+        set_write_page(bus, page, bus->write_pages[page]);
+}
+
+void bus_watch_page(bus_t *bus, uint8_t *memory)
+{
+    size_t index = (memory - bus->watched_memory) / BUS_PAGE_SIZE;
+    bus->watched[index >> 6] |= (uint64_t)1 << (index & 63);
+    for(int page = 0; page < BUS_PAGE_COUNT; page++)
+    {
+        if(bus->write_pages[page] == memory)
+            set_write_page(bus, page, memory);
+    }
+}
+
+void bus_clear_dirty(bus_t *bus)
+{
+    for(int page = 0; page < BUS_PAGE_COUNT; page++)
+    {
+        if(bus->write_pages[page] != NULL && is_tracked(bus, bus->write_pages[page]))
+        {
+            bus->tracked_pages[page] = bus->write_pages[page];
+            bus->write_pages[page] = NULL;
+        }
+    }
+    memset(bus->dirty, 0, sizeof(bus->dirty));
+}
+
+void bus_write_slow(bus_t *bus, uint16_t address, uint8_t data)
+{
+    uint8_t *tracked = bus->tracked_pages[address >> 8];
+    if(tracked != NULL)
+    {
+        if(is_watched(bus, tracked))
+        {
+            size_t index = (tracked - bus->watched_memory) / BUS_PAGE_SIZE;
+            bus->watched[index >> 6] &= ~((uint64_t)1 << (index & 63));
+            bus->watch(bus->watch_context, tracked);
+        }
+        if(is_tracked(bus, tracked))
+        {
+            int page = (tracked - bus->tracked_memory) / BUS_PAGE_SIZE;
+            bus->dirty[page >> 6] |= (uint64_t)1 << (page & 63);
+        }
+        bus->write_pages[address >> 8] = tracked;
+        bus->tracked_pages[address >> 8] = NULL;
+        tracked[address & 0xFF] = data;
+        return;
+    }
+    struct bus_handler *handler = &bus->handlers[bus->page_handler[address >> 8]];
+    if(handler->write != NULL)
+        handler->write(handler->context, address, data);
+}
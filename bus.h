@@ -0,0 +1,150 @@
+#ifndef BUS_H
+#define BUS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUS_PAGE_COUNT 256
+#define BUS_PAGE_SIZE 256
+#define BUS_MAX_HANDLERS 16
+
+#if defined(__GNUC__)
+#define BUS_LIKELY(x) __builtin_expect(!!(x), 1)
+#else
+#define BUS_LIKELY(x) (x)
+#endif
+
+typedef uint8_t (*bus_read_handler_t)(void *context, uint16_t address);
+typedef void (*bus_write_handler_t)(void *context, uint16_t address, uint8_t data);
+typedef void (*bus_watch_handler_t)(void *context, uint8_t *page);
+typedef uint64_t (*bus_stable_handler_t)(void *context, uint16_t address);
+
+struct bus_handler
+{
+    bus_read_handler_t read;
+    bus_write_handler_t write;
+    bus_stable_handler_t stable;
+    void *context;
+};
+
+/*
+ * The 64KB address space as 256 pages of 256 bytes. A page with a host
+ * pointer is read or written directly; a NULL pointer sends the access to
+ * the page's handler instead. Handler 0 is open bus: reads return 0 and
+ * writes are dropped.
+ */
+struct bus
+{
+    uint8_t *read_pages[BUS_PAGE_COUNT];
+    uint8_t *write_pages[BUS_PAGE_COUNT];
+    uint8_t page_handler[BUS_PAGE_COUNT];
+    uint8_t handler_count;
+    struct bus_handler handlers[BUS_MAX_HANDLERS];
+
+    // Write pointers of pages trapped for tracking or watching
+    uint8_t *tracked_pages[BUS_PAGE_COUNT];
+
+    // Write tracking, see bus_track_writes()
+    uint8_t *tracked_memory;
+    size_t tracked_size;
+    uint64_t dirty[BUS_PAGE_COUNT / 64];
+
+    // Write watches, see bus_watch_writes()
+    uint8_t *watched_memory;
+    size_t watched_size;
+    uint64_t watched[BUS_PAGE_COUNT / 64];
+    bus_watch_handler_t watch;
+    void *watch_context;
+};
+
+typedef struct bus bus_t;
+
+void bus_init(bus_t *bus);
+
+/*
+ * Points the pages covering [start, start + length) at memory, repeating
+ * every memory_size bytes so smaller memories are mirrored. Read-only
+ * mappings leave writes to the page's handler. start, length and
+ * memory_size must be multiples of BUS_PAGE_SIZE.
+ */
+void bus_map_memory(bus_t *bus, uint16_t start, size_t length, uint8_t *memory, size_t memory_size, bool writable);
+
+/*
+ * Routes every access to [start, start + length) through read/write; either
+ * may be NULL. Each distinct read/write/context takes one of
+ * BUS_MAX_HANDLERS slots; once they are used up it returns false and leaves
+ * the pages as they were.
+ */
+bool bus_map_handler(bus_t *bus, uint16_t start, size_t length,
+                     bus_read_handler_t read, bus_write_handler_t write, void *context);
+
+/*
+ * Lets the CPU skip idle loops polling [start, start + length), which must
+ * already be mapped to a handler. stable returns the first CPU cycle at
+ * which the device may change, on its own, what a read of address returns;
+ * until then a read right after another must return the same and change
+ * nothing. It returns 0 for addresses where that never holds. Handlers
+ * without one are never skipped over.
+ */
+void bus_map_stable(bus_t *bus, uint16_t start, size_t length, bus_stable_handler_t stable);
+
+// bus_map_stable()'s answer for address: UINT64_MAX for memory and open bus, which only writes change, and 0 for handlers without one
+uint64_t bus_stable_until(const bus_t *bus, uint16_t address);
+
+// Whether any bus page writes, directly or through a trap, to the BUS_PAGE_SIZE bytes at page
+bool bus_writes_page(const bus_t *bus, const uint8_t *page);
+
+/*
+ * Records which pages of memory[0, size) are written through the bus.
+ * Pages mapped into memory are trapped: their write pointer is parked in
+ * tracked_pages and the first write to each goes through bus_write_slow(),
+ * which sets the page's bit in dirty and restores the pointer, so later
+ * writes take the fast path again. Writes made to memory directly are not
+ * seen. A NULL memory stops tracking.
+ */
+void bus_track_writes(bus_t *bus, uint8_t *memory, size_t size);
+
+// Clears dirty and traps the pages written since the last call
+void bus_clear_dirty(bus_t *bus);
+
+static inline bool bus_page_dirty(const bus_t *bus, int page)
+{
+    return (bus->dirty[page >> 6] >> (page & 63)) & 1;
+}
+
+/*
+ * Watches pages of memory[0, size), which may be at most 64KB, for writes
+ * through the bus. Pages are armed one at a time with bus_watch_page();
+ * the first write to an armed page, through any bus page mapping it, calls
+ * watch with the page before the data lands and disarms it. Trapping works
+ * as for tracking, and a page can be tracked and watched at once. A NULL
+ * memory stops watching.
+ */
+void bus_watch_writes(bus_t *bus, uint8_t *memory, size_t size, bus_watch_handler_t watch, void *context);
+
+// Arms the watch on the BUS_PAGE_SIZE bytes at page, which must lie in the watched memory
+void bus_watch_page(bus_t *bus, uint8_t *page);
+
+uint8_t bus_read_slow(bus_t *bus, uint16_t address);
+
+void bus_write_slow(bus_t *bus, uint16_t address, uint8_t data);
+
+static inline uint8_t bus_read(bus_t *bus, uint16_t address)
+{
+    uint8_t *page = bus->read_pages[address >> 8];
+    if(BUS_LIKELY(page != NULL))
+        return page[address & 0xFF];
+    return bus_read_slow(bus, address);
+}
+
+static inline void bus_write(bus_t *bus, uint16_t address, uint8_t data)
+{
+    uint8_t *page = bus->write_pages[address >> 8];
+    if(BUS_LIKELY(page != NULL))
+        page[address & 0xFF] = data;
+    else
+        bus_write_slow(bus, address, data);
+}
+
+#endif
@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cartridge.h"
+
+#if defined(_WIN32)
+
+static uint8_t *map_file(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if(file == NULL)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *data = length > 0 ? malloc(length) : NULL;
+    if(data == NULL || fread(data, 1, length, file) != (size_t)length)
+    {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    *size = length;
+    return data;
+}
+
+static void unmap_file(uint8_t *data, size_t size)
+{
+    free(data);
+}
+
+#else
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint8_t *map_file(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+        return NULL;
+    *size = st.st_size;
+    return data;
+}
+
+static void unmap_file(uint8_t *data, size_t size)
+{
+    munmap(data, size);
+}
+
+#endif
+
+// NES 2.0 sizes: a 4-bit MSB of 0xF switches the LSB byte to exponent-multiplier form
+static size_t nes2_rom_size(uint8_t lsb, uint8_t msb, size_t unit)
+{
+    if(msb == 0xF)
+    {
+        int exponent = lsb >> 2;
+        int multiplier = (lsb & 0x3) * 2 + 1;
+        if(exponent > 40)
+            return SIZE_MAX;
+        return ((size_t)1 << exponent) * multiplier;
+    }
+    return (((size_t)msb << 8) | lsb) * unit;
+}
+
+static size_t nes2_ram_size(uint8_t shift)
+{
+    return shift == 0 ? 0 : (size_t)64 << shift;
+}
+
+// Fails on invalid headers and allocation failures; cartridge_close() frees what was allocated
+static bool parse_header(cartridge_t *cart)
+{
+    const uint8_t *header = cart->image;
+    if(cart->image_size < INES_HEADER_SIZE || memcmp(header, "NES\x1a", 4) != 0)
+        return false;
+
+    cart->nes2 = (header[7] & 0x0C) == 0x08;
+    cart->battery = (header[6] & 0x02) != 0;
+    if(header[6] & 0x08)
+        cart->mirroring = MIRROR_FOUR_SCREEN;
+    else
+        cart->mirroring = (header[6] & 0x01) ? MIRROR_VERTICAL : MIRROR_HORIZONTAL;
+
+    size_t chr_ram_size;
+    if(cart->nes2)
+    {
+        cart->mapper = (header[6] >> 4) | (header[7] & 0xF0) | ((uint16_t)(header[8] & 0x0F) << 8);
+        cart->submapper = header[8] >> 4;
+        cart->prg_rom_size = nes2_rom_size(header[4], header[9] & 0x0F, PRG_BANK_SIZE);
+        cart->chr_rom_size = nes2_rom_size(header[5], header[9] >> 4, CHR_BANK_SIZE);
+        cart->prg_ram_size = nes2_ram_size(header[10] & 0x0F) + nes2_ram_size(header[10] >> 4);
+        chr_ram_size = nes2_ram_size(header[11] & 0x0F) + nes2_ram_size(header[11] >> 4);
+    }
+    else
+    {
+        // Headers with junk in bytes 12-15 ("DiskDude!") predate byte 7's mapper nibble
+        bool dirty = header[12] | header[13] | header[14] | header[15];
+        cart->mapper = (header[6] >> 4) | (dirty ? 0 : (header[7] & 0xF0));
+        cart->submapper = 0;
+        cart->prg_rom_size = (size_t)header[4] * PRG_BANK_SIZE;
+        cart->chr_rom_size = (size_t)header[5] * CHR_BANK_SIZE;
+        cart->prg_ram_size = (header[8] == 0 ? 1 : header[8]) * (size_t)0x2000;
+        chr_ram_size = CHR_BANK_SIZE;
+    }
+
+    size_t offset = INES_HEADER_SIZE;
+    bool trainer = (header[6] & 0x04) != 0;
+    if(trainer)
+        offset += INES_TRAINER_SIZE;
+    // The PPU reads CHR through whole 1KB banks
+    if(cart->prg_rom_size == 0 || cart->prg_rom_size % 0x2000 != 0 || cart->chr_rom_size % 0x400 != 0 ||
+       cart->prg_rom_size == SIZE_MAX || cart->chr_rom_size == SIZE_MAX ||
+       offset + cart->prg_rom_size + cart->chr_rom_size > cart->image_size)
+        return false;
+
+    cart->prg_rom = cart->image + offset;
+    cart->chr_rom = cart->chr_rom_size ? cart->prg_rom + cart->prg_rom_size : NULL;
+
+    if(cart->prg_ram_size == 0 && trainer)
+        cart->prg_ram_size = 0x2000;
+    if(cart->prg_ram_size != 0)
+    {
+        cart->prg_ram_size = (cart->prg_ram_size + 0x1FFF) & ~(size_t)0x1FFF;
+        cart->prg_ram = calloc(1, cart->prg_ram_size);
+        if(cart->prg_ram == NULL)
+            return false;
+        if(trainer)
+            memcpy(cart->prg_ram + 0x1000, cart->image + INES_HEADER_SIZE, INES_TRAINER_SIZE);
+    }
+    if(cart->chr_rom == NULL)
+    {
+        cart->chr_ram_size = (chr_ram_size + CHR_BANK_SIZE - 1) & ~(size_t)(CHR_BANK_SIZE - 1);
+        if(cart->chr_ram_size == 0)
+            cart->chr_ram_size = CHR_BANK_SIZE;
+        cart->chr_ram = calloc(1, cart->chr_ram_size);
+        if(cart->chr_ram == NULL)
+            return false;
+    }
+    return true;
+}
+
+cartridge_t *cartridge_open(const char *path)
+{
+    cartridge_t *cart = (cartridge_t *)calloc(1, sizeof(cartridge_t));
+    if(cart == NULL)
+        return NULL;
+    cart->image = map_file(path, &cart->image_size);
+    cart->owns_image = cart->image != NULL;
+    if(cart->image == NULL || !parse_header(cart))
+    {
+        cartridge_close(cart);
+        return NULL;
+    }
+    cart->mapper_ops = mapper_find(cart->mapper);
+    return cart;
+}
+
+cartridge_t *cartridge_from_image(const uint8_t *image, size_t image_size)
+{
+    cartridge_t *cart = (cartridge_t *)calloc(1, sizeof(cartridge_t));
+    if(cart == NULL)
+        return NULL;
+    cart->image = (uint8_t *)image;
+    cart->image_size = image_size;
+    if(!parse_header(cart))
+    {
+        cartridge_close(cart);
+        return NULL;
+    }
+    cart->mapper_ops = mapper_find(cart->mapper);
+    return cart;
+}
+
+void cartridge_close(cartridge_t *cart)
+{
+    if(cart == NULL)
+        return;
+    if(cart->owns_image)
+        unmap_file(cart->image, cart->image_size);
+    free(cart->prg_ram);
+    free(cart->chr_ram);
+    free(cart);
+}
+
+static void mapper_write(void *context, uint16_t address, uint8_t data)
+{
+    cartridge_t *cart = context;
+    cart->mapper_ops->write(cart, address, data);
+}
+
+void cartridge_map_prg(cartridge_t *cart, uint16_t address, size_t size, int bank)
+{
+    size_t bank_count = cart->prg_rom_size / size;
+    if(bank_count == 0)
+    {
+        bus_map_memory(&cart->cpu->bus, address, size, (uint8_t *)cart->prg_rom, cart->prg_rom_size, false);
+        return;
+    }
+    size_t index = bank < 0 ? bank_count - ((size_t)-bank % bank_count) : (size_t)bank;
+    uint8_t *memory = (uint8_t *)cart->prg_rom + (index % bank_count) * size;
+    bus_map_memory(&cart->cpu->bus, address, size, memory, size, false);
+}
+
+void cartridge_map_chr(cartridge_t *cart, uint16_t address, size_t size, int bank)
+{
+    uint8_t *chr = cart->chr_rom ? (uint8_t *)cart->chr_rom : cart->chr_ram;
+    size_t chr_size = cart->chr_rom ? cart->chr_rom_size : cart->chr_ram_size;
+    size_t bank_count = chr_size / size;
+    if(bank_count == 0)
+        bank_count = 1;
+    size_t index = bank < 0 ? bank_count - ((size_t)-bank % bank_count) : (size_t)bank;
+    uint8_t *memory = chr + (index % bank_count) * size;
+    for(size_t offset = 0; offset < size; offset += 0x400)
+        cart->chr_banks[((address + offset) >> 10) & 7] = memory + offset % chr_size;
+}
+
+void cartridge_scanline(cartridge_t *cart)
+{
+    if(cart->mapper_ops != NULL && cart->mapper_ops->scanline != NULL)
+        cart->mapper_ops->scanline(cart);
+}
+
+int cartridge_irq_clocks(const cartridge_t *cart)
+{
+    if(cart->mapper_ops == NULL || cart->mapper_ops->irq_clocks == NULL)
+        return 0;
+    return cart->mapper_ops->irq_clocks(cart);
+}
+
+void cartridge_insert(cartridge_t *cart, cpu_t *cpu)
+{
+    bus_t *bus = &cpu->bus;
+    cart->cpu = cpu;
+
+    bus_map_memory(bus, 0x0000, 0x2000, cpu->memory, 0x800, true);
+    bus_map_handler(bus, 0x2000, 0x6000, NULL, NULL, NULL);
+    if(cart->prg_ram != NULL)
+        bus_map_memory(bus, 0x6000, 0x2000, cart->prg_ram, cart->prg_ram_size, true);
+
+    if(cart->mapper_ops != NULL && cart->mapper_ops->write != NULL)
+        bus_map_handler(bus, 0x8000, 0x8000, NULL, mapper_write, cart);
+    else
+        bus_map_handler(bus, 0x8000, 0x8000, NULL, NULL, NULL);
+
+    cartridge_map_chr(cart, 0x0000, CHR_BANK_SIZE, 0);
+    if(cart->mapper_ops != NULL)
+    {
+        cart->mapper_ops->power_on(cart);
+    }
+    else
+    {
+        cartridge_map_prg(cart, 0x8000, PRG_BANK_SIZE, 0);
+        cartridge_map_prg(cart, 0xC000, PRG_BANK_SIZE, -1);
+    }
+
+    cpu_reset(cpu);
+}
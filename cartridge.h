@@ -0,0 +1,109 @@
+#ifndef CARTRIDGE_H
+#define CARTRIDGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "mapper.h"
+
+#define INES_HEADER_SIZE 16
+#define INES_TRAINER_SIZE 512
+#define PRG_BANK_SIZE 0x4000
+#define CHR_BANK_SIZE 0x2000
+
+enum Mirroring
+{
+    MIRROR_HORIZONTAL,
+    MIRROR_VERTICAL,
+    MIRROR_FOUR_SCREEN,
+    MIRROR_SINGLE_LOW,
+    MIRROR_SINGLE_HIGH
+};
+
+/*
+ * A cartridge loaded from an iNES or NES 2.0 file. The file is memory
+ * mapped and PRG/CHR ROM point straight into the mapping, so loading does
+ * not copy ROM and identical ROMs share page cache between processes.
+ */
+struct cartridge
+{
+    uint8_t *image;
+    size_t image_size;
+
+    const uint8_t *prg_rom;
+    size_t prg_rom_size;
+    // CHR ROM, or NULL when the board has CHR RAM instead
+    const uint8_t *chr_rom;
+    size_t chr_rom_size;
+    uint8_t *chr_ram;
+    size_t chr_ram_size;
+    uint8_t *prg_ram;
+    size_t prg_ram_size;
+
+    uint16_t mapper;
+    uint8_t submapper;
+    enum Mirroring mirroring;
+    bool battery;
+    bool nes2;
+    // Set by cartridge_open(); the image is unmapped by cartridge_close()
+    bool owns_image;
+
+    // Current CHR banks as seen by the PPU at $0000-$1FFF, 1KB each
+    uint8_t *chr_banks[8];
+    const struct mapper *mapper_ops;
+    cpu_t *cpu;
+    // Level of the cartridge's IRQ output
+    bool irq;
+    union
+    {
+        struct
+        {
+            uint8_t shift;
+            uint8_t shift_count;
+            uint8_t control;
+            uint8_t chr_bank[2];
+            uint8_t prg_bank;
+        } mmc1;
+        struct
+        {
+            uint8_t bank_select;
+            uint8_t banks[8];
+            uint8_t irq_latch;
+            uint8_t irq_counter;
+            bool irq_reload;
+            bool irq_enabled;
+        } mmc3;
+    } state;
+};
+
+typedef struct cartridge cartridge_t;
+
+// Returns NULL if the file cannot be read, is not a valid iNES/NES 2.0 image or its RAM cannot be allocated
+cartridge_t *cartridge_open(const char *path);
+
+// Parses an image already in memory; the image must outlive the cartridge
+cartridge_t *cartridge_from_image(const uint8_t *image, size_t image_size);
+
+void cartridge_close(cartridge_t *cart);
+
+/*
+ * Maps the cartridge and 2KB of internal RAM (mirrored to $1FFF) onto the
+ * CPU's bus, then resets the CPU through the ROM's reset vector. Boards
+ * with an unsupported mapper get the first and last PRG banks, fixed.
+ */
+void cartridge_insert(cartridge_t *cart, cpu_t *cpu);
+
+// Maps PRG bank `bank` of `size` bytes at `address`; negative banks count back from the last
+void cartridge_map_prg(cartridge_t *cart, uint16_t address, size_t size, int bank);
+
+// Maps CHR bank `bank` of `size` bytes at PPU `address`; negative banks count back from the last
+void cartridge_map_chr(cartridge_t *cart, uint16_t address, size_t size, int bank);
+
+// Clocks the mapper's scanline counter, if it has one
+void cartridge_scanline(cartridge_t *cart);
+
+// Scanline clocks until the mapper raises its IRQ, or 0 if it will not
+int cartridge_irq_clocks(const cartridge_t *cart);
+
+#endif
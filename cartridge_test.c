@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "cartridge.h"
+
+static char rom_path[] = "/tmp/cnes_cartridge_test_XXXXXX";
+
+static void write_rom(const uint8_t *header, const uint8_t *body, size_t body_size)
+{
+    int fd = mkstemp(rom_path);
+    if(fd < 0 || write(fd, header, INES_HEADER_SIZE) != INES_HEADER_SIZE ||
+       write(fd, body, body_size) != (ssize_t)body_size)
+    {
+        fprintf(stderr, "cartridge_test: could not write %s\n", rom_path);
+        exit(1);
+    }
+    close(fd);
+}
+
+static void remove_rom()
+{
+    unlink(rom_path);
+    strcpy(rom_path, "/tmp/cnes_cartridge_test_XXXXXX");
+}
+
+void test_ines_nrom_128()
+{
+    // 16KB PRG, 8KB CHR, vertical mirroring, mapper 0
+    uint8_t header[INES_HEADER_SIZE] = {'N', 'E', 'S', 0x1a, 1, 1, 0x01, 0x00};
+    uint8_t *body = calloc(1, PRG_BANK_SIZE + CHR_BANK_SIZE);
+    // $C000: LDA #$42; STA $0810; LDA $8000; BRK
+    uint8_t code[] = {0xa9, 0x42, 0x8d, 0x10, 0x08, 0xad, 0x00, 0x80, 0x00};
+    memcpy(body, code, sizeof(code));
+    body[0x3ffc] = 0x00;
+    body[0x3ffd] = 0xc0;
+    body[PRG_BANK_SIZE] = 0x77;
+    write_rom(header, body, PRG_BANK_SIZE + CHR_BANK_SIZE);
+
+    cartridge_t *cart = cartridge_open(rom_path);
+    if(cart == NULL)
+    {
+        fprintf(stderr, "ines_nrom_128 failure: ROM not loaded\n");
+        exit(1);
+    }
+    if(cart->mapper != 0 || cart->nes2 || cart->mirroring != MIRROR_VERTICAL ||
+       cart->prg_rom_size != PRG_BANK_SIZE || cart->chr_rom_size != CHR_BANK_SIZE ||
+       cart->chr_rom == NULL || cart->chr_rom[0] != 0x77 || cart->chr_ram != NULL)
+    {
+        fprintf(stderr, "ines_nrom_128 failure: header not parsed correctly\n");
+        exit(1);
+    }
+
+    cpu_t *cpu = init_cpu();
+    cartridge_insert(cart, cpu);
+    if(cpu->program_counter != 0xc000)
+    {
+        fprintf(stderr, "ines_nrom_128 failure: reset vector not read from ROM: %04x\n", cpu->program_counter);
+        exit(1);
+    }
+    run(cpu);
+    if(cpu->memory[0x10] != 0x42 || cpu->reg_a != 0xa9)
+    {
+        fprintf(stderr, "ines_nrom_128 failure: program did not run from ROM\n");
+        exit(1);
+    }
+    if(cpu->bus.read_pages[0x80] != cart->prg_rom || cpu->bus.read_pages[0xc0] != cart->prg_rom)
+    {
+        fprintf(stderr, "ines_nrom_128 failure: PRG ROM not mapped in place\n");
+        exit(1);
+    }
+    free_cpu(cpu);
+    cartridge_close(cart);
+    free(body);
+    remove_rom();
+}
+
+void test_nes2_header()
+{
+    // NES 2.0: mapper 0x104 submapper 3, 32KB PRG, no CHR ROM, 8KB PRG RAM, 32KB CHR RAM, battery
+    uint8_t header[INES_HEADER_SIZE] = {'N', 'E', 'S', 0x1a, 2, 0, 0x42, 0x08, 0x31, 0x00, 0x07, 0x09};
+    uint8_t *body = calloc(1, 2 * PRG_BANK_SIZE);
+    write_rom(header, body, 2 * PRG_BANK_SIZE);
+
+    cartridge_t *cart = cartridge_open(rom_path);
+    if(cart == NULL || !cart->nes2 || cart->mapper != 0x104 || cart->submapper != 3 || !cart->battery ||
+       cart->mirroring != MIRROR_HORIZONTAL || cart->prg_rom_size != 2 * PRG_BANK_SIZE ||
+       cart->prg_ram_size != 0x2000 || cart->chr_rom != NULL || cart->chr_ram_size != 0x8000)
+    {
+        fprintf(stderr, "nes2_header failure: header not parsed correctly\n");
+        exit(1);
+    }
+    cartridge_close(cart);
+    free(body);
+    remove_rom();
+}
+
+void test_nes2_exponent_size()
+{
+    // PRG size MSB nibble 0xF: 2^14 * (1 * 2 + 1) = 48KB
+    uint8_t header[INES_HEADER_SIZE] = {'N', 'E', 'S', 0x1a, (14 << 2) | 1, 0, 0x00, 0x08, 0x00, 0x0f};
+    size_t size = 3 * PRG_BANK_SIZE;
+    uint8_t *body = calloc(1, size);
+    write_rom(header, body, size);
+
+    cartridge_t *cart = cartridge_open(rom_path);
+    if(cart == NULL || cart->prg_rom_size != size)
+    {
+        fprintf(stderr, "nes2_exponent_size failure: PRG size not parsed correctly\n");
+        exit(1);
+    }
+    cartridge_close(cart);
+    free(body);
+    remove_rom();
+}
+
+void test_nes2_small_chr()
+{
+    // 128 bytes of CHR RAM (shift 1) is rounded up to a whole 8KB bank
+    uint8_t header[INES_HEADER_SIZE] = {'N', 'E', 'S', 0x1a, 1, 0, 0x00, 0x08, 0x00, 0x00, 0x00, 0x01};
+    size_t size = INES_HEADER_SIZE + PRG_BANK_SIZE;
+    uint8_t *image = calloc(1, size + 0x200);
+    memcpy(image, header, INES_HEADER_SIZE);
+    cartridge_t *cart = cartridge_from_image(image, size);
+    if(cart == NULL || cart->chr_ram_size != CHR_BANK_SIZE)
+    {
+        fprintf(stderr, "nes2_small_chr failure: small CHR RAM not rounded up\n");
+        exit(1);
+    }
+    cartridge_close(cart);
+
+    // 512 bytes of CHR ROM (2^9 * 1) cannot back a 1KB bank
+    image[5] = 9 << 2;
+    image[9] = 0xf0;
+    if(cartridge_from_image(image, size + 0x200) != NULL)
+    {
+        fprintf(stderr, "nes2_small_chr failure: CHR ROM smaller than a bank accepted\n");
+        exit(1);
+    }
+    free(image);
+}
+
+void test_rejects_bad_images()
+{
+    // Header claims 2 PRG banks but only one is present
+    uint8_t header[INES_HEADER_SIZE] = {'N', 'E', 'S', 0x1a, 2, 0};
+    uint8_t *body = calloc(1, PRG_BANK_SIZE);
+    write_rom(header, body, PRG_BANK_SIZE);
+    if(cartridge_open(rom_path) != NULL)
+    {
+        fprintf(stderr, "rejects_bad_images failure: truncated image accepted\n");
+        exit(1);
+    }
+    remove_rom();
+
+    uint8_t bad_magic[INES_HEADER_SIZE] = {'N', 'E', 'Z', 0x1a, 1, 0};
+    write_rom(bad_magic, body, PRG_BANK_SIZE);
+    if(cartridge_open(rom_path) != NULL)
+    {
+        fprintf(stderr, "rejects_bad_images failure: bad magic accepted\n");
+        exit(1);
+    }
+    remove_rom();
+
+    if(cartridge_open("/nonexistent/rom.nes") != NULL)
+    {
+        fprintf(stderr, "rejects_bad_images failure: missing file accepted\n");
+        exit(1);
+    }
+    free(body);
+}
+
+// Builds an iNES image whose 8KB PRG banks and 1KB CHR banks start with their own index
+static uint8_t *build_image(uint8_t mapper, int prg_8k_banks, int chr_1k_banks, size_t *image_size)
+{
+    size_t prg_size = (size_t)prg_8k_banks * 0x2000;
+    size_t chr_size = (size_t)chr_1k_banks * 0x400;
+    *image_size = INES_HEADER_SIZE + prg_size + chr_size;
+    uint8_t *image = calloc(1, *image_size);
+    memcpy(image, "NES\x1a", 4);
+    image[4] = prg_size / PRG_BANK_SIZE;
+    image[5] = chr_size / CHR_BANK_SIZE;
+    image[6] = (mapper & 0x0F) << 4;
+    image[7] = mapper & 0xF0;
+    for(int i = 0; i < prg_8k_banks; i++)
+        image[INES_HEADER_SIZE + i * 0x2000] = i;
+    for(int i = 0; i < chr_1k_banks; i++)
+        image[INES_HEADER_SIZE + prg_size + i * 0x400] = i;
+    return image;
+}
+
+static void expect_prg(const char *name, cpu_t *cpu, uint16_t address, uint8_t bank)
+{
+    uint8_t tag = bus_read(&cpu->bus, address);
+    if(tag != bank)
+    {
+        fprintf(stderr, "%s failure: $%04x maps 8KB bank %d, expected %d\n", name, address, tag, bank);
+        exit(1);
+    }
+}
+
+static void expect_chr(const char *name, cartridge_t *cart, int slot, uint8_t bank)
+{
+    if(cart->chr_banks[slot][0] != bank)
+    {
+        fprintf(stderr, "%s failure: CHR slot %d maps 1KB bank %d, expected %d\n", name, slot, cart->chr_banks[slot][0], bank);
+        exit(1);
+    }
+}
+
+void test_mapper_uxrom()
+{
+    size_t size;
+    uint8_t *image = build_image(2, 8, 0, &size);
+    // $C100 in the last bank: LDA #$02; STA $8000; LDA $8000; BRK
+    uint8_t code[] = {0xa9, 0x02, 0x8d, 0x00, 0x80, 0xad, 0x00, 0x80, 0x00};
+    uint8_t *last_bank = image + INES_HEADER_SIZE + 3 * PRG_BANK_SIZE;
+    memcpy(last_bank + 0x100, code, sizeof(code));
+    last_bank[0x3ffc] = 0x00;
+    last_bank[0x3ffd] = 0xc1;
+
+    cartridge_t *cart = cartridge_from_image(image, size);
+    cpu_t *cpu = init_cpu();
+    cartridge_insert(cart, cpu);
+    expect_prg("mapper_uxrom", cpu, 0x8000, 0);
+    expect_prg("mapper_uxrom", cpu, 0xc000, 6);
+    run(cpu);
+    if(cpu->reg_a != 4)
+    {
+        fprintf(stderr, "mapper_uxrom failure: program did not switch banks\n");
+        exit(1);
+    }
+    expect_prg("mapper_uxrom", cpu, 0xc000, 6);
+    free_cpu(cpu);
+    cartridge_close(cart);
+    free(image);
+}
+
+static void mmc1_serial_write(cpu_t *cpu, uint16_t address, uint8_t value)
+{
+    for(int i = 0; i < 5; i++)
+        bus_write(&cpu->bus, address, (value >> i) & 1);
+}
+
+void test_mapper_mmc1()
+{
+    size_t size;
+    uint8_t *image = build_image(1, 16, 32, &size);
+    cartridge_t *cart = cartridge_from_image(image, size);
+    cpu_t *cpu = init_cpu();
+    cartridge_insert(cart, cpu);
+    expect_prg("mapper_mmc1", cpu, 0x8000, 0);
+    expect_prg("mapper_mmc1", cpu, 0xc000, 14);
+
+    mmc1_serial_write(cpu, 0xe000, 5);
+    expect_prg("mapper_mmc1", cpu, 0x8000, 10);
+    expect_prg("mapper_mmc1", cpu, 0xc000, 14);
+
+    // Fix the first bank at $8000, switch $C000, 4KB CHR banks, vertical mirroring
+    mmc1_serial_write(cpu, 0x8000, 0x1a);
+    expect_prg("mapper_mmc1", cpu, 0x8000, 0);
+    expect_prg("mapper_mmc1", cpu, 0xc000, 10);
+    if(cart->mirroring != MIRROR_VERTICAL)
+    {
+        fprintf(stderr, "mapper_mmc1 failure: mirroring not updated\n");
+        exit(1);
+    }
+    mmc1_serial_write(cpu, 0xc000, 3);
+    expect_chr("mapper_mmc1", cart, 4, 12);
+
+    // A write with bit 7 set resets the shift register and fixes the last bank
+    bus_write(&cpu->bus, 0x8000, 1);
+    bus_write(&cpu->bus, 0x8000, 0x80);
+    expect_prg("mapper_mmc1", cpu, 0x8000, 10);
+    expect_prg("mapper_mmc1", cpu, 0xc000, 14);
+    free_cpu(cpu);
+    cartridge_close(cart);
+    free(image);
+}
+
+void test_mapper_cnrom()
+{
+    size_t size;
+    uint8_t *image = build_image(3, 4, 16, &size);
+    cartridge_t *cart = cartridge_from_image(image, size);
+    cpu_t *cpu = init_cpu();
+    cartridge_insert(cart, cpu);
+    expect_chr("mapper_cnrom", cart, 0, 0);
+    bus_write(&cpu->bus, 0x8000, 1);
+    expect_chr("mapper_cnrom", cart, 0, 8);
+    expect_chr("mapper_cnrom", cart, 7, 15);
+    expect_prg("mapper_cnrom", cpu, 0x8000, 0);
+    free_cpu(cpu);
+    cartridge_close(cart);
+    free(image);
+}
+
+void test_mapper_mmc3()
+{
+    size_t size;
+    uint8_t *image = build_image(4, 8, 32, &size);
+    cartridge_t *cart = cartridge_from_image(image, size);
+    cpu_t *cpu = init_cpu();
+    cartridge_insert(cart, cpu);
+    expect_prg("mapper_mmc3", cpu, 0x8000, 0);
+    expect_prg("mapper_mmc3", cpu, 0xa000, 1);
+    expect_prg("mapper_mmc3", cpu, 0xc000, 6);
+    expect_prg("mapper_mmc3", cpu, 0xe000, 7);
+
+    bus_write(&cpu->bus, 0x8000, 0x06);
+    bus_write(&cpu->bus, 0x8001, 3);
+    expect_prg("mapper_mmc3", cpu, 0x8000, 3);
+    bus_write(&cpu->bus, 0x8000, 0x46);
+    expect_prg("mapper_mmc3", cpu, 0x8000, 6);
+    expect_prg("mapper_mmc3", cpu, 0xc000, 3);
+
+    bus_write(&cpu->bus, 0x8000, 0x02);
+    bus_write(&cpu->bus, 0x8001, 9);
+    expect_chr("mapper_mmc3", cart, 4, 9);
+    bus_write(&cpu->bus, 0x8000, 0x82);
+    expect_chr("mapper_mmc3", cart, 0, 9);
+
+    bus_write(&cpu->bus, 0xa000, 1);
+    if(cart->mirroring != MIRROR_HORIZONTAL)
+    {
+        fprintf(stderr, "mapper_mmc3 failure: mirroring not updated\n");
+        exit(1);
+    }
+
+    // Latch 2: the IRQ fires on the third scanline after a reload
+    bus_write(&cpu->bus, 0xc000, 2);
+    bus_write(&cpu->bus, 0xc001, 0);
+    bus_write(&cpu->bus, 0xe001, 0);
+    cartridge_scanline(cart);
+    cartridge_scanline(cart);
+    if(cart->irq)
+    {
+        fprintf(stderr, "mapper_mmc3 failure: IRQ fired early\n");
+        exit(1);
+    }
+    cartridge_scanline(cart);
+    if(!cart->irq || (cpu->irq_lines & IRQ_MAPPER) == 0)
+    {
+        fprintf(stderr, "mapper_mmc3 failure: IRQ did not fire\n");
+        exit(1);
+    }
+    bus_write(&cpu->bus, 0xe000, 0);
+    if(cart->irq || cpu->irq_lines != 0)
+    {
+        fprintf(stderr, "mapper_mmc3 failure: IRQ not acknowledged\n");
+        exit(1);
+    }
+    free_cpu(cpu);
+    cartridge_close(cart);
+    free(image);
+}
+
+int main()
+{
+    test_ines_nrom_128();
+    test_nes2_header();
+    test_nes2_exponent_size();
+    test_nes2_small_chr();
+    test_rejects_bad_images();
+    test_mapper_uxrom();
+    test_mapper_mmc1();
+    test_mapper_cnrom();
+    test_mapper_mmc3();
+    printf("All tests passed!\n");
+    return 0;
+}
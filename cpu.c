@@ -1,8 +1,13 @@
+#include <inttypes.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "cpu.h"
+#include "fusion.h"
+#include "jit.h"
 #include "opcode.h"
+#include "profile.h"
 
 const uint16_t STACK_BASE = 0x0100;
 const uint8_t STACK_RESET = 0xfd;
@@ -10,29 +15,214 @@ const uint8_t STACK_RESET = 0xfd;
 cpu_t* init_cpu()
 {
     cpu_t *new_cpu = (cpu_t *)calloc(1, sizeof(cpu_t));
+    if(new_cpu == NULL)
+        return NULL;
     new_cpu->reg_a = 0;
     new_cpu->reg_status = 0;
     new_cpu->program_counter = 0;
+    new_cpu->engine = CPU_DEFAULT_ENGINE;
+    new_cpu->stop_on_brk = true;
+    new_cpu->fuse_pairs = true;
+    new_cpu->skip_idle_loops = true;
+    bus_init(&new_cpu->bus);
+    bus_map_memory(&new_cpu->bus, 0x0000, sizeof(new_cpu->memory), new_cpu->memory, sizeof(new_cpu->memory), true);
     return new_cpu;
 }
 
+// A frozen memory page, shared by every CPU forked while it was unchanged
+struct cow_page
+{
+    int refs;
+    uint8_t page;
+    uint8_t data[BUS_PAGE_SIZE];
+};
+
+struct cpu_cow
+{
+    // Indexed by memory page; NULL when the CPU's own memory holds it
+    struct cow_page *shared[BUS_PAGE_COUNT];
+};
+
+static void cow_write(void *context, uint16_t address, uint8_t data);
+
+static void release_page(struct cow_page *shared)
+{
+    if(__atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(shared);
+}
+
 void free_cpu(cpu_t *cpu)
 {
+    jit_free(cpu->jit);
+    fusion_free(cpu->fusion);
+    if(cpu->cow != NULL)
+    {
+        for(int page = 0; page < BUS_PAGE_COUNT; page++)
+        {
+            if(cpu->cow->shared[page] != NULL)
+                release_page(cpu->cow->shared[page]);
+        }
+        free(cpu->cow);
+    }
     free(cpu);
 }
 
+static bool is_cow_page(const bus_t *bus, int page)
+{
+    return bus->handlers[bus->page_handler[page]].write == cow_write;
+}
+
+// Copies a shared page into the CPU's memory and points its bus pages back at it
+static void unshare_page(cpu_t *cpu, struct cow_page *shared)
+{
+    uint8_t *own = &cpu->memory[shared->page * BUS_PAGE_SIZE];
+    memcpy(own, shared->data, BUS_PAGE_SIZE);
+    for(int page = 0; page < BUS_PAGE_COUNT; page++)
+    {
+        if(cpu->bus.read_pages[page] == shared->data)
+            bus_map_memory(&cpu->bus, page * BUS_PAGE_SIZE, BUS_PAGE_SIZE, own, BUS_PAGE_SIZE, is_cow_page(&cpu->bus, page));
+    }
+    cpu->cow->shared[shared->page] = NULL;
+    release_page(shared);
+}
+
+// Write handler behind shared pages: takes a private copy, then retries the write
+static void cow_write(void *context, uint16_t address, uint8_t data)
+{
+    cpu_t *cpu = context;
+    uint8_t *data_pointer = cpu->bus.read_pages[address >> 8];
+    unshare_page(cpu, (struct cow_page *)(data_pointer - offsetof(struct cow_page, data)));
+    bus_write(&cpu->bus, address, data);
+}
+
+/*
+ * Moves every page of memory the CPU owns into a shared copy and points
+ * the bus pages that map it there, writable ones with cow_write behind.
+ * Pages still shared from an earlier fork are left as they are.
+ */
+static bool freeze(cpu_t *cpu)
+{
+    if(cpu->cow == NULL)
+    {
+        cpu->cow = calloc(1, sizeof(struct cpu_cow));
+        if(cpu->cow == NULL)
+            return false;
+    }
+    for(int page = 0; page < BUS_PAGE_COUNT; page++)
+    {
+        if(cpu->cow->shared[page] != NULL)
+            continue;
+        struct cow_page *shared = malloc(sizeof(struct cow_page));
+        if(shared == NULL)
+            return false;
+        shared->refs = 1;
+        shared->page = page;
+        memcpy(shared->data, &cpu->memory[page * BUS_PAGE_SIZE], BUS_PAGE_SIZE);
+        cpu->cow->shared[page] = shared;
+    }
+
+    bus_t *bus = &cpu->bus;
+    for(int page = 0; page < BUS_PAGE_COUNT; page++)
+    {
+        uint8_t *read = bus->read_pages[page];
+        if(read == NULL || read < cpu->memory || read >= cpu->memory + sizeof(cpu->memory))
+            continue;
+        struct cow_page *shared = cpu->cow->shared[(read - cpu->memory) / BUS_PAGE_SIZE];
+        bool writable = bus->write_pages[page] != NULL || bus->tracked_pages[page] != NULL;
+        if(writable && !bus_map_handler(bus, page * BUS_PAGE_SIZE, BUS_PAGE_SIZE, NULL, cow_write, cpu))
+            return false;
+        bus_map_memory(bus, page * BUS_PAGE_SIZE, BUS_PAGE_SIZE, shared->data, BUS_PAGE_SIZE, false);
+    }
+    return true;
+}
+
+cpu_t *cpu_fork(cpu_t *cpu)
+{
+    if(!freeze(cpu))
+        return NULL;
+    // Freed shared pages may come back at the same address with other code
+    jit_flush(cpu->jit);
+    fusion_flush(cpu->fusion);
+    // Every page of memory is shared, so the child's own array needs no copy or clearing
+    cpu_t *child = malloc(sizeof(cpu_t));
+    struct cpu_cow *child_cow = calloc(1, sizeof(struct cpu_cow));
+    if(child == NULL || child_cow == NULL)
+    {
+        free(child);
+        free(child_cow);
+        return NULL;
+    }
+    memcpy(child, cpu, offsetof(cpu_t, memory));
+    child->cow = child_cow;
+    // Tracing, profiling, the JIT, the pair cache and the console's scheduler stay with the parent
+    child->trace = NULL;
+    child->trace_context = NULL;
+    child->profile = NULL;
+    child->jit = NULL;
+    child->fusion = NULL;
+    child->scheduler = NULL;
+    for(int page = 0; page < BUS_PAGE_COUNT; page++)
+    {
+        struct cow_page *shared = cpu->cow->shared[page];
+        __atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+        child_cow->shared[page] = shared;
+    }
+
+    bus_t *bus = &child->bus;
+    for(int i = 0; i < bus->handler_count; i++)
+    {
+        if(bus->handlers[i].write == cow_write)
+            bus->handlers[i].context = child;
+    }
+    // Write tracking and watches stay with the parent
+    bus->tracked_memory = NULL;
+    bus->tracked_size = 0;
+    memset(bus->dirty, 0, sizeof(bus->dirty));
+    bus->watched_memory = NULL;
+    bus->watched_size = 0;
+    memset(bus->watched, 0, sizeof(bus->watched));
+    bus->watch = NULL;
+    bus->watch_context = NULL;
+    return child;
+}
+
+void cpu_unshare(cpu_t *cpu)
+{
+    jit_flush(cpu->jit);
+    fusion_flush(cpu->fusion);
+    if(cpu->cow == NULL)
+        return;
+    for(int page = 0; page < BUS_PAGE_COUNT; page++)
+    {
+        if(cpu->cow->shared[page] != NULL)
+            unshare_page(cpu, cpu->cow->shared[page]);
+    }
+}
+
+const uint8_t *cpu_page(const cpu_t *cpu, int page)
+{
+    if(cpu->cow != NULL && cpu->cow->shared[page] != NULL)
+        return cpu->cow->shared[page]->data;
+    return &cpu->memory[page * BUS_PAGE_SIZE];
+}
+
 uint8_t mem_read(cpu_t *cpu, uint16_t address)
 {
-    return cpu->memory[address];
+    return bus_read(&cpu->bus, address);
 }
 
 void mem_write(cpu_t *cpu, uint16_t address, uint8_t data)
 {
-    cpu->memory[address] = data;
+    bus_write(&cpu->bus, address, data);
 }
 
 uint16_t mem_read_16(cpu_t *cpu, uint16_t address)
 {
+    uint8_t *page = cpu->bus.read_pages[address >> 8];
+    uint8_t offset = address & 0xFF;
+    if(page != NULL && offset != 0xFF)
+        return ((uint16_t)page[offset + 1] << 8) | page[offset];
+
     uint16_t low_byte = mem_read(cpu, address);
     uint16_t high_byte = mem_read(cpu, address + 1);
     return (high_byte << 8) | low_byte;
@@ -47,41 +237,42 @@ void mem_write_16(cpu_t *cpu, uint16_t address, uint16_t data)
     mem_write(cpu, address + 1, high_byte);
 }
 
-uint16_t get_operand_address(cpu_t *cpu, enum AddressingMode mode)
+// The address the operand at pc refers to
+static inline uint16_t operand_address_at(cpu_t *cpu, enum AddressingMode mode, uint16_t pc)
 {
     uint16_t address;
     switch(mode)
     {
         case IMMEDIATE:
-            address = cpu->program_counter;
+            address = pc;
             break;
         case ZERO_PAGE:
-            address = (uint16_t)mem_read(cpu, cpu->program_counter);
+            address = (uint16_t)mem_read(cpu, pc);
             break;
         case ABSOLUTE:
-            address = mem_read_16(cpu, cpu->program_counter);
+            address = mem_read_16(cpu, pc);
             break;
         case ZERO_PAGE_X:
-            address = (uint16_t)(mem_read(cpu, cpu->program_counter) + cpu->reg_x);
+            address = (uint16_t)(mem_read(cpu, pc) + cpu->reg_x);
             break;
         case ZERO_PAGE_Y:
-            address = (uint16_t)(mem_read(cpu, cpu->program_counter) + cpu->reg_y);
+            address = (uint16_t)(mem_read(cpu, pc) + cpu->reg_y);
             break;
         case ABSOLUTE_X:
-            address = (mem_read_16(cpu, cpu->program_counter) + (uint16_t)cpu->reg_x);
+            address = (mem_read_16(cpu, pc) + (uint16_t)cpu->reg_x);
             break;
         case ABSOLUTE_Y:
-            address = (mem_read_16(cpu, cpu->program_counter) + (uint16_t)cpu->reg_y);
+            address = (mem_read_16(cpu, pc) + (uint16_t)cpu->reg_y);
             break;
         case INDIRECT_X: {
-            uint8_t base = mem_read(cpu, cpu->program_counter);
+            uint8_t base = mem_read(cpu, pc);
             uint8_t ptr = base + cpu->reg_x;
             uint8_t lo = mem_read(cpu, (uint16_t)ptr);
             uint8_t hi = mem_read(cpu, (uint16_t)(ptr + 1));
             address = ((uint16_t)hi << 8) | (uint16_t)lo;
             break; }
         case INDIRECT_Y: {
-            uint8_t base = mem_read(cpu, cpu->program_counter);
+            uint8_t base = mem_read(cpu, pc);
             uint8_t lo = mem_read(cpu, (uint16_t)base);
             uint8_t hi = mem_read(cpu, (uint16_t)(base + 1));
             uint16_t deref_base = ((uint16_t)hi << 8) | (uint16_t)lo;
@@ -93,32 +284,66 @@ uint16_t get_operand_address(cpu_t *cpu, enum AddressingMode mode)
     return address;
 }
 
-void reset(cpu_t *cpu)
+uint16_t get_operand_address(cpu_t *cpu, enum AddressingMode mode)
+{
+    return operand_address_at(cpu, mode, cpu->program_counter);
+}
+
+// Indexed reads that cross a page boundary take one extra cycle
+uint16_t get_read_operand_address(cpu_t *cpu, enum AddressingMode mode)
+{
+    uint16_t address = get_operand_address(cpu, mode);
+    if(mode == ABSOLUTE_X || mode == ABSOLUTE_Y || mode == INDIRECT_Y)
+    {
+        uint8_t index = (mode == ABSOLUTE_X) ? cpu->reg_x : cpu->reg_y;
+        uint16_t base = address - index;
+        if((base & 0xFF00) != (address & 0xFF00))
+            cpu->cycles += 1;
+    }
+    return address;
+}
+
+void cpu_reset(cpu_t *cpu)
 {
     cpu->reg_a = 0;
     cpu->reg_x = 0;
     cpu->reg_y = 0;
-    cpu->reg_status = 0;
-    cpu->program_counter = mem_read_16(cpu, 0xFFFC);
+    cpu->reg_status = INTERRUPT_DISABLE | BREAK2;
+    cpu->stack_pointer = STACK_RESET;
+    cpu->nmi_pending = false;
+    cpu->program_counter = mem_read_16(cpu, RESET_VECTOR);
 }
 
-void load(cpu_t *cpu, int *program, int program_size)
+void load(cpu_t *cpu, const uint8_t *program, size_t program_size)
 {
-    memcpy(&cpu->memory[0x8000], program, program_size * sizeof(int));
+    if(program_size > 0x8000)
+        program_size = 0x8000;
+    cpu_unshare(cpu);
+    memcpy(&cpu->memory[0x8000], program, program_size);
     mem_write_16(cpu, 0xFFFC, 0x8000);
 }
 
-void set_flags(cpu_t *cpu, uint8_t result)
+// N and Z are only worked out from the last result when something reads them
+static inline void set_flags(cpu_t *cpu, uint8_t result)
 {
-    if(result == 0)
-        cpu->reg_status |= ZERO;
-    else
-        cpu->reg_status &= ~ZERO;
-    
-    if((result & 0b10000000) != 0)
-        cpu->reg_status |= NEGATIVE;
-    else
-        cpu->reg_status &= ~NEGATIVE;
+    cpu->nz = result;
+}
+
+static inline bool is_zero(const cpu_t *cpu)
+{
+    return (cpu->nz & 0xFF) == 0;
+}
+
+static inline bool is_negative(const cpu_t *cpu)
+{
+    return (cpu->nz & 0x180) != 0;
+}
+
+// Sets the whole status register, N and Z included
+static inline void set_status(cpu_t *cpu, uint8_t status)
+{
+    cpu->reg_status = status;
+    cpu->nz = ((status & NEGATIVE) << 1) | ((status & ZERO) ? 0 : 1);
 }
 
 void set_reg_a(cpu_t *cpu, uint8_t val)
@@ -129,21 +354,21 @@ void set_reg_a(cpu_t *cpu, uint8_t val)
 
 void ldy(cpu_t *cpu, enum AddressingMode mode)
 {
-    uint16_t address = get_operand_address(cpu, mode);
+    uint16_t address = get_read_operand_address(cpu, mode);
     cpu->reg_y = mem_read(cpu, address);
     set_flags(cpu, cpu->reg_y);
 }
 
 void ldx(cpu_t *cpu, enum AddressingMode mode)
 {
-    uint16_t address = get_operand_address(cpu, mode);
+    uint16_t address = get_read_operand_address(cpu, mode);
     cpu->reg_x = mem_read(cpu, address);
     set_flags(cpu, cpu->reg_x);
 }
 
 void lda(cpu_t *cpu, enum AddressingMode mode)
 {
-    uint16_t address = get_operand_address(cpu, mode);
+    uint16_t address = get_read_operand_address(cpu, mode);
     uint8_t val = mem_read(cpu, address);
     set_reg_a(cpu, val);
 }
@@ -156,21 +381,21 @@ void sta(cpu_t *cpu, enum AddressingMode mode)
 
 void and(cpu_t *cpu, enum AddressingMode mode)
 {
-    uint16_t address = get_operand_address(cpu, mode);
+    uint16_t address = get_read_operand_address(cpu, mode);
     uint8_t val = mem_read(cpu, address);
     set_reg_a(cpu, (cpu->reg_a & val));
 }
 
 void eor(cpu_t *cpu, enum AddressingMode mode)
 {
-    uint16_t address = get_operand_address(cpu, mode);
+    uint16_t address = get_read_operand_address(cpu, mode);
     uint8_t val = mem_read(cpu, address);
     set_reg_a(cpu, (cpu->reg_a ^ val));
 }
 
 void ora(cpu_t *cpu, enum AddressingMode mode)
 {
-    uint16_t address = get_operand_address(cpu, mode);
+    uint16_t address = get_read_operand_address(cpu, mode);
     uint8_t val = mem_read(cpu, address);
     set_reg_a(cpu, (cpu->reg_a | val));
 }
@@ -203,44 +428,30 @@ void clear_carry_flag(cpu_t *cpu)
     cpu->reg_status &= ~CARRY;
 }
 
+static inline void set_carry(cpu_t *cpu, uint8_t carry)
+{
+    cpu->reg_status = (cpu->reg_status & ~CARRY) | carry;
+}
+
 void add_to_reg_a(cpu_t *cpu, uint8_t data)
 {
-    uint16_t sum = (uint16_t)cpu->reg_a + (uint16_t)data;
-    if(cpu->reg_status & CARRY != 0)
-    {
-        sum += 1;
-    }
-    bool carry = sum > 0xff;
-    if(carry)
-    {
-        cpu->reg_status |= CARRY;
-    }
-    else
-    {
-        cpu->reg_status &= ~CARRY;
-    }
+    uint16_t sum = (uint16_t)cpu->reg_a + (uint16_t)data + (cpu->reg_status & CARRY);
     uint8_t result = (uint8_t)sum;
-    if(((data ^ result) & (result ^ cpu->reg_a) & 0x80) != 0)
-    {
-        cpu->reg_status |= OVERFLOW;
-    }
-    else
-    {
-        cpu->reg_status &= ~OVERFLOW;
-    }
+    uint8_t overflow = ((data ^ result) & (result ^ cpu->reg_a) & 0x80) >> 1;
+    cpu->reg_status = (cpu->reg_status & ~(CARRY | OVERFLOW)) | (sum >> 8) | overflow;
     set_reg_a(cpu, result);
 }
 
 void sbc(cpu_t *cpu, enum AddressingMode mode)
 {
-    uint16_t address = get_operand_address(cpu, mode);
+    uint16_t address = get_read_operand_address(cpu, mode);
     uint8_t data = mem_read(cpu, address);
     add_to_reg_a(cpu, (~data + 1));
 }
 
 void adc(cpu_t *cpu, enum AddressingMode mode)
 {
-    uint16_t address = get_operand_address(cpu, mode);
+    uint16_t address = get_read_operand_address(cpu, mode);
     uint8_t val = mem_read(cpu, address);
     add_to_reg_a(cpu, val);
 }
@@ -275,14 +486,7 @@ uint16_t stack_pop_16(cpu_t *cpu)
 void asl_accumulator(cpu_t *cpu)
 {
     uint8_t data = cpu->reg_a;
-    if ((data >> 7) == 1)
-    {
-        set_carry_flag(cpu);
-    }
-    else
-    {
-        clear_carry_flag(cpu);
-    }
+    set_carry(cpu, data >> 7);
     data = data << 1;
     set_reg_a(cpu, data);
 }
@@ -291,14 +495,7 @@ uint8_t asl(cpu_t *cpu, enum AddressingMode mode)
 {
     uint16_t address = get_operand_address(cpu, mode);
     uint8_t data = mem_read(cpu, address);
-    if((data >> 7) == 1)
-    {
-        set_carry_flag(cpu);
-    }
-    else
-    {
-        clear_carry_flag(cpu);
-    }
+    set_carry(cpu, data >> 7);
     data = data << 1;
     mem_write(cpu, address, data);
     set_flags(cpu, data);
@@ -308,14 +505,7 @@ uint8_t asl(cpu_t *cpu, enum AddressingMode mode)
 void lsr_accumulator(cpu_t *cpu)
 {
     uint8_t data = cpu->reg_a;
-    if ((data & 1) == 1)
-    {
-        set_carry_flag(cpu);
-    }
-    else
-    {
-        clear_carry_flag(cpu);
-    }
+    set_carry(cpu, data & 1);
     data = data >> 1;
     set_reg_a(cpu, data);
 }
@@ -324,14 +514,7 @@ uint8_t lsr(cpu_t *cpu, enum AddressingMode mode)
 {
     uint16_t address = get_operand_address(cpu, mode);
     uint8_t data = mem_read(cpu, address);
-    if((data & 1) == 1)
-    {
-        set_carry_flag(cpu);
-    }
-    else
-    {
-        clear_carry_flag(cpu);
-    }
+    set_carry(cpu, data & 1);
     data = data >> 1;
     mem_write(cpu, address, data);
     set_flags(cpu, data);
@@ -343,14 +526,7 @@ uint8_t rol(cpu_t *cpu, enum AddressingMode mode)
     uint16_t address = get_operand_address(cpu, mode);
     uint8_t data = mem_read(cpu, address);
     bool carry = ((cpu->reg_status & CARRY) != 0);
-    if((data >> 7) == 1)
-    {
-        set_carry_flag(cpu);
-    }
-    else
-    {
-        clear_carry_flag(cpu);
-    }
+    set_carry(cpu, data >> 7);
     data = data << 1;
     if(carry)
     {
@@ -365,14 +541,7 @@ void rol_accumulator(cpu_t *cpu)
 {
     uint8_t data = cpu->reg_a;
     bool carry = ((cpu->reg_status & CARRY) != 0);
-    if((data >> 7) == 1)
-    {
-        set_carry_flag(cpu);
-    }
-    else
-    {
-        clear_carry_flag(cpu);
-    }
+    set_carry(cpu, data >> 7);
     data = data << 1;
     if(carry)
     {
@@ -386,14 +555,7 @@ uint8_t ror(cpu_t *cpu, enum AddressingMode mode)
     uint16_t address = get_operand_address(cpu, mode);
     uint8_t data = mem_read(cpu, address);
     bool carry = ((cpu->reg_status & CARRY) != 0);
-    if((data & 1) == 1)
-    {
-        set_carry_flag(cpu);
-    }
-    else
-    {
-        clear_carry_flag(cpu);
-    }
+    set_carry(cpu, data & 1);
     data = data >> 1;
     if(carry)
     {
@@ -408,14 +570,7 @@ void ror_accumulator(cpu_t *cpu)
 {
     uint8_t data = cpu->reg_a;
     bool carry = ((cpu->reg_status & CARRY) != 0);
-    if ((data & 1) == 1)
-    {
-        set_carry_flag(cpu);
-    }
-    else
-    {
-        clear_carry_flag(cpu);
-    }
+    set_carry(cpu, data & 1);
     data = data >> 1;
     if(carry)
     {
@@ -462,16 +617,28 @@ void pla(cpu_t *cpu)
     set_flags(cpu, data);
 }
 
+// An IRQ held while I was set is taken at the next boundary once I clears
+static inline void poll_irq(cpu_t *cpu)
+{
+    if(cpu->irq_lines != 0 && (cpu->reg_status & INTERRUPT_DISABLE) == 0)
+        cpu->deadline = 0;
+}
+
 void plp(cpu_t *cpu)
 {
-    cpu->reg_status = stack_pop(cpu);
-    cpu->reg_status &= ~BREAK;
-    cpu->reg_status |= BREAK2;
+    set_status(cpu, (stack_pop(cpu) & ~BREAK) | BREAK2);
+    poll_irq(cpu);
+}
+
+void cli(cpu_t *cpu)
+{
+    cpu->reg_status &= ~INTERRUPT_DISABLE;
+    poll_irq(cpu);
 }
 
 void php(cpu_t *cpu)
 {
-    uint8_t flags = cpu->reg_status;
+    uint8_t flags = cpu_status(cpu);
     flags |= BREAK;
     flags |= BREAK2;
     stack_push(cpu, flags);
@@ -482,59 +649,122 @@ void bit(cpu_t *cpu, enum AddressingMode mode)
     uint16_t address = get_operand_address(cpu, mode);
     uint8_t data = mem_read(cpu, address);
     uint8_t res = cpu->reg_a & data;
-    if(res == 0)
-    {
-        cpu->reg_status |= ZERO;
-    }
-    else
-    {
-        cpu->reg_status &= ~ZERO;
-    }
-    if((data & NEGATIVE) > 0)
-    {
-        cpu->reg_status |= NEGATIVE;
-    }
-    if((data & OVERFLOW) > 0)
-    {
-        cpu->reg_status |= OVERFLOW;
-    }
+    // N and V are set from the operand but never cleared
+    bool negative = is_negative(cpu) || (data & NEGATIVE) != 0;
+    cpu->nz = (negative ? 0x100 : 0) | (res != 0);
+    cpu->reg_status |= data & OVERFLOW;
+}
+
+static inline void compare_value(cpu_t *cpu, uint8_t data, uint8_t comp)
+{
+    cpu->reg_status = (cpu->reg_status & ~CARRY) | (data <= comp);
+    set_flags(cpu, (comp - data));
 }
 
 void compare(cpu_t *cpu, enum AddressingMode mode, uint8_t comp)
 {
-    uint16_t address = get_operand_address(cpu, mode);
+    uint16_t address = get_read_operand_address(cpu, mode);
     uint8_t data = mem_read(cpu, address);
-    if (data <= comp)
+    compare_value(cpu, data, comp);
+}
+
+// Jumps offset bytes from next_pc, the address after the branch
+static inline void take_branch(cpu_t *cpu, int8_t offset, uint16_t next_pc)
+{
+    uint16_t new_pc = (next_pc + (uint16_t)offset);
+    cpu->cycles += ((next_pc & 0xFF00) != (new_pc & 0xFF00)) ? 2 : 1;
+    cpu->program_counter = new_pc;
+}
+
+void branch(cpu_t *cpu, bool condition)
+{
+    if (condition)
+        take_branch(cpu, (int8_t)mem_read(cpu, cpu->program_counter), cpu->program_counter + 1);
+    else
+        cpu->program_counter += 1;
+}
+
+void jmp_absolute(cpu_t *cpu)
+{
+    uint16_t addr = mem_read_16(cpu, cpu->program_counter);
+    cpu->program_counter = addr;
+}
+
+void jmp_indirect(cpu_t *cpu)
+{
+    uint16_t addr = mem_read_16(cpu, cpu->program_counter);
+    if((addr & 0x00FF) == 0x00FF)
     {
-        cpu->reg_status |= CARRY;
+        uint8_t lo = mem_read(cpu, addr);
+        uint8_t hi = mem_read(cpu, (addr & 0xFF00));
+        cpu->program_counter = (((uint16_t)hi << 8) | (uint16_t) lo);
     }
     else
     {
-        cpu->reg_status &= ~CARRY;
+        cpu->program_counter = mem_read_16(cpu, addr);
     }
-    set_flags(cpu, (comp - data));
 }
 
-void branch(cpu_t *cpu, bool condition)
+void jsr(cpu_t *cpu)
 {
-    if (condition)
-    {
-        int8_t offset = (int8_t)mem_read(cpu, cpu->program_counter);
-        uint16_t new_pc = ((cpu->program_counter + 1) + (uint16_t)offset);
-        cpu->program_counter = new_pc;
-    }
+    stack_push_16(cpu, (cpu->program_counter + 2 - 1));
+    uint16_t addr = mem_read_16(cpu, cpu->program_counter);
+    cpu->program_counter = addr;
 }
 
-void run(cpu_t *cpu)
+void rts(cpu_t *cpu)
 {
+    cpu->program_counter = (stack_pop_16(cpu) + 1);
+}
+
+void rti(cpu_t *cpu)
+{
+    set_status(cpu, (stack_pop(cpu) & ~BREAK) | BREAK2);
+    cpu->program_counter = stack_pop_16(cpu);
+    poll_irq(cpu);
+}
+
+// Pushes PC and status and jumps through vector; B is only set in the copy pushed by BRK
+static void interrupt(cpu_t *cpu, uint16_t vector, bool brk)
+{
+    stack_push_16(cpu, cpu->program_counter);
+    uint8_t status = (cpu_status(cpu) | BREAK2) & ~BREAK;
+    stack_push(cpu, brk ? (status | BREAK) : status);
+    cpu->reg_status |= INTERRUPT_DISABLE;
+    cpu->program_counter = mem_read_16(cpu, vector);
+}
+
+void brk(cpu_t *cpu)
+{
+    // BRK skips the byte after the opcode, so RTI returns to opcode + 2
+    cpu->program_counter += 1;
+    interrupt(cpu, IRQ_VECTOR, true);
+}
+
+/*
+ * Engines leave through the deadline check when an interrupt is raised, so
+ * the remaining instruction budget is written back for cpu_run_for() to
+ * resume with. The other stop reasons end the run.
+ */
+static enum CPUStopReason run_switch(cpu_t *cpu, uint64_t *instructions)
+{
+    uint64_t max_instructions = *instructions;
     while(true)
     {
+        if(cpu->cycles >= cpu->deadline)
+        {
+            *instructions = max_instructions;
+            return STOP_CYCLE_LIMIT;
+        }
+        if(max_instructions-- == 0)
+            return STOP_INSTRUCTION_LIMIT;
+
         int code = mem_read(cpu, cpu->program_counter);
         cpu->program_counter += 1;
-        uint16_t program_counter_state = cpu->program_counter;
-        opcode_t op = opcode_lookup(code);
+        const opcode_t *op = opcode_lookup(code);
+        cpu->cycles += op->cycles;
 
-        switch(op.code)
+        switch(code)
         {
             case 0xA9:
             case 0xA5: 
@@ -544,7 +774,7 @@ void run(cpu_t *cpu)
             case 0xB9: 
             case 0xA1: 
             case 0xB1:
-                lda(cpu, op.mode);
+                lda(cpu, op->mode);
                 break;
             case 0x85:
             case 0x95: 
@@ -553,19 +783,19 @@ void run(cpu_t *cpu)
             case 0x99: 
             case 0x81: 
             case 0x91:
-                sta(cpu, op.mode);
+                sta(cpu, op->mode);
                 break;
             case 0xAA:
-                tax(cpu, op.mode);
+                tax(cpu, op->mode);
                 break;
             case 0xE8:
-                inx(cpu, op.mode);
+                inx(cpu, op->mode);
                 break;
             case 0xD8:
                 cpu->reg_status &= ~DECIMAL_MODE;
                 break;
             case 0x58:
-                cpu->reg_status &= ~INTERRUPT_DISABLE;
+                cli(cpu);
                 break;
             case 0xB8:
                 cpu->reg_status &= ~OVERFLOW;
@@ -602,7 +832,7 @@ void run(cpu_t *cpu)
             case 0x79:
             case 0x61:
             case 0x71:
-                adc(cpu, op.mode);
+                adc(cpu, op->mode);
                 break;
             case 0xE9:
             case 0xE5:
@@ -612,7 +842,7 @@ void run(cpu_t *cpu)
             case 0xF9:
             case 0xE1:
             case 0xF1:
-                sbc(cpu, op.mode);
+                sbc(cpu, op->mode);
                 break;
             case 0x29:
             case 0x25:
@@ -622,7 +852,7 @@ void run(cpu_t *cpu)
             case 0x39:
             case 0x21:
             case 0x31:
-                and(cpu, op.mode);
+                and(cpu, op->mode);
                 break;
             case 0x49:
             case 0x45:
@@ -632,7 +862,7 @@ void run(cpu_t *cpu)
             case 0x59:
             case 0x41:
             case 0x51:
-                eor(cpu, op.mode);
+                eor(cpu, op->mode);
                 break;
             case 0x09:
             case 0x05:
@@ -642,7 +872,7 @@ void run(cpu_t *cpu)
             case 0x19:
             case 0x01:
             case 0x11:
-                ora(cpu, op.mode);
+                ora(cpu, op->mode);
                 break;
             case 0x4A:
                 lsr_accumulator(cpu);
@@ -651,7 +881,7 @@ void run(cpu_t *cpu)
             case 0x56:
             case 0x4E:
             case 0x5E:
-                lsr(cpu, op.mode);
+                lsr(cpu, op->mode);
                 break;
             case 0x0A:
                 asl_accumulator(cpu);
@@ -660,7 +890,7 @@ void run(cpu_t *cpu)
             case 0x16:
             case 0x0E:
             case 0x1E:
-                asl(cpu, op.mode);
+                asl(cpu, op->mode);
                 break;
             case 0x2A:
                 rol_accumulator(cpu);
@@ -669,7 +899,7 @@ void run(cpu_t *cpu)
             case 0x36:
             case 0x2E:
             case 0x3E:
-                rol(cpu, op.mode);
+                rol(cpu, op->mode);
                 break;
             case 0x6A:
                 ror_accumulator(cpu);
@@ -678,22 +908,22 @@ void run(cpu_t *cpu)
             case 0x76:
             case 0x6E:
             case 0x7E:
-                ror(cpu, op.mode);
+                ror(cpu, op->mode);
                 break;
             case 0xE6:
             case 0xF6:
             case 0xEE:
             case 0xFE:
-                inc(cpu, op.mode);
+                inc(cpu, op->mode);
                 break;
             case 0xC8:
-                iny(cpu, op.mode);
+                iny(cpu, op->mode);
                 break;
             case 0xC6:
             case 0xD6:
             case 0xCE:
             case 0xDE:
-                dec(cpu, op.mode);
+                dec(cpu, op->mode);
                 break;
             case 0xCA:
                 dex(cpu);
@@ -709,87 +939,71 @@ void run(cpu_t *cpu)
             case 0xD9:
             case 0xC1:
             case 0xD1:
-                compare(cpu, op.mode, cpu->reg_a);
+                compare(cpu, op->mode, cpu->reg_a);
                 break;
             case 0xC0:
             case 0xC4:
             case 0xCC:
-                compare(cpu, op.mode, cpu->reg_y);
+                compare(cpu, op->mode, cpu->reg_y);
                 break;
             case 0xE0:
             case 0xE4:
             case 0xEC:
-                compare(cpu, op.mode, cpu->reg_x);
+                compare(cpu, op->mode, cpu->reg_x);
                 break;
-            case 0x4C:{
-                uint16_t addr = mem_read_16(cpu, cpu->program_counter);
-                cpu->program_counter = addr;
-                break;}
-            case 0x6C:{
-                uint16_t addr = mem_read_16(cpu, cpu->program_counter);
-                if((addr & 0x00FF) == 0x00FF)
-                {
-                    uint8_t lo = mem_read(cpu, addr);
-                    uint8_t hi = mem_read(cpu, (addr & 0xFF00));
-                    cpu->program_counter = (((uint16_t)hi << 8) | (uint16_t) lo);
-                }
-                else
-                {
-                    cpu->program_counter = mem_read_16(cpu, addr);
-                }
-                break;}
-            case 0x20:{
-                stack_push_16(cpu, (cpu->program_counter + 2 - 1));
-                uint16_t addr = mem_read_16(cpu, cpu->program_counter);
-                cpu->program_counter = addr;
-                break;}
+            case 0x4C:
+                jmp_absolute(cpu);
+                continue;
+            case 0x6C:
+                jmp_indirect(cpu);
+                continue;
+            case 0x20:
+                jsr(cpu);
+                continue;
             case 0x60:
-                cpu->program_counter = (stack_pop_16(cpu) + 1);
-                break;
+                rts(cpu);
+                continue;
             case 0x40:
-                cpu->reg_status = stack_pop(cpu);
-                cpu->reg_status &= ~BREAK;
-                cpu->reg_status |= BREAK2;
-                cpu->program_counter = stack_pop_16(cpu);
-                break;
+                rti(cpu);
+                continue;
             case 0xD0:
-                branch(cpu , ((cpu->reg_status & ZERO) == 0)); 
-                break;
+                branch(cpu, !is_zero(cpu));
+                continue;
             case 0x70:
                 branch(cpu, ((cpu->reg_status & OVERFLOW) > 0));
-                break;
+                continue;
             case 0x50:
                 branch(cpu, ((cpu->reg_status & OVERFLOW) == 0));
-                break;
+                continue;
             case 0x10:
-                branch(cpu, ((cpu->reg_status & NEGATIVE) == 0));
-                break;
+                branch(cpu, !is_negative(cpu));
+                continue;
             case 0x30:
-                branch(cpu, ((cpu->reg_status & NEGATIVE) > 0));
-                break;
+                branch(cpu, is_negative(cpu));
+                continue;
             case 0xF0:
-                branch(cpu, ((cpu->reg_status & ZERO) > 0));
-                break;
+                branch(cpu, is_zero(cpu));
+                continue;
             case 0xB0:
                 branch(cpu, ((cpu->reg_status & CARRY) > 0));
-                break;
+                continue;
             case 0x90:
                 branch(cpu, ((cpu->reg_status & CARRY) == 0));
-                break;
+                continue;
             case 0x24:
             case 0x2C:
-                bit(cpu, op.mode);
+                bit(cpu, op->mode);
                 break;
             case 0x86:
             case 0x96:
             case 0x8E:{
-                uint16_t addr = get_operand_address(cpu, op.mode);
+                uint16_t addr = get_operand_address(cpu, op->mode);
                 mem_write(cpu, addr, cpu->reg_x);
                 break;}
             case 0x84:
             case 0x94:
             case 0x8C:{
-                uint16_t addr = get_operand_address(cpu, op.mode);
+                uint16_t addr = get_operand_address(cpu, op->mode);
                 mem_write(cpu, addr, cpu->reg_y);
                 break;}
             case 0xA2:
@@ -797,14 +1011,14 @@ void run(cpu_t *cpu)
             case 0xB6:
             case 0xAE:
             case 0xBE:
-                ldx(cpu, op.mode);
+                ldx(cpu, op->mode);
                 break;
             case 0xA0:
             case 0xA4:
             case 0xB4:
             case 0xAC:
             case 0xBC:
-                ldy(cpu, op.mode);
+                ldy(cpu, op->mode);
                 break;
             case 0xEA:
                 break;
@@ -828,20 +1042,539 @@ void run(cpu_t *cpu)
                 set_flags(cpu, cpu->reg_a);
                 break;
             case 0x00:
-                return;
+                if(cpu->stop_on_brk)
+                    return STOP_BRK;
+                brk(cpu);
+                continue;
             default:
-                return;              
+                return STOP_ILLEGAL_OPCODE;
+        }
+        cpu->program_counter += ((uint16_t)(op->len - 1));
+    }
+}
+
+/*
+ * Threaded engine. Each opcode in opcode_list.h gets its own handler with
+ * the addressing mode and length baked in as constants, so the mode switch
+ * in get_operand_address() folds away. insn_* return false to stop run().
+ */
+#define INSN(name, body) \
+    static inline bool insn_##name(cpu_t *cpu, enum AddressingMode mode, int len) \
+    { \
+        body; \
+        cpu->program_counter += len - 1; \
+        return true; \
+    }
+
+#define JUMP_INSN(name, body) \
+    static inline bool insn_##name(cpu_t *cpu, enum AddressingMode mode, int len) \
+    { \
+        body; \
+        return true; \
+    }
+
+static inline bool insn_BRK(cpu_t *cpu, enum AddressingMode mode, int len)
+{
+    if(cpu->stop_on_brk)
+        return false;
+    brk(cpu);
+    return true;
+}
+
+INSN(NOP, )
+INSN(LDA, lda(cpu, mode))
+INSN(LDX, ldx(cpu, mode))
+INSN(LDY, ldy(cpu, mode))
+INSN(STA, sta(cpu, mode))
+INSN(STX, mem_write(cpu, get_operand_address(cpu, mode), cpu->reg_x))
+INSN(STY, mem_write(cpu, get_operand_address(cpu, mode), cpu->reg_y))
+INSN(ADC, adc(cpu, mode))
+INSN(SBC, sbc(cpu, mode))
+INSN(AND, and(cpu, mode))
+INSN(EOR, eor(cpu, mode))
+INSN(ORA, ora(cpu, mode))
+INSN(BIT, bit(cpu, mode))
+INSN(CMP, compare(cpu, mode, cpu->reg_a))
+INSN(CPX, compare(cpu, mode, cpu->reg_x))
+INSN(CPY, compare(cpu, mode, cpu->reg_y))
+INSN(ASL, if(mode == NONE_ADDRESSING) asl_accumulator(cpu); else asl(cpu, mode))
+INSN(LSR, if(mode == NONE_ADDRESSING) lsr_accumulator(cpu); else lsr(cpu, mode))
+INSN(ROL, if(mode == NONE_ADDRESSING) rol_accumulator(cpu); else rol(cpu, mode))
+INSN(ROR, if(mode == NONE_ADDRESSING) ror_accumulator(cpu); else ror(cpu, mode))
+INSN(INC, inc(cpu, mode))
+INSN(DEC, dec(cpu, mode))
+INSN(INX, inx(cpu, mode))
+INSN(INY, iny(cpu, mode))
+INSN(DEX, dex(cpu))
+INSN(DEY, dey(cpu))
+INSN(TAX, tax(cpu, mode))
+INSN(TAY, cpu->reg_y = cpu->reg_a; set_flags(cpu, cpu->reg_y))
+INSN(TXA, cpu->reg_a = cpu->reg_x; set_flags(cpu, cpu->reg_a))
+INSN(TYA, cpu->reg_a = cpu->reg_y; set_flags(cpu, cpu->reg_a))
+INSN(TSX, cpu->reg_x = cpu->stack_pointer; set_flags(cpu, cpu->reg_x))
+INSN(TXS, cpu->stack_pointer = cpu->reg_x)
+INSN(PHA, stack_push(cpu, cpu->reg_a))
+INSN(PLA, pla(cpu))
+INSN(PHP, php(cpu))
+INSN(PLP, plp(cpu))
+INSN(CLC, clear_carry_flag(cpu))
+INSN(SEC, set_carry_flag(cpu))
+INSN(CLD, cpu->reg_status &= ~DECIMAL_MODE)
+INSN(SED, cpu->reg_status |= DECIMAL_MODE)
+INSN(CLI, cli(cpu))
+INSN(SEI, cpu->reg_status |= INTERRUPT_DISABLE)
+INSN(CLV, cpu->reg_status &= ~OVERFLOW)
+JUMP_INSN(JMP, if(mode == INDIRECT) jmp_indirect(cpu); else jmp_absolute(cpu))
+JUMP_INSN(JSR, jsr(cpu))
+JUMP_INSN(RTS, rts(cpu))
+JUMP_INSN(RTI, rti(cpu))
+JUMP_INSN(BNE, branch(cpu, !is_zero(cpu)))
+JUMP_INSN(BEQ, branch(cpu, is_zero(cpu)))
+JUMP_INSN(BPL, branch(cpu, !is_negative(cpu)))
+JUMP_INSN(BMI, branch(cpu, is_negative(cpu)))
+JUMP_INSN(BVC, branch(cpu, (cpu->reg_status & OVERFLOW) == 0))
+JUMP_INSN(BVS, branch(cpu, (cpu->reg_status & OVERFLOW) != 0))
+JUMP_INSN(BCC, branch(cpu, (cpu->reg_status & CARRY) == 0))
+JUMP_INSN(BCS, branch(cpu, (cpu->reg_status & CARRY) != 0))
+
+#if defined(CPU_NO_COMPUTED_GOTO) || !defined(__GNUC__)
+
+typedef bool (*insn_handler_t)(cpu_t *cpu);
+
+#define OPCODE(c, n, l, cy, m) \
+    static bool handle_##c(cpu_t *cpu) \
+    { \
+        cpu->cycles += cy; \
+        return insn_##n(cpu, m, l); \
+    }
+#include "opcode_list.h"
+#undef OPCODE
+
+static const insn_handler_t handlers[256] = {
+#define OPCODE(c, n, l, cy, m) [c] = handle_##c,
+#include "opcode_list.h"
+#undef OPCODE
+};
+
+#endif
+
+/*
+ * Idle loops: a few instructions that only read, closed by a backward
+ * branch or JMP, as in `BIT $2002; BPL` or `LDA flag; BEQ`. Once an
+ * iteration leaves the registers exactly as it found them, every later
+ * one does the same until something the loop reads can change, so whole
+ * iterations up to then, or up to the deadline, are skipped by adding
+ * their cycles and instructions.
+ */
+#define IDLE_LOOP_BYTES 16
+
+#if defined(__GNUC__)
+#define IDLE_COLD __attribute__((noinline, cold))
+#else
+#define IDLE_COLD
+#endif
+
+// Instructions that leave memory, the stack, the I flag and the program counter alone
+#define POLLS(n, m) \
+    ((n) == MN_LDA || (n) == MN_LDX || (n) == MN_LDY || (n) == MN_BIT || (n) == MN_CMP || \
+     (n) == MN_CPX || (n) == MN_CPY || (n) == MN_AND || (n) == MN_ORA || (n) == MN_EOR || \
+     (n) == MN_ADC || (n) == MN_SBC || (n) == MN_TAX || (n) == MN_TAY || (n) == MN_TXA || \
+     (n) == MN_TYA || (n) == MN_TSX || (n) == MN_INX || (n) == MN_INY || (n) == MN_DEX || \
+     (n) == MN_DEY || (n) == MN_NOP || (n) == MN_CLC || (n) == MN_SEC || (n) == MN_CLV || \
+     (n) == MN_CLD || (n) == MN_SED || \
+     (((n) == MN_ASL || (n) == MN_LSR || (n) == MN_ROL || (n) == MN_ROR) && (m) == NONE_ADDRESSING))
+
+static const bool only_polls[256] = {
+#define OPCODE(c, n, l, cy, m) [c] = POLLS(MN_##n, m),
+#include "opcode_list.h"
+#undef OPCODE
+};
+
+#undef POLLS
+
+/*
+ * Checks that [head, end) is straight-line code of length polling
+ * instructions ending in the branch or JMP at end, and returns the first
+ * cycle at which one of its reads may change; 0 if it is not an idle loop
+ * or may change now. Sets rejected when the code itself rules it out.
+ */
+static uint64_t idle_loop_stable(cpu_t *cpu, uint16_t head, uint16_t end, uint64_t length, bool *rejected)
+{
+    const bus_t *bus = &cpu->bus;
+    uint64_t stable = UINT64_MAX;
+    uint64_t count = 0;
+    uint16_t pc = head;
+    while(true)
+    {
+        // Code in memory only changes through writes, which the loop does not make
+        const uint8_t *page = bus->read_pages[pc >> 8];
+        if(page == NULL || bus->read_pages[(uint16_t)(pc + 2) >> 8] == NULL)
+            break;
+        uint8_t code = page[pc & 0xFF];
+        const opcode_t *op = opcode_lookup(code);
+        uint16_t next = pc + op->len;
+        count += 1;
+        if((code & 0x1F) == 0x10 || code == 0x4c)
+            return next == end && count == length ? stable : 0;
+        if(!only_polls[code] || next - head >= end - head)
+            break;
+        if(op->mode == INDIRECT_X || op->mode == INDIRECT_Y)
+        {
+            // The pointer is read from the zero page, or just past it
+            if(bus->read_pages[0x00] == NULL || bus->read_pages[0x01] == NULL)
+                break;
+        }
+        if(op->mode != IMMEDIATE && op->mode != NONE_ADDRESSING)
+        {
+            uint64_t until = bus_stable_until(bus, operand_address_at(cpu, op->mode, pc + 1));
+            // A read that may change at any time never lets the loop be skipped
+            if(until == 0)
+                break;
+            stable = until < stable ? until : stable;
+        }
+        pc = next;
+    }
+    *rejected = true;
+    return 0;
+}
+
+/*
+ * Run each time round a loop that left the registers unchanged. The first
+ * time finds when its reads may next change; from the second, whose reads
+ * all came after that, the iterations before then are skipped.
+ */
+IDLE_COLD static void skip_idle_loop(cpu_t *cpu, uint64_t *instructions)
+{
+    struct cpu_idle *idle = &cpu->idle;
+    uint64_t period = cpu->cycles - idle->cycles;
+    uint64_t length = idle->instructions - *instructions;
+    if(idle->stable > cpu->cycles && period > 0 && length > 0)
+    {
+        uint64_t bound = idle->stable < cpu->deadline ? idle->stable : cpu->deadline;
+        // Every read of a skipped iteration happens before bound
+        uint64_t iterations = bound > cpu->cycles ? (bound - cpu->cycles - 1) / period : 0;
+        if(*instructions / length < iterations)
+            iterations = *instructions / length;
+        cpu->cycles += iterations * period;
+        *instructions -= iterations * length;
+        if(iterations > 0 && cpu->profile != NULL)
+            profile_idle_loop(cpu->profile, idle->head, idle->end, iterations * length, iterations * period);
+    }
+    else
+    {
+        idle->stable = idle_loop_stable(cpu, idle->head, idle->end, length, &idle->rejected);
+    }
+    idle->cycles = cpu->cycles;
+    idle->instructions = *instructions;
+}
+
+// Run by the engines after a branch or JMP to head, before its end
+static inline void idle_loop(cpu_t *cpu, uint16_t end, uint64_t *instructions)
+{
+    struct cpu_idle *idle = &cpu->idle;
+    uint16_t head = cpu->program_counter;
+    if(idle->head != head || idle->end != end)
+    {
+        idle->head = head;
+        idle->end = end;
+        idle->rejected = end - head > IDLE_LOOP_BYTES;
+    }
+    else if(!idle->rejected && idle->reg_a == cpu->reg_a && idle->reg_x == cpu->reg_x &&
+            idle->reg_y == cpu->reg_y && idle->reg_status == cpu->reg_status &&
+            idle->stack_pointer == cpu->stack_pointer && idle->nz == cpu->nz)
+    {
+        skip_idle_loop(cpu, instructions);
+        return;
+    }
+    idle->reg_a = cpu->reg_a;
+    idle->reg_x = cpu->reg_x;
+    idle->reg_y = cpu->reg_y;
+    idle->reg_status = cpu->reg_status;
+    idle->stack_pointer = cpu->stack_pointer;
+    idle->nz = cpu->nz;
+    idle->stable = 0;
+    idle->cycles = cpu->cycles;
+    idle->instructions = *instructions;
+}
+
+#define ENGINE_NAME run_threaded
+#define ENGINE_HOOK(cpu)
+#define ENGINE_IDLE
+#include "cpu_threaded.h"
+
+// ENGINE_THREADED running the pairs decoded into cpu->fusion
+#define ENGINE_NAME run_fused
+#define ENGINE_HOOK(cpu)
+#define ENGINE_IDLE
+#define ENGINE_FUSED
+#include "cpu_threaded.h"
+
+// The same loop reporting each instruction to the trace handler or profile before it runs
+#define ENGINE_NAME run_traced
+#define ENGINE_HOOK(cpu) cpu->trace(cpu->trace_context, cpu)
+#include "cpu_threaded.h"
+
+#define ENGINE_NAME run_profiled
+#define ENGINE_HOOK(cpu) profile_instruction(cpu->profile, cpu)
+#define ENGINE_IDLE
+#include "cpu_threaded.h"
+
+#define ENGINE_NAME run_traced_profiled
+#define ENGINE_HOOK(cpu) cpu->trace(cpu->trace_context, cpu); profile_instruction(cpu->profile, cpu)
+#include "cpu_threaded.h"
+
+/*
+ * Alternates translated blocks with single interpreted instructions for
+ * the code jit_run() leaves to the interpreter.
+ */
+static enum CPUStopReason run_jit(cpu_t *cpu, uint64_t *instructions)
+{
+    uint64_t max_instructions = *instructions;
+    while(true)
+    {
+        if(cpu->cycles >= cpu->deadline)
+        {
+            *instructions = max_instructions;
+            return STOP_CYCLE_LIMIT;
         }
-        if(program_counter_state == cpu->program_counter)
+        if(max_instructions == 0)
+            return STOP_INSTRUCTION_LIMIT;
+        uint64_t executed = jit_run(cpu->jit, max_instructions);
+        if(executed == 0)
         {
-            cpu->program_counter += ((uint16_t)(op.len - 1));
+            uint64_t one = 1;
+            enum CPUStopReason reason = run_threaded(cpu, &one);
+            if(reason == STOP_BRK || reason == STOP_ILLEGAL_OPCODE)
+                return reason;
+            executed = 1;
         }
+        if(max_instructions != CPU_UNLIMITED)
+            max_instructions -= executed;
     }
 }
 
-void load_and_run(cpu_t *cpu, int *program, int program_size)
+// Register and memory snapshots on either side of a block in ENGINE_JIT_CHECKED
+struct jit_check
+{
+    cpu_t before;
+    cpu_t after;
+};
+
+static bool registers_match(const cpu_t *a, const cpu_t *b)
+{
+    return a->reg_a == b->reg_a && a->reg_x == b->reg_x && a->reg_y == b->reg_y &&
+           cpu_status(a) == cpu_status(b) && a->program_counter == b->program_counter &&
+           a->stack_pointer == b->stack_pointer && a->cycles == b->cycles;
+}
+
+/*
+ * Runs each translated block, then rewinds registers and memory and runs
+ * the same instructions on the interpreter. Only plain memory is rewound,
+ * so blocks that reach bus handlers with side effects may report false
+ * mismatches.
+ */
+static enum CPUStopReason run_jit_checked(cpu_t *cpu, uint64_t *instructions)
+{
+    // Compared through the memory array, so no page may still be shared
+    if(cpu->cow != NULL)
+        cpu_unshare(cpu);
+    struct jit_check *check = malloc(sizeof(struct jit_check));
+    if(check == NULL)
+        return run_threaded(cpu, instructions);
+    uint64_t max_instructions = *instructions;
+    enum CPUStopReason reason;
+    while(true)
+    {
+        if(cpu->cycles >= cpu->deadline)
+        {
+            *instructions = max_instructions;
+            reason = STOP_CYCLE_LIMIT;
+            break;
+        }
+        if(max_instructions == 0)
+        {
+            reason = STOP_INSTRUCTION_LIMIT;
+            break;
+        }
+        memcpy(&check->before, cpu, sizeof(cpu_t));
+        uint64_t executed = jit_run(cpu->jit, max_instructions);
+        if(executed == 0)
+        {
+            uint64_t one = 1;
+            reason = run_threaded(cpu, &one);
+            if(reason == STOP_BRK || reason == STOP_ILLEGAL_OPCODE)
+                break;
+            executed = 1;
+        }
+        else
+        {
+            memcpy(&check->after, cpu, sizeof(cpu_t));
+            memcpy(cpu->memory, check->before.memory, sizeof(cpu->memory));
+            cpu->reg_a = check->before.reg_a;
+            cpu->reg_x = check->before.reg_x;
+            cpu->reg_y = check->before.reg_y;
+            cpu->reg_status = check->before.reg_status;
+            cpu->nz = check->before.nz;
+            cpu->program_counter = check->before.program_counter;
+            cpu->stack_pointer = check->before.stack_pointer;
+            cpu->cycles = check->before.cycles;
+            cpu->deadline = UINT64_MAX;
+            uint64_t replay = executed;
+            run_threaded(cpu, &replay);
+            if(!registers_match(cpu, &check->after) || memcmp(cpu->memory, check->after.memory, sizeof(cpu->memory)) != 0)
+            {
+                fprintf(stderr, "jit mismatch in %" PRIu64 " instructions from $%04X: "
+                        "A=%02X/%02X X=%02X/%02X Y=%02X/%02X P=%02X/%02X PC=%04X/%04X SP=%02X/%02X cycles=%" PRIu64 "/%" PRIu64 "\n",
+                        executed, check->before.program_counter,
+                        check->after.reg_a, cpu->reg_a, check->after.reg_x, cpu->reg_x,
+                        check->after.reg_y, cpu->reg_y, cpu_status(&check->after), cpu_status(cpu),
+                        check->after.program_counter, cpu->program_counter,
+                        check->after.stack_pointer, cpu->stack_pointer, check->after.cycles, cpu->cycles);
+                reason = STOP_JIT_MISMATCH;
+                break;
+            }
+            cpu->deadline = check->after.deadline;
+        }
+        if(max_instructions != CPU_UNLIMITED)
+            max_instructions -= executed;
+    }
+    free(check);
+    return reason;
+}
+
+static void service_interrupts(cpu_t *cpu)
+{
+    if(cpu->nmi_pending)
+    {
+        cpu->nmi_pending = false;
+        if(cpu->profile != NULL)
+            profile_interrupt(cpu->profile, cpu, NMI_VECTOR, FRAME_NMI);
+        interrupt(cpu, NMI_VECTOR, false);
+        cpu->cycles += INTERRUPT_CYCLES;
+    }
+    else if(cpu->irq_lines != 0 && (cpu->reg_status & INTERRUPT_DISABLE) == 0)
+    {
+        if(cpu->profile != NULL)
+            profile_interrupt(cpu->profile, cpu, IRQ_VECTOR, FRAME_IRQ);
+        interrupt(cpu, IRQ_VECTOR, false);
+        cpu->cycles += INTERRUPT_CYCLES;
+    }
+}
+
+// ENGINE_THREADED, with pairs from the decode cache while fuse_pairs is set
+static enum CPUStopReason run_interpreter(cpu_t *cpu, uint64_t *instructions)
+{
+    if(!cpu->fuse_pairs)
+        return run_threaded(cpu, instructions);
+    if(cpu->fusion == NULL)
+    {
+        // The JIT's bus watch makes way for the cache's
+        jit_free(cpu->jit);
+        cpu->jit = NULL;
+        cpu->fusion = fusion_create(cpu);
+    }
+    if(cpu->fusion == NULL)
+        return run_threaded(cpu, instructions);
+    return run_fused(cpu, instructions);
+}
+
+/*
+ * Raising a line pulls deadline down to 0, so the engine drops out at the
+ * next instruction boundary through the check it already makes for the
+ * cycle budget. Interrupts are serviced here and the engine re-entered
+ * until the real budget runs out.
+ */
+enum CPUStopReason cpu_run_for(cpu_t *cpu, uint64_t max_instructions, uint64_t max_cycles)
+{
+    cpu->run_deadline = (max_cycles > UINT64_MAX - cpu->cycles) ? UINT64_MAX : cpu->cycles + max_cycles;
+    while(true)
+    {
+        if(cpu->cycles >= cpu->run_deadline)
+            return STOP_CYCLE_LIMIT;
+        // Callers may have set reg_status directly since the last run
+        set_status(cpu, cpu->reg_status);
+        service_interrupts(cpu);
+        cpu->deadline = cpu->run_deadline;
+        // An interrupt or the caller may have run code since a loop was last seen
+        cpu->idle.end = 0;
+
+        enum CPUStopReason reason;
+        if(cpu->trace != NULL && cpu->profile != NULL)
+            reason = run_traced_profiled(cpu, &max_instructions);
+        else if(cpu->trace != NULL)
+            reason = run_traced(cpu, &max_instructions);
+        else if(cpu->profile != NULL)
+            reason = run_profiled(cpu, &max_instructions);
+        else if(cpu->engine == ENGINE_THREADED)
+            reason = run_interpreter(cpu, &max_instructions);
+        else if(cpu->engine == ENGINE_JIT || cpu->engine == ENGINE_JIT_CHECKED)
+        {
+            if(cpu->jit == NULL)
+            {
+                cpu->jit = jit_create(cpu);
+                // The JIT has taken the bus watch over from the cache
+                if(cpu->jit != NULL)
+                {
+                    fusion_free(cpu->fusion);
+                    cpu->fusion = NULL;
+                }
+            }
+            if(cpu->jit == NULL)
+                reason = run_interpreter(cpu, &max_instructions);
+            else if(cpu->engine == ENGINE_JIT)
+                reason = run_jit(cpu, &max_instructions);
+            else
+                reason = run_jit_checked(cpu, &max_instructions);
+        }
+        else
+            reason = run_switch(cpu, &max_instructions);
+        cpu->reg_status = cpu_status(cpu);
+        if(reason != STOP_CYCLE_LIMIT || cpu->cycles >= cpu->run_deadline)
+            return reason;
+    }
+}
+
+void cpu_nmi(cpu_t *cpu)
+{
+    cpu->nmi_pending = true;
+    cpu->deadline = 0;
+}
+
+void cpu_irq(cpu_t *cpu, uint8_t source, bool asserted)
+{
+    if(asserted)
+        cpu->irq_lines |= source;
+    else
+        cpu->irq_lines &= ~source;
+    poll_irq(cpu);
+}
+
+void cpu_stop_at(cpu_t *cpu, uint64_t cycle)
+{
+    if(cycle < cpu->run_deadline)
+        cpu->run_deadline = cycle;
+    if(cycle < cpu->deadline)
+        cpu->deadline = cycle;
+}
+
+enum CPUStopReason cpu_step(cpu_t *cpu)
+{
+    return cpu_run_for(cpu, 1, CPU_UNLIMITED);
+}
+
+void run(cpu_t *cpu)
+{
+    cpu_run_for(cpu, CPU_UNLIMITED, CPU_UNLIMITED);
+}
+
+void run_cycles(cpu_t *cpu, uint64_t cycles)
+{
+    cpu_run_for(cpu, CPU_UNLIMITED, cycles);
+}
+
+void load_and_run(cpu_t *cpu, const uint8_t *program, size_t program_size)
 {
     load(cpu, program, program_size);
-    reset(cpu);
+    cpu_reset(cpu);
     run(cpu);
 }
\ No newline at end of file
@@ -1,4 +1,10 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include "bus.h"
 
 enum CPUFlags {
     CARRY = 0b00000001,
@@ -11,6 +17,68 @@ enum CPUFlags {
     NEGATIVE = 0b10000000
 };
 
+enum CPUEngine {
+    ENGINE_SWITCH,
+    ENGINE_THREADED,
+    // Translates hot code to x86-64, falling back to ENGINE_THREADED elsewhere; see jit.h
+    ENGINE_JIT,
+    // ENGINE_JIT replaying every translated block on the interpreter to compare
+    ENGINE_JIT_CHECKED
+};
+
+enum CPUStopReason {
+    STOP_BRK,
+    STOP_ILLEGAL_OPCODE,
+    STOP_INSTRUCTION_LIMIT,
+    STOP_CYCLE_LIMIT,
+    // ENGINE_JIT_CHECKED saw translated code disagree with the interpreter
+    STOP_JIT_MISMATCH
+};
+
+// Devices that can hold the IRQ line low; the line is asserted while any bit is set
+enum IRQSource {
+    IRQ_MAPPER = 0x01,
+    IRQ_APU_FRAME = 0x02,
+    IRQ_APU_DMC = 0x04,
+    IRQ_EXTERNAL = 0x80
+};
+
+#define CPU_UNLIMITED UINT64_MAX
+
+#define NMI_VECTOR 0xFFFA
+#define RESET_VECTOR 0xFFFC
+#define IRQ_VECTOR 0xFFFE
+#define INTERRUPT_CYCLES 7
+
+#ifndef CPU_DEFAULT_ENGINE
+#define CPU_DEFAULT_ENGINE ENGINE_THREADED
+#endif
+
+struct cpu;
+
+// Called with the CPU's state before each instruction executes
+typedef void (*cpu_trace_handler_t)(void *context, const struct cpu *cpu);
+
+// The last backward branch or JMP taken, and the state it left, while looking for an idle loop
+struct cpu_idle
+{
+    uint16_t head;
+    uint16_t end;
+    uint8_t reg_a;
+    uint8_t reg_x;
+    uint8_t reg_y;
+    uint8_t reg_status;
+    uint8_t stack_pointer;
+    // The loop at head does more than poll memory, or polls a register that may change at any time
+    bool rejected;
+    uint16_t nz;
+    // First cycle at which a read made by the loop may change, once known
+    uint64_t stable;
+    uint64_t cycles;
+    // The engine's instruction budget at the time
+    uint64_t instructions;
+};
+
 struct cpu
 {
     uint8_t reg_a;
@@ -19,14 +87,125 @@ struct cpu
     uint8_t reg_status;
     uint16_t program_counter;
     uint8_t stack_pointer;
-    // Array representing 64KB of memory
-    int memory[0xFFFF];
+    // N and Z while an engine runs, as the last result; see cpu_status()
+    uint16_t nz;
+    enum CPUEngine engine;
+    // Emulated CPU cycles since power-on
+    uint64_t cycles;
+    // Execution stops at the first instruction boundary at or past this cycle
+    uint64_t deadline;
+    // Cycle limit of the current cpu_run_for(); deadline is pulled below it to service interrupts
+    uint64_t run_deadline;
+    bool nmi_pending;
+    // IRQSource bits currently asserting the IRQ line
+    uint8_t irq_lines;
+    // Return STOP_BRK from cpu_run_for() instead of vectoring through $FFFE
+    bool stop_on_brk;
+    // Lets ENGINE_THREADED run common instruction pairs as one, decoded ahead; on by default
+    bool fuse_pairs;
+    // Lets the interpreters fast-forward through loops that only poll memory until what they read can change; on by default
+    bool skip_idle_loops;
+    struct cpu_idle idle;
+    // Set to run every instruction past trace; see trace.h
+    cpu_trace_handler_t trace;
+    void *trace_context;
+    // Set to count every instruction into; see profile.h
+    struct cpu_profile *profile;
+    // Pages shared copy-on-write with forks of this CPU, NULL if it never forked
+    struct cpu_cow *cow;
+    // Translated code, NULL until ENGINE_JIT first runs
+    struct cpu_jit *jit;
+    // Decoded instruction pairs, NULL until ENGINE_THREADED first runs with fuse_pairs; see fusion.h
+    struct cpu_fusion *fusion;
+    // Device events of the console around the CPU, NULL for a bare one; see scheduler.h
+    struct scheduler *scheduler;
+    // All memory accesses go through the bus; init_cpu() maps it flat onto memory
+    bus_t bus;
+    // 64KB of backing RAM, one byte per address
+    uint8_t memory[0x10000];
 };
 
 typedef struct cpu cpu_t;
 
+/*
+ * The status register. reg_status is exact between runs, but while an
+ * engine runs N and Z live in nz as the last result: Z is set when its low
+ * byte is 0 and N when bit 7 or 8 is. Trace hooks and bus handlers read
+ * the status through here.
+ */
+static inline uint8_t cpu_status(const cpu_t *cpu)
+{
+    uint8_t status = cpu->reg_status & ~(ZERO | NEGATIVE);
+    status |= (cpu->nz & 0xFF) == 0 ? ZERO : 0;
+    status |= (cpu->nz & 0x180) != 0 ? NEGATIVE : 0;
+    return status;
+}
+
+// NULL if out of memory
 cpu_t *init_cpu();
 
 void free_cpu(cpu_t *cpu);
 
-void load_and_run(cpu_t *cpu, int *program, int program_size);
\ No newline at end of file
+/*
+ * Returns a child with the CPU's registers and memory, or NULL on
+ * allocation failure. Parent and child share memory copy-on-write: the
+ * pages become read-only copies and each CPU takes a page back into its
+ * own memory the first time it writes it. The first fork copies memory
+ * once; later forks only copy the pages written since, and the child
+ * itself costs a page table copy. Shared pages are immutable and reference
+ * counted, so the parent and its children may run on separate threads.
+ * Bus handlers, and the devices behind them, are not forked; children of a
+ * plain init_cpu() CPU share none. That includes memory mapped from outside
+ * the memory array, such as a cartridge's PRG RAM: parent and child write
+ * the same bytes. The child starts without trace, profile or scheduler and
+ * translates its own code when it runs ENGINE_JIT.
+ *
+ * The memory array is stale for pages a CPU still shares. Call
+ * cpu_unshare() before touching memory directly, or read it through
+ * cpu_page().
+ */
+cpu_t *cpu_fork(cpu_t *cpu);
+
+/*
+ * Copies every page the CPU still shares back into its memory array and
+ * drops code translated from memory; call it before writing memory
+ * directly.
+ */
+void cpu_unshare(cpu_t *cpu);
+
+// The 256 bytes of memory page page, wherever they live
+const uint8_t *cpu_page(const cpu_t *cpu, int page);
+
+// Sets registers to their power-on values and jumps through the reset vector; memory is untouched
+void cpu_reset(cpu_t *cpu);
+
+/*
+ * Executes until BRK (with stop_on_brk set), an unknown opcode, max_instructions instructions, or
+ * at least max_cycles cycles, whichever comes first. Either limit may be
+ * CPU_UNLIMITED. Execution can be resumed by calling again.
+ */
+enum CPUStopReason cpu_run_for(cpu_t *cpu, uint64_t max_instructions, uint64_t max_cycles);
+
+/*
+ * Interrupt lines, sampled at the next instruction boundary. NMI is edge
+ * triggered; IRQ is level triggered and stays asserted until the source
+ * releases it. Both may be called from bus handlers during execution.
+ */
+void cpu_nmi(cpu_t *cpu);
+
+void cpu_irq(cpu_t *cpu, uint8_t source, bool asserted);
+
+// Ends the current cpu_run_for() at the first instruction boundary at or past cycle, if that is sooner
+void cpu_stop_at(cpu_t *cpu, uint64_t cycle);
+
+enum CPUStopReason cpu_step(cpu_t *cpu);
+
+void run(cpu_t *cpu);
+
+void run_cycles(cpu_t *cpu, uint64_t cycles);
+
+void load(cpu_t *cpu, const uint8_t *program, size_t program_size);
+
+void load_and_run(cpu_t *cpu, const uint8_t *program, size_t program_size);
+
+#endif
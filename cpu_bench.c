@@ -0,0 +1,608 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "lockstep.h"
+#include "cartridge.h"
+#include "nes.h"
+#include "state.h"
+#include "rewind.h"
+#include "trace.h"
+#include "profile.h"
+
+/*
+ * Every benchmark runs a fixed input: warmup untimed samples, then
+ * repetitions timed ones, reporting the median and the fastest. The
+ * instructions and cycles in a sample are counted once up front with a
+ * trace handler, so the rates are exact. --json prints one object per line
+ * for tracking regressions across commits.
+ */
+
+static int warmup = 2;
+static int repetitions = 10;
+static bool json = false;
+static char **filters;
+static int filter_count;
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs one sample and returns the seconds it is timed at
+typedef double (*sample_t)(void *context);
+
+struct timing
+{
+    double median;
+    double min;
+};
+
+// Work done by one sample; zero for what does not apply
+struct metrics
+{
+    double instructions;
+    double cycles;
+    double frames;
+    double operations;
+};
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double left = *(const double *)a;
+    double right = *(const double *)b;
+    return (left > right) - (left < right);
+}
+
+static struct timing measure(sample_t sample, void *context)
+{
+    for(int i = 0; i < warmup; i++)
+        sample(context);
+    double *times = malloc(repetitions * sizeof(double));
+    for(int i = 0; i < repetitions; i++)
+        times[i] = sample(context);
+    qsort(times, repetitions, sizeof(double), compare_doubles);
+    struct timing timing;
+    timing.min = times[0];
+    if(repetitions % 2 == 1)
+        timing.median = times[repetitions / 2];
+    else
+        timing.median = (times[repetitions / 2 - 1] + times[repetitions / 2]) / 2;
+    free(times);
+    return timing;
+}
+
+// True if name starts with one of the filters given on the command line
+static bool selected(const char *name)
+{
+    if(filter_count == 0)
+        return true;
+    for(int i = 0; i < filter_count; i++)
+    {
+        if(strncmp(name, filters[i], strlen(filters[i])) == 0)
+            return true;
+    }
+    return false;
+}
+
+// extra_name/extra are one more per-sample quantity to print, or NULL
+static void report(const char *name, const char *variant, struct timing timing, struct metrics metrics,
+                   const char *extra_name, double extra)
+{
+    double seconds = timing.median;
+    if(json)
+    {
+        printf("{\"name\":\"%s\",\"variant\":\"%s\",\"warmup\":%d,\"repetitions\":%d,\"median_s\":%.9f,\"min_s\":%.9f",
+               name, variant, warmup, repetitions, timing.median, timing.min);
+        if(metrics.instructions > 0)
+            printf(",\"instructions\":%.0f,\"instructions_per_s\":%.0f,\"ns_per_instruction\":%.4f",
+                   metrics.instructions, metrics.instructions / seconds, seconds / metrics.instructions * 1e9);
+        if(metrics.cycles > 0)
+            printf(",\"cycles\":%.0f,\"cycles_per_s\":%.0f", metrics.cycles, metrics.cycles / seconds);
+        if(metrics.frames > 0)
+            printf(",\"frames\":%.0f,\"frames_per_s\":%.2f", metrics.frames, metrics.frames / seconds);
+        if(metrics.operations > 0)
+            printf(",\"operations\":%.0f,\"ns_per_operation\":%.2f",
+                   metrics.operations, seconds / metrics.operations * 1e9);
+        if(extra_name != NULL)
+            printf(",\"%s\":%.9g", extra_name, extra);
+        printf("}\n");
+        return;
+    }
+    printf("%s/%s:", name, variant);
+    if(metrics.instructions > 0)
+        printf(" %.2f M instructions/s, %.2f ns/instruction,",
+               metrics.instructions / seconds / 1e6, seconds / metrics.instructions * 1e9);
+    if(metrics.cycles > 0)
+        printf(" %.2f M cycles/s,", metrics.cycles / seconds / 1e6);
+    if(metrics.frames > 0)
+        printf(" %.1f frames/s (%.1fx real time),", metrics.frames / seconds, metrics.frames / seconds / 60.0988);
+    if(metrics.operations > 0)
+        printf(" %.2f us per operation,", seconds / metrics.operations * 1e6);
+    if(extra_name != NULL)
+        printf(" %s %.2f,", extra_name, extra);
+    printf(" median %.3f ms, min %.3f ms\n", timing.median * 1e3, timing.min * 1e3);
+}
+
+static void count_instruction(void *context, const cpu_t *cpu)
+{
+    (*(uint64_t *)context)++;
+}
+
+// Runs one untimed sample of cpu with its instructions and cycles counted
+static struct metrics count_sample(cpu_t *cpu, sample_t sample, void *context)
+{
+    uint64_t instructions = 0;
+    cpu_trace_handler_t trace = cpu->trace;
+    void *trace_context = cpu->trace_context;
+    cpu->trace = count_instruction;
+    cpu->trace_context = &instructions;
+    uint64_t start_cycles = cpu->cycles;
+    sample(context);
+    struct metrics metrics = {0};
+    metrics.instructions = instructions;
+    metrics.cycles = cpu->cycles - start_cycles;
+    cpu->trace = trace;
+    cpu->trace_context = trace_context;
+    return metrics;
+}
+
+/* Synthetic kernels, loaded at $8000 and run to their BRK by load_and_run() */
+
+// LDY #0; outer: LDX #0; inner: INX; BNE inner; DEY; BNE outer; BRK
+static const uint8_t tight_loop[] = {0xa0, 0x00, 0xa2, 0x00, 0xe8, 0xd0, 0xfd, 0x88, 0xd0, 0xf8, 0x00};
+
+// Copies $2000-$4FFF to $5000-$7FFF 16 times with LDA ($10),Y / STA ($12),Y
+static const uint8_t memcpy_kernel[] = {
+    0xa9, 0x10, 0x85, 0x14,
+    0xa9, 0x00, 0x85, 0x10, 0x85, 0x12, 0xa9, 0x20, 0x85, 0x11, 0xa9, 0x50, 0x85, 0x13,
+    0xa2, 0x30,
+    0xa0, 0x00,
+    0xb1, 0x10, 0x91, 0x12, 0xc8, 0xd0, 0xf9,
+    0xe6, 0x11, 0xe6, 0x13, 0xca, 0xd0, 0xf0,
+    0xc6, 0x14, 0xd0, 0xdc, 0x00
+};
+
+// 65536 rounds of ADC and SBC against zero page and immediates
+static const uint8_t adc_sbc_kernel[] = {
+    0xa0, 0x00,
+    0xa2, 0x00,
+    0x8a, 0x18, 0x65, 0x20, 0x85, 0x20, 0x38, 0xe5, 0x21, 0x85, 0x21, 0x69, 0x07, 0xe9, 0x03, 0x85, 0x22,
+    0xe8, 0xd0, 0xec,
+    0x88, 0xd0, 0xe7, 0x00
+};
+
+// 65536 rounds of four branches on the low bits of X, taken in every pattern
+static const uint8_t branch_kernel[] = {
+    0xa0, 0x00,
+    0xa2, 0x00,
+    0x8a, 0x4a, 0x90, 0x02, 0xe6, 0x20, 0x4a, 0xb0, 0x02, 0xe6, 0x21, 0x29, 0x03, 0xf0, 0x02, 0xe6, 0x22,
+    0x30, 0x00,
+    0xe8, 0xd0, 0xea,
+    0x88, 0xd0, 0xe5, 0x00
+};
+
+// Sums the values of a shuffled linked list 16 times, following the pointers with LDA ($10),Y
+static const uint8_t table_walk_kernel[] = {
+    0xa9, 0x10, 0x85, 0x14,
+    0xa9, 0x00, 0x85, 0x10, 0xa9, 0x20, 0x85, 0x11,
+    0xa0, 0x02, 0xb1, 0x10, 0x18, 0x65, 0x20, 0x85, 0x20,
+    0xa0, 0x00, 0xb1, 0x10, 0xaa, 0xc8, 0xb1, 0x10, 0x85, 0x11, 0x86, 0x10,
+    0xd0, 0xe9,
+    0xc6, 0x14, 0xd0, 0xdd, 0x00
+};
+
+// 65536 rounds of the instruction pairs the threaded engine fuses: copy, add, compare and count
+static const uint8_t pairs_kernel[] = {
+    0xa0, 0x00,
+    0xa2, 0x00,
+    0xad, 0x20, 0x00, 0x8d, 0x21, 0x00, 0x18, 0x69, 0x03, 0x8d, 0x20, 0x00, 0xc9, 0x80, 0xd0, 0x00,
+    0xe8, 0xe0, 0x00, 0xd0, 0xeb,
+    0x88, 0xd0, 0xe6, 0x00
+};
+
+#define TABLE_NODES 4096
+#define TABLE_BASE 0x2000
+
+// Nodes of next pointer and value at $2000, linked in the full-period order k -> 5k + 1; $0000 ends the list
+static void prepare_table_walk(cpu_t *cpu)
+{
+    int node = 0;
+    for(int i = 0; i < TABLE_NODES; i++)
+    {
+        int next = (node * 5 + 1) % TABLE_NODES;
+        uint16_t address = TABLE_BASE + node * 3;
+        uint16_t next_address = i == TABLE_NODES - 1 ? 0 : TABLE_BASE + next * 3;
+        cpu->memory[address] = next_address & 0xFF;
+        cpu->memory[address + 1] = next_address >> 8;
+        cpu->memory[address + 2] = (uint8_t)node;
+        node = next;
+    }
+}
+
+struct kernel
+{
+    const char *name;
+    const uint8_t *program;
+    size_t program_size;
+    // Sets up memory before the kernel runs, or NULL
+    void (*prepare)(cpu_t *cpu);
+};
+
+static const struct kernel kernels[] = {
+    {"tight_loop", tight_loop, sizeof(tight_loop), NULL},
+    {"memcpy", memcpy_kernel, sizeof(memcpy_kernel), NULL},
+    {"adc_sbc", adc_sbc_kernel, sizeof(adc_sbc_kernel), NULL},
+    {"branches", branch_kernel, sizeof(branch_kernel), NULL},
+    {"table_walk", table_walk_kernel, sizeof(table_walk_kernel), prepare_table_walk},
+    {"pairs", pairs_kernel, sizeof(pairs_kernel), NULL},
+};
+
+struct kernel_run
+{
+    const struct kernel *kernel;
+    cpu_t *cpu;
+};
+
+static double kernel_sample(void *context)
+{
+    struct kernel_run *kernel_run = context;
+    if(kernel_run->kernel->prepare != NULL)
+        kernel_run->kernel->prepare(kernel_run->cpu);
+    double start = now_seconds();
+    load_and_run(kernel_run->cpu, kernel_run->kernel->program, kernel_run->kernel->program_size);
+    return now_seconds() - start;
+}
+
+static void bench_kernel(const struct kernel *kernel, const char *variant, cpu_t *cpu)
+{
+    struct kernel_run kernel_run = {kernel, cpu};
+    struct metrics metrics = count_sample(cpu, kernel_sample, &kernel_run);
+    report(kernel->name, variant, measure(kernel_sample, &kernel_run), metrics, NULL, 0);
+}
+
+#define LOCKSTEP_LANES 64
+
+struct lockstep_kernel_run
+{
+    const struct kernel *kernel;
+    cpu_t *cpu;
+    lockstep_t *lockstep;
+};
+
+// The kernel in every lane at once, loaded untimed
+static double lockstep_sample(void *context)
+{
+    struct lockstep_kernel_run *run = context;
+    if(run->kernel->prepare != NULL)
+        run->kernel->prepare(run->cpu);
+    load(run->cpu, run->kernel->program, run->kernel->program_size);
+    cpu_reset(run->cpu);
+    for(int lane = 0; lane < LOCKSTEP_LANES; lane++)
+        lockstep_load(run->lockstep, lane, run->cpu);
+    double start = now_seconds();
+    lockstep_run(run->lockstep, CPU_UNLIMITED, CPU_UNLIMITED);
+    return now_seconds() - start;
+}
+
+static void bench_lockstep(const struct kernel *kernel, cpu_t *cpu)
+{
+    struct kernel_run kernel_run = {kernel, cpu};
+    struct metrics metrics = count_sample(cpu, kernel_sample, &kernel_run);
+    metrics.instructions *= LOCKSTEP_LANES;
+    metrics.cycles *= LOCKSTEP_LANES;
+    struct lockstep_kernel_run run = {kernel, cpu, lockstep_create(LOCKSTEP_LANES)};
+    report(kernel->name, "lockstep", measure(lockstep_sample, &run), metrics, NULL, 0);
+    lockstep_free(run.lockstep);
+}
+
+static void bench_kernels()
+{
+    for(size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+    {
+        if(!selected(kernels[i].name))
+            continue;
+        cpu_t *cpu = init_cpu();
+        cpu->engine = ENGINE_SWITCH;
+        bench_kernel(&kernels[i], "switch", cpu);
+        cpu->engine = ENGINE_THREADED;
+        cpu->fuse_pairs = false;
+        bench_kernel(&kernels[i], "threaded_unfused", cpu);
+        cpu->fuse_pairs = true;
+        bench_kernel(&kernels[i], "threaded", cpu);
+        cpu->engine = ENGINE_JIT;
+        bench_kernel(&kernels[i], "jit", cpu);
+        cpu->engine = ENGINE_THREADED;
+        bench_lockstep(&kernels[i], cpu);
+        free_cpu(cpu);
+    }
+}
+
+// The tight loop recorded into a memory-mapped trace ring, then under the profiler
+static void bench_instrumented()
+{
+    if(!selected("tight_loop"))
+        return;
+    cpu_t *cpu = init_cpu();
+    struct kernel_run kernel_run = {&kernels[0], cpu};
+    struct metrics metrics = count_sample(cpu, kernel_sample, &kernel_run);
+
+    char path[] = "/tmp/cnes_bench_trace_XXXXXX";
+    close(mkstemp(path));
+    tracer_t *tracer = trace_open_ring(path, 1 << 20);
+    trace_attach(tracer, cpu);
+    report("tight_loop", "traced", measure(kernel_sample, &kernel_run), metrics, NULL, 0);
+    trace_detach(cpu);
+    trace_close(tracer);
+    unlink(path);
+
+    profile_t *profile = profile_create();
+    profile_attach(profile, cpu);
+    report("tight_loop", "profiled", measure(kernel_sample, &kernel_run), metrics, NULL, 0);
+    profile_detach(cpu);
+    profile_free(profile);
+    free_cpu(cpu);
+}
+
+/*
+ * At $E000: select MMC3 bank 3 at $8000, then sum $8000-$81FF 256 times with
+ * LDA abs,X / ADC abs,X. On flat RAM the bank select is a plain store.
+ */
+static const uint8_t banked_reads[] = {
+    0xa9, 0x06, 0x8d, 0x00, 0x80, 0xa9, 0x03, 0x8d, 0x01, 0x80,
+    0xa0, 0x00, 0xa2, 0x00, 0xbd, 0x00, 0x80, 0x7d, 0x00, 0x81,
+    0xe8, 0xd0, 0xf7, 0x88, 0xd0, 0xf2, 0x00
+};
+#define BANKED_READS (2 * 256 * 256)
+
+static double banked_reads_sample(void *context)
+{
+    cpu_t *cpu = context;
+    double start = now_seconds();
+    cpu->program_counter = 0xe000;
+    run(cpu);
+    return now_seconds() - start;
+}
+
+static void bench_reads(const char *variant, cpu_t *cpu)
+{
+    struct metrics metrics = count_sample(cpu, banked_reads_sample, cpu);
+    struct timing timing = measure(banked_reads_sample, cpu);
+    report("banked_reads", variant, timing, metrics, "reads_per_s", BANKED_READS / timing.median);
+}
+
+static void bench_banked_reads()
+{
+    if(!selected("banked_reads"))
+        return;
+    cpu_t *flat = init_cpu();
+    memcpy(&flat->memory[0xe000], banked_reads, sizeof(banked_reads));
+    bench_reads("flat_ram", flat);
+    free_cpu(flat);
+
+    // MMC3 with 8 PRG banks; the code lives in the fixed bank at $E000
+    size_t prg_size = 8 * 0x2000;
+    size_t image_size = INES_HEADER_SIZE + prg_size + CHR_BANK_SIZE;
+    uint8_t *image = calloc(1, image_size);
+    memcpy(image, "NES\x1a", 4);
+    image[4] = prg_size / PRG_BANK_SIZE;
+    image[5] = 1;
+    image[6] = 0x40;
+    memcpy(image + INES_HEADER_SIZE + 7 * 0x2000, banked_reads, sizeof(banked_reads));
+    cartridge_t *cart = cartridge_from_image(image, image_size);
+    cpu_t *banked = init_cpu();
+    cartridge_insert(cart, banked);
+    bench_reads("mmc3_rom", banked);
+    free_cpu(banked);
+    cartridge_close(cart);
+    free(image);
+}
+
+/*
+ * NROM game loop: turn on NMI, background and sprites, then spin while the
+ * NMI handler does an OAM DMA from $0200 each frame.
+ */
+static const uint8_t frame_loop[] = {
+    0xa9, 0x80, 0x8d, 0x00, 0x20, 0xa9, 0x1e, 0x8d, 0x01, 0x20,
+    0x4c, 0x0a, 0x80
+};
+static const uint8_t frame_nmi[] = {0xa9, 0x02, 0x8d, 0x14, 0x40, 0x40};
+// One emulated second of headless rendering per sample
+#define SAMPLE_FRAMES 60
+
+static double frames_sample(void *context)
+{
+    nes_t *nes = context;
+    double start = now_seconds();
+    for(int i = 0; i < SAMPLE_FRAMES; i++)
+        nes_run_frame(nes);
+    return now_seconds() - start;
+}
+
+static void bench_frames()
+{
+    if(!selected("frames"))
+        return;
+    size_t image_size = INES_HEADER_SIZE + PRG_BANK_SIZE + CHR_BANK_SIZE;
+    uint8_t *image = calloc(1, image_size);
+    memcpy(image, "NES\x1a", 4);
+    image[4] = 1;
+    image[5] = 1;
+    uint8_t *prg = image + INES_HEADER_SIZE;
+    memcpy(prg, frame_loop, sizeof(frame_loop));
+    memcpy(prg + 0x100, frame_nmi, sizeof(frame_nmi));
+    prg[0x3ffb] = 0x81;
+    prg[0x3ffd] = 0x80;
+    uint8_t *chr = prg + PRG_BANK_SIZE;
+    for(int i = 0; i < CHR_BANK_SIZE; i++)
+        chr[i] = (uint8_t)(i * 37);
+
+    cartridge_t *cart = cartridge_from_image(image, image_size);
+    nes_t *nes = nes_create(cart);
+    for(int i = 0; i < 0x400; i++)
+        nes->ppu.vram[i] = (uint8_t)i;
+    for(int i = 0; i < 256; i++)
+        nes->cpu->memory[0x200 + i] = (uint8_t)(i * 7);
+
+    struct metrics metrics = count_sample(nes->cpu, frames_sample, nes);
+    metrics.frames = SAMPLE_FRAMES;
+    report("frames", "nrom", measure(frames_sample, nes), metrics, NULL, 0);
+    nes->ppu.skip_pixels = true;
+    metrics = count_sample(nes->cpu, frames_sample, nes);
+    metrics.frames = SAMPLE_FRAMES;
+    report("frames", "nrom_skip_pixels", measure(frames_sample, nes), metrics, NULL, 0);
+    nes->ppu.skip_pixels = false;
+    nes->cpu->engine = ENGINE_JIT;
+    metrics = count_sample(nes->cpu, frames_sample, nes);
+    metrics.frames = SAMPLE_FRAMES;
+    report("frames", "nrom_jit", measure(frames_sample, nes), metrics, NULL, 0);
+    nes_free(nes);
+    cartridge_close(cart);
+    free(image);
+}
+
+#define SAMPLE_STATES 1000
+
+static double save_state_sample(void *context)
+{
+    cpu_t *cpu = context;
+    static uint8_t state[CPU_STATE_SIZE];
+    double start = now_seconds();
+    for(int i = 0; i < SAMPLE_STATES; i++)
+    {
+        cpu_save_state(cpu, state, sizeof(state));
+        cpu_load_state(cpu, state, sizeof(state));
+    }
+    return now_seconds() - start;
+}
+
+static void bench_save_state()
+{
+    if(!selected("save_state"))
+        return;
+    cpu_t *cpu = init_cpu();
+    load_and_run(cpu, tight_loop, sizeof(tight_loop));
+    struct metrics metrics = {0};
+    metrics.operations = SAMPLE_STATES;
+    report("save_state", "round_trip", measure(save_state_sample, cpu), metrics, NULL, 0);
+    free_cpu(cpu);
+}
+
+/*
+ * LDX #0; copy: LDA $0300,X; ADC #1; STA $0300,X; INX; BNE copy; INC $10;
+ * JMP: rewrites one page about eight times a frame.
+ */
+static const uint8_t rewind_loop[] = {
+    0xa2, 0x00, 0xbd, 0x00, 0x03, 0x69, 0x01, 0x9d, 0x00, 0x03, 0xe8, 0xd0, 0xf5, 0xe6, 0x10, 0x4c, 0x00, 0x80
+};
+// Ten emulated seconds per sample
+#define REWIND_FRAMES 600
+#define REWIND_BUDGET (4 << 20)
+#define CYCLES_PER_FRAME 29781
+
+// Records REWIND_FRAMES frames into a fresh buffer and leaves its size in context; only the captures are timed
+static double rewind_sample(void *context)
+{
+    size_t *bytes = context;
+    cpu_t *cpu = init_cpu();
+    load(cpu, rewind_loop, sizeof(rewind_loop));
+    cpu_reset(cpu);
+    rewind_buffer_t *buffer = rewind_create(cpu, REWIND_BUDGET, REWIND_FRAMES, 60);
+    double capturing = 0;
+    for(int i = 0; i < REWIND_FRAMES; i++)
+    {
+        cpu_run_for(cpu, CPU_UNLIMITED, CYCLES_PER_FRAME);
+        double start = now_seconds();
+        rewind_capture(buffer);
+        capturing += now_seconds() - start;
+    }
+    *bytes = buffer->used;
+    rewind_free(buffer);
+    free_cpu(cpu);
+    return capturing;
+}
+
+static void bench_rewind()
+{
+    if(!selected("rewind"))
+        return;
+    size_t bytes = 0;
+    struct timing timing = measure(rewind_sample, &bytes);
+    struct metrics metrics = {0};
+    metrics.operations = REWIND_FRAMES;
+    report("rewind", "capture", timing, metrics, "bytes_per_frame", (double)bytes / REWIND_FRAMES);
+}
+
+#define SAMPLE_FORKS 1000
+
+// Forks a running CPU and runs each child for a frame, as a search would; only the forks are timed
+static double fork_sample(void *context)
+{
+    cpu_t *parent = context;
+    double forking = 0;
+    for(int i = 0; i < SAMPLE_FORKS; i++)
+    {
+        double start = now_seconds();
+        cpu_t *child = cpu_fork(parent);
+        forking += now_seconds() - start;
+        bus_write(&child->bus, 0x10, i);
+        cpu_run_for(child, CPU_UNLIMITED, CYCLES_PER_FRAME);
+        free_cpu(child);
+    }
+    return forking;
+}
+
+static void bench_fork()
+{
+    if(!selected("fork"))
+        return;
+    cpu_t *parent = init_cpu();
+    load(parent, rewind_loop, sizeof(rewind_loop));
+    cpu_reset(parent);
+    cpu_run_for(parent, CPU_UNLIMITED, CYCLES_PER_FRAME);
+    struct metrics metrics = {0};
+    metrics.operations = SAMPLE_FORKS;
+    report("fork", "cow", measure(fork_sample, parent), metrics, NULL, 0);
+    free_cpu(parent);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: cpu_bench [--json] [--warmup N] [--repetitions N] [name...]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    filters = malloc(argc * sizeof(char *));
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--json") == 0)
+            json = true;
+        else if(strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+            warmup = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc)
+            repetitions = atoi(argv[++i]);
+        else if(argv[i][0] == '-')
+            usage();
+        else
+            filters[filter_count++] = argv[i];
+    }
+    if(warmup < 0 || repetitions < 1)
+        usage();
+
+    bench_kernels();
+    bench_instrumented();
+    bench_banked_reads();
+    bench_frames();
+    bench_save_state();
+    bench_rewind();
+    bench_fork();
+    free(filters);
+    return 0;
+}
@@ -2,16 +2,26 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "cpu.h"
+#include "fusion.h"
+#include "opcode.h"
+#include "state.h"
+#include "rewind.h"
+#include "trace.h"
+#include "profile.h"
+#include "lockstep.h"
+
+// 64KB of memory, the bus page tables with write tracking, registers and engine pointers; catches accidental growth of cpu_t
+#define CPU_SIZE_BUDGET (0x10000 + 0x1C08)
 
 void test_0xa9_lda_immediate_load_data()
 {
     cpu_t *cpu = init_cpu();
-    int *program = malloc(sizeof(int) * 3);
-    program[0] = 0xa9;
-    program[1] = 0x05;
-    program[2] = 0x00;
-    load_and_run(cpu, program, 3);
+    uint8_t program[] = {0xa9, 0x05, 0x00};
+    load_and_run(cpu, program, sizeof(program));
     if(cpu->reg_a != 0x05)
     {
         fprintf(stderr, "0xa9_lda_immediate_load_data failure: reg_a not correct: %d\n", cpu->reg_a);
@@ -33,11 +43,8 @@ void test_0xa9_lda_immediate_load_data()
 void test_0xa9_lda_zero_flag()
 {
     cpu_t *cpu = init_cpu();
-    int *program = malloc(sizeof(int)*3);
-    program[0] = 0xa9;
-    program[1] = 0x00;
-    program[2] = 0x00;
-    load_and_run(cpu, program, 3);
+    uint8_t program[] = {0xa9, 0x00, 0x00};
+    load_and_run(cpu, program, sizeof(program));
     if((cpu->reg_status & 0b00000010) != 0b10)
     {
         fprintf(stderr, "0xa9_lda_zero_flag failure: zero flag not correct");
@@ -49,11 +56,8 @@ void test_0xa9_lda_zero_flag()
 void test_0xa9_lda_negative_flag()
 {
     cpu_t *cpu = init_cpu();
-    int *program = malloc(sizeof(int)*3);
-    program[0] = 0xa9;
-    program[1] = 0xF0;
-    program[2] = 0x00;
-    load_and_run(cpu, program, 3);
+    uint8_t program[] = {0xa9, 0xF0, 0x00};
+    load_and_run(cpu, program, sizeof(program));
     if((cpu->reg_status & 0b10000000) != 0b10000000)
     {
         fprintf(stderr, "0xa9_lda_negative_flag failure: negative flag not correct");
@@ -66,12 +70,8 @@ void test_0xa9_lda_negative_flag()
 void test_0xaa_tax()
 {
     cpu_t *cpu = init_cpu();
-    int *program = malloc(sizeof(int)*2);
-    program[0] = 0xa9;
-    program[1] = 0x11;
-    program[2] = 0xaa;
-    program[3] = 0x00;
-    load_and_run(cpu, program, 4);
+    uint8_t program[] = {0xa9, 0x11, 0xaa, 0x00};
+    load_and_run(cpu, program, sizeof(program));
     if(cpu->reg_x != 17)
     {
         fprintf(stderr, "0xaa_tax failure: reg_x not correct");
@@ -93,13 +93,8 @@ void test_0xaa_tax()
 void test_0xe8_inx()
 {
     cpu_t *cpu = init_cpu();
-    int *program = malloc(sizeof(int)*5);
-    program[0] = 0xa9;
-    program[1] = 0x01;
-    program[2] = 0xaa;
-    program[3] = 0xe8;
-    program[4] = 0x00;
-    load_and_run(cpu, program, 5);
+    uint8_t program[] = {0xa9, 0x01, 0xaa, 0xe8, 0x00};
+    load_and_run(cpu, program, sizeof(program));
     if(cpu->reg_x != 0x02)
     {
         fprintf(stderr, "0xe8_inx failure: reg_x not correct");
@@ -121,13 +116,8 @@ void test_0xe8_inx()
 void test_0xe8_inx_nonzero()
 {
     cpu_t *cpu = init_cpu();
-    int *program = malloc(sizeof(int)*2);
-    program[0] = 0xa9;
-    program[1] = 0x06;
-    program[2] = 0xaa;
-    program[3] = 0xe8;
-    program[4] = 0x00;
-    load_and_run(cpu, program, 5);
+    uint8_t program[] = {0xa9, 0x06, 0xaa, 0xe8, 0x00};
+    load_and_run(cpu, program, sizeof(program));
     if(cpu->reg_x != 0x07)
     {
         fprintf(stderr, "0xe8_inx_nonzero failure: reg_x not correct");
@@ -150,13 +140,8 @@ void test_0xe8_inx_nonzero()
 void test_ops_together()
 {
     cpu_t *cpu = init_cpu();
-    int *program = malloc(sizeof(int)*5);
-    program[0] = 0xa9;
-    program[1] = 0xc0;
-    program[2] = 0xaa;
-    program[3] = 0xe8;
-    program[4] = 0x00;
-    load_and_run(cpu, program, 5);
+    uint8_t program[] = {0xa9, 0xc0, 0xaa, 0xe8, 0x00};
+    load_and_run(cpu, program, sizeof(program));
     if(cpu->reg_x != 0xc1)
     {
         fprintf(stderr, "ops_together failure: reg_x not correct");
@@ -168,14 +153,8 @@ void test_ops_together()
 void test_overflow_inx()
 {
     cpu_t *cpu = init_cpu();
-    int *program = malloc(sizeof(int)*3);
-    program[0] = 0xa9;
-    program[1] = 0xff;
-    program[2] = 0xaa;
-    program[3] = 0xe8;
-    program[4] = 0xe8;
-    program[5] = 0x00;
-    load_and_run(cpu, program, 6);
+    uint8_t program[] = {0xa9, 0xff, 0xaa, 0xe8, 0xe8, 0x00};
+    load_and_run(cpu, program, sizeof(program));
     if(cpu->reg_x != 1)
     {
         fprintf(stderr, "overflow_inx failure: reg_x not correct");
@@ -184,6 +163,1511 @@ void test_overflow_inx()
     free_cpu(cpu);
 }
 
+void test_cpu_size_budget()
+{
+    if(sizeof(cpu_t) > CPU_SIZE_BUDGET)
+    {
+        fprintf(stderr, "cpu_size_budget failure: sizeof(cpu_t) is %zu, budget %d\n", sizeof(cpu_t), CPU_SIZE_BUDGET);
+        exit(1);
+    }
+}
+
+void test_lda_absolute_top_of_memory()
+{
+    cpu_t *cpu = init_cpu();
+    cpu->memory[0xffff] = 0x7f;
+    uint8_t program[] = {0xad, 0xff, 0xff, 0x00};
+    load_and_run(cpu, program, sizeof(program));
+    if(cpu->reg_a != 0x7f)
+    {
+        fprintf(stderr, "lda_absolute_top_of_memory failure: reg_a not correct: %d\n", cpu->reg_a);
+        exit(1);
+    }
+    free_cpu(cpu);
+}
+
+void test_bus_ram_mirroring()
+{
+    // STA $0010; LDX $0810; LDY $1810 with $0000-$07FF mirrored up to $1FFF
+    uint8_t program[] = {0xa9, 0x5a, 0x8d, 0x10, 0x00, 0xae, 0x10, 0x08, 0xac, 0x10, 0x18, 0x00};
+    cpu_t *cpu = init_cpu();
+    bus_map_memory(&cpu->bus, 0x0000, 0x2000, cpu->memory, 0x800, true);
+    load_and_run(cpu, program, sizeof(program));
+    if(cpu->reg_x != 0x5a || cpu->reg_y != 0x5a)
+    {
+        fprintf(stderr, "bus_ram_mirroring failure: mirrored read not correct\n");
+        exit(1);
+    }
+    if(cpu->bus.read_pages[0x00] != cpu->bus.read_pages[0x08] || cpu->bus.read_pages[0x00] != cpu->bus.read_pages[0x18])
+    {
+        fprintf(stderr, "bus_ram_mirroring failure: mirrors do not share a page\n");
+        exit(1);
+    }
+    free_cpu(cpu);
+}
+
+struct test_device
+{
+    uint8_t last_write;
+    uint16_t last_write_address;
+    int reads;
+};
+
+static uint8_t test_device_read(void *context, uint16_t address)
+{
+    struct test_device *device = context;
+    device->reads += 1;
+    return (uint8_t)address;
+}
+
+static void test_device_write(void *context, uint16_t address, uint8_t data)
+{
+    struct test_device *device = context;
+    device->last_write = data;
+    device->last_write_address = address;
+}
+
+void test_bus_mapped_handler()
+{
+    // LDA $2002; STA $2007; LDX $3000 (open bus)
+    uint8_t program[] = {0xad, 0x02, 0x20, 0x8d, 0x07, 0x20, 0xae, 0x00, 0x30, 0x00};
+    struct test_device device = {0};
+    cpu_t *cpu = init_cpu();
+    bus_map_handler(&cpu->bus, 0x2000, 0x1000, test_device_read, test_device_write, &device);
+    bus_map_handler(&cpu->bus, 0x3000, 0x100, NULL, NULL, NULL);
+    cpu->reg_x = 0xff;
+    load_and_run(cpu, program, sizeof(program));
+    if(cpu->reg_a != 0x02 || device.reads != 1)
+    {
+        fprintf(stderr, "bus_mapped_handler failure: handler read not correct\n");
+        exit(1);
+    }
+    if(device.last_write != 0x02 || device.last_write_address != 0x2007)
+    {
+        fprintf(stderr, "bus_mapped_handler failure: handler write not correct\n");
+        exit(1);
+    }
+    if(cpu->reg_x != 0x00)
+    {
+        fprintf(stderr, "bus_mapped_handler failure: open bus read not correct\n");
+        exit(1);
+    }
+    free_cpu(cpu);
+}
+
+void test_bus_handler_table_full()
+{
+    // Slot 0 is open bus, so the last device does not fit
+    struct test_device devices[BUS_MAX_HANDLERS] = {{0}};
+    cpu_t *cpu = init_cpu();
+    for(int i = 0; i < BUS_MAX_HANDLERS - 1; i++)
+    {
+        if(!bus_map_handler(&cpu->bus, 0x4000 + i * BUS_PAGE_SIZE, BUS_PAGE_SIZE,
+                            test_device_read, test_device_write, &devices[i]))
+        {
+            fprintf(stderr, "bus_handler_table_full failure: handler %d not mapped\n", i);
+            exit(1);
+        }
+    }
+    uint16_t last = 0x4000 + (BUS_MAX_HANDLERS - 1) * BUS_PAGE_SIZE;
+    cpu->memory[last] = 0x55;
+    bus_map_memory(&cpu->bus, last, BUS_PAGE_SIZE, &cpu->memory[last], BUS_PAGE_SIZE, true);
+    if(bus_map_handler(&cpu->bus, last, BUS_PAGE_SIZE, test_device_read, test_device_write,
+                       &devices[BUS_MAX_HANDLERS - 1]))
+    {
+        fprintf(stderr, "bus_handler_table_full failure: handler mapped past the table\n");
+        exit(1);
+    }
+    if(bus_read(&cpu->bus, last) != 0x55 || devices[BUS_MAX_HANDLERS - 1].reads != 0)
+    {
+        fprintf(stderr, "bus_handler_table_full failure: page remapped\n");
+        exit(1);
+    }
+    // Mapping a handler already in the table still works
+    if(!bus_map_handler(&cpu->bus, last, BUS_PAGE_SIZE, test_device_read, test_device_write, &devices[0]))
+    {
+        fprintf(stderr, "bus_handler_table_full failure: existing handler not mapped\n");
+        exit(1);
+    }
+    free_cpu(cpu);
+}
+
+void test_bus_read_only_memory()
+{
+    // STA $C000 is dropped by a read-only mapping; LDX $C000 still reads it
+    uint8_t rom[BUS_PAGE_SIZE] = {0x33};
+    uint8_t program[] = {0xa9, 0x44, 0x8d, 0x00, 0xc0, 0xae, 0x00, 0xc0, 0x00};
+    cpu_t *cpu = init_cpu();
+    bus_map_handler(&cpu->bus, 0xc000, BUS_PAGE_SIZE, NULL, NULL, NULL);
+    bus_map_memory(&cpu->bus, 0xc000, BUS_PAGE_SIZE, rom, sizeof(rom), false);
+    load_and_run(cpu, program, sizeof(program));
+    if(cpu->reg_x != 0x33 || rom[0] != 0x33)
+    {
+        fprintf(stderr, "bus_read_only_memory failure: ROM was written\n");
+        exit(1);
+    }
+    free_cpu(cpu);
+}
+
+struct status_probe
+{
+    cpu_t *cpu;
+    uint8_t statuses[2];
+};
+
+static void status_probe_write(void *context, uint16_t address, uint8_t data)
+{
+    struct status_probe *probe = context;
+    probe->statuses[address & 1] = cpu_status(probe->cpu);
+}
+
+void test_status_accessor()
+{
+    // LDA #$00; STA $2000; LDA #$80; STA $2001; LDX #$01
+    uint8_t program[] = {0xa9, 0x00, 0x8d, 0x00, 0x20, 0xa9, 0x80, 0x8d, 0x01, 0x20, 0xa2, 0x01, 0x00};
+    for(int engine = ENGINE_SWITCH; engine <= ENGINE_JIT_CHECKED; engine++)
+    {
+        cpu_t *cpu = init_cpu();
+        struct status_probe probe = {cpu, {0, 0}};
+        cpu->engine = engine;
+        bus_map_handler(&cpu->bus, 0x2000, BUS_PAGE_SIZE, NULL, status_probe_write, &probe);
+        load_and_run(cpu, program, sizeof(program));
+        if((probe.statuses[0] & (ZERO | NEGATIVE)) != ZERO || (probe.statuses[1] & (ZERO | NEGATIVE)) != NEGATIVE)
+        {
+            fprintf(stderr, "status_accessor failure: flags seen by a handler not correct with engine %d\n", engine);
+            exit(1);
+        }
+        if((cpu->reg_status & (ZERO | NEGATIVE)) != 0 || cpu_status(cpu) != cpu->reg_status)
+        {
+            fprintf(stderr, "status_accessor failure: reg_status not correct after the run with engine %d\n", engine);
+            exit(1);
+        }
+        free_cpu(cpu);
+    }
+}
+
+void expect_cycles(const char *name, uint8_t *program, size_t program_size, uint64_t expected)
+{
+    for(int engine = ENGINE_SWITCH; engine <= ENGINE_JIT_CHECKED; engine++)
+    {
+        cpu_t *cpu = init_cpu();
+        cpu->engine = engine;
+        load_and_run(cpu, program, program_size);
+        // BRK's own 7 cycles are counted before run() stops
+        if(cpu->cycles != expected + 7)
+        {
+            fprintf(stderr, "%s failure: cycles not correct: %llu\n", name, (unsigned long long)(cpu->cycles - 7));
+            exit(1);
+        }
+        free_cpu(cpu);
+    }
+}
+
+void test_cycles_base()
+{
+    uint8_t program[] = {0xa9, 0x05, 0x85, 0x10, 0xee, 0x00, 0x03, 0x00};
+    expect_cycles("cycles_base", program, sizeof(program), 2 + 3 + 6);
+}
+
+void test_cycles_page_cross_read()
+{
+    // LDX #1; LDA $80FF,X; LDA $8000,X; LDY #1; LDA ($10),Y with ($10) = $00FF
+    uint8_t program[] = {0xa2, 0x01, 0xbd, 0xff, 0x80, 0xbd, 0x00, 0x80,
+                         0xa9, 0xff, 0x85, 0x10, 0xa0, 0x01, 0xb1, 0x10, 0x00};
+    expect_cycles("cycles_page_cross_read", program, sizeof(program), 2 + 5 + 4 + 2 + 3 + 2 + 6);
+}
+
+void test_cycles_page_cross_write()
+{
+    // LDX #1; STA $80FF,X always takes 5 cycles
+    uint8_t program[] = {0xa2, 0x01, 0x9d, 0xff, 0x80, 0x00};
+    expect_cycles("cycles_page_cross_write", program, sizeof(program), 2 + 5);
+}
+
+void test_cycles_branch()
+{
+    // LDX #2; loop: DEX; BNE loop
+    uint8_t program[] = {0xa2, 0x02, 0xca, 0xd0, 0xfd, 0x00};
+    expect_cycles("cycles_branch", program, sizeof(program), 2 + 2 + 3 + 2 + 2);
+}
+
+void test_cycles_branch_page_cross()
+{
+    // JMP $80FB; at $80FB: LDX #1; BNE $8102 crosses from $80FF into $81xx
+    uint8_t program[0x103] = {0x4c, 0xfb, 0x80};
+    program[0xfb] = 0xa2;
+    program[0xfc] = 0x01;
+    program[0xfd] = 0xd0;
+    program[0xfe] = 0x03;
+    program[0x102] = 0x00;
+    expect_cycles("cycles_branch_page_cross", program, sizeof(program), 3 + 2 + 4);
+}
+
+void test_run_cycles_budget()
+{
+    // JMP $8000 forever
+    uint8_t program[] = {0x4c, 0x00, 0x80};
+    cpu_t *cpu = init_cpu();
+    load(cpu, program, sizeof(program));
+    cpu->program_counter = 0x8000;
+    run_cycles(cpu, 10);
+    if(cpu->cycles != 12)
+    {
+        fprintf(stderr, "run_cycles_budget failure: cycles not correct: %llu\n", (unsigned long long)cpu->cycles);
+        exit(1);
+    }
+    run_cycles(cpu, 1);
+    if(cpu->cycles != 15)
+    {
+        fprintf(stderr, "run_cycles_budget failure: cycles not correct after resume: %llu\n", (unsigned long long)cpu->cycles);
+        exit(1);
+    }
+    free_cpu(cpu);
+}
+
+static uint8_t corpus_indirect_copy[] = {
+    0xa9, 0x00, 0x85, 0x10, 0xa9, 0x80, 0x85, 0x11,
+    0xa9, 0x00, 0x85, 0x12, 0xa9, 0x02, 0x85, 0x13,
+    0xa0, 0x00, 0xb1, 0x10, 0x91, 0x12, 0xc8, 0xd0,
+    0xf9, 0x00
+};
+
+static uint8_t corpus_arithmetic[] = {
+    0x18, 0xa9, 0x50, 0x69, 0x50, 0x85, 0x00, 0x38,
+    0xe9, 0xf0, 0x85, 0x01, 0x2a, 0x6a, 0x0a, 0x4a,
+    0x06, 0x00, 0x26, 0x01, 0x46, 0x00, 0x66, 0x01,
+    0xe6, 0x02, 0xc6, 0x03, 0xa2, 0x05, 0x75, 0xfb,
+    0x29, 0x0f, 0x09, 0x80, 0x49, 0xff, 0x24, 0x00,
+    0xc9, 0x10, 0xe0, 0x05, 0xc0, 0x00, 0x00
+};
+
+static uint8_t corpus_subroutine[] = {
+    0xa2, 0xff, 0x9a, 0xa9, 0x42, 0x48, 0x08, 0x20,
+    0x10, 0x80, 0x28, 0x68, 0x8d, 0x00, 0x03, 0x00,
+    0xa0, 0x07, 0x98, 0xa8, 0x8a, 0xba, 0x8c, 0x01,
+    0x03, 0x8e, 0x02, 0x03, 0x60
+};
+
+static uint8_t corpus_branches[] = {
+    0xa2, 0x0a, 0x18, 0x8a, 0x65, 0x20, 0x85, 0x20,
+    0xca, 0xd0, 0xf7, 0x90, 0x02, 0xa9, 0xff, 0xb8,
+    0x50, 0x02, 0xa9, 0xee, 0x78, 0x58, 0xf8, 0xd8,
+    0x10, 0x02, 0xa9, 0xdd, 0x4c, 0x21, 0x80, 0xa9,
+    0xcc, 0xa9, 0x30, 0x8d, 0x00, 0x04, 0xa9, 0x80,
+    0x8d, 0x01, 0x04, 0x6c, 0x00, 0x04, 0xea, 0xea,
+    0xb0, 0x02, 0x30, 0x01, 0xea, 0xf0, 0x01, 0x70,
+    0x01, 0xea, 0x00
+};
+
+static uint8_t corpus_indexed[] = {
+    0xa2, 0x03, 0xa0, 0x02, 0xa9, 0x11, 0x9d, 0x00,
+    0x05, 0x99, 0x00, 0x05, 0x95, 0x30, 0x96, 0x40,
+    0x94, 0x50, 0xbd, 0x00, 0x05, 0xb9, 0xff, 0x04,
+    0xb5, 0x30, 0xb6, 0x40, 0xb4, 0x50, 0xa9, 0x00,
+    0x85, 0x60, 0xa9, 0x05, 0x85, 0x61, 0xa1, 0x5d,
+    0x81, 0x5d, 0xfe, 0x00, 0x05, 0xde, 0x00, 0x05,
+    0x1e, 0x00, 0x05, 0x5e, 0x00, 0x05, 0x3e, 0x00,
+    0x05, 0x7e, 0x00, 0x05, 0xae, 0x00, 0x05, 0xac,
+    0x03, 0x05, 0xbe, 0xfd, 0x04, 0xbc, 0x00, 0x05,
+    0x00
+};
+
+struct corpus_entry
+{
+    const char *name;
+    uint8_t *program;
+    size_t program_size;
+};
+
+#define CORPUS_ENTRY(p) { #p, p, sizeof(p) }
+
+static struct corpus_entry corpus[] = {
+    CORPUS_ENTRY(corpus_indirect_copy),
+    CORPUS_ENTRY(corpus_arithmetic),
+    CORPUS_ENTRY(corpus_subroutine),
+    CORPUS_ENTRY(corpus_branches),
+    CORPUS_ENTRY(corpus_indexed),
+};
+
+void test_engines_agree_on_corpus()
+{
+    for(int i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++)
+    {
+        cpu_t *reference = init_cpu();
+        reference->engine = ENGINE_SWITCH;
+        load_and_run(reference, corpus[i].program, corpus[i].program_size);
+        for(int engine = ENGINE_THREADED; engine <= ENGINE_JIT_CHECKED; engine++)
+        {
+            cpu_t *cpu = init_cpu();
+            cpu->engine = engine;
+            load_and_run(cpu, corpus[i].program, corpus[i].program_size);
+            if(reference->reg_a != cpu->reg_a || reference->reg_x != cpu->reg_x ||
+               reference->reg_y != cpu->reg_y || reference->reg_status != cpu->reg_status ||
+               reference->program_counter != cpu->program_counter ||
+               reference->stack_pointer != cpu->stack_pointer ||
+               reference->cycles != cpu->cycles)
+            {
+                fprintf(stderr, "engines_agree_on_corpus failure: registers differ on %s with engine %d\n", corpus[i].name, engine);
+                exit(1);
+            }
+            if(memcmp(reference->memory, cpu->memory, sizeof(reference->memory)) != 0)
+            {
+                fprintf(stderr, "engines_agree_on_corpus failure: memory differs on %s with engine %d\n", corpus[i].name, engine);
+                exit(1);
+            }
+            free_cpu(cpu);
+        }
+        free_cpu(reference);
+    }
+}
+
+static void random_program(cpu_t *cpu, uint32_t seed)
+{
+    uint8_t program[0x100];
+    size_t length = 0;
+    while(length + 6 <= sizeof(program))
+    {
+        seed = seed * 1103515245 + 12345;
+        uint8_t code = seed >> 16;
+        const opcode_t *op = opcode_lookup(code);
+        if(op->name == NULL || code == 0x00)
+            continue;
+        program[length++] = code;
+        for(int i = 1; i < op->len; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            program[length++] = seed >> 16;
+        }
+        // Keep jumps inside the program, and JMP ($01xx) reads the stack page below
+        if(code == 0x4c || code == 0x20)
+            program[length - 1] = 0x80;
+        if(code == 0x6c)
+            program[length - 1] = 0x01;
+    }
+    while(length < sizeof(program) - 3)
+        program[length++] = 0xea;
+    program[length++] = 0x4c;
+    program[length++] = 0x00;
+    program[length++] = 0x80;
+    load(cpu, program, sizeof(program));
+    for(int address = 0; address < 0x800; address++)
+    {
+        seed = seed * 1103515245 + 12345;
+        cpu->memory[address] = seed >> 16;
+    }
+    // RTS, RTI and BRK land back in the program
+    memset(&cpu->memory[0x0100], 0x80, 0x100);
+    cpu->memory[IRQ_VECTOR] = 0x00;
+    cpu->memory[IRQ_VECTOR + 1] = 0x80;
+    cpu->stop_on_brk = false;
+    cpu_reset(cpu);
+}
+
+void test_jit_random_programs()
+{
+    for(uint32_t seed = 1; seed <= 200; seed++)
+    {
+        cpu_t *reference = init_cpu();
+        reference->engine = ENGINE_THREADED;
+        random_program(reference, seed);
+        enum CPUStopReason expected = cpu_run_for(reference, CPU_UNLIMITED, 5000);
+        for(int engine = ENGINE_JIT; engine <= ENGINE_JIT_CHECKED; engine++)
+        {
+            cpu_t *cpu = init_cpu();
+            cpu->engine = engine;
+            random_program(cpu, seed);
+            enum CPUStopReason reason = cpu_run_for(cpu, CPU_UNLIMITED, 5000);
+            if(reason != expected || cpu->reg_a != reference->reg_a || cpu->reg_x != reference->reg_x ||
+               cpu->reg_y != reference->reg_y || cpu->reg_status != reference->reg_status ||
+               cpu->program_counter != reference->program_counter ||
+               cpu->stack_pointer != reference->stack_pointer || cpu->cycles != reference->cycles ||
+               memcmp(cpu->memory, reference->memory, sizeof(cpu->memory)) != 0)
+            {
+                fprintf(stderr, "jit_random_programs failure: seed %u differs with engine %d (stop %d, expected %d)\n",
+                        (unsigned)seed, engine, reason, expected);
+                exit(1);
+            }
+            free_cpu(cpu);
+        }
+        free_cpu(reference);
+    }
+}
+
+void test_jit_invalidation()
+{
+    // JSR $0300; STA $10; LDA #$02; STA $0301; JSR $0300; STA $11; JSR $C000; STA $12
+    uint8_t program[] = {0x20, 0x00, 0x03, 0x85, 0x10, 0xa9, 0x02, 0x8d, 0x01, 0x03,
+                         0x20, 0x00, 0x03, 0x85, 0x11, 0x20, 0x00, 0xc0, 0x85, 0x12, 0x00};
+    // LDA #n; RTS in RAM and in two ROM banks at $C000
+    uint8_t subroutine[] = {0xa9, 0x01, 0x60};
+    uint8_t bank_a[BUS_PAGE_SIZE] = {0xa9, 0x0a, 0x60};
+    uint8_t bank_b[BUS_PAGE_SIZE] = {0xa9, 0x0b, 0x60};
+    for(int engine = ENGINE_JIT; engine <= ENGINE_JIT_CHECKED; engine++)
+    {
+        cpu_t *cpu = init_cpu();
+        cpu->engine = engine;
+        bus_map_handler(&cpu->bus, 0xc000, BUS_PAGE_SIZE, NULL, NULL, NULL);
+        bus_map_memory(&cpu->bus, 0xc000, BUS_PAGE_SIZE, bank_a, sizeof(bank_a), false);
+        load(cpu, program, sizeof(program));
+        memcpy(&cpu->memory[0x0300], subroutine, sizeof(subroutine));
+        cpu_reset(cpu);
+        run(cpu);
+        if(cpu->memory[0x10] != 0x01 || cpu->memory[0x11] != 0x02 || cpu->memory[0x12] != 0x0a)
+        {
+            fprintf(stderr, "jit_invalidation failure: self-modified code ran stale with engine %d\n", engine);
+            exit(1);
+        }
+        bus_map_memory(&cpu->bus, 0xc000, BUS_PAGE_SIZE, bank_b, sizeof(bank_b), false);
+        cpu_reset(cpu);
+        run(cpu);
+        if(cpu->memory[0x12] != 0x0b)
+        {
+            fprintf(stderr, "jit_invalidation failure: bank switched code ran stale with engine %d\n", engine);
+            exit(1);
+        }
+        free_cpu(cpu);
+    }
+}
+
+static bool same_cpu_state(const cpu_t *a, const cpu_t *b)
+{
+    return a->reg_a == b->reg_a && a->reg_x == b->reg_x && a->reg_y == b->reg_y &&
+           a->reg_status == b->reg_status && a->program_counter == b->program_counter &&
+           a->stack_pointer == b->stack_pointer && a->cycles == b->cycles &&
+           memcmp(a->memory, b->memory, sizeof(a->memory)) == 0;
+}
+
+// Every pair in fusion.h, in a loop that runs four times
+static const uint8_t fused_program[] = {
+    0xa2, 0x04,                         // LDX #$04
+    0xad, 0x10, 0x00, 0x8d, 0x00, 0x03, // LDA $0010; STA $0300
+    0x18, 0x69, 0x03, 0x85, 0x10,       // CLC; ADC #$03; STA $10
+    0x18, 0x65, 0x10,                   // CLC; ADC $10
+    0xc9, 0x09, 0xd0, 0x00,             // CMP #$09; BNE +0
+    0xc9, 0x80, 0xd0, 0x00,             // CMP #$80; BNE +0
+    0x86, 0x20, 0xa2, 0xfc,             // STX $20; LDX #$FC
+    0xe8, 0xe0, 0xff, 0xd0, 0xfb,       // INX; CPX #$FF; BNE -5
+    0xa6, 0x20,                         // LDX $20
+    0xca, 0xd0, 0xdc,                   // DEX; BNE $8002 + padding
+    0x00
+};
+
+// The program after padding NOPs, which push some pairs across a page and make the loop branch cross back
+static cpu_t *fused_program_cpu(int engine, bool fuse_pairs, int padding)
+{
+    uint8_t program[0x100 + sizeof(fused_program)];
+    memset(program, 0xea, padding);
+    memcpy(program + padding, fused_program, sizeof(fused_program));
+    cpu_t *cpu = init_cpu();
+    cpu->engine = engine;
+    cpu->fuse_pairs = fuse_pairs;
+    load(cpu, program, padding + sizeof(fused_program));
+    cpu->memory[0x10] = 0x7e;
+    cpu_reset(cpu);
+    return cpu;
+}
+
+void test_fused_pairs_match_interpreter()
+{
+    int paddings[] = {0, 0xee};
+    for(int i = 0; i < 2; i++)
+    {
+        cpu_t *whole = fused_program_cpu(ENGINE_SWITCH, false, paddings[i]);
+        run(whole);
+        for(int fuse_pairs = 0; fuse_pairs <= 1; fuse_pairs++)
+        {
+            cpu_t *cpu = fused_program_cpu(ENGINE_THREADED, fuse_pairs, paddings[i]);
+            run(cpu);
+            if(!same_cpu_state(cpu, whole))
+            {
+                fprintf(stderr, "fused_pairs_match_interpreter failure: whole run differs with fuse_pairs %d, padding %d\n",
+                        fuse_pairs, paddings[i]);
+                exit(1);
+            }
+            if(fuse_pairs && fusion_op(cpu->fusion, 0x8002 + paddings[i])->pair != FUSED_LDA_STA)
+            {
+                fprintf(stderr, "fused_pairs_match_interpreter failure: no pair decoded with padding %d\n", paddings[i]);
+                exit(1);
+            }
+            free_cpu(cpu);
+            // Single steps and cycle deadlines stop between the two halves of a pair
+            cpu = fused_program_cpu(ENGINE_THREADED, fuse_pairs, paddings[i]);
+            cpu_t *reference = fused_program_cpu(ENGINE_SWITCH, false, paddings[i]);
+            enum CPUStopReason reason;
+            do
+            {
+                reason = cpu_step(cpu);
+                if(reason != cpu_step(reference) || !same_cpu_state(cpu, reference))
+                {
+                    fprintf(stderr, "fused_pairs_match_interpreter failure: step at $%04X differs with fuse_pairs %d\n",
+                            reference->program_counter, fuse_pairs);
+                    exit(1);
+                }
+            } while(reason == STOP_INSTRUCTION_LIMIT);
+            free_cpu(cpu);
+            free_cpu(reference);
+            for(uint64_t deadline = 1; deadline < whole->cycles; deadline++)
+            {
+                cpu = fused_program_cpu(ENGINE_THREADED, fuse_pairs, paddings[i]);
+                reference = fused_program_cpu(ENGINE_SWITCH, false, paddings[i]);
+                cpu_run_for(cpu, CPU_UNLIMITED, deadline);
+                cpu_run_for(reference, CPU_UNLIMITED, deadline);
+                if(!same_cpu_state(cpu, reference))
+                {
+                    fprintf(stderr, "fused_pairs_match_interpreter failure: %llu cycle run differs with fuse_pairs %d\n",
+                            (unsigned long long)deadline, fuse_pairs);
+                    exit(1);
+                }
+                free_cpu(cpu);
+                free_cpu(reference);
+            }
+        }
+        free_cpu(whole);
+    }
+}
+
+void test_fused_pairs_invalidation()
+{
+    // LDY #$00; LDX #$02; DEX; BNE -3; INY; LDA #$F0; STA $8005; CPY #$02; BNE $8002
+    // The second pass runs DEX; BEQ, as written over the first
+    uint8_t program[] = {0xa0, 0x00, 0xa2, 0x02, 0xca, 0xd0, 0xfd, 0xc8, 0xa9, 0xf0,
+                         0x8d, 0x05, 0x80, 0xc0, 0x02, 0xd0, 0xf1, 0x00};
+    cpu_t *cpu = init_cpu();
+    cpu->engine = ENGINE_THREADED;
+    load_and_run(cpu, program, sizeof(program));
+    if(cpu->reg_x != 0x01 || cpu->reg_y != 0x02)
+    {
+        fprintf(stderr, "fused_pairs_invalidation failure: self-modified pair ran stale\n");
+        exit(1);
+    }
+    free_cpu(cpu);
+
+    // JSR $C000; STA $12, where each bank compares A with its own immediate
+    uint8_t caller[] = {0x20, 0x00, 0xc0, 0x85, 0x12, 0x00};
+    // LDA #$05; CMP #n; BNE +2; LDA #$0A; RTS
+    uint8_t bank_a[BUS_PAGE_SIZE] = {0xa9, 0x05, 0xc9, 0x05, 0xd0, 0x02, 0xa9, 0x0a, 0x60};
+    uint8_t bank_b[BUS_PAGE_SIZE] = {0xa9, 0x05, 0xc9, 0x06, 0xd0, 0x02, 0xa9, 0x0a, 0x60};
+    cpu = init_cpu();
+    cpu->engine = ENGINE_THREADED;
+    bus_map_handler(&cpu->bus, 0xc000, BUS_PAGE_SIZE, NULL, NULL, NULL);
+    bus_map_memory(&cpu->bus, 0xc000, BUS_PAGE_SIZE, bank_a, sizeof(bank_a), false);
+    load_and_run(cpu, caller, sizeof(caller));
+    bus_map_memory(&cpu->bus, 0xc000, BUS_PAGE_SIZE, bank_b, sizeof(bank_b), false);
+    cpu_reset(cpu);
+    run(cpu);
+    if(cpu->memory[0x12] != 0x05)
+    {
+        fprintf(stderr, "fused_pairs_invalidation failure: bank switched pair ran stale\n");
+        exit(1);
+    }
+    free_cpu(cpu);
+}
+
+static cpu_t *idle_program_cpu(const uint8_t *program, size_t program_size, bool skip_idle_loops)
+{
+    cpu_t *cpu = init_cpu();
+    cpu->skip_idle_loops = skip_idle_loops;
+    load(cpu, program, program_size);
+    cpu_reset(cpu);
+    return cpu;
+}
+
+void test_idle_loop_skips_exactly()
+{
+    // LDX #$03; wait: LDA $10; BEQ wait; BRK
+    uint8_t program[] = {0xa2, 0x03, 0xa5, 0x10, 0xf0, 0xfc, 0x00};
+    for(uint64_t limit = 1; limit < 200; limit++)
+    {
+        cpu_t *skipped = idle_program_cpu(program, sizeof(program), true);
+        cpu_t *stepped = idle_program_cpu(program, sizeof(program), false);
+        // Cycle limits first, then instruction limits on top
+        cpu_run_for(skipped, CPU_UNLIMITED, limit);
+        cpu_run_for(stepped, CPU_UNLIMITED, limit);
+        enum CPUStopReason reason = cpu_run_for(skipped, limit, CPU_UNLIMITED);
+        if(reason != cpu_run_for(stepped, limit, CPU_UNLIMITED) || !same_cpu_state(skipped, stepped))
+        {
+            fprintf(stderr, "idle_loop_skips_exactly failure: state differs at limit %llu\n", (unsigned long long)limit);
+            exit(1);
+        }
+        free_cpu(skipped);
+        free_cpu(stepped);
+    }
+
+    cpu_t *cpu = idle_program_cpu(program, sizeof(program), true);
+    profile_t *profile = profile_create();
+    profile_attach(profile, cpu);
+    cpu_run_for(cpu, CPU_UNLIMITED, 1000000);
+    profile_detach(cpu);
+    // The three iterations that find the loop run, and a last partial one before the limit
+    if(cpu->cycles != 1000001 || cpu->program_counter != 0x8004 || profile->idle_loop_count != 1 ||
+       profile->idle_loops[0].head != 0x8002 || profile->idle_loops[0].end != 0x8006 ||
+       profile->idle_cycles < 999900 || profile->pc_count[0x8002] > 4)
+    {
+        fprintf(stderr, "idle_loop_skips_exactly failure: loop not skipped\n");
+        exit(1);
+    }
+    // Once memory changes, the loop exits
+    cpu->memory[0x10] = 1;
+    if(cpu_run_for(cpu, CPU_UNLIMITED, CPU_UNLIMITED) != STOP_BRK || cpu->reg_a != 1)
+    {
+        fprintf(stderr, "idle_loop_skips_exactly failure: loop did not exit\n");
+        exit(1);
+    }
+    profile_free(profile);
+    free_cpu(cpu);
+}
+
+void test_idle_loop_rejects_writes()
+{
+    // wait: STA $10; LDA $10; BEQ wait
+    uint8_t program[] = {0x85, 0x10, 0xa5, 0x10, 0xf0, 0xfa};
+    cpu_t *cpu = idle_program_cpu(program, sizeof(program), true);
+    profile_t *profile = profile_create();
+    profile_attach(profile, cpu);
+    cpu_run_for(cpu, CPU_UNLIMITED, 10000);
+    profile_detach(cpu);
+    if(profile->idle_loop_count != 0 || profile->pc_count[0x8000] < 1000)
+    {
+        fprintf(stderr, "idle_loop_rejects_writes failure: a loop that writes was skipped\n");
+        exit(1);
+    }
+    profile_free(profile);
+    free_cpu(cpu);
+}
+
+void test_idle_loop_rejects_unstable_reads()
+{
+    // wait: LDA $2002; BNE wait, on a device that never says when it changes
+    uint8_t program[] = {0xad, 0x02, 0x20, 0xd0, 0xfb};
+    struct test_device device = {0};
+    cpu_t *cpu = idle_program_cpu(program, sizeof(program), true);
+    bus_map_handler(&cpu->bus, 0x2000, BUS_PAGE_SIZE, test_device_read, NULL, &device);
+    cpu_run_for(cpu, 1000, CPU_UNLIMITED);
+    if(!cpu->idle.rejected || device.reads != 500)
+    {
+        fprintf(stderr, "idle_loop_rejects_unstable_reads failure: %d reads, rejected %d\n",
+                device.reads, cpu->idle.rejected);
+        exit(1);
+    }
+    free_cpu(cpu);
+}
+
+void test_lockstep_matches_interpreter()
+{
+    enum { LANES = 48 };
+    lockstep_t *lockstep = lockstep_create(LANES);
+    cpu_t *cpus[LANES];
+    for(int lane = 0; lane < LANES; lane++)
+    {
+        // Half the lanes run one program on different zero page data, the rest a program each
+        cpus[lane] = init_cpu();
+        random_program(cpus[lane], lane < LANES / 2 ? 1 : lane);
+        if(lane < LANES / 2)
+        {
+            for(int address = 0; address < 0x100; address++)
+                cpus[lane]->memory[address] = lane * 37 + address * 11;
+        }
+        cpus[lane]->stop_on_brk = lane % 3 == 0;
+        lockstep_load(lockstep, lane, cpus[lane]);
+    }
+    // Stopped lanes resume on the second run, as cpu_run_for() does
+    for(int run = 0; run < 2; run++)
+    {
+        lockstep_run(lockstep, 1500, 4000);
+        for(int lane = 0; lane < LANES; lane++)
+        {
+            enum CPUStopReason expected = cpu_run_for(cpus[lane], 1500, 4000);
+            cpu_t *cpu = init_cpu();
+            lockstep_store(lockstep, lane, cpu);
+            cpu_t *reference = cpus[lane];
+            if(lockstep->reasons[lane] != expected || cpu->reg_a != reference->reg_a ||
+               cpu->reg_x != reference->reg_x || cpu->reg_y != reference->reg_y ||
+               cpu->reg_status != reference->reg_status || cpu->program_counter != reference->program_counter ||
+               cpu->stack_pointer != reference->stack_pointer || cpu->cycles != reference->cycles ||
+               memcmp(cpu->memory, reference->memory, sizeof(cpu->memory)) != 0)
+            {
+                fprintf(stderr, "lockstep_matches_interpreter failure: lane %d differs on run %d (stop %d, expected %d)\n",
+                        lane, run, lockstep->reasons[lane], expected);
+                exit(1);
+            }
+            free_cpu(cpu);
+        }
+    }
+    for(int lane = 0; lane < LANES; lane++)
+        free_cpu(cpus[lane]);
+    lockstep_free(lockstep);
+}
+
+void test_cpu_step()
+{
+    uint8_t program[] = {0xa9, 0x05, 0xaa, 0xe8, 0x00};
+    for(int engine = ENGINE_SWITCH; engine <= ENGINE_JIT_CHECKED; engine++)
+    {
+        cpu_t *cpu = init_cpu();
+        cpu->engine = engine;
+        load(cpu, program, sizeof(program));
+        cpu_reset(cpu);
+        if(cpu_step(cpu) != STOP_INSTRUCTION_LIMIT || cpu->reg_a != 0x05 || cpu->program_counter != 0x8002)
+        {
+            fprintf(stderr, "cpu_step failure: first step not correct\n");
+            exit(1);
+        }
+        cpu_step(cpu);
+        cpu_step(cpu);
+        if(cpu->reg_x != 0x06 || cpu->program_counter != 0x8004)
+        {
+            fprintf(stderr, "cpu_step failure: third step not correct\n");
+            exit(1);
+        }
+        if(cpu_step(cpu) != STOP_BRK)
+        {
+            fprintf(stderr, "cpu_step failure: BRK not reported\n");
+            exit(1);
+        }
+        free_cpu(cpu);
+    }
+}
+
+void test_cpu_run_for_stop_reasons()
+{
+    // JMP $8000 forever
+    uint8_t loop[] = {0x4c, 0x00, 0x80};
+    uint8_t illegal[] = {0xea, 0x02};
+    for(int engine = ENGINE_SWITCH; engine <= ENGINE_JIT_CHECKED; engine++)
+    {
+        cpu_t *cpu = init_cpu();
+        cpu->engine = engine;
+        load(cpu, loop, sizeof(loop));
+        cpu_reset(cpu);
+        if(cpu_run_for(cpu, 5, CPU_UNLIMITED) != STOP_INSTRUCTION_LIMIT || cpu->cycles != 15)
+        {
+            fprintf(stderr, "cpu_run_for_stop_reasons failure: instruction limit not correct\n");
+            exit(1);
+        }
+        if(cpu_run_for(cpu, CPU_UNLIMITED, 7) != STOP_CYCLE_LIMIT || cpu->cycles != 24)
+        {
+            fprintf(stderr, "cpu_run_for_stop_reasons failure: cycle limit not correct\n");
+            exit(1);
+        }
+        load(cpu, illegal, sizeof(illegal));
+        cpu_reset(cpu);
+        if(cpu_run_for(cpu, CPU_UNLIMITED, CPU_UNLIMITED) != STOP_ILLEGAL_OPCODE || cpu->program_counter != 0x8002)
+        {
+            fprintf(stderr, "cpu_run_for_stop_reasons failure: illegal opcode not reported\n");
+            exit(1);
+        }
+        free_cpu(cpu);
+    }
+}
+
+void test_cpu_run_for_interleaved()
+{
+    // Two instances time-sliced one instruction at a time reach the same state as running straight through
+    cpu_t *sliced_a = init_cpu();
+    cpu_t *sliced_b = init_cpu();
+    load(sliced_a, corpus_branches, sizeof(corpus_branches));
+    load(sliced_b, corpus_indexed, sizeof(corpus_indexed));
+    cpu_reset(sliced_a);
+    cpu_reset(sliced_b);
+    bool a_done = false;
+    bool b_done = false;
+    while(!a_done || !b_done)
+    {
+        if(!a_done)
+            a_done = cpu_run_for(sliced_a, 1, CPU_UNLIMITED) == STOP_BRK;
+        if(!b_done)
+            b_done = cpu_run_for(sliced_b, 3, CPU_UNLIMITED) == STOP_BRK;
+    }
+    cpu_t *whole = init_cpu();
+    load_and_run(whole, corpus_branches, sizeof(corpus_branches));
+    if(whole->reg_a != sliced_a->reg_a || whole->cycles != sliced_a->cycles ||
+       memcmp(whole->memory, sliced_a->memory, sizeof(whole->memory)) != 0)
+    {
+        fprintf(stderr, "cpu_run_for_interleaved failure: sliced run differs\n");
+        exit(1);
+    }
+    free_cpu(whole);
+    free_cpu(sliced_a);
+    free_cpu(sliced_b);
+}
+
+void test_cpu_reset_keeps_memory()
+{
+    uint8_t program[] = {0xa9, 0x42, 0x85, 0x10, 0x00};
+    cpu_t *cpu = init_cpu();
+    load_and_run(cpu, program, sizeof(program));
+    cpu_reset(cpu);
+    if(cpu->memory[0x10] != 0x42 || cpu->program_counter != 0x8000 || cpu->reg_a != 0 ||
+       cpu->stack_pointer != 0xfd || cpu->reg_status != (INTERRUPT_DISABLE | BREAK2))
+    {
+        fprintf(stderr, "cpu_reset_keeps_memory failure: state after reset not correct\n");
+        exit(1);
+    }
+    free_cpu(cpu);
+}
+
+// Copies handler into memory at $9000 and points vector at it
+static void install_handler(cpu_t *cpu, uint16_t vector, const uint8_t *handler, size_t handler_size)
+{
+    memcpy(&cpu->memory[0x9000], handler, handler_size);
+    cpu->memory[vector] = 0x00;
+    cpu->memory[vector + 1] = 0x90;
+}
+
+void test_nmi()
+{
+    // loop: JMP loop; handler: INX; RTI
+    uint8_t program[] = {0x4c, 0x00, 0x80};
+    uint8_t handler[] = {0xe8, 0x40};
+    for(int engine = ENGINE_SWITCH; engine <= ENGINE_JIT_CHECKED; engine++)
+    {
+        cpu_t *cpu = init_cpu();
+        cpu->engine = engine;
+        load(cpu, program, sizeof(program));
+        install_handler(cpu, NMI_VECTOR, handler, sizeof(handler));
+        cpu_reset(cpu);
+        cpu_run_for(cpu, 3, CPU_UNLIMITED);
+        cpu_nmi(cpu);
+        cpu_run_for(cpu, 1, CPU_UNLIMITED);
+        if(cpu->reg_x != 1 || cpu->program_counter != 0x9001 || cpu->cycles != 3 * 3 + INTERRUPT_CYCLES + 2)
+        {
+            fprintf(stderr, "nmi failure: handler not entered\n");
+            exit(1);
+        }
+        if(cpu->stack_pointer != 0xfa || cpu->memory[0x1fd] != 0x80 || cpu->memory[0x1fc] != 0x00 ||
+           cpu->memory[0x1fb] != (INTERRUPT_DISABLE | BREAK2))
+        {
+            fprintf(stderr, "nmi failure: pushed state not correct\n");
+            exit(1);
+        }
+        cpu_step(cpu);
+        if(cpu->program_counter != 0x8000 || cpu->stack_pointer != 0xfd)
+        {
+            fprintf(stderr, "nmi failure: RTI did not return\n");
+            exit(1);
+        }
+        free_cpu(cpu);
+    }
+}
+
+void test_irq_waits_for_cli()
+{
+    // CLI; loop: JMP loop; handler: INC $10; loop: JMP loop
+    uint8_t program[] = {0x58, 0x4c, 0x01, 0x80};
+    uint8_t handler[] = {0xe6, 0x10, 0x4c, 0x02, 0x90};
+    for(int engine = ENGINE_SWITCH; engine <= ENGINE_JIT_CHECKED; engine++)
+    {
+        cpu_t *cpu = init_cpu();
+        cpu->engine = engine;
+        load(cpu, program, sizeof(program));
+        install_handler(cpu, IRQ_VECTOR, handler, sizeof(handler));
+        cpu_reset(cpu);
+        cpu_irq(cpu, IRQ_EXTERNAL, true);
+        // The IRQ is taken inside this call, right after CLI unmasks it
+        if(cpu_run_for(cpu, 2, CPU_UNLIMITED) != STOP_INSTRUCTION_LIMIT)
+        {
+            fprintf(stderr, "irq_waits_for_cli failure: wrong stop reason\n");
+            exit(1);
+        }
+        if(cpu->memory[0x10] != 1 || cpu->program_counter != 0x9002 || cpu->cycles != 2 + INTERRUPT_CYCLES + 5)
+        {
+            fprintf(stderr, "irq_waits_for_cli failure: handler not entered after CLI\n");
+            exit(1);
+        }
+        if((cpu->reg_status & INTERRUPT_DISABLE) == 0 || cpu->memory[0x1fb] != BREAK2 ||
+           cpu->memory[0x1fc] != 0x01 || cpu->memory[0x1fd] != 0x80)
+        {
+            fprintf(stderr, "irq_waits_for_cli failure: pushed state not correct\n");
+            exit(1);
+        }
+        free_cpu(cpu);
+    }
+}
+
+void test_brk_vectors()
+{
+    // LDX #1; BRK; (padding); LDY #5; handler: LDA #$77; RTI
+    uint8_t program[] = {0xa2, 0x01, 0x00, 0xea, 0xa0, 0x05};
+    uint8_t handler[] = {0xa9, 0x77, 0x40};
+    for(int engine = ENGINE_SWITCH; engine <= ENGINE_JIT_CHECKED; engine++)
+    {
+        cpu_t *cpu = init_cpu();
+        cpu->engine = engine;
+        cpu->stop_on_brk = false;
+        load(cpu, program, sizeof(program));
+        install_handler(cpu, IRQ_VECTOR, handler, sizeof(handler));
+        cpu_reset(cpu);
+        if(cpu_run_for(cpu, 5, CPU_UNLIMITED) != STOP_INSTRUCTION_LIMIT)
+        {
+            fprintf(stderr, "brk_vectors failure: wrong stop reason\n");
+            exit(1);
+        }
+        if(cpu->reg_a != 0x77 || cpu->reg_y != 0x05 || cpu->program_counter != 0x8006 || cpu->cycles != 2 + 7 + 2 + 6 + 2)
+        {
+            fprintf(stderr, "brk_vectors failure: did not return past the padding byte\n");
+            exit(1);
+        }
+        if(cpu->memory[0x1fb] != (INTERRUPT_DISABLE | BREAK | BREAK2))
+        {
+            fprintf(stderr, "brk_vectors failure: B not set in pushed status\n");
+            exit(1);
+        }
+        free_cpu(cpu);
+    }
+}
+
+static void nmi_device_write(void *context, uint16_t address, uint8_t data)
+{
+    cpu_nmi(context);
+}
+
+void test_nmi_raised_during_run()
+{
+    // STA $2000; loop: JMP loop; handler: INX; loop: JMP loop
+    uint8_t program[] = {0x8d, 0x00, 0x20, 0x4c, 0x03, 0x80};
+    uint8_t handler[] = {0xe8, 0x4c, 0x01, 0x90};
+    for(int engine = ENGINE_SWITCH; engine <= ENGINE_JIT_CHECKED; engine++)
+    {
+        cpu_t *cpu = init_cpu();
+        cpu->engine = engine;
+        bus_map_handler(&cpu->bus, 0x2000, 0x100, NULL, nmi_device_write, cpu);
+        load(cpu, program, sizeof(program));
+        install_handler(cpu, NMI_VECTOR, handler, sizeof(handler));
+        cpu_reset(cpu);
+        if(cpu_run_for(cpu, CPU_UNLIMITED, 100) != STOP_CYCLE_LIMIT || cpu->cycles < 100 || cpu->cycles >= 103)
+        {
+            fprintf(stderr, "nmi_raised_during_run failure: cycle budget not kept\n");
+            exit(1);
+        }
+        if(cpu->reg_x != 1 || cpu->program_counter < 0x9001)
+        {
+            fprintf(stderr, "nmi_raised_during_run failure: NMI not taken\n");
+            exit(1);
+        }
+        free_cpu(cpu);
+    }
+}
+
+void test_save_state_round_trip()
+{
+    // Run half of the corpus, save, finish, then restore and finish again
+    cpu_t *cpu = init_cpu();
+    load(cpu, corpus_arithmetic, sizeof(corpus_arithmetic));
+    cpu_reset(cpu);
+    cpu_run_for(cpu, 4, CPU_UNLIMITED);
+    static uint8_t state[CPU_STATE_SIZE];
+    if(cpu_save_state(cpu, state, sizeof(state)) != cpu_state_size(cpu))
+    {
+        fprintf(stderr, "save_state_round_trip failure: state not saved\n");
+        exit(1);
+    }
+    cpu_run_for(cpu, CPU_UNLIMITED, CPU_UNLIMITED);
+    cpu_t *finished = init_cpu();
+    memcpy(finished->memory, cpu->memory, sizeof(cpu->memory));
+    finished->reg_a = cpu->reg_a;
+    finished->cycles = cpu->cycles;
+
+    cpu_t *restored = init_cpu();
+    if(!cpu_load_state(restored, state, sizeof(state)))
+    {
+        fprintf(stderr, "save_state_round_trip failure: state not loaded\n");
+        exit(1);
+    }
+    cpu_run_for(restored, CPU_UNLIMITED, CPU_UNLIMITED);
+    if(restored->reg_a != finished->reg_a || restored->cycles != finished->cycles ||
+       memcmp(restored->memory, finished->memory, sizeof(restored->memory)) != 0)
+    {
+        fprintf(stderr, "save_state_round_trip failure: restored run differs\n");
+        exit(1);
+    }
+    // A device holding the IRQ line low is saved with the registers
+    cpu_t *irq = init_cpu();
+    irq->reg_status |= INTERRUPT_DISABLE;
+    cpu_irq(irq, IRQ_APU_FRAME, true);
+    static uint8_t irq_state[CPU_STATE_SIZE];
+    cpu_save_state(irq, irq_state, sizeof(irq_state));
+    cpu_irq(irq, IRQ_APU_FRAME, false);
+    if(!cpu_load_state(irq, irq_state, sizeof(irq_state)) || irq->irq_lines != IRQ_APU_FRAME)
+    {
+        fprintf(stderr, "save_state_round_trip failure: IRQ lines not restored\n");
+        exit(1);
+    }
+    free_cpu(irq);
+    free_cpu(restored);
+    free_cpu(finished);
+    free_cpu(cpu);
+}
+
+void test_save_state_loads_version_1()
+{
+    // A version 1 state is the same without the IRQ lines byte of the CPU chunk
+    cpu_t *cpu = init_cpu();
+    cpu->reg_a = 0x5a;
+    cpu->cycles = 1234;
+    cpu->memory[0x0300] = 0xa5;
+    static uint8_t state[CPU_STATE_SIZE];
+    static uint8_t old[CPU_STATE_SIZE - 1];
+    cpu_save_state(cpu, state, sizeof(state));
+    size_t cpu_chunk = STATE_HEADER_SIZE + STATE_CHUNK_HEADER_SIZE;
+    memcpy(old, state, cpu_chunk + STATE_CPU_V1_SIZE);
+    memcpy(old + cpu_chunk + STATE_CPU_V1_SIZE, state + cpu_chunk + STATE_CPU_SIZE, sizeof(old) - cpu_chunk - STATE_CPU_V1_SIZE);
+    old[4] = 1;
+    old[8] = sizeof(old) & 0xff;
+    old[9] = (sizeof(old) >> 8) & 0xff;
+    old[10] = sizeof(old) >> 16;
+    old[STATE_HEADER_SIZE + 4] = STATE_CPU_V1_SIZE;
+
+    cpu_t *restored = init_cpu();
+    restored->irq_lines = IRQ_EXTERNAL;
+    if(!cpu_load_state(restored, old, sizeof(old)) || restored->reg_a != 0x5a || restored->cycles != 1234 ||
+       restored->memory[0x0300] != 0xa5 || restored->irq_lines != 0)
+    {
+        fprintf(stderr, "save_state_loads_version_1 failure: version 1 state not restored\n");
+        exit(1);
+    }
+    free_cpu(restored);
+    free_cpu(cpu);
+}
+
+void test_save_state_rejects_bad_input()
+{
+    cpu_t *cpu = init_cpu();
+    static uint8_t state[CPU_STATE_SIZE];
+    if(cpu_save_state(cpu, state, sizeof(state) - 1) != 0)
+    {
+        fprintf(stderr, "save_state_rejects_bad_input failure: saved into a short buffer\n");
+        exit(1);
+    }
+    cpu_save_state(cpu, state, sizeof(state));
+    cpu->reg_a = 0x42;
+    if(cpu_load_state(cpu, state, sizeof(state) - 1))
+    {
+        fprintf(stderr, "save_state_rejects_bad_input failure: loaded a truncated state\n");
+        exit(1);
+    }
+    // A total size inside the header would underflow the chunk bounds checks
+    state[8] = STATE_HEADER_SIZE - 1;
+    state[9] = state[10] = state[11] = 0;
+    if(cpu_load_state(cpu, state, sizeof(state)) || cpu->reg_a != 0x42)
+    {
+        fprintf(stderr, "save_state_rejects_bad_input failure: loaded a truncated header\n");
+        exit(1);
+    }
+    state[4] = STATE_VERSION + 1;
+    if(cpu_load_state(cpu, state, sizeof(state)) || cpu->reg_a != 0x42)
+    {
+        fprintf(stderr, "save_state_rejects_bad_input failure: loaded an unknown version\n");
+        exit(1);
+    }
+    free_cpu(cpu);
+}
+
+void test_bus_track_writes()
+{
+    // STA $10; STA $0345; BRK
+    uint8_t program[] = {0x85, 0x10, 0x8d, 0x45, 0x03, 0x00};
+    cpu_t *cpu = init_cpu();
+    load(cpu, program, sizeof(program));
+    cpu_reset(cpu);
+    bus_track_writes(&cpu->bus, cpu->memory, sizeof(cpu->memory));
+    run(cpu);
+    if(!bus_page_dirty(&cpu->bus, 0x00) || !bus_page_dirty(&cpu->bus, 0x03) || bus_page_dirty(&cpu->bus, 0x02))
+    {
+        fprintf(stderr, "bus_track_writes failure: dirty pages not correct\n");
+        exit(1);
+    }
+    bus_clear_dirty(&cpu->bus);
+    bus_write(&cpu->bus, 0x0346, 0x01);
+    if(bus_page_dirty(&cpu->bus, 0x00) || !bus_page_dirty(&cpu->bus, 0x03) || cpu->memory[0x0346] != 0x01)
+    {
+        fprintf(stderr, "bus_track_writes failure: write after clearing not seen\n");
+        exit(1);
+    }
+    bus_track_writes(&cpu->bus, NULL, 0);
+    if(cpu->bus.write_pages[0x00] != cpu->memory)
+    {
+        fprintf(stderr, "bus_track_writes failure: pages still trapped after stopping\n");
+        exit(1);
+    }
+    free_cpu(cpu);
+}
+
+// LDX #0; loop: INX; TXA; STA $0200,X; STA $0345; INC $10; JMP loop
+static uint8_t rewind_program[] = {
+    0xa2, 0x00, 0xe8, 0x8a, 0x9d, 0x00, 0x02, 0x8d, 0x45, 0x03, 0xe6, 0x10, 0x4c, 0x02, 0x80
+};
+#define REWIND_FRAMES 40
+
+void test_rewind_steps_back_through_frames()
+{
+    static uint8_t states[REWIND_FRAMES][CPU_STATE_SIZE];
+    cpu_t *cpu = init_cpu();
+    load(cpu, rewind_program, sizeof(rewind_program));
+    cpu_reset(cpu);
+    rewind_buffer_t *buffer = rewind_create(cpu, 1 << 20, REWIND_FRAMES, 8);
+    for(int i = 0; i < REWIND_FRAMES; i++)
+    {
+        cpu_run_for(cpu, 37, CPU_UNLIMITED);
+        cpu_save_state(cpu, states[i], CPU_STATE_SIZE);
+        if(!rewind_capture(buffer))
+        {
+            fprintf(stderr, "rewind_steps_back_through_frames failure: frame %d not captured\n", i);
+            exit(1);
+        }
+    }
+    // Deltas hold only the few written bytes
+    if(buffer->used > 8 * 1024)
+    {
+        fprintf(stderr, "rewind_steps_back_through_frames failure: %zu bytes for %d frames\n", buffer->used, REWIND_FRAMES);
+        exit(1);
+    }
+    static uint8_t state[CPU_STATE_SIZE];
+    for(int i = REWIND_FRAMES - 1; i >= REWIND_FRAMES / 2; i--)
+    {
+        cpu->memory[0x0345] = 0xee;
+        rewind_step_back(buffer);
+        cpu_save_state(cpu, state, CPU_STATE_SIZE);
+        if(memcmp(state, states[i], CPU_STATE_SIZE) != 0)
+        {
+            fprintf(stderr, "rewind_steps_back_through_frames failure: frame %d not restored\n", i);
+            exit(1);
+        }
+    }
+    // Running on from a restored frame records the new timeline
+    cpu_run_for(cpu, 37, CPU_UNLIMITED);
+    cpu_save_state(cpu, states[0], CPU_STATE_SIZE);
+    rewind_capture(buffer);
+    rewind_step_back(buffer);
+    cpu_save_state(cpu, state, CPU_STATE_SIZE);
+    if(memcmp(state, states[0], CPU_STATE_SIZE) != 0 || buffer->count != REWIND_FRAMES / 2)
+    {
+        fprintf(stderr, "rewind_steps_back_through_frames failure: new timeline not restored\n");
+        exit(1);
+    }
+    rewind_free(buffer);
+    free_cpu(cpu);
+}
+
+void test_rewind_drops_oldest_over_budget()
+{
+    cpu_t *cpu = init_cpu();
+    load(cpu, rewind_program, sizeof(rewind_program));
+    cpu_reset(cpu);
+    rewind_buffer_t *buffer = rewind_create(cpu, 2048, 1000, 8);
+    static uint8_t newest[CPU_STATE_SIZE];
+    for(int i = 0; i < 200; i++)
+    {
+        cpu_run_for(cpu, 37, CPU_UNLIMITED);
+        rewind_capture(buffer);
+    }
+    cpu_save_state(cpu, newest, CPU_STATE_SIZE);
+    if(buffer->used > 2048 || buffer->count == 0 || buffer->count >= 200 ||
+       !buffer->records[buffer->first].keyframe)
+    {
+        fprintf(stderr, "rewind_drops_oldest_over_budget failure: %zu frames in %zu bytes\n", buffer->count, buffer->used);
+        exit(1);
+    }
+    static uint8_t state[CPU_STATE_SIZE];
+    size_t frames = buffer->count;
+    rewind_step_back(buffer);
+    cpu_save_state(cpu, state, CPU_STATE_SIZE);
+    if(memcmp(state, newest, CPU_STATE_SIZE) != 0)
+    {
+        fprintf(stderr, "rewind_drops_oldest_over_budget failure: newest frame not restored\n");
+        exit(1);
+    }
+    while(rewind_step_back(buffer))
+        frames -= 1;
+    if(frames != 1)
+    {
+        fprintf(stderr, "rewind_drops_oldest_over_budget failure: frames lost while stepping back\n");
+        exit(1);
+    }
+    rewind_free(buffer);
+    free_cpu(cpu);
+}
+
+// LDA $20; ASL A; STA $0300; LDX #0; loop: TXA; ADC $20; STA $0400,X; INX; BNE loop; BRK
+static uint8_t fork_program[] = {
+    0xa5, 0x20, 0x0a, 0x8d, 0x00, 0x03, 0xa2, 0x00, 0x8a, 0x65, 0x20, 0x9d, 0x00, 0x04, 0xe8, 0xd0, 0xf7, 0x00
+};
+
+// Runs fork_program from the start with input at $20 and saves the result
+static void run_fork_program(cpu_t *cpu, uint8_t input, uint8_t *state)
+{
+    bus_write(&cpu->bus, 0x20, input);
+    cpu_run_for(cpu, CPU_UNLIMITED, CPU_UNLIMITED);
+    cpu_save_state(cpu, state, CPU_STATE_SIZE);
+}
+
+void test_cpu_fork_copy_on_write()
+{
+    static uint8_t expected[CPU_STATE_SIZE];
+    static uint8_t state[CPU_STATE_SIZE];
+    cpu_t *reference = init_cpu();
+    load(reference, fork_program, sizeof(fork_program));
+    reference->memory[0x0500] = 0x77;
+    cpu_reset(reference);
+    run_fork_program(reference, 3, expected);
+
+    cpu_t *parent = init_cpu();
+    load(parent, fork_program, sizeof(fork_program));
+    parent->memory[0x0500] = 0x77;
+    cpu_reset(parent);
+    cpu_t *child = cpu_fork(parent);
+    cpu_t *grandchild = cpu_fork(child);
+    run_fork_program(child, 3, state);
+    if(memcmp(state, expected, CPU_STATE_SIZE) != 0 || parent->memory[0x0300] != 0 || parent->program_counter != 0x8000)
+    {
+        fprintf(stderr, "cpu_fork_copy_on_write failure: child run differs or reached the parent\n");
+        exit(1);
+    }
+    bus_write(&parent->bus, 0x0500, 0x11);
+    if(cpu_page(child, 0x05)[0] != 0x77 || cpu_page(grandchild, 0x04)[0] != 0x00 || parent->memory[0x0500] != 0x11)
+    {
+        fprintf(stderr, "cpu_fork_copy_on_write failure: shared pages not independent\n");
+        exit(1);
+    }
+    free_cpu(child);
+    run_fork_program(grandchild, 3, state);
+    if(memcmp(state, expected, CPU_STATE_SIZE) != 0)
+    {
+        fprintf(stderr, "cpu_fork_copy_on_write failure: grandchild run differs\n");
+        exit(1);
+    }
+    cpu_unshare(grandchild);
+    if(grandchild->memory[0x0500] != 0x77 || memcmp(&grandchild->memory[0x0400], &reference->memory[0x0400], 0x100) != 0)
+    {
+        fprintf(stderr, "cpu_fork_copy_on_write failure: unshared memory not correct\n");
+        exit(1);
+    }
+    free_cpu(grandchild);
+    free_cpu(parent);
+    free_cpu(reference);
+}
+
+static void count_trace(void *context, const cpu_t *cpu)
+{
+    *(int *)context += 1;
+}
+
+void test_cpu_fork_drops_attachments()
+{
+    // LDA #$01; BRK
+    uint8_t program[] = {0xa9, 0x01, 0x00};
+    int traced = 0;
+    cpu_t *parent = init_cpu();
+    load(parent, program, sizeof(program));
+    cpu_reset(parent);
+    parent->trace = count_trace;
+    parent->trace_context = &traced;
+    cpu_t *child = cpu_fork(parent);
+    if(child->trace != NULL || child->trace_context != NULL || child->profile != NULL ||
+       child->jit != NULL || child->scheduler != NULL)
+    {
+        fprintf(stderr, "cpu_fork_drops_attachments failure: child inherited the parent's attachments\n");
+        exit(1);
+    }
+    cpu_run_for(child, CPU_UNLIMITED, CPU_UNLIMITED);
+    if(traced != 0 || child->reg_a != 0x01)
+    {
+        fprintf(stderr, "cpu_fork_drops_attachments failure: child traced into the parent\n");
+        exit(1);
+    }
+    free_cpu(child);
+    free_cpu(parent);
+}
+
+#define FORK_THREADS 8
+
+struct fork_job
+{
+    cpu_t *cpu;
+    uint8_t input;
+    uint8_t state[CPU_STATE_SIZE];
+};
+
+static void *run_fork_job(void *argument)
+{
+    struct fork_job *job = argument;
+    run_fork_program(job->cpu, job->input, job->state);
+    free_cpu(job->cpu);
+    return NULL;
+}
+
+void test_cpu_fork_children_on_threads()
+{
+    static struct fork_job jobs[FORK_THREADS];
+    static uint8_t expected[CPU_STATE_SIZE];
+    pthread_t threads[FORK_THREADS];
+    cpu_t *parent = init_cpu();
+    load(parent, fork_program, sizeof(fork_program));
+    cpu_reset(parent);
+    for(int i = 0; i < FORK_THREADS; i++)
+    {
+        jobs[i].cpu = cpu_fork(parent);
+        jobs[i].input = i * 11;
+        pthread_create(&threads[i], NULL, run_fork_job, &jobs[i]);
+    }
+    for(int i = 0; i < FORK_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    for(int i = 0; i < FORK_THREADS; i++)
+    {
+        cpu_t *alone = init_cpu();
+        load(alone, fork_program, sizeof(fork_program));
+        cpu_reset(alone);
+        run_fork_program(alone, i * 11, expected);
+        if(memcmp(jobs[i].state, expected, CPU_STATE_SIZE) != 0)
+        {
+            fprintf(stderr, "cpu_fork_children_on_threads failure: child %d differs\n", i);
+            exit(1);
+        }
+        free_cpu(alone);
+    }
+    free_cpu(parent);
+}
+
+// LDX #$05; STX $10; LDA $0B,X; ASL A; BNE +0; BRK
+static uint8_t trace_program[] = {0xa2, 0x05, 0x86, 0x10, 0xb5, 0x0b, 0x0a, 0xd0, 0x00, 0x00};
+
+static const char *trace_expected[] = {
+    "8000  A2 05     LDX #$05                        A:00 X:00 Y:00 P:24 SP:FD CYC:0",
+    "8002  86 10     STX $10 = 00                    A:00 X:05 Y:00 P:24 SP:FD CYC:2",
+    "8004  B5 0B     LDA $0B,X @ 10 = 05             A:00 X:05 Y:00 P:24 SP:FD CYC:5",
+    "8006  0A        ASL A                           A:05 X:05 Y:00 P:24 SP:FD CYC:9",
+    "8007  D0 00     BNE $8009                       A:0A X:05 Y:00 P:24 SP:FD CYC:11",
+    "8009  00        BRK                             A:0A X:05 Y:00 P:24 SP:FD CYC:14",
+};
+
+// Compares the lines of file with expected, or only their starts when prefix is set
+static void check_trace_lines(const char *test, FILE *file, const char **expected, int count, bool prefix)
+{
+    char line[TRACE_LINE_SIZE + 2];
+    rewind(file);
+    for(int i = 0; i < count; i++)
+    {
+        if(fgets(line, sizeof(line), file) == NULL)
+        {
+            fprintf(stderr, "%s failure: only %d lines\n", test, i);
+            exit(1);
+        }
+        line[strcspn(line, "\n")] = '\0';
+        size_t length = prefix ? strlen(expected[i]) : sizeof(line);
+        if(strncmp(line, expected[i], length) != 0)
+        {
+            fprintf(stderr, "%s failure: line %d is \"%s\"\n", test, i, line);
+            exit(1);
+        }
+    }
+    if(fgets(line, sizeof(line), file) != NULL)
+    {
+        fprintf(stderr, "%s failure: extra lines\n", test);
+        exit(1);
+    }
+}
+
+void test_trace_text()
+{
+    cpu_t *cpu = init_cpu();
+    FILE *file = tmpfile();
+    tracer_t *tracer = trace_open_text(file);
+    trace_attach(tracer, cpu);
+    load(cpu, trace_program, sizeof(trace_program));
+    cpu_reset(cpu);
+    run(cpu);
+    trace_close(tracer);
+    check_trace_lines("trace_text", file, trace_expected, 6, false);
+    fclose(file);
+    free_cpu(cpu);
+}
+
+void test_trace_ring()
+{
+    // Operand values are not recorded, so dumped lines stop at the operand
+    const char *expected[] = {
+        "8004  B5 0B     LDA $0B,X",
+        "8006  0A        ASL A",
+        "8007  D0 00     BNE $8009",
+        "8009  00        BRK",
+    };
+    char path[] = "/tmp/cnes_trace_test_XXXXXX";
+    close(mkstemp(path));
+    cpu_t *cpu = init_cpu();
+    tracer_t *tracer = trace_open_ring(path, 4);
+    trace_attach(tracer, cpu);
+    load(cpu, trace_program, sizeof(trace_program));
+    cpu_reset(cpu);
+    run(cpu);
+    if(tracer->header->count != 6)
+    {
+        fprintf(stderr, "trace_ring failure: %llu records\n", (unsigned long long)tracer->header->count);
+        exit(1);
+    }
+    trace_detach(cpu);
+    trace_close(tracer);
+
+    FILE *file = tmpfile();
+    if(!trace_dump_ring(path, file))
+    {
+        fprintf(stderr, "trace_ring failure: ring file not read back\n");
+        exit(1);
+    }
+    unlink(path);
+    check_trace_lines("trace_ring", file, expected, 4, true);
+    fclose(file);
+    free_cpu(cpu);
+}
+
+void test_profile_counts_and_call_stacks()
+{
+    // main: JSR outer; JSR inner; BRK
+    uint8_t main_code[] = {0x20, 0x10, 0x80, 0x20, 0x20, 0x80, 0x00};
+    // outer: JSR inner; RTS
+    uint8_t outer[] = {0x20, 0x20, 0x80, 0x60};
+    // inner: LDX #$10; loop: DEX; BNE loop; RTS
+    uint8_t inner[] = {0xa2, 0x10, 0xca, 0xd0, 0xfd, 0x60};
+    cpu_t *cpu = init_cpu();
+    load(cpu, main_code, sizeof(main_code));
+    memcpy(&cpu->memory[0x8010], outer, sizeof(outer));
+    memcpy(&cpu->memory[0x8020], inner, sizeof(inner));
+    cpu_reset(cpu);
+    profile_t *profile = profile_create();
+    profile_attach(profile, cpu);
+    run(cpu);
+    profile_detach(cpu);
+
+    uint64_t cycles = 0;
+    for(int i = 0; i < 256; i++)
+        cycles += profile->opcode_cycles[i];
+    if(profile->opcode_count[0xca] != 32 || profile->pc_count[0x8022] != 32 || profile->opcode_count[0x20] != 3 ||
+       cycles != cpu->cycles || profile->pc_cycles[0x8020] != 4)
+    {
+        fprintf(stderr, "profile_counts_and_call_stacks failure: counters not correct\n");
+        exit(1);
+    }
+
+    // inner is 2 + 16 * 2 + 15 * 3 + 2 + 6 cycles wherever it is called from
+    const char *expected =
+        "root 19\n"
+        "root;sub_8010 12\n"
+        "root;sub_8010;sub_8020 87\n"
+        "root;sub_8020 87\n";
+    FILE *file = tmpfile();
+    profile_write_folded(profile, file);
+    char folded[256];
+    rewind(file);
+    size_t length = fread(folded, 1, sizeof(folded) - 1, file);
+    folded[length] = '\0';
+    fclose(file);
+    if(strcmp(folded, expected) != 0)
+    {
+        fprintf(stderr, "profile_counts_and_call_stacks failure: folded stacks are\n%s", folded);
+        exit(1);
+    }
+    profile_free(profile);
+    free_cpu(cpu);
+}
+
 int main()
 {
     test_0xa9_lda_immediate_load_data();
@@ -194,6 +1678,48 @@ int main()
     test_0xe8_inx_nonzero();
     test_ops_together();
     test_overflow_inx();
+    test_cpu_size_budget();
+    test_lda_absolute_top_of_memory();
+    test_bus_ram_mirroring();
+    test_bus_mapped_handler();
+    test_bus_handler_table_full();
+    test_bus_read_only_memory();
+    test_status_accessor();
+    test_cycles_base();
+    test_cycles_page_cross_read();
+    test_cycles_page_cross_write();
+    test_cycles_branch();
+    test_cycles_branch_page_cross();
+    test_run_cycles_budget();
+    test_engines_agree_on_corpus();
+    test_jit_random_programs();
+    test_jit_invalidation();
+    test_fused_pairs_match_interpreter();
+    test_fused_pairs_invalidation();
+    test_idle_loop_skips_exactly();
+    test_idle_loop_rejects_writes();
+    test_idle_loop_rejects_unstable_reads();
+    test_lockstep_matches_interpreter();
+    test_cpu_step();
+    test_cpu_run_for_stop_reasons();
+    test_cpu_run_for_interleaved();
+    test_cpu_reset_keeps_memory();
+    test_nmi();
+    test_irq_waits_for_cli();
+    test_brk_vectors();
+    test_nmi_raised_during_run();
+    test_save_state_round_trip();
+    test_save_state_loads_version_1();
+    test_save_state_rejects_bad_input();
+    test_bus_track_writes();
+    test_rewind_steps_back_through_frames();
+    test_rewind_drops_oldest_over_budget();
+    test_cpu_fork_copy_on_write();
+    test_cpu_fork_drops_attachments();
+    test_cpu_fork_children_on_threads();
+    test_trace_text();
+    test_trace_ring();
+    test_profile_counts_and_call_stacks();
     printf("All tests passed!\n");
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,183 @@
+/*
+ * The threaded engine's run loop, included by cpu.c once per variant with
+ * ENGINE_NAME defined as the function to generate and ENGINE_HOOK(cpu) as
+ * a statement to run before each instruction, or nothing. Variants are
+ * picked once per engine entry, so a hook costs nothing when it is not in
+ * use. With ENGINE_IDLE defined, backward branches and JMPs look for idle loops
+ * to skip while cpu->skip_idle_loops is set. With ENGINE_FUSED defined as
+ * well, the first opcode of each pair in fusion.h looks its address up in
+ * cpu->fusion, which must be set, and runs the whole pair when one was
+ * decoded there and the limits leave room for all of it.
+ */
+#if defined(__GNUC__) && !defined(CPU_NO_COMPUTED_GOTO)
+
+// flatten inlines every helper so each handler is specialized for its mode
+__attribute__((flatten)) static enum CPUStopReason ENGINE_NAME(cpu_t *cpu, uint64_t *instructions)
+{
+    uint64_t max_instructions = *instructions;
+    static void *const dispatch[256] = {
+        [0 ... 255] = &&illegal,
+#define OPCODE(c, n, l, cy, m) [c] = &&op_##c,
+#include "opcode_list.h"
+#undef OPCODE
+#ifdef ENGINE_FUSED
+        // Overrides the entries above
+        [0xc9] = &&fuse_0xc9,
+        [0xca] = &&fuse_0xca,
+        [0xad] = &&fuse_0xad,
+        [0xe8] = &&fuse_0xe8,
+        [0x18] = &&fuse_0x18,
+#endif
+    };
+
+#define DISPATCH() \
+    do { \
+        if(cpu->cycles >= cpu->deadline) \
+        { \
+            *instructions = max_instructions; \
+            return STOP_CYCLE_LIMIT; \
+        } \
+        if(max_instructions-- == 0) \
+            return STOP_INSTRUCTION_LIMIT; \
+        ENGINE_HOOK(cpu); \
+        goto *dispatch[mem_read(cpu, cpu->program_counter++)]; \
+    } while(0)
+#ifdef ENGINE_IDLE
+// Only the branches and JMP absolute, known from c at compile time, can close a loop
+#define IDLE(c, end) \
+    if(((c & 0x1F) == 0x10 || c == 0x4c) && cpu->program_counter < end - 1 && cpu->skip_idle_loops) \
+        idle_loop(cpu, end, &max_instructions);
+#else
+#define IDLE(c, end) (void)end
+#endif
+    DISPATCH();
+#define OPCODE(c, n, l, cy, m) \
+    op_##c: { \
+        const uint16_t end = cpu->program_counter + (l - 1); \
+        cpu->cycles += cy; \
+        if(!insn_##n(cpu, m, l)) \
+            return STOP_BRK; \
+        IDLE(c, end); \
+        DISPATCH(); \
+    }
+#include "opcode_list.h"
+#undef OPCODE
+#ifdef ENGINE_FUSED
+/*
+ * The first half has been counted by DISPATCH(). The pair runs as one when
+ * accept holds for what was decoded and the boundaries within its first
+ * lead cycles leave room for the other extra instructions; otherwise the
+ * first opcode runs alone.
+ */
+#define FUSED(c, accept, lead, extra) \
+    const struct fused_op fused = *fusion_op(cpu->fusion, cpu->program_counter - 1); \
+    if(!(accept) || cpu->cycles + (lead) >= cpu->deadline || max_instructions < (extra)) \
+        goto op_##c; \
+    max_instructions -= (extra);
+#define FUSED_BNE(next) \
+    do { \
+        const uint16_t end = next; \
+        if(!is_zero(cpu)) \
+            take_branch(cpu, fused.offset, end); \
+        else \
+            cpu->program_counter = end; \
+        IDLE(0xd0, end); \
+    } while(0)
+    fuse_0xc9: {
+        FUSED(0xc9, fused.pair == FUSED_CMP_BNE, 2, 1);
+        cpu->cycles += 4;
+        compare_value(cpu, fused.operand, cpu->reg_a);
+        FUSED_BNE(cpu->program_counter + 3);
+        DISPATCH();
+    }
+    fuse_0xca: {
+        FUSED(0xca, fused.pair == FUSED_DEX_BNE, 2, 1);
+        cpu->cycles += 4;
+        dex(cpu);
+        FUSED_BNE(cpu->program_counter + 2);
+        DISPATCH();
+    }
+    fuse_0xe8: {
+        FUSED(0xe8, fused.pair == FUSED_INX_CPX_BNE, 4, 2);
+        cpu->cycles += 6;
+        cpu->reg_x += 1;
+        compare_value(cpu, fused.operand, cpu->reg_x);
+        FUSED_BNE(cpu->program_counter + 4);
+        DISPATCH();
+    }
+    fuse_0xad: {
+        FUSED(0xad, fused.pair == FUSED_LDA_STA, 4, 1);
+        cpu->cycles += 4;
+        set_reg_a(cpu, mem_read(cpu, fused.address));
+        cpu->program_counter += 2;
+        // A handler behind the load may have raised an interrupt
+        if(cpu->cycles >= cpu->deadline)
+        {
+            max_instructions += 1;
+            DISPATCH();
+        }
+        cpu->cycles += 4;
+        mem_write(cpu, fused.target, cpu->reg_a);
+        cpu->program_counter += 3;
+        DISPATCH();
+    }
+    fuse_0x18: {
+        FUSED(0x18, fused.pair == FUSED_CLC_ADC || fused.pair == FUSED_CLC_ADC_ZP, 2, 1);
+        clear_carry_flag(cpu);
+        if(fused.pair == FUSED_CLC_ADC)
+        {
+            cpu->cycles += 4;
+            add_to_reg_a(cpu, fused.operand);
+        }
+        else
+        {
+            cpu->cycles += 5;
+            add_to_reg_a(cpu, mem_read(cpu, fused.operand));
+        }
+        cpu->program_counter += 2;
+        DISPATCH();
+    }
+#undef FUSED
+#undef FUSED_BNE
+#endif
+#undef IDLE
+#undef DISPATCH
+illegal:
+    return STOP_ILLEGAL_OPCODE;
+}
+
+#else
+
+static enum CPUStopReason ENGINE_NAME(cpu_t *cpu, uint64_t *instructions)
+{
+    uint64_t max_instructions = *instructions;
+    while(true)
+    {
+        if(cpu->cycles >= cpu->deadline)
+        {
+            *instructions = max_instructions;
+            return STOP_CYCLE_LIMIT;
+        }
+        if(max_instructions-- == 0)
+            return STOP_INSTRUCTION_LIMIT;
+        ENGINE_HOOK(cpu);
+        uint8_t code = mem_read(cpu, cpu->program_counter++);
+        insn_handler_t handler = handlers[code];
+        if(handler == NULL)
+            return STOP_ILLEGAL_OPCODE;
+        uint16_t end = cpu->program_counter + (code == 0x4c ? 2 : 1);
+        if(!handler(cpu))
+            return STOP_BRK;
+#ifdef ENGINE_IDLE
+        if(((code & 0x1F) == 0x10 || code == 0x4c) && cpu->program_counter < end - 1 && cpu->skip_idle_loops)
+            idle_loop(cpu, end, &max_instructions);
+#endif
+    }
+}
+
+#endif
+
+#undef ENGINE_NAME
+#undef ENGINE_HOOK
+#undef ENGINE_IDLE
+#undef ENGINE_FUSED
@@ -0,0 +1,130 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fusion.h"
+
+// Stands in for pages that are not code or could not be allocated
+static const struct fused_page no_pairs;
+
+static bool in_memory(const struct cpu_fusion *fusion, const uint8_t *page)
+{
+    return page >= fusion->cpu->memory && page < fusion->cpu->memory + sizeof(fusion->cpu->memory);
+}
+
+// Pairs must fit in the page, as only its own source is checked
+static void decode(struct fused_page *fused, const uint8_t *memory)
+{
+    memset(fused->ops, 0, sizeof(fused->ops));
+    for(int i = 0; i < BUS_PAGE_SIZE; i++)
+    {
+        const uint8_t *code = &memory[i];
+        int left = BUS_PAGE_SIZE - i;
+        struct fused_op *op = &fused->ops[i];
+        if(code[0] == 0xc9 && left >= 4 && code[2] == 0xd0)
+        {
+            op->pair = FUSED_CMP_BNE;
+            op->operand = code[1];
+            op->offset = (int8_t)code[3];
+        }
+        else if(code[0] == 0xca && left >= 3 && code[1] == 0xd0)
+        {
+            op->pair = FUSED_DEX_BNE;
+            op->offset = (int8_t)code[2];
+        }
+        else if(code[0] == 0xad && left >= 6 && code[3] == 0x8d)
+        {
+            op->pair = FUSED_LDA_STA;
+            op->address = code[1] | (code[2] << 8);
+            op->target = code[4] | (code[5] << 8);
+        }
+        else if(code[0] == 0xe8 && left >= 5 && code[1] == 0xe0 && code[3] == 0xd0)
+        {
+            op->pair = FUSED_INX_CPX_BNE;
+            op->operand = code[2];
+            op->offset = (int8_t)code[4];
+        }
+        else if(code[0] == 0x18 && left >= 3 && (code[1] == 0x69 || code[1] == 0x65))
+        {
+            op->pair = code[1] == 0x69 ? FUSED_CLC_ADC : FUSED_CLC_ADC_ZP;
+            op->operand = code[2];
+        }
+    }
+}
+
+// Drops the decodes of a page of cpu->memory when the bus sees it written
+static void fusion_watch(void *context, uint8_t *page)
+{
+    struct cpu_fusion *fusion = context;
+    for(int i = 0; i < BUS_PAGE_COUNT; i++)
+    {
+        if(fusion->pages[i] != NULL && fusion->pages[i]->source == page)
+        {
+            free(fusion->pages[i]);
+            fusion->pages[i] = NULL;
+        }
+    }
+}
+
+struct cpu_fusion *fusion_create(cpu_t *cpu)
+{
+    struct cpu_fusion *fusion = calloc(1, sizeof(struct cpu_fusion));
+    if(fusion == NULL)
+        return NULL;
+    fusion->cpu = cpu;
+    bus_watch_writes(&cpu->bus, cpu->memory, sizeof(cpu->memory), fusion_watch, fusion);
+    return fusion;
+}
+
+void fusion_free(struct cpu_fusion *fusion)
+{
+    if(fusion == NULL)
+        return;
+    // The JIT may have taken the watch over since
+    if(fusion->cpu->bus.watch_context == fusion)
+        bus_watch_writes(&fusion->cpu->bus, NULL, 0, NULL, NULL);
+    fusion_flush(fusion);
+    free(fusion);
+}
+
+/*
+ * Code may come from pages of cpu->memory, which are watched, or from
+ * memory nothing on the bus writes directly, such as ROM or pages shared
+ * with forks. Other pages, and those mapped to handlers, get no pairs.
+ */
+const struct fused_page *fusion_decode(struct cpu_fusion *fusion, uint8_t page)
+{
+    bus_t *bus = &fusion->cpu->bus;
+    uint8_t *memory = bus->read_pages[page];
+    if(memory == NULL)
+        return &no_pairs;
+    struct fused_page *fused = fusion->pages[page];
+    if(fused == NULL)
+    {
+        fused = malloc(sizeof(struct fused_page));
+        if(fused == NULL)
+            return &no_pairs;
+        fusion->pages[page] = fused;
+    }
+    fused->source = memory;
+    if(in_memory(fusion, memory))
+    {
+        decode(fused, memory);
+        bus_watch_page(bus, memory);
+    }
+    else if(!bus_writes_page(bus, memory))
+        decode(fused, memory);
+    else
+        memset(fused->ops, 0, sizeof(fused->ops));
+    return fused;
+}
+
+void fusion_flush(struct cpu_fusion *fusion)
+{
+    if(fusion == NULL)
+        return;
+    for(int i = 0; i < BUS_PAGE_COUNT; i++)
+    {
+        free(fusion->pages[i]);
+        fusion->pages[i] = NULL;
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef FUSION_H
+#define FUSION_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+/*
+ * Decode cache behind cpu->fuse_pairs. Each page of code is scanned once
+ * for the instruction pairs below, and ENGINE_THREADED runs a pair found
+ * there as one handler on the operands decoded here, with a single check
+ * of the cycle and instruction limits for both halves. Flags, cycles and
+ * the point where limits stop the CPU stay exactly as for the two
+ * instructions run one by one.
+ *
+ * Pages are invalidated as for jit.h: the decode is dropped when the bus
+ * maps a different page there, pages of cpu->memory are watched on the
+ * bus and the first write to one drops its decode, and memory written
+ * directly needs cpu_unshare() first. Only one of the JIT and the cache
+ * watches a CPU's bus at a time.
+ */
+
+enum FusedPair {
+    FUSED_NONE,
+    // CMP #imm; BNE
+    FUSED_CMP_BNE,
+    // DEX; BNE
+    FUSED_DEX_BNE,
+    // LDA abs; STA abs
+    FUSED_LDA_STA,
+    // INX; CPX #imm; BNE
+    FUSED_INX_CPX_BNE,
+    // CLC; ADC #imm
+    FUSED_CLC_ADC,
+    // CLC; ADC zp
+    FUSED_CLC_ADC_ZP
+};
+
+// The pair starting at one address, with its operands
+struct fused_op
+{
+    uint8_t pair;
+    // Immediate of CMP, CPX or ADC, or the zero page address of ADC
+    uint8_t operand;
+    int8_t offset;
+    uint16_t address;
+    uint16_t target;
+};
+
+struct fused_page
+{
+    // The bus read page decoded, checked against the bus before each use
+    const uint8_t *source;
+    struct fused_op ops[BUS_PAGE_SIZE];
+};
+
+struct cpu_fusion
+{
+    cpu_t *cpu;
+    // Indexed by bus page; NULL until code there first runs
+    struct fused_page *pages[BUS_PAGE_COUNT];
+};
+
+// Returns NULL if out of memory
+struct cpu_fusion *fusion_create(cpu_t *cpu);
+
+void fusion_free(struct cpu_fusion *fusion);
+
+// Decodes a bus page as currently mapped; never NULL
+const struct fused_page *fusion_decode(struct cpu_fusion *fusion, uint8_t page);
+
+// Drops every decoded page
+void fusion_flush(struct cpu_fusion *fusion);
+
+static inline const struct fused_op *fusion_op(struct cpu_fusion *fusion, uint16_t address)
+{
+    const struct fused_page *page = fusion->pages[address >> 8];
+    if(page == NULL || page->source != fusion->cpu->bus.read_pages[address >> 8])
+        page = fusion_decode(fusion, address >> 8);
+    return &page->ops[address & 0xFF];
+}
+
+#endif
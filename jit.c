@@ -0,0 +1,1281 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jit.h"
+#include "opcode.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_WIN32) && !defined(CPU_NO_JIT)
+
+#include <sys/mman.h>
+
+// Hot code runs inline; cold code holds the slow paths and exits
+#define JIT_HOT_SIZE (3 << 20)
+#define JIT_COLD_SIZE (1 << 20)
+#define JIT_MAX_BLOCKS 16384
+#define JIT_BLOCK_INSTRUCTIONS 32
+// Free room a translation needs in each region; the cache is flushed when less is left
+#define JIT_BLOCK_RESERVE (32 << 10)
+
+static const uint8_t mnemonics[256] = {
+#define OPCODE(c, n, l, cy, m) [c] = MN_##n,
+#include "opcode_list.h"
+#undef OPCODE
+};
+
+enum HostRegister {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/*
+ * Translated code runs with the CPU in rbx, A, X and Y zero-extended in
+ * r12-r14, P in r15 and the interpreter's lazy N and Z result in rbp; see
+ * cpu_status().
+ */
+#define REG_CPU RBX
+#define REG_A R12
+#define REG_X R13
+#define REG_Y R14
+#define REG_P R15
+#define REG_NZ RBP
+
+// Stack frame slots below the saved registers
+#define FRAME_UNLIMITED 0
+#define FRAME_EXECUTED 8
+#define FRAME_ADDRESS 16
+#define FRAME_EXIT 24
+#define FRAME_LOW 32
+#define FRAME_SIZE 40
+
+#define CPU_FIELD(field) ((int32_t)offsetof(cpu_t, field))
+#define READ_PAGES ((int32_t)(offsetof(cpu_t, bus) + offsetof(bus_t, read_pages)))
+#define WRITE_PAGES ((int32_t)(offsetof(cpu_t, bus) + offsetof(bus_t, write_pages)))
+
+enum Condition {
+    CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5
+};
+
+struct jit_block
+{
+    // Entered with the registers loaded; chained code jumps through it
+    void *code;
+    // Worst-case cycles before the last instruction starts
+    uint64_t span;
+    uint16_t pc;
+    // 0 for a marker sending the instruction at pc to the interpreter
+    int count;
+    // Host pages the block was read from and the bus pages they were mapped at
+    int source_count;
+    uint8_t *sources[2];
+    uint8_t pages[2];
+    // Next block read from the same memory page, per source
+    struct jit_block *next[2];
+};
+
+typedef uint64_t (*jit_enter_t)(cpu_t *cpu, void *code, uint64_t unlimited);
+
+struct cpu_jit
+{
+    cpu_t *cpu;
+    uint8_t *code;
+    uint8_t *hot;
+    uint8_t *cold;
+    // Start of each region after the permanent stubs
+    uint8_t *hot_start;
+    uint8_t *cold_start;
+    jit_enter_t enter;
+    // Stores the registers and returns the executed count in eax plus the frame's
+    uint8_t *exit;
+    // The same with nothing executed in the current block
+    uint8_t *exit_zero;
+    int block_count;
+    struct jit_block pool[JIT_MAX_BLOCKS];
+    // Blocks read from each page of cpu->memory
+    struct jit_block *memory_blocks[BUS_PAGE_COUNT];
+    struct jit_block *blocks[0x10000];
+};
+
+struct emitter
+{
+    uint8_t *p;
+    uint8_t *end;
+    bool overflow;
+};
+
+static void emit8(struct emitter *e, uint8_t byte)
+{
+    if(e->p < e->end)
+        *e->p++ = byte;
+    else
+        e->overflow = true;
+}
+
+static void emit32(struct emitter *e, uint32_t value)
+{
+    for(int i = 0; i < 4; i++)
+        emit8(e, value >> (i * 8));
+}
+
+static void emit64(struct emitter *e, uint64_t value)
+{
+    for(int i = 0; i < 8; i++)
+        emit8(e, value >> (i * 8));
+}
+
+// low_bytes forces a REX prefix so registers 4-7 name SPL-DIL instead of AH-BH
+static void emit_rex(struct emitter *e, bool wide, int reg, int index, int base, bool low_bytes)
+{
+    uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+    if(rex != 0x40 || low_bytes)
+        emit8(e, rex);
+}
+
+// One-byte opcodes, or two-byte ones given as 0x0Fxx
+static void emit_opcode(struct emitter *e, int opcode)
+{
+    if(opcode > 0xFF)
+        emit8(e, opcode >> 8);
+    emit8(e, opcode & 0xFF);
+}
+
+static bool is_low_byte(int reg)
+{
+    return reg >= RSP && reg <= RDI;
+}
+
+// opcode reg, rm between registers; reg may be an opcode extension
+static void emit_rr(struct emitter *e, bool wide, bool bytes, int opcode, int reg, int rm)
+{
+    emit_rex(e, wide, reg, 0, rm, bytes && (is_low_byte(reg) || is_low_byte(rm)));
+    emit_opcode(e, opcode);
+    emit8(e, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// opcode reg, [base + index * scale + disp]; index is -1 for none
+static void emit_rm(struct emitter *e, bool wide, bool bytes, int opcode, int reg, int base, int index, int scale, int32_t disp)
+{
+    emit_rex(e, wide, reg, index < 0 ? 0 : index, base, bytes && is_low_byte(reg));
+    emit_opcode(e, opcode);
+    int mod = (disp >= -128 && disp <= 127) ? 1 : 2;
+    if(index < 0 && (base & 7) != RSP)
+        emit8(e, mod << 6 | (reg & 7) << 3 | (base & 7));
+    else
+    {
+        int ss = scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+        emit8(e, mod << 6 | (reg & 7) << 3 | 4);
+        emit8(e, ss << 6 | ((index < 0 ? RSP : index) & 7) << 3 | (base & 7));
+    }
+    if(mod == 1)
+        emit8(e, (uint8_t)disp);
+    else
+        emit32(e, disp);
+}
+
+static void emit_mov(struct emitter *e, int dst, int src)
+{
+    emit_rr(e, false, false, 0x89, src, dst);
+}
+
+static void emit_mov_imm(struct emitter *e, int dst, uint32_t value)
+{
+    emit_rex(e, false, 0, 0, dst, false);
+    emit8(e, 0xB8 + (dst & 7));
+    emit32(e, value);
+}
+
+static void emit_mov_imm64(struct emitter *e, int dst, uint64_t value)
+{
+    emit_rex(e, true, 0, 0, dst, false);
+    emit8(e, 0xB8 + (dst & 7));
+    emit64(e, value);
+}
+
+// movzx dst, src8
+static void emit_zero_extend(struct emitter *e, int dst, int src)
+{
+    emit_rr(e, false, true, 0x0FB6, dst, src);
+}
+
+// Arithmetic opcodes of the r/m, reg form and their /digit for immediates
+enum AluOp {
+    ALU_ADD = 0x01, ALU_OR = 0x09, ALU_AND = 0x21, ALU_SUB = 0x29, ALU_XOR = 0x31, ALU_CMP = 0x39, ALU_TEST = 0x85
+};
+
+static int alu_digit(enum AluOp op)
+{
+    return op == ALU_TEST ? 0 : (op >> 3);
+}
+
+// op dst, src on 32-bit registers
+static void emit_alu(struct emitter *e, enum AluOp op, int dst, int src)
+{
+    emit_rr(e, false, false, op, src, dst);
+}
+
+static void emit_alu_imm(struct emitter *e, enum AluOp op, int dst, int32_t value)
+{
+    if(op == ALU_TEST)
+    {
+        emit_rr(e, false, false, 0xF7, 0, dst);
+        emit32(e, value);
+    }
+    else if(value >= -128 && value <= 127)
+    {
+        emit_rr(e, false, false, 0x83, alu_digit(op), dst);
+        emit8(e, (uint8_t)value);
+    }
+    else
+    {
+        emit_rr(e, false, false, 0x81, alu_digit(op), dst);
+        emit32(e, value);
+    }
+}
+
+// op qword [base + disp], value
+static void emit_alu_mem64_imm(struct emitter *e, enum AluOp op, int base, int32_t disp, int32_t value)
+{
+    if(value >= -128 && value <= 127)
+    {
+        emit_rm(e, true, false, 0x83, alu_digit(op), base, -1, 0, disp);
+        emit8(e, (uint8_t)value);
+    }
+    else
+    {
+        emit_rm(e, true, false, 0x81, alu_digit(op), base, -1, 0, disp);
+        emit32(e, value);
+    }
+}
+
+// op byte [base + disp], value
+static void emit_alu_mem8_imm(struct emitter *e, enum AluOp op, int base, int32_t disp, uint8_t value)
+{
+    emit_rm(e, false, false, 0x80, alu_digit(op), base, -1, 0, disp);
+    emit8(e, value);
+}
+
+enum ShiftOp {
+    SHIFT_LEFT = 4, SHIFT_RIGHT = 5
+};
+
+static void emit_shift(struct emitter *e, enum ShiftOp op, int dst, uint8_t count)
+{
+    emit_rr(e, false, false, 0xC1, op, dst);
+    emit8(e, count);
+}
+
+// setcc dst8; movzx dst, dst8
+static void emit_set(struct emitter *e, enum Condition condition, int dst)
+{
+    emit_rr(e, false, true, 0x0F90 | condition, 0, dst);
+    emit_zero_extend(e, dst, dst);
+}
+
+static void emit_call(struct emitter *e, const void *function)
+{
+    emit_mov_imm64(e, RAX, (uint64_t)(uintptr_t)function);
+    emit_rr(e, false, false, 0xFF, 2, RAX);
+}
+
+static void patch32(uint8_t *field, const uint8_t *target)
+{
+    int32_t offset = (int32_t)(target - (field + 4));
+    memcpy(field, &offset, 4);
+}
+
+// Emits a jump to target, or to be patched when target is NULL; returns the rel32 field
+static uint8_t *emit_jump(struct emitter *e, const uint8_t *target)
+{
+    emit8(e, 0xE9);
+    uint8_t *field = e->p;
+    emit32(e, 0);
+    if(target != NULL && !e->overflow)
+        patch32(field, target);
+    return field;
+}
+
+static uint8_t *emit_branch(struct emitter *e, enum Condition condition, const uint8_t *target)
+{
+    emit_opcode(e, 0x0F80 | condition);
+    uint8_t *field = e->p;
+    emit32(e, 0);
+    if(target != NULL && !e->overflow)
+        patch32(field, target);
+    return field;
+}
+
+static void patch_here(struct emitter *e, uint8_t *field)
+{
+    if(!e->overflow)
+        patch32(field, e->p);
+}
+
+// Works out P into dst from r15 and the NZ result, using rdx
+static void emit_status(struct emitter *e, int dst)
+{
+    emit_mov(e, dst, REG_P);
+    emit_alu_imm(e, ALU_AND, dst, ~(NEGATIVE | ZERO) & 0xFF);
+    emit_alu_imm(e, ALU_TEST, REG_NZ, 0x180);
+    emit_set(e, CC_NE, RDX);
+    emit_shift(e, SHIFT_LEFT, RDX, 7);
+    emit_alu(e, ALU_OR, dst, RDX);
+    emit_alu_imm(e, ALU_TEST, REG_NZ, 0xFF);
+    emit_set(e, CC_E, RDX);
+    emit_shift(e, SHIFT_LEFT, RDX, 1);
+    emit_alu(e, ALU_OR, dst, RDX);
+}
+
+// Stores the registers held in host ones, for the exit and for bus handlers to see
+static void emit_spill(struct emitter *e)
+{
+    emit_rm(e, false, true, 0x88, REG_A, REG_CPU, -1, 0, CPU_FIELD(reg_a));
+    emit_rm(e, false, true, 0x88, REG_X, REG_CPU, -1, 0, CPU_FIELD(reg_x));
+    emit_rm(e, false, true, 0x88, REG_Y, REG_CPU, -1, 0, CPU_FIELD(reg_y));
+    emit_rm(e, false, true, 0x88, REG_P, REG_CPU, -1, 0, CPU_FIELD(reg_status));
+    emit8(e, 0x66);
+    emit_rm(e, false, false, 0x89, REG_NZ, REG_CPU, -1, 0, CPU_FIELD(nz));
+}
+
+static const int saved_registers[] = {RBX, RBP, R12, R13, R14, R15};
+
+// Builds the entry trampoline and the exit stubs at the start of the regions
+static void emit_stubs(struct cpu_jit *jit, struct emitter *hot, struct emitter *cold)
+{
+    jit->enter = (jit_enter_t)hot->p;
+    for(int i = 0; i < 6; i++)
+    {
+        emit_rex(hot, false, 0, 0, saved_registers[i], false);
+        emit8(hot, 0x50 + (saved_registers[i] & 7));
+    }
+    emit_rr(hot, true, false, 0x83, 5, RSP);
+    emit8(hot, FRAME_SIZE);
+    emit_rm(hot, true, false, 0x89, RDX, RSP, -1, 0, FRAME_UNLIMITED);
+    emit_rm(hot, true, false, 0xC7, 0, RSP, -1, 0, FRAME_EXECUTED);
+    emit32(hot, 0);
+    emit_rm(hot, true, false, 0xC7, 0, RSP, -1, 0, FRAME_EXIT);
+    emit32(hot, 0);
+    emit_rr(hot, true, false, 0x89, RDI, REG_CPU);
+    emit_rm(hot, false, false, 0x0FB6, REG_A, REG_CPU, -1, 0, CPU_FIELD(reg_a));
+    emit_rm(hot, false, false, 0x0FB6, REG_X, REG_CPU, -1, 0, CPU_FIELD(reg_x));
+    emit_rm(hot, false, false, 0x0FB6, REG_Y, REG_CPU, -1, 0, CPU_FIELD(reg_y));
+    emit_rm(hot, false, false, 0x0FB6, REG_P, REG_CPU, -1, 0, CPU_FIELD(reg_status));
+    emit_rm(hot, false, false, 0x0FB7, REG_NZ, REG_CPU, -1, 0, CPU_FIELD(nz));
+    emit_rr(hot, false, false, 0xFF, 4, RSI);
+
+    jit->exit = cold->p;
+    emit_rm(cold, true, false, 0x03, RAX, RSP, -1, 0, FRAME_EXECUTED);
+    emit_spill(cold);
+    emit_rr(cold, true, false, 0x83, 0, RSP);
+    emit8(cold, FRAME_SIZE);
+    for(int i = 5; i >= 0; i--)
+    {
+        emit_rex(cold, false, 0, 0, saved_registers[i], false);
+        emit8(cold, 0x58 + (saved_registers[i] & 7));
+    }
+    emit8(cold, 0xC3);
+
+    jit->exit_zero = cold->p;
+    emit_alu(cold, ALU_XOR, RAX, RAX);
+    emit_jump(cold, jit->exit);
+}
+
+static uint32_t read_slow(cpu_t *cpu, uint32_t address)
+{
+    uint8_t data = bus_read_slow(&cpu->bus, address);
+    return data | (cpu->cycles >= cpu->deadline ? 0x100 : 0);
+}
+
+static void write_slow(cpu_t *cpu, uint32_t address, uint32_t data)
+{
+    bus_write_slow(&cpu->bus, address, data);
+}
+
+struct translation
+{
+    struct cpu_jit *jit;
+    struct emitter hot;
+    struct emitter cold;
+    struct jit_block *block;
+    // Cycles of the instructions so far not yet added to cpu->cycles
+    int pending;
+};
+
+static void flush_cycles(struct translation *t)
+{
+    if(t->pending > 0)
+        emit_alu_mem64_imm(&t->hot, ALU_ADD, REG_CPU, CPU_FIELD(cycles), t->pending);
+    t->pending = 0;
+}
+
+// Slow read into eax of the address in ecx, keeping ecx; flags an exit once the deadline has passed
+static void emit_read_slow(struct translation *t, const uint8_t *back)
+{
+    struct emitter *e = &t->cold;
+    emit_rm(e, true, false, 0x89, RCX, RSP, -1, 0, FRAME_ADDRESS);
+    emit_spill(e);
+    emit_mov(e, RSI, RCX);
+    emit_rr(e, true, false, 0x89, REG_CPU, RDI);
+    emit_call(e, read_slow);
+    emit_alu_imm(e, ALU_TEST, RAX, 0x100);
+    emit8(e, 0x74);
+    emit8(e, 5);
+    emit_rm(e, false, false, 0xC6, 0, RSP, -1, 0, FRAME_EXIT);
+    emit8(e, 1);
+    emit_zero_extend(e, RAX, RAX);
+    emit_rm(e, true, false, 0x8B, RCX, RSP, -1, 0, FRAME_ADDRESS);
+    emit_jump(e, back);
+}
+
+// eax = byte at a constant address
+static void emit_read_constant(struct translation *t, uint16_t address)
+{
+    struct emitter *e = &t->hot;
+    emit_rm(e, true, false, 0x8B, RAX, REG_CPU, -1, 0, READ_PAGES + (address >> 8) * 8);
+    emit_rr(e, true, false, ALU_TEST, RAX, RAX);
+    emit_branch(e, CC_E, t->cold.p);
+    emit_rm(e, false, false, 0x0FB6, RAX, RAX, -1, 0, address & 0xFF);
+    emit_mov_imm(&t->cold, RCX, address);
+    emit_read_slow(t, e->p);
+}
+
+// eax = byte at the address in ecx, which is kept
+static void emit_read_dynamic(struct translation *t)
+{
+    struct emitter *e = &t->hot;
+    emit_mov(e, RAX, RCX);
+    emit_shift(e, SHIFT_RIGHT, RAX, 8);
+    emit_rm(e, true, false, 0x8B, RAX, REG_CPU, RAX, 8, READ_PAGES);
+    emit_rr(e, true, false, ALU_TEST, RAX, RAX);
+    emit_branch(e, CC_E, t->cold.p);
+    emit_zero_extend(e, RDX, RCX);
+    emit_rm(e, false, false, 0x0FB6, RAX, RAX, RDX, 1, 0);
+    emit_read_slow(t, e->p);
+}
+
+// Slow write of src to the address in esi; always ends the block after the instruction
+static void emit_write_slow(struct translation *t, int src, const uint8_t *back)
+{
+    struct emitter *e = &t->cold;
+    emit_spill(e);
+    emit_mov(e, RDX, src);
+    emit_rr(e, true, false, 0x89, REG_CPU, RDI);
+    emit_call(e, write_slow);
+    emit_rm(e, false, false, 0xC6, 0, RSP, -1, 0, FRAME_EXIT);
+    emit8(e, 1);
+    emit_jump(e, back);
+}
+
+static void emit_write_constant(struct translation *t, uint16_t address, int src)
+{
+    struct emitter *e = &t->hot;
+    emit_rm(e, true, false, 0x8B, RDX, REG_CPU, -1, 0, WRITE_PAGES + (address >> 8) * 8);
+    emit_rr(e, true, false, ALU_TEST, RDX, RDX);
+    emit_branch(e, CC_E, t->cold.p);
+    emit_rm(e, false, true, 0x88, src, RDX, -1, 0, address & 0xFF);
+    emit_mov_imm(&t->cold, RSI, address);
+    emit_write_slow(t, src, e->p);
+}
+
+static void emit_write_dynamic(struct translation *t, int src)
+{
+    struct emitter *e = &t->hot;
+    emit_mov(e, RDX, RCX);
+    emit_shift(e, SHIFT_RIGHT, RDX, 8);
+    emit_rm(e, true, false, 0x8B, RDX, REG_CPU, RDX, 8, WRITE_PAGES);
+    emit_rr(e, true, false, ALU_TEST, RDX, RDX);
+    emit_branch(e, CC_E, t->cold.p);
+    emit_zero_extend(e, RSI, RCX);
+    emit_rm(e, false, true, 0x88, src, RDX, RSI, 1, 0);
+    emit_mov(&t->cold, RSI, RCX);
+    emit_write_slow(t, src, e->p);
+}
+
+// Adds the page crossing cycle when the address in ecx is on another page than the one in base
+static void emit_page_cross(struct translation *t, int base, int scratch)
+{
+    struct emitter *e = &t->hot;
+    emit_mov(e, scratch, RCX);
+    emit_alu(e, ALU_XOR, scratch, base);
+    emit_alu_imm(e, ALU_TEST, scratch, (int32_t)0xFFFFFF00);
+    emit8(e, 0x74);
+    uint8_t *skip = e->p;
+    emit8(e, 0);
+    emit_alu_mem64_imm(e, ALU_ADD, REG_CPU, CPU_FIELD(cycles), 1);
+    *skip = (uint8_t)(e->p - (skip + 1));
+}
+
+/*
+ * Effective address of a memory operand, as get_operand_address() works it
+ * out: returns true with a constant address, or leaves it in ecx. read adds
+ * the page crossing cycle of indexed reads.
+ */
+static bool emit_address(struct translation *t, enum AddressingMode mode, uint16_t operand, bool read, uint16_t *address)
+{
+    struct emitter *e = &t->hot;
+    switch(mode)
+    {
+        case ZERO_PAGE:
+        case ABSOLUTE:
+            *address = operand;
+            return true;
+        case ZERO_PAGE_X:
+        case ZERO_PAGE_Y:
+            // Not wrapped within the zero page, matching the interpreter
+            emit_rm(e, false, false, 0x8D, RCX, mode == ZERO_PAGE_X ? REG_X : REG_Y, -1, 0, operand);
+            return false;
+        case ABSOLUTE_X:
+        case ABSOLUTE_Y:
+            emit_rm(e, false, false, 0x8D, RCX, mode == ABSOLUTE_X ? REG_X : REG_Y, -1, 0, operand);
+            if(read)
+            {
+                emit_mov_imm(e, RDX, operand);
+                emit_page_cross(t, RDX, RAX);
+            }
+            emit_rr(e, false, false, 0x0FB7, RCX, RCX);
+            return false;
+        case INDIRECT_X:
+            emit_rm(e, false, false, 0x8D, RCX, REG_X, -1, 0, operand);
+            emit_zero_extend(e, RCX, RCX);
+            emit_read_dynamic(t);
+            emit_rm(e, false, false, 0x89, RAX, RSP, -1, 0, FRAME_LOW);
+            // The high byte comes from ptr + 1 without wrapping, as in get_operand_address()
+            emit_alu_imm(e, ALU_ADD, RCX, 1);
+            emit_read_dynamic(t);
+            emit_shift(e, SHIFT_LEFT, RAX, 8);
+            emit_rm(e, false, false, 0x0B, RAX, RSP, -1, 0, FRAME_LOW);
+            emit_mov(e, RCX, RAX);
+            return false;
+        case INDIRECT_Y:
+            emit_read_constant(t, operand);
+            emit_rm(e, false, false, 0x89, RAX, RSP, -1, 0, FRAME_LOW);
+            emit_read_constant(t, operand + 1);
+            emit_shift(e, SHIFT_LEFT, RAX, 8);
+            emit_rm(e, false, false, 0x0B, RAX, RSP, -1, 0, FRAME_LOW);
+            emit_rm(e, false, false, 0x8D, RCX, RAX, REG_Y, 1, 0);
+            if(read)
+                emit_page_cross(t, RAX, RDX);
+            emit_rr(e, false, false, 0x0FB7, RCX, RCX);
+            return false;
+        default:
+            return true;
+    }
+}
+
+// eax = the operand of a read instruction
+static void emit_operand(struct translation *t, const opcode_t *op, uint16_t operand)
+{
+    if(op->mode == IMMEDIATE)
+    {
+        emit_mov_imm(&t->hot, RAX, operand);
+        return;
+    }
+    flush_cycles(t);
+    uint16_t address;
+    if(emit_address(t, op->mode, operand, true, &address))
+        emit_read_constant(t, address);
+    else
+        emit_read_dynamic(t);
+}
+
+static void emit_store(struct translation *t, const opcode_t *op, uint16_t operand, int src)
+{
+    flush_cycles(t);
+    uint16_t address;
+    if(emit_address(t, op->mode, operand, false, &address))
+        emit_write_constant(t, address, src);
+    else
+        emit_write_dynamic(t, src);
+}
+
+// ecx = $0100 + S
+static void emit_stack_address(struct emitter *e)
+{
+    emit_rm(e, false, false, 0x0FB6, RCX, REG_CPU, -1, 0, CPU_FIELD(stack_pointer));
+    emit_alu_imm(e, ALU_OR, RCX, 0x100);
+}
+
+static void emit_push(struct translation *t, int src)
+{
+    flush_cycles(t);
+    emit_stack_address(&t->hot);
+    emit_write_dynamic(t, src);
+    emit_alu_mem8_imm(&t->hot, ALU_SUB, REG_CPU, CPU_FIELD(stack_pointer), 1);
+}
+
+static void emit_pull(struct translation *t)
+{
+    flush_cycles(t);
+    emit_alu_mem8_imm(&t->hot, ALU_ADD, REG_CPU, CPU_FIELD(stack_pointer), 1);
+    emit_stack_address(&t->hot);
+    emit_read_dynamic(t);
+}
+
+// reg = value and the NZ result with it
+static void emit_load(struct emitter *e, int reg)
+{
+    emit_mov(e, reg, RAX);
+    emit_mov(e, REG_NZ, RAX);
+}
+
+static void emit_set_nz(struct emitter *e, int reg)
+{
+    emit_mov(e, REG_NZ, reg);
+}
+
+// A = A + value + C with eax as the value, as add_to_reg_a() does
+static void emit_add(struct emitter *e)
+{
+    emit_mov(e, RCX, REG_P);
+    emit_alu_imm(e, ALU_AND, RCX, CARRY);
+    emit_mov(e, RDX, REG_A);
+    emit_alu(e, ALU_ADD, RDX, RAX);
+    emit_alu(e, ALU_ADD, RDX, RCX);
+    emit_alu_imm(e, ALU_AND, REG_P, ~(CARRY | OVERFLOW) & 0xFF);
+    emit_mov(e, RCX, RDX);
+    emit_shift(e, SHIFT_RIGHT, RCX, 8);
+    emit_alu(e, ALU_OR, REG_P, RCX);
+    emit_zero_extend(e, RDX, RDX);
+    // V = (value ^ result) & (result ^ A) & 0x80
+    emit_alu(e, ALU_XOR, RAX, RDX);
+    emit_mov(e, RCX, RDX);
+    emit_alu(e, ALU_XOR, RCX, REG_A);
+    emit_alu(e, ALU_AND, RAX, RCX);
+    emit_alu_imm(e, ALU_AND, RAX, 0x80);
+    emit_shift(e, SHIFT_RIGHT, RAX, 1);
+    emit_alu(e, ALU_OR, REG_P, RAX);
+    emit_mov(e, REG_A, RDX);
+    emit_set_nz(e, RDX);
+}
+
+static void emit_compare(struct emitter *e, int reg)
+{
+    emit_alu_imm(e, ALU_AND, REG_P, ~CARRY & 0xFF);
+    emit_alu(e, ALU_CMP, reg, RAX);
+    emit_set(e, CC_AE, RCX);
+    emit_alu(e, ALU_OR, REG_P, RCX);
+    emit_mov(e, RDX, reg);
+    emit_alu(e, ALU_SUB, RDX, RAX);
+    emit_zero_extend(e, REG_NZ, RDX);
+}
+
+// ASL, LSR, ROL or ROR of reg, using esi and edi
+static void emit_rotate(struct emitter *e, int mnemonic, int reg)
+{
+    bool rotate = mnemonic == MN_ROL || mnemonic == MN_ROR;
+    bool left = mnemonic == MN_ASL || mnemonic == MN_ROL;
+    if(rotate)
+    {
+        emit_mov(e, RDI, REG_P);
+        emit_alu_imm(e, ALU_AND, RDI, CARRY);
+        if(!left)
+            emit_shift(e, SHIFT_LEFT, RDI, 7);
+    }
+    emit_alu_imm(e, ALU_AND, REG_P, ~CARRY & 0xFF);
+    emit_mov(e, RSI, reg);
+    if(left)
+        emit_shift(e, SHIFT_RIGHT, RSI, 7);
+    else
+        emit_alu_imm(e, ALU_AND, RSI, 1);
+    emit_alu(e, ALU_OR, REG_P, RSI);
+    emit_shift(e, left ? SHIFT_LEFT : SHIFT_RIGHT, reg, 1);
+    if(rotate)
+        emit_alu(e, ALU_OR, reg, RDI);
+    if(left)
+        emit_zero_extend(e, reg, reg);
+    emit_set_nz(e, reg);
+}
+
+static void emit_step(struct emitter *e, int reg, int delta)
+{
+    emit_alu_imm(e, ALU_ADD, reg, delta);
+    emit_zero_extend(e, reg, reg);
+    emit_set_nz(e, reg);
+}
+
+static void emit_store_pc(struct emitter *e, uint16_t pc)
+{
+    emit8(e, 0x66);
+    emit_rm(e, false, false, 0xC7, 0, REG_CPU, -1, 0, CPU_FIELD(program_counter));
+    emit8(e, pc & 0xFF);
+    emit8(e, pc >> 8);
+}
+
+/*
+ * Leaves the block for target, in ecx when dynamic: credits the block's
+ * instructions, then jumps into the target's block if the run is unlimited
+ * and the block fits before the deadline, or returns to jit_run().
+ */
+static void emit_chain(struct translation *t, bool dynamic, uint16_t target, int executed)
+{
+    struct emitter *e = &t->hot;
+    struct cpu_jit *jit = t->jit;
+    flush_cycles(t);
+    if(dynamic)
+    {
+        emit8(e, 0x66);
+        emit_rm(e, false, false, 0x89, RCX, REG_CPU, -1, 0, CPU_FIELD(program_counter));
+    }
+    else
+        emit_store_pc(e, target);
+    emit_alu_mem64_imm(e, ALU_ADD, RSP, FRAME_EXECUTED, executed);
+    emit_alu_mem64_imm(e, ALU_CMP, RSP, FRAME_UNLIMITED, 0);
+    emit_branch(e, CC_E, jit->exit_zero);
+    if(dynamic)
+    {
+        emit_mov_imm64(e, RAX, (uint64_t)(uintptr_t)jit->blocks);
+        emit_rm(e, true, false, 0x8B, RAX, RAX, RCX, 8, 0);
+    }
+    else
+    {
+        emit_mov_imm64(e, RAX, (uint64_t)(uintptr_t)&jit->blocks[target]);
+        emit_rm(e, true, false, 0x8B, RAX, RAX, -1, 0, 0);
+    }
+    emit_rr(e, true, false, ALU_TEST, RAX, RAX);
+    emit_branch(e, CC_E, jit->exit_zero);
+    emit_rm(e, true, false, 0x8B, RDX, REG_CPU, -1, 0, CPU_FIELD(cycles));
+    emit_rm(e, true, false, 0x03, RDX, RAX, -1, 0, offsetof(struct jit_block, span));
+    emit_rm(e, true, false, 0x3B, RDX, REG_CPU, -1, 0, CPU_FIELD(deadline));
+    emit_branch(e, CC_AE, jit->exit_zero);
+    emit_rm(e, false, false, 0xFF, 4, RAX, -1, 0, offsetof(struct jit_block, code));
+}
+
+// Leaves after the instruction when a slow access asked for it, crediting the block's instructions so far
+static void emit_exit_check(struct translation *t, uint16_t next_pc, int executed)
+{
+    flush_cycles(t);
+    emit_alu_mem8_imm(&t->hot, ALU_CMP, RSP, FRAME_EXIT, 0);
+    emit_branch(&t->hot, CC_NE, t->cold.p);
+    emit_store_pc(&t->cold, next_pc);
+    emit_mov_imm(&t->cold, RAX, executed);
+    emit_jump(&t->cold, t->jit->exit);
+}
+
+// Read-modify-write of a memory operand through eax
+static void emit_modify(struct translation *t, const opcode_t *op, uint16_t operand, int mnemonic)
+{
+    struct emitter *e = &t->hot;
+    flush_cycles(t);
+    uint16_t address;
+    bool constant = emit_address(t, op->mode, operand, false, &address);
+    if(constant)
+        emit_read_constant(t, address);
+    else
+        emit_read_dynamic(t);
+    if(mnemonic == MN_INC || mnemonic == MN_DEC)
+        emit_step(e, RAX, mnemonic == MN_INC ? 1 : -1);
+    else
+        emit_rotate(e, mnemonic, RAX);
+    if(constant)
+        emit_write_constant(t, address, RAX);
+    else
+        emit_write_dynamic(t, RAX);
+}
+
+// BIT sets Z from A & value and copies bits 7 and 6 of the value into N and V, never clearing them
+static void emit_bit(struct emitter *e)
+{
+    emit_alu_imm(e, ALU_TEST, REG_NZ, 0x180);
+    emit_set(e, CC_NE, RCX);
+    emit_mov(e, RDX, RAX);
+    emit_alu_imm(e, ALU_AND, RDX, NEGATIVE);
+    emit_shift(e, SHIFT_RIGHT, RDX, 7);
+    emit_alu(e, ALU_OR, RCX, RDX);
+    emit_shift(e, SHIFT_LEFT, RCX, 8);
+    emit_mov(e, RDX, REG_A);
+    emit_alu(e, ALU_AND, RDX, RAX);
+    emit_set(e, CC_NE, RDX);
+    emit_alu(e, ALU_OR, RCX, RDX);
+    emit_mov(e, REG_NZ, RCX);
+    emit_alu_imm(e, ALU_AND, RAX, OVERFLOW);
+    emit_alu(e, ALU_OR, REG_P, RAX);
+}
+
+static bool is_penalized(int mnemonic)
+{
+    switch(mnemonic)
+    {
+        case MN_LDA: case MN_LDX: case MN_LDY: case MN_ADC: case MN_SBC: case MN_AND:
+        case MN_ORA: case MN_EOR: case MN_CMP: case MN_CPX: case MN_CPY:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// The interpreter's cycles for an instruction, before any taken branch
+static int max_cycles(const opcode_t *op, int mnemonic)
+{
+    bool indexed = op->mode == ABSOLUTE_X || op->mode == ABSOLUTE_Y || op->mode == INDIRECT_Y;
+    return op->cycles + (indexed && is_penalized(mnemonic) ? 1 : 0);
+}
+
+// Instructions left to the interpreter: they poll interrupts, read vectors or jump indirectly
+static bool is_translatable(const opcode_t *op, int mnemonic)
+{
+    if(op->name == NULL)
+        return false;
+    switch(mnemonic)
+    {
+        case MN_BRK: case MN_RTI: case MN_PLP: case MN_CLI:
+            return false;
+        case MN_JMP:
+            return op->mode != INDIRECT;
+        default:
+            return true;
+    }
+}
+
+static bool is_terminator(int mnemonic)
+{
+    switch(mnemonic)
+    {
+        case MN_JMP: case MN_JSR: case MN_RTS:
+        case MN_BCC: case MN_BCS: case MN_BEQ: case MN_BMI:
+        case MN_BNE: case MN_BPL: case MN_BVC: case MN_BVS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool touches_memory(const opcode_t *op, int mnemonic)
+{
+    if(mnemonic == MN_PHA || mnemonic == MN_PHP || mnemonic == MN_PLA)
+        return true;
+    return op->mode != NONE_ADDRESSING && op->mode != IMMEDIATE;
+}
+
+static void emit_branch_instruction(struct translation *t, int mnemonic, uint16_t pc, uint16_t operand, int executed)
+{
+    struct emitter *e = &t->hot;
+    int reg = REG_P;
+    int mask = CARRY;
+    bool taken_if_set = false;
+    switch(mnemonic)
+    {
+        case MN_BNE: reg = REG_NZ; mask = 0xFF; taken_if_set = true; break;
+        case MN_BEQ: reg = REG_NZ; mask = 0xFF; break;
+        case MN_BPL: reg = REG_NZ; mask = 0x180; break;
+        case MN_BMI: reg = REG_NZ; mask = 0x180; taken_if_set = true; break;
+        case MN_BVC: mask = OVERFLOW; break;
+        case MN_BVS: mask = OVERFLOW; taken_if_set = true; break;
+        case MN_BCC: break;
+        case MN_BCS: taken_if_set = true; break;
+    }
+    uint16_t next_pc = pc + 2;
+    uint16_t target = next_pc + (int8_t)operand;
+    int pending = t->pending;
+    emit_alu_imm(e, ALU_TEST, reg, mask);
+    uint8_t *taken = emit_branch(e, taken_if_set ? CC_NE : CC_E, NULL);
+    emit_chain(t, false, next_pc, executed);
+    patch_here(e, taken);
+    t->pending = pending + (((next_pc & 0xFF00) != (target & 0xFF00)) ? 2 : 1);
+    emit_chain(t, false, target, executed);
+}
+
+// Emits instruction number index of the block, at pc
+static void emit_instruction(struct translation *t, uint16_t pc, uint8_t code, uint16_t operand, int index)
+{
+    struct emitter *e = &t->hot;
+    const opcode_t *op = opcode_lookup(code);
+    int mnemonic = mnemonics[code];
+    uint16_t next_pc = pc + op->len;
+    int executed = index + 1;
+    t->pending += op->cycles;
+    switch(mnemonic)
+    {
+        case MN_LDA: emit_operand(t, op, operand); emit_load(e, REG_A); break;
+        case MN_LDX: emit_operand(t, op, operand); emit_load(e, REG_X); break;
+        case MN_LDY: emit_operand(t, op, operand); emit_load(e, REG_Y); break;
+        case MN_STA: emit_store(t, op, operand, REG_A); break;
+        case MN_STX: emit_store(t, op, operand, REG_X); break;
+        case MN_STY: emit_store(t, op, operand, REG_Y); break;
+        case MN_ADC:
+            emit_operand(t, op, operand);
+            emit_add(e);
+            break;
+        case MN_SBC:
+            // SBC adds the two's complement of the value, as sbc() does
+            emit_operand(t, op, operand);
+            emit_rr(e, false, false, 0xF7, 3, RAX);
+            emit_zero_extend(e, RAX, RAX);
+            emit_add(e);
+            break;
+        case MN_AND:
+        case MN_ORA:
+        case MN_EOR:
+            emit_operand(t, op, operand);
+            emit_alu(e, mnemonic == MN_AND ? ALU_AND : mnemonic == MN_ORA ? ALU_OR : ALU_XOR, REG_A, RAX);
+            emit_set_nz(e, REG_A);
+            break;
+        case MN_CMP: emit_operand(t, op, operand); emit_compare(e, REG_A); break;
+        case MN_CPX: emit_operand(t, op, operand); emit_compare(e, REG_X); break;
+        case MN_CPY: emit_operand(t, op, operand); emit_compare(e, REG_Y); break;
+        case MN_BIT:
+            // BIT takes no page crossing cycle, but it only has zero page and absolute forms
+            emit_operand(t, op, operand);
+            emit_bit(e);
+            break;
+        case MN_ASL:
+        case MN_LSR:
+        case MN_ROL:
+        case MN_ROR:
+            if(op->mode == NONE_ADDRESSING)
+                emit_rotate(e, mnemonic, REG_A);
+            else
+                emit_modify(t, op, operand, mnemonic);
+            break;
+        case MN_INC:
+        case MN_DEC:
+            emit_modify(t, op, operand, mnemonic);
+            break;
+        case MN_INX: emit_step(e, REG_X, 1); break;
+        case MN_INY: emit_step(e, REG_Y, 1); break;
+        case MN_DEX: emit_step(e, REG_X, -1); break;
+        case MN_DEY: emit_step(e, REG_Y, -1); break;
+        case MN_TAX: emit_mov(e, REG_X, REG_A); emit_set_nz(e, REG_X); break;
+        case MN_TAY: emit_mov(e, REG_Y, REG_A); emit_set_nz(e, REG_Y); break;
+        case MN_TXA: emit_mov(e, REG_A, REG_X); emit_set_nz(e, REG_A); break;
+        case MN_TYA: emit_mov(e, REG_A, REG_Y); emit_set_nz(e, REG_A); break;
+        case MN_TSX:
+            emit_rm(e, false, false, 0x0FB6, REG_X, REG_CPU, -1, 0, CPU_FIELD(stack_pointer));
+            emit_set_nz(e, REG_X);
+            break;
+        case MN_TXS:
+            emit_rm(e, false, true, 0x88, REG_X, REG_CPU, -1, 0, CPU_FIELD(stack_pointer));
+            break;
+        case MN_CLC: emit_alu_imm(e, ALU_AND, REG_P, ~CARRY & 0xFF); break;
+        case MN_SEC: emit_alu_imm(e, ALU_OR, REG_P, CARRY); break;
+        case MN_CLD: emit_alu_imm(e, ALU_AND, REG_P, ~DECIMAL_MODE & 0xFF); break;
+        case MN_SED: emit_alu_imm(e, ALU_OR, REG_P, DECIMAL_MODE); break;
+        case MN_SEI: emit_alu_imm(e, ALU_OR, REG_P, INTERRUPT_DISABLE); break;
+        case MN_CLV: emit_alu_imm(e, ALU_AND, REG_P, ~OVERFLOW & 0xFF); break;
+        case MN_NOP: break;
+        case MN_PHA: emit_push(t, REG_A); break;
+        case MN_PHP:
+            emit_status(e, RAX);
+            emit_alu_imm(e, ALU_OR, RAX, BREAK | BREAK2);
+            emit_push(t, RAX);
+            break;
+        case MN_PLA:
+            // PLA sets N and Z from the pulled value but leaves A alone, as pla() does
+            emit_pull(t);
+            emit_set_nz(e, RAX);
+            break;
+        case MN_JMP:
+            emit_chain(t, false, operand, executed);
+            break;
+        case MN_JSR:
+            emit_mov_imm(e, RDI, (uint16_t)(pc + 2) >> 8);
+            emit_push(t, RDI);
+            emit_mov_imm(e, RDI, (pc + 2) & 0xFF);
+            emit_push(t, RDI);
+            emit_chain(t, false, operand, executed);
+            break;
+        case MN_RTS:
+            emit_pull(t);
+            emit_rm(e, false, false, 0x89, RAX, RSP, -1, 0, FRAME_LOW);
+            emit_pull(t);
+            emit_shift(e, SHIFT_LEFT, RAX, 8);
+            emit_rm(e, false, false, 0x0B, RAX, RSP, -1, 0, FRAME_LOW);
+            emit_rm(e, false, false, 0x8D, RCX, RAX, -1, 0, 1);
+            emit_rr(e, false, false, 0x0FB7, RCX, RCX);
+            emit_chain(t, true, 0, executed);
+            break;
+        default:
+            emit_branch_instruction(t, mnemonic, pc, operand, executed);
+            break;
+    }
+    if(!is_terminator(mnemonic) && touches_memory(op, mnemonic))
+        emit_exit_check(t, next_pc, executed);
+}
+
+static void flush(struct cpu_jit *jit)
+{
+    jit->hot = jit->hot_start;
+    jit->cold = jit->cold_start;
+    jit->block_count = 0;
+    memset(jit->memory_blocks, 0, sizeof(jit->memory_blocks));
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+}
+
+static bool in_memory(const struct cpu_jit *jit, const uint8_t *page)
+{
+    return page >= jit->cpu->memory && page < jit->cpu->memory + sizeof(jit->cpu->memory);
+}
+
+/*
+ * Code may come from pages of cpu->memory, which are watched, or from
+ * memory nothing on the bus writes directly, such as ROM or pages shared
+ * with forks. Memory mapped writable elsewhere is left to the interpreter.
+ */
+static bool is_code_page(const struct cpu_jit *jit, const uint8_t *page)
+{
+    if(page == NULL)
+        return false;
+    return in_memory(jit, page) || !bus_writes_page(&jit->cpu->bus, page);
+}
+
+// Reads a byte of code, adding its page to the block's sources
+static bool fetch(struct cpu_jit *jit, struct jit_block *block, uint16_t address, uint8_t *byte)
+{
+    uint8_t page = address >> 8;
+    uint8_t *memory = jit->cpu->bus.read_pages[page];
+    int source = 0;
+    while(source < block->source_count && (block->pages[source] != page || block->sources[source] != memory))
+        source++;
+    if(source == block->source_count)
+    {
+        if(source == 2 || !is_code_page(jit, memory))
+            return false;
+        block->pages[source] = page;
+        block->sources[source] = memory;
+        block->source_count++;
+    }
+    *byte = memory[address & 0xFF];
+    return true;
+}
+
+static bool is_current(const cpu_t *cpu, const struct jit_block *block)
+{
+    for(int i = 0; i < block->source_count; i++)
+    {
+        if(cpu->bus.read_pages[block->pages[i]] != block->sources[i])
+            return false;
+    }
+    return true;
+}
+
+// Drops the blocks read from a page of cpu->memory when the bus sees it written
+static void jit_watch(void *context, uint8_t *page)
+{
+    struct cpu_jit *jit = context;
+    int index = (page - jit->cpu->memory) / BUS_PAGE_SIZE;
+    struct jit_block *block = jit->memory_blocks[index];
+    while(block != NULL)
+    {
+        if(jit->blocks[block->pc] == block)
+            jit->blocks[block->pc] = NULL;
+        block = block->next[block->sources[0] == page ? 0 : 1];
+    }
+    jit->memory_blocks[index] = NULL;
+}
+
+struct instruction
+{
+    uint16_t pc;
+    uint8_t code;
+    uint16_t operand;
+};
+
+// Decodes up to JIT_BLOCK_INSTRUCTIONS from pc, stopping after a terminator or before anything untranslatable
+static int decode(struct cpu_jit *jit, struct jit_block *block, struct instruction *instructions)
+{
+    uint16_t pc = block->pc;
+    int count = 0;
+    while(count < JIT_BLOCK_INSTRUCTIONS)
+    {
+        uint8_t code;
+        if(!fetch(jit, block, pc, &code))
+            break;
+        const opcode_t *op = opcode_lookup(code);
+        int mnemonic = mnemonics[code];
+        if(!is_translatable(op, mnemonic))
+            break;
+        uint8_t bytes[2] = {0, 0};
+        bool fetched = true;
+        for(int i = 1; i < op->len && fetched; i++)
+            fetched = fetch(jit, block, pc + i, &bytes[i - 1]);
+        if(!fetched)
+            break;
+        instructions[count].pc = pc;
+        instructions[count].code = code;
+        instructions[count].operand = bytes[0] | (uint16_t)bytes[1] << 8;
+        count++;
+        pc += op->len;
+        if(is_terminator(mnemonic))
+            break;
+    }
+    return count;
+}
+
+static void emit_block(struct translation *t, const struct instruction *instructions, int count)
+{
+    struct jit_block *block = t->block;
+    struct emitter *e = &t->hot;
+    block->code = e->p;
+    if(count == 0)
+    {
+        // A marker: nothing here runs, jit_run() hands the instruction to the interpreter
+        emit_store_pc(e, block->pc);
+        emit_jump(e, t->jit->exit_zero);
+        return;
+    }
+
+    // Chained blocks check their sources on entry; jit_run() has already for the first
+    uint8_t *stale = t->cold.p;
+    emit_store_pc(&t->cold, block->pc);
+    emit_jump(&t->cold, t->jit->exit_zero);
+    for(int i = 0; i < block->source_count; i++)
+    {
+        emit_rm(e, true, false, 0x8B, RAX, REG_CPU, -1, 0, READ_PAGES + block->pages[i] * 8);
+        emit_mov_imm64(e, RDX, (uint64_t)(uintptr_t)block->sources[i]);
+        emit_rr(e, true, false, ALU_CMP, RDX, RAX);
+        emit_branch(e, CC_NE, stale);
+    }
+
+    for(int i = 0; i < count; i++)
+    {
+        const opcode_t *op = opcode_lookup(instructions[i].code);
+        if(i < count - 1)
+            block->span += max_cycles(op, mnemonics[instructions[i].code]);
+        emit_instruction(t, instructions[i].pc, instructions[i].code, instructions[i].operand, i);
+    }
+    const struct instruction *last = &instructions[count - 1];
+    if(!is_terminator(mnemonics[last->code]))
+        emit_chain(t, false, last->pc + opcode_lookup(last->code)->len, count);
+}
+
+// The code buffer is never writable and executable at once; it is only written while translating
+static bool set_writable(struct cpu_jit *jit, bool writable)
+{
+    int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+    return mprotect(jit->code, JIT_HOT_SIZE + JIT_COLD_SIZE, protection) == 0;
+}
+
+static struct jit_block *translate(struct cpu_jit *jit, uint16_t pc)
+{
+    if(jit->block_count == JIT_MAX_BLOCKS ||
+       jit->code + JIT_HOT_SIZE - jit->hot < JIT_BLOCK_RESERVE ||
+       jit->code + JIT_HOT_SIZE + JIT_COLD_SIZE - jit->cold < JIT_BLOCK_RESERVE)
+        flush(jit);
+
+    struct jit_block *block = &jit->pool[jit->block_count++];
+    memset(block, 0, sizeof(*block));
+    block->pc = pc;
+    struct instruction instructions[JIT_BLOCK_INSTRUCTIONS];
+    int count = decode(jit, block, instructions);
+    block->count = count;
+    if(count == 0)
+    {
+        // Keep the opcode's page so the marker goes stale with a bank switch
+        block->source_count = 1;
+        block->pages[0] = pc >> 8;
+        block->sources[0] = jit->cpu->bus.read_pages[pc >> 8];
+    }
+
+    struct translation t = {
+        .jit = jit,
+        .hot = {jit->hot, jit->code + JIT_HOT_SIZE, false},
+        .cold = {jit->cold, jit->code + JIT_HOT_SIZE + JIT_COLD_SIZE, false},
+        .block = block,
+        .pending = 0
+    };
+    if(!set_writable(jit, true))
+    {
+        jit->block_count--;
+        return NULL;
+    }
+    emit_block(&t, instructions, count);
+    if(!set_writable(jit, false) || t.hot.overflow || t.cold.overflow)
+    {
+        flush(jit);
+        return NULL;
+    }
+    jit->hot = t.hot.p;
+    jit->cold = t.cold.p;
+
+    for(int i = 0; i < block->source_count; i++)
+    {
+        uint8_t *source = block->sources[i];
+        // A page mirrored at both source pages is listed once
+        if(source == NULL || !in_memory(jit, source) || (i == 1 && block->sources[0] == source))
+            continue;
+        int index = (source - jit->cpu->memory) / BUS_PAGE_SIZE;
+        block->next[i] = jit->memory_blocks[index];
+        jit->memory_blocks[index] = block;
+        bus_watch_page(&jit->cpu->bus, source);
+    }
+    jit->blocks[pc] = block;
+    return block;
+}
+
+struct cpu_jit *jit_create(cpu_t *cpu)
+{
+    struct cpu_jit *jit = calloc(1, sizeof(struct cpu_jit));
+    if(jit == NULL)
+        return NULL;
+    void *code = mmap(NULL, JIT_HOT_SIZE + JIT_COLD_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(code == MAP_FAILED)
+    {
+        free(jit);
+        return NULL;
+    }
+    jit->cpu = cpu;
+    jit->code = code;
+    struct emitter hot = {jit->code, jit->code + JIT_HOT_SIZE, false};
+    struct emitter cold = {jit->code + JIT_HOT_SIZE, jit->code + JIT_HOT_SIZE + JIT_COLD_SIZE, false};
+    emit_stubs(jit, &hot, &cold);
+    jit->hot_start = hot.p;
+    jit->cold_start = cold.p;
+    if(!set_writable(jit, false))
+    {
+        munmap(jit->code, JIT_HOT_SIZE + JIT_COLD_SIZE);
+        free(jit);
+        return NULL;
+    }
+    flush(jit);
+    bus_watch_writes(&cpu->bus, cpu->memory, sizeof(cpu->memory), jit_watch, jit);
+    return jit;
+}
+
+void jit_free(struct cpu_jit *jit)
+{
+    if(jit == NULL)
+        return;
+    bus_watch_writes(&jit->cpu->bus, NULL, 0, NULL, NULL);
+    munmap(jit->code, JIT_HOT_SIZE + JIT_COLD_SIZE);
+    free(jit);
+}
+
+uint64_t jit_run(struct cpu_jit *jit, uint64_t max_instructions)
+{
+    cpu_t *cpu = jit->cpu;
+    struct jit_block *block = jit->blocks[cpu->program_counter];
+    if(block == NULL || !is_current(cpu, block))
+        block = translate(jit, cpu->program_counter);
+    if(block == NULL || block->count == 0)
+        return 0;
+    if(max_instructions != CPU_UNLIMITED && (uint64_t)block->count > max_instructions)
+        return 0;
+    if(cpu->cycles + block->span >= cpu->deadline)
+        return 0;
+    return jit->enter(cpu, block->code, max_instructions == CPU_UNLIMITED);
+}
+
+void jit_flush(struct cpu_jit *jit)
+{
+    if(jit != NULL)
+        flush(jit);
+}
+
+#else
+
+struct cpu_jit *jit_create(cpu_t *cpu)
+{
+    return NULL;
+}
+
+void jit_free(struct cpu_jit *jit)
+{
+}
+
+uint64_t jit_run(struct cpu_jit *jit, uint64_t max_instructions)
+{
+    return 0;
+}
+
+void jit_flush(struct cpu_jit *jit)
+{
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+/*
+ * Dynamic recompiler behind ENGINE_JIT. Basic blocks of 6502 code, ending
+ * at a branch, JMP, JSR or RTS, are translated to x86-64 the first time
+ * they run and cached by address. Translated code keeps A, X, Y, P and
+ * the lazy N and Z result in host registers and jumps straight from one
+ * block into the next while the cycle deadline allows.
+ *
+ * Blocks remember the host pages they were read from and are dropped when
+ * the bus maps different ones there, so bank switches never run stale
+ * code. Pages of cpu->memory holding code are watched on the bus, and the
+ * first write to one drops the blocks read from it; memory written
+ * directly needs cpu_unshare() first, as for forks.
+ *
+ * BRK, RTI, PLP, CLI and JMP indirect are left to the interpreter, which
+ * stays the reference: ENGINE_JIT_CHECKED replays every block on it.
+ */
+
+struct cpu_jit;
+
+// Returns NULL if translated code cannot run on this host
+struct cpu_jit *jit_create(cpu_t *cpu);
+
+void jit_free(struct cpu_jit *jit);
+
+/*
+ * Runs translated code from the CPU's program counter. Only whole blocks
+ * are run: one if max_instructions is limited and the block fits in it,
+ * and as many as the cycle deadline allows otherwise. Returns the
+ * instructions executed, 0 if the next one has to be interpreted.
+ */
+uint64_t jit_run(struct cpu_jit *jit, uint64_t max_instructions);
+
+// Drops every translated block
+void jit_flush(struct cpu_jit *jit);
+
+#endif
@@ -0,0 +1,915 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lockstep.h"
+#include "opcode.h"
+
+#define STACK_BASE 0x0100
+#define VECTOR_LANES 16
+
+#if defined(__GNUC__) && !defined(LOCKSTEP_NO_VECTOR)
+#define LOCKSTEP_VECTOR
+#endif
+
+lockstep_t *lockstep_create(int lanes)
+{
+    if(lanes < 1)
+        return NULL;
+    lockstep_t *lockstep = calloc(1, sizeof(lockstep_t));
+    if(lockstep == NULL)
+        return NULL;
+    int stride = (lanes + VECTOR_LANES - 1) / VECTOR_LANES * VECTOR_LANES;
+    lockstep->lanes = lanes;
+    lockstep->stride = stride;
+    lockstep->reg_a = calloc(stride, 1);
+    lockstep->reg_x = calloc(stride, 1);
+    lockstep->reg_y = calloc(stride, 1);
+    lockstep->reg_status = calloc(stride, 1);
+    lockstep->stack_pointer = calloc(stride, 1);
+    lockstep->program_counter = calloc(stride, sizeof(uint16_t));
+    lockstep->cycles = calloc(stride, sizeof(uint64_t));
+    lockstep->stop_on_brk = calloc(stride, sizeof(bool));
+    lockstep->reasons = calloc(stride, sizeof(enum CPUStopReason));
+    lockstep->deadline = calloc(stride, sizeof(uint64_t));
+    lockstep->instructions = calloc(stride, sizeof(uint64_t));
+    lockstep->running = calloc(stride, sizeof(bool));
+    lockstep->group = calloc(stride, sizeof(int));
+    lockstep->mask = calloc(stride, 1);
+    lockstep->scratch = calloc(stride, 1);
+    lockstep->addresses = calloc(stride, sizeof(uint16_t));
+    lockstep->memory = calloc(stride, 0x10000);
+    if(lockstep->reg_a == NULL || lockstep->reg_x == NULL || lockstep->reg_y == NULL ||
+       lockstep->reg_status == NULL || lockstep->stack_pointer == NULL || lockstep->program_counter == NULL ||
+       lockstep->cycles == NULL || lockstep->stop_on_brk == NULL || lockstep->reasons == NULL ||
+       lockstep->deadline == NULL || lockstep->instructions == NULL || lockstep->running == NULL ||
+       lockstep->group == NULL || lockstep->mask == NULL || lockstep->scratch == NULL ||
+       lockstep->addresses == NULL || lockstep->memory == NULL)
+    {
+        lockstep_free(lockstep);
+        return NULL;
+    }
+    return lockstep;
+}
+
+void lockstep_free(lockstep_t *lockstep)
+{
+    free(lockstep->memory);
+    free(lockstep->addresses);
+    free(lockstep->scratch);
+    free(lockstep->mask);
+    free(lockstep->group);
+    free(lockstep->running);
+    free(lockstep->instructions);
+    free(lockstep->deadline);
+    free(lockstep->reasons);
+    free(lockstep->stop_on_brk);
+    free(lockstep->cycles);
+    free(lockstep->program_counter);
+    free(lockstep->stack_pointer);
+    free(lockstep->reg_status);
+    free(lockstep->reg_y);
+    free(lockstep->reg_x);
+    free(lockstep->reg_a);
+    free(lockstep);
+}
+
+void lockstep_load(lockstep_t *lockstep, int lane, const cpu_t *cpu)
+{
+    lockstep->reg_a[lane] = cpu->reg_a;
+    lockstep->reg_x[lane] = cpu->reg_x;
+    lockstep->reg_y[lane] = cpu->reg_y;
+    lockstep->reg_status[lane] = cpu->reg_status;
+    lockstep->stack_pointer[lane] = cpu->stack_pointer;
+    lockstep->program_counter[lane] = cpu->program_counter;
+    lockstep->cycles[lane] = cpu->cycles;
+    lockstep->stop_on_brk[lane] = cpu->stop_on_brk;
+    uint8_t *memory = &lockstep->memory[lane];
+    for(int page = 0; page < BUS_PAGE_COUNT; page++)
+    {
+        const uint8_t *bytes = cpu_page(cpu, page);
+        for(int offset = 0; offset < BUS_PAGE_SIZE; offset++, memory += lockstep->stride)
+            *memory = bytes[offset];
+    }
+}
+
+void lockstep_store(const lockstep_t *lockstep, int lane, cpu_t *cpu)
+{
+    cpu->reg_a = lockstep->reg_a[lane];
+    cpu->reg_x = lockstep->reg_x[lane];
+    cpu->reg_y = lockstep->reg_y[lane];
+    cpu->reg_status = lockstep->reg_status[lane];
+    cpu->stack_pointer = lockstep->stack_pointer[lane];
+    cpu->program_counter = lockstep->program_counter[lane];
+    cpu->cycles = lockstep->cycles[lane];
+    cpu_unshare(cpu);
+    const uint8_t *memory = &lockstep->memory[lane];
+    for(int address = 0; address < 0x10000; address++, memory += lockstep->stride)
+        cpu->memory[address] = *memory;
+}
+
+static inline uint8_t *lane_byte(lockstep_t *lockstep, int lane, uint16_t address)
+{
+    return &lockstep->memory[(size_t)address * lockstep->stride + lane];
+}
+
+static inline uint16_t lane_word(lockstep_t *lockstep, int lane, uint16_t address)
+{
+    uint8_t lo = *lane_byte(lockstep, lane, address);
+    uint8_t hi = *lane_byte(lockstep, lane, address + 1);
+    return ((uint16_t)hi << 8) | lo;
+}
+
+/*
+ * The helpers below mirror the interpreter in cpu.c, quirks included, with
+ * the program counter still on the opcode and N and Z kept in the status.
+ */
+static inline uint16_t lane_address_at(lockstep_t *lockstep, int lane, enum AddressingMode mode, uint16_t operand)
+{
+    switch(mode)
+    {
+        case IMMEDIATE:
+            return operand;
+        case ZERO_PAGE:
+            return *lane_byte(lockstep, lane, operand);
+        case ZERO_PAGE_X:
+            return *lane_byte(lockstep, lane, operand) + lockstep->reg_x[lane];
+        case ZERO_PAGE_Y:
+            return *lane_byte(lockstep, lane, operand) + lockstep->reg_y[lane];
+        case ABSOLUTE:
+            return lane_word(lockstep, lane, operand);
+        case ABSOLUTE_X:
+            return lane_word(lockstep, lane, operand) + lockstep->reg_x[lane];
+        case ABSOLUTE_Y:
+            return lane_word(lockstep, lane, operand) + lockstep->reg_y[lane];
+        case INDIRECT_X: {
+            uint8_t ptr = *lane_byte(lockstep, lane, operand) + lockstep->reg_x[lane];
+            uint8_t lo = *lane_byte(lockstep, lane, ptr);
+            uint8_t hi = *lane_byte(lockstep, lane, ptr + 1);
+            return ((uint16_t)hi << 8) | lo; }
+        case INDIRECT_Y: {
+            uint8_t base = *lane_byte(lockstep, lane, operand);
+            uint8_t lo = *lane_byte(lockstep, lane, base);
+            uint8_t hi = *lane_byte(lockstep, lane, base + 1);
+            return (((uint16_t)hi << 8) | lo) + lockstep->reg_y[lane]; }
+        default:
+            return 0;
+    }
+}
+
+static inline uint16_t lane_address(lockstep_t *lockstep, int lane, enum AddressingMode mode)
+{
+    return lane_address_at(lockstep, lane, mode, lockstep->program_counter[lane] + 1);
+}
+
+// Indexed reads that cross a page boundary take one extra cycle
+static inline uint8_t *lane_operand(lockstep_t *lockstep, int lane, enum AddressingMode mode)
+{
+    uint16_t address = lane_address(lockstep, lane, mode);
+    if(mode == ABSOLUTE_X || mode == ABSOLUTE_Y || mode == INDIRECT_Y)
+    {
+        uint8_t index = (mode == ABSOLUTE_X) ? lockstep->reg_x[lane] : lockstep->reg_y[lane];
+        uint16_t base = address - index;
+        if((base & 0xFF00) != (address & 0xFF00))
+            lockstep->cycles[lane] += 1;
+    }
+    return lane_byte(lockstep, lane, address);
+}
+
+static inline void set_flags(lockstep_t *lockstep, int lane, uint8_t result)
+{
+    uint8_t status = lockstep->reg_status[lane] & ~(ZERO | NEGATIVE);
+    lockstep->reg_status[lane] = status | (result == 0 ? ZERO : 0) | (result & NEGATIVE);
+}
+
+static inline void set_carry(lockstep_t *lockstep, int lane, uint8_t carry)
+{
+    lockstep->reg_status[lane] = (lockstep->reg_status[lane] & ~CARRY) | carry;
+}
+
+static inline void add_to_reg_a(lockstep_t *lockstep, int lane, uint8_t data)
+{
+    uint8_t a = lockstep->reg_a[lane];
+    uint16_t sum = (uint16_t)a + data + (lockstep->reg_status[lane] & CARRY);
+    uint8_t result = (uint8_t)sum;
+    uint8_t overflow = ((data ^ result) & (result ^ a) & 0x80) >> 1;
+    lockstep->reg_status[lane] = (lockstep->reg_status[lane] & ~(CARRY | OVERFLOW)) | (sum >> 8) | overflow;
+    lockstep->reg_a[lane] = result;
+    set_flags(lockstep, lane, result);
+}
+
+static inline void compare(lockstep_t *lockstep, int lane, enum AddressingMode mode, uint8_t comp)
+{
+    uint8_t data = *lane_operand(lockstep, lane, mode);
+    set_carry(lockstep, lane, data <= comp);
+    set_flags(lockstep, lane, comp - data);
+}
+
+static inline void push(lockstep_t *lockstep, int lane, uint8_t data)
+{
+    *lane_byte(lockstep, lane, STACK_BASE + lockstep->stack_pointer[lane]) = data;
+    lockstep->stack_pointer[lane] -= 1;
+}
+
+static inline uint8_t pull(lockstep_t *lockstep, int lane)
+{
+    lockstep->stack_pointer[lane] += 1;
+    return *lane_byte(lockstep, lane, STACK_BASE + lockstep->stack_pointer[lane]);
+}
+
+static inline void push_16(lockstep_t *lockstep, int lane, uint16_t data)
+{
+    push(lockstep, lane, data >> 8);
+    push(lockstep, lane, data & 0xFF);
+}
+
+static inline uint16_t pull_16(lockstep_t *lockstep, int lane)
+{
+    uint8_t lo = pull(lockstep, lane);
+    uint8_t hi = pull(lockstep, lane);
+    return ((uint16_t)hi << 8) | lo;
+}
+
+// Shifts and rotates of A or memory; carry_in is ORed into the shifted value
+#define SHIFT(name, carry_out, shifted, carry_in) \
+    static inline void name(lockstep_t *lockstep, int lane, enum AddressingMode mode) \
+    { \
+        uint8_t *target = mode == NONE_ADDRESSING ? &lockstep->reg_a[lane] \
+                                                  : lane_byte(lockstep, lane, lane_address(lockstep, lane, mode)); \
+        uint8_t data = *target; \
+        uint8_t in = carry_in; \
+        set_carry(lockstep, lane, carry_out); \
+        data = (shifted) | in; \
+        *target = data; \
+        set_flags(lockstep, lane, data); \
+    }
+
+SHIFT(asl, data >> 7, data << 1, 0)
+SHIFT(lsr, data & 1, data >> 1, 0)
+SHIFT(rol, data >> 7, data << 1, lockstep->reg_status[lane] & CARRY)
+SHIFT(ror, data & 1, data >> 1, (lockstep->reg_status[lane] & CARRY) << 7)
+
+#undef SHIFT
+
+static inline void branch(lockstep_t *lockstep, int lane, bool condition)
+{
+    uint16_t next_pc = lockstep->program_counter[lane] + 2;
+    if(condition)
+    {
+        int8_t offset = (int8_t)*lane_byte(lockstep, lane, next_pc - 1);
+        uint16_t new_pc = next_pc + (uint16_t)offset;
+        lockstep->cycles[lane] += ((next_pc & 0xFF00) != (new_pc & 0xFF00)) ? 2 : 1;
+        next_pc = new_pc;
+    }
+    lockstep->program_counter[lane] = next_pc;
+}
+
+static inline void stop(lockstep_t *lockstep, int lane, enum CPUStopReason reason)
+{
+    lockstep->reasons[lane] = reason;
+    lockstep->running[lane] = false;
+}
+
+/*
+ * One function per mnemonic, stepping a lane past the instruction. They
+ * return true when the lanes of a group may no longer share a program
+ * counter afterwards.
+ */
+#define LANE(name, body) \
+    static inline bool lane_##name(lockstep_t *lockstep, int lane, enum AddressingMode mode, int len) \
+    { \
+        body; \
+        lockstep->program_counter[lane] += len; \
+        return false; \
+    }
+
+#define JUMP_LANE(name, body) \
+    static inline bool lane_##name(lockstep_t *lockstep, int lane, enum AddressingMode mode, int len) \
+    { \
+        body; \
+        return true; \
+    }
+
+#define A lockstep->reg_a[lane]
+#define X lockstep->reg_x[lane]
+#define Y lockstep->reg_y[lane]
+#define P lockstep->reg_status[lane]
+#define SP lockstep->stack_pointer[lane]
+#define PC lockstep->program_counter[lane]
+#define OPERAND (*lane_operand(lockstep, lane, mode))
+#define TARGET (*lane_byte(lockstep, lane, lane_address(lockstep, lane, mode)))
+
+LANE(NOP, )
+LANE(LDA, A = OPERAND; set_flags(lockstep, lane, A))
+LANE(LDX, X = OPERAND; set_flags(lockstep, lane, X))
+LANE(LDY, Y = OPERAND; set_flags(lockstep, lane, Y))
+LANE(STA, TARGET = A)
+LANE(STX, TARGET = X)
+LANE(STY, TARGET = Y)
+LANE(ADC, add_to_reg_a(lockstep, lane, OPERAND))
+LANE(SBC, add_to_reg_a(lockstep, lane, ~OPERAND + 1))
+LANE(AND, A &= OPERAND; set_flags(lockstep, lane, A))
+LANE(EOR, A ^= OPERAND; set_flags(lockstep, lane, A))
+LANE(ORA, A |= OPERAND; set_flags(lockstep, lane, A))
+// N and V are set from the operand but never cleared
+LANE(BIT, uint8_t data = TARGET;
+          P = (P & ~ZERO) | ((A & data) == 0 ? ZERO : 0) | (data & (NEGATIVE | OVERFLOW)))
+LANE(CMP, compare(lockstep, lane, mode, A))
+LANE(CPX, compare(lockstep, lane, mode, X))
+LANE(CPY, compare(lockstep, lane, mode, Y))
+LANE(ASL, asl(lockstep, lane, mode))
+LANE(LSR, lsr(lockstep, lane, mode))
+LANE(ROL, rol(lockstep, lane, mode))
+LANE(ROR, ror(lockstep, lane, mode))
+LANE(INC, uint8_t *target = &TARGET; *target += 1; set_flags(lockstep, lane, *target))
+LANE(DEC, uint8_t *target = &TARGET; *target -= 1; set_flags(lockstep, lane, *target))
+LANE(INX, X += 1; set_flags(lockstep, lane, X))
+LANE(INY, Y += 1; set_flags(lockstep, lane, Y))
+LANE(DEX, X -= 1; set_flags(lockstep, lane, X))
+LANE(DEY, Y -= 1; set_flags(lockstep, lane, Y))
+LANE(TAX, X = A; set_flags(lockstep, lane, X))
+LANE(TAY, Y = A; set_flags(lockstep, lane, Y))
+LANE(TXA, A = X; set_flags(lockstep, lane, A))
+LANE(TYA, A = Y; set_flags(lockstep, lane, A))
+LANE(TSX, X = SP; set_flags(lockstep, lane, X))
+LANE(TXS, SP = X)
+LANE(PHA, push(lockstep, lane, A))
+// PLA sets N and Z from the pulled byte but leaves A alone, as cpu.c does
+LANE(PLA, set_flags(lockstep, lane, pull(lockstep, lane)))
+LANE(PHP, push(lockstep, lane, P | BREAK | BREAK2))
+LANE(PLP, P = (pull(lockstep, lane) & ~BREAK) | BREAK2)
+LANE(CLC, P &= ~CARRY)
+LANE(SEC, P |= CARRY)
+LANE(CLD, P &= ~DECIMAL_MODE)
+LANE(SED, P |= DECIMAL_MODE)
+LANE(CLI, P &= ~INTERRUPT_DISABLE)
+LANE(SEI, P |= INTERRUPT_DISABLE)
+LANE(CLV, P &= ~OVERFLOW)
+JUMP_LANE(JMP,
+    uint16_t address = lane_word(lockstep, lane, PC + 1);
+    if(mode == INDIRECT && (address & 0xFF) == 0xFF)
+        address = ((uint16_t)*lane_byte(lockstep, lane, address & 0xFF00) << 8) | *lane_byte(lockstep, lane, address);
+    else if(mode == INDIRECT)
+        address = lane_word(lockstep, lane, address);
+    PC = address)
+JUMP_LANE(JSR, push_16(lockstep, lane, PC + 2); PC = lane_word(lockstep, lane, PC + 1))
+JUMP_LANE(RTS, PC = pull_16(lockstep, lane) + 1)
+JUMP_LANE(RTI, P = (pull(lockstep, lane) & ~BREAK) | BREAK2; PC = pull_16(lockstep, lane))
+JUMP_LANE(BNE, branch(lockstep, lane, (P & ZERO) == 0))
+JUMP_LANE(BEQ, branch(lockstep, lane, (P & ZERO) != 0))
+JUMP_LANE(BPL, branch(lockstep, lane, (P & NEGATIVE) == 0))
+JUMP_LANE(BMI, branch(lockstep, lane, (P & NEGATIVE) != 0))
+JUMP_LANE(BVC, branch(lockstep, lane, (P & OVERFLOW) == 0))
+JUMP_LANE(BVS, branch(lockstep, lane, (P & OVERFLOW) != 0))
+JUMP_LANE(BCC, branch(lockstep, lane, (P & CARRY) == 0))
+JUMP_LANE(BCS, branch(lockstep, lane, (P & CARRY) != 0))
+// BRK skips the byte after the opcode, so RTI returns to opcode + 2
+JUMP_LANE(BRK,
+    if(lockstep->stop_on_brk[lane])
+    {
+        PC = PC + 1;
+        stop(lockstep, lane, STOP_BRK);
+        return true;
+    }
+    push_16(lockstep, lane, PC + 2);
+    push(lockstep, lane, P | BREAK | BREAK2);
+    P |= INTERRUPT_DISABLE;
+    PC = lane_word(lockstep, lane, IRQ_VECTOR))
+
+#undef A
+#undef X
+#undef Y
+#undef P
+#undef SP
+#undef PC
+#undef OPERAND
+#undef TARGET
+
+typedef bool (*group_handler_t)(lockstep_t *lockstep, const int *group, int count);
+
+// Each opcode steps a whole group with its mode and length baked in
+#define OPCODE(c, n, l, cy, m) \
+    static bool step_##c(lockstep_t *lockstep, const int *group, int count) \
+    { \
+        bool diverged = false; \
+        for(int i = 0; i < count; i++) \
+        { \
+            int lane = group[i]; \
+            lockstep->cycles[lane] += cy; \
+            diverged = lane_##n(lockstep, lane, m, l); \
+        } \
+        return diverged; \
+    }
+#include "opcode_list.h"
+#undef OPCODE
+
+static bool step_illegal(lockstep_t *lockstep, const int *group, int count)
+{
+    for(int i = 0; i < count; i++)
+    {
+        lockstep->program_counter[group[i]] += 1;
+        stop(lockstep, group[i], STOP_ILLEGAL_OPCODE);
+    }
+    return true;
+}
+
+static const group_handler_t handlers[256] = {
+#define OPCODE(c, n, l, cy, m) [c] = step_##c,
+#include "opcode_list.h"
+#undef OPCODE
+};
+
+#ifdef LOCKSTEP_VECTOR
+
+typedef uint8_t vector_t __attribute__((vector_size(VECTOR_LANES)));
+
+static inline vector_t load_vector(const uint8_t *bytes)
+{
+    vector_t vector;
+    memcpy(&vector, bytes, sizeof(vector));
+    return vector;
+}
+
+// Stores vector into the lanes set in mask and leaves the others alone
+static inline void blend_vector(uint8_t *bytes, vector_t vector, vector_t mask)
+{
+    vector = (load_vector(bytes) & ~mask) | (vector & mask);
+    memcpy(bytes, &vector, sizeof(vector));
+}
+
+static inline bool is_clear(vector_t vector)
+{
+    uint64_t halves[2];
+    memcpy(halves, &vector, sizeof(halves));
+    return (halves[0] | halves[1]) == 0;
+}
+
+static inline vector_t vector_flags(vector_t status, vector_t result)
+{
+    return (status & (uint8_t)~(ZERO | NEGATIVE)) | ((vector_t)(result == 0) & ZERO) | (result & NEGATIVE);
+}
+
+/*
+ * A group running in vectors. Its lanes share a program counter, so it is
+ * kept here once, along with the cycles and instructions run since the
+ * group formed; they go back to each lane when the group breaks up.
+ */
+struct wide
+{
+    lockstep_t *lockstep;
+    // A lane of the group, to read bytes every lane shares
+    int first;
+    uint16_t pc;
+    // Operand bytes of the current instruction
+    uint8_t lo;
+    uint8_t hi;
+    uint64_t cycles;
+    // No lane reaches its deadline while cycles stays below this
+    uint64_t slack;
+    uint64_t instructions;
+    // Instructions every lane still has the budget for
+    uint64_t budget;
+};
+
+static inline uint8_t *wide_row(lockstep_t *lockstep, uint16_t address)
+{
+    return &lockstep->memory[(size_t)address * lockstep->stride];
+}
+
+// True if every lane of the group holds the same byte in bytes, which goes to value
+static inline bool wide_uniform(const struct wide *w, const uint8_t *bytes, uint8_t *value)
+{
+    lockstep_t *lockstep = w->lockstep;
+    uint8_t first = bytes[w->first];
+    vector_t differ = {0};
+    for(int base = 0; base < lockstep->stride; base += VECTOR_LANES)
+        differ |= (load_vector(&bytes[base]) ^ first) & load_vector(&lockstep->mask[base]);
+    *value = first;
+    return is_clear(differ);
+}
+
+/*
+ * The operand of every lane: a row of memory when the address is the
+ * same for all of them, else gathered lane by lane into scratch.
+ */
+static inline uint8_t *wide_operands(struct wide *w, enum AddressingMode mode, bool read)
+{
+    lockstep_t *lockstep = w->lockstep;
+    if(mode == IMMEDIATE)
+        return wide_row(lockstep, w->pc + 1);
+    if(mode == ZERO_PAGE)
+        return wide_row(lockstep, w->lo);
+    if(mode == ABSOLUTE)
+        return wide_row(lockstep, ((uint16_t)w->hi << 8) | w->lo);
+    bool crossed = false;
+    for(int lane = 0; lane < lockstep->stride; lane++)
+    {
+        if(lockstep->mask[lane] == 0)
+            continue;
+        uint16_t address = lane_address_at(lockstep, lane, mode, w->pc + 1);
+        // Indexed reads that cross a page boundary take one extra cycle
+        if(read && (mode == ABSOLUTE_X || mode == ABSOLUTE_Y || mode == INDIRECT_Y))
+        {
+            uint8_t index = (mode == ABSOLUTE_X) ? lockstep->reg_x[lane] : lockstep->reg_y[lane];
+            uint16_t base = address - index;
+            if((base & 0xFF00) != (address & 0xFF00))
+            {
+                lockstep->cycles[lane] += 1;
+                crossed = true;
+            }
+        }
+        lockstep->addresses[lane] = address;
+        lockstep->scratch[lane] = *lane_byte(lockstep, lane, address);
+    }
+    // Lanes that paid the extra cycle are one closer to their deadline
+    if(crossed)
+        w->slack -= 1;
+    return lockstep->scratch;
+}
+
+static inline void wide_scatter(struct wide *w, enum AddressingMode mode)
+{
+    lockstep_t *lockstep = w->lockstep;
+    if(mode == IMMEDIATE || mode == ZERO_PAGE || mode == ABSOLUTE)
+        return;
+    for(int lane = 0; lane < lockstep->stride; lane++)
+    {
+        if(lockstep->mask[lane] != 0)
+            *lane_byte(lockstep, lane, lockstep->addresses[lane]) = lockstep->scratch[lane];
+    }
+}
+
+enum WideAccess
+{
+    WIDE_IMPLIED,
+    WIDE_READ,
+    WIDE_MODIFY
+};
+
+/*
+ * One function per mnemonic, running the instruction for a whole group a
+ * vector at a time. The body sees the registers of a vector's lanes in a,
+ * x, y, p and s and their operand in m, and what it leaves there is stored
+ * back for the lanes in the group. prepare may return false before
+ * anything changes, leaving the instruction to the lane by lane path.
+ */
+#define WIDE_INSN(name, access, prepare, body, next) \
+    static inline bool wide_##name(struct wide *w, enum AddressingMode mode, int len) \
+    { \
+        lockstep_t *lockstep = w->lockstep; \
+        prepare; \
+        uint8_t *operands = (access) == WIDE_IMPLIED || mode == NONE_ADDRESSING ? NULL \
+                                                                                  : wide_operands(w, mode, (access) == WIDE_READ); \
+        for(int base = 0; base < lockstep->stride; base += VECTOR_LANES) \
+        { \
+            vector_t mask = load_vector(&lockstep->mask[base]); \
+            vector_t a = load_vector(&lockstep->reg_a[base]); \
+            vector_t x = load_vector(&lockstep->reg_x[base]); \
+            vector_t y = load_vector(&lockstep->reg_y[base]); \
+            vector_t p = load_vector(&lockstep->reg_status[base]); \
+            vector_t s = load_vector(&lockstep->stack_pointer[base]); \
+            vector_t m = operands != NULL ? load_vector(&operands[base]) : a; \
+            body; \
+            blend_vector(&lockstep->reg_a[base], a, mask); \
+            blend_vector(&lockstep->reg_x[base], x, mask); \
+            blend_vector(&lockstep->reg_y[base], y, mask); \
+            blend_vector(&lockstep->reg_status[base], p, mask); \
+            blend_vector(&lockstep->stack_pointer[base], s, mask); \
+            if((access) == WIDE_MODIFY && operands != NULL) \
+                blend_vector(&operands[base], m, mask); \
+        } \
+        if((access) == WIDE_MODIFY && operands != NULL) \
+            wide_scatter(w, mode); \
+        next; \
+        return true; \
+    }
+
+#define WIDE(name, access, body) WIDE_INSN(name, access, , body, w->pc += len)
+
+// Stack accesses share a row of memory when every lane has the same stack pointer
+#define STACK(offset) \
+    uint8_t sp; \
+    if(!wide_uniform(w, lockstep->stack_pointer, &sp)) \
+        return false; \
+    uint8_t *top = wide_row(lockstep, STACK_BASE + (uint8_t)(sp + (offset)))
+
+#define ADD(data) \
+    vector_t d = data; \
+    vector_t r = a + d + (p & CARRY); \
+    vector_t carry = ((a & d) | ((a | d) & ~r)) >> 7; \
+    vector_t overflow = ((d ^ r) & (r ^ a) & 0x80) >> 1; \
+    p = (p & (uint8_t)~(CARRY | OVERFLOW)) | carry | overflow; \
+    a = r; \
+    p = vector_flags(p, a)
+
+#define COMPARE(reg) \
+    p = (p & (uint8_t)~CARRY) | ((vector_t)(m <= reg) & CARRY); \
+    p = vector_flags(p, reg - m)
+
+#define SHIFT(carry_out, shifted, carry_in) \
+    vector_t v = mode == NONE_ADDRESSING ? a : m; \
+    vector_t in = carry_in; \
+    p = (p & (uint8_t)~CARRY) | (carry_out); \
+    v = (shifted) | in; \
+    p = vector_flags(p, v); \
+    if(mode == NONE_ADDRESSING) \
+        a = v; \
+    else \
+        m = v
+
+WIDE(NOP, WIDE_IMPLIED, )
+WIDE(LDA, WIDE_READ, a = m; p = vector_flags(p, a))
+WIDE(LDX, WIDE_READ, x = m; p = vector_flags(p, x))
+WIDE(LDY, WIDE_READ, y = m; p = vector_flags(p, y))
+WIDE(STA, WIDE_MODIFY, m = a)
+WIDE(STX, WIDE_MODIFY, m = x)
+WIDE(STY, WIDE_MODIFY, m = y)
+WIDE(ADC, WIDE_READ, ADD(m))
+WIDE(SBC, WIDE_READ, ADD(~m + 1))
+WIDE(AND, WIDE_READ, a &= m; p = vector_flags(p, a))
+WIDE(EOR, WIDE_READ, a ^= m; p = vector_flags(p, a))
+WIDE(ORA, WIDE_READ, a |= m; p = vector_flags(p, a))
+WIDE(BIT, WIDE_READ, p = (p & (uint8_t)~ZERO) | ((vector_t)((a & m) == 0) & ZERO) | (m & (NEGATIVE | OVERFLOW)))
+WIDE(CMP, WIDE_READ, COMPARE(a))
+WIDE(CPX, WIDE_READ, COMPARE(x))
+WIDE(CPY, WIDE_READ, COMPARE(y))
+WIDE(ASL, WIDE_MODIFY, SHIFT(v >> 7, v << 1, (vector_t){0}))
+WIDE(LSR, WIDE_MODIFY, SHIFT(v & 1, v >> 1, (vector_t){0}))
+WIDE(ROL, WIDE_MODIFY, SHIFT(v >> 7, v << 1, p & CARRY))
+WIDE(ROR, WIDE_MODIFY, SHIFT(v & 1, v >> 1, (p & CARRY) << 7))
+WIDE(INC, WIDE_MODIFY, m += 1; p = vector_flags(p, m))
+WIDE(DEC, WIDE_MODIFY, m -= 1; p = vector_flags(p, m))
+WIDE(INX, WIDE_IMPLIED, x += 1; p = vector_flags(p, x))
+WIDE(INY, WIDE_IMPLIED, y += 1; p = vector_flags(p, y))
+WIDE(DEX, WIDE_IMPLIED, x -= 1; p = vector_flags(p, x))
+WIDE(DEY, WIDE_IMPLIED, y -= 1; p = vector_flags(p, y))
+WIDE(TAX, WIDE_IMPLIED, x = a; p = vector_flags(p, x))
+WIDE(TAY, WIDE_IMPLIED, y = a; p = vector_flags(p, y))
+WIDE(TXA, WIDE_IMPLIED, a = x; p = vector_flags(p, a))
+WIDE(TYA, WIDE_IMPLIED, a = y; p = vector_flags(p, a))
+WIDE(TSX, WIDE_IMPLIED, x = s; p = vector_flags(p, x))
+WIDE(TXS, WIDE_IMPLIED, s = x)
+WIDE_INSN(PHA, WIDE_IMPLIED, STACK(0), blend_vector(&top[base], a, mask); s -= 1, w->pc += len)
+WIDE_INSN(PLA, WIDE_IMPLIED, STACK(1), p = vector_flags(p, load_vector(&top[base])); s += 1, w->pc += len)
+WIDE_INSN(PHP, WIDE_IMPLIED, STACK(0), blend_vector(&top[base], p | (BREAK | BREAK2), mask); s -= 1, w->pc += len)
+WIDE_INSN(PLP, WIDE_IMPLIED, STACK(1), p = (load_vector(&top[base]) & (uint8_t)~BREAK) | BREAK2; s += 1, w->pc += len)
+WIDE(CLC, WIDE_IMPLIED, p &= (uint8_t)~CARRY)
+WIDE(SEC, WIDE_IMPLIED, p |= CARRY)
+WIDE(CLD, WIDE_IMPLIED, p &= (uint8_t)~DECIMAL_MODE)
+WIDE(SED, WIDE_IMPLIED, p |= DECIMAL_MODE)
+WIDE(CLI, WIDE_IMPLIED, p &= (uint8_t)~INTERRUPT_DISABLE)
+WIDE(SEI, WIDE_IMPLIED, p |= INTERRUPT_DISABLE)
+WIDE(CLV, WIDE_IMPLIED, p &= (uint8_t)~OVERFLOW)
+
+static inline bool wide_JMP(struct wide *w, enum AddressingMode mode, int len)
+{
+    uint16_t address = ((uint16_t)w->hi << 8) | w->lo;
+    if(mode == INDIRECT)
+    {
+        // The pointer's high byte does not carry into the next page
+        uint16_t hi_address = (address & 0xFF) == 0xFF ? address & 0xFF00 : address + 1;
+        uint8_t lo, hi;
+        if(!wide_uniform(w, wide_row(w->lockstep, address), &lo) ||
+           !wide_uniform(w, wide_row(w->lockstep, hi_address), &hi))
+            return false;
+        address = ((uint16_t)hi << 8) | lo;
+    }
+    w->pc = address;
+    return true;
+}
+
+// The target is read after the push, which may have overwritten it with the same bytes in every lane
+WIDE_INSN(JSR, WIDE_IMPLIED, STACK(0); uint8_t *below = wide_row(lockstep, STACK_BASE + (uint8_t)(sp - 1));
+                             uint16_t next = w->pc + 2,
+          blend_vector(&top[base], (vector_t){0} + (uint8_t)(next >> 8), mask);
+          blend_vector(&below[base], (vector_t){0} + (uint8_t)next, mask);
+          s -= 2,
+          w->pc = lane_word(lockstep, w->first, w->pc + 1))
+
+WIDE_INSN(RTS, WIDE_IMPLIED, STACK(1); uint8_t lo; uint8_t hi;
+                             if(!wide_uniform(w, top, &lo) ||
+                                !wide_uniform(w, wide_row(lockstep, STACK_BASE + (uint8_t)(sp + 2)), &hi))
+                                 return false,
+          s += 2,
+          w->pc = (((uint16_t)hi << 8) | lo) + 1)
+
+// A branch runs in vectors only when every lane of the group goes the same way
+#define WIDE_BRANCH(name, flag, set) \
+    static inline bool wide_##name(struct wide *w, enum AddressingMode mode, int len) \
+    { \
+        lockstep_t *lockstep = w->lockstep; \
+        vector_t taken = {0}; \
+        vector_t skipped = {0}; \
+        for(int base = 0; base < lockstep->stride; base += VECTOR_LANES) \
+        { \
+            vector_t mask = load_vector(&lockstep->mask[base]); \
+            vector_t bit = (vector_t)((load_vector(&lockstep->reg_status[base]) & (flag)) != 0); \
+            taken |= ((set) ? bit : ~bit) & mask; \
+            skipped |= ((set) ? ~bit : bit) & mask; \
+        } \
+        if(!is_clear(taken) && !is_clear(skipped)) \
+            return false; \
+        uint16_t next_pc = w->pc + 2; \
+        if(!is_clear(taken)) \
+        { \
+            uint16_t new_pc = next_pc + (uint16_t)(int8_t)w->lo; \
+            w->cycles += ((next_pc & 0xFF00) != (new_pc & 0xFF00)) ? 2 : 1; \
+            next_pc = new_pc; \
+        } \
+        w->pc = next_pc; \
+        return true; \
+    }
+
+WIDE_BRANCH(BNE, ZERO, false)
+WIDE_BRANCH(BEQ, ZERO, true)
+WIDE_BRANCH(BPL, NEGATIVE, false)
+WIDE_BRANCH(BMI, NEGATIVE, true)
+WIDE_BRANCH(BVC, OVERFLOW, false)
+WIDE_BRANCH(BVS, OVERFLOW, true)
+WIDE_BRANCH(BCC, CARRY, false)
+WIDE_BRANCH(BCS, CARRY, true)
+
+// Left to the lane by lane path
+static inline bool wide_BRK(struct wide *w, enum AddressingMode mode, int len)
+{
+    return false;
+}
+
+static inline bool wide_RTI(struct wide *w, enum AddressingMode mode, int len)
+{
+    return false;
+}
+
+#undef WIDE_INSN
+#undef WIDE
+#undef STACK
+#undef ADD
+#undef COMPARE
+#undef SHIFT
+#undef WIDE_BRANCH
+
+typedef bool (*wide_handler_t)(struct wide *w);
+
+// Operand bytes have to match across the group as well as the opcode
+#define OPCODE(c, n, l, cy, m) \
+    static bool wide_step_##c(struct wide *w) \
+    { \
+        if(l > 1 && !wide_uniform(w, wide_row(w->lockstep, w->pc + 1), &w->lo)) \
+            return false; \
+        if(l > 2 && !wide_uniform(w, wide_row(w->lockstep, w->pc + 2), &w->hi)) \
+            return false; \
+        if(!wide_##n(w, m, l)) \
+            return false; \
+        w->cycles += cy; \
+        return true; \
+    }
+#include "opcode_list.h"
+#undef OPCODE
+
+static const wide_handler_t wide_handlers[256] = {
+#define OPCODE(c, n, l, cy, m) [c] = wide_step_##c,
+#include "opcode_list.h"
+#undef OPCODE
+};
+
+// Groups with fewer than one lane in this many step lane by lane; vectors would carry mostly idle lanes
+#define WIDE_SHARE 8
+
+/*
+ * Runs a group in vectors for as long as its lanes share a program
+ * counter and none of them is near a limit; returns the instructions run.
+ */
+static uint64_t run_wide(lockstep_t *lockstep, const int *group, int count, uint16_t pc)
+{
+    struct wide w = {lockstep, group[0], pc, 0, 0, 0, UINT64_MAX, 0, UINT64_MAX};
+    memset(lockstep->mask, 0, lockstep->stride);
+    for(int i = 0; i < count; i++)
+    {
+        int lane = group[i];
+        lockstep->mask[lane] = 0xFF;
+        uint64_t cycles = lockstep->cycles[lane];
+        uint64_t slack = cycles < lockstep->deadline[lane] ? lockstep->deadline[lane] - cycles : 0;
+        if(slack < w.slack)
+            w.slack = slack;
+        if(lockstep->instructions[lane] < w.budget)
+            w.budget = lockstep->instructions[lane];
+    }
+    while(w.cycles < w.slack && w.instructions < w.budget)
+    {
+        uint8_t code;
+        if(!wide_uniform(&w, wide_row(lockstep, w.pc), &code) || wide_handlers[code] == NULL ||
+           !wide_handlers[code](&w))
+            break;
+        w.instructions++;
+    }
+    for(int i = 0; i < count; i++)
+    {
+        int lane = group[i];
+        lockstep->cycles[lane] += w.cycles;
+        lockstep->instructions[lane] -= w.instructions;
+        lockstep->program_counter[lane] = w.pc;
+    }
+    return w.instructions;
+}
+
+#endif
+
+// Drops the stopped lanes from a group; its size if the rest still share a program counter, 0 otherwise
+static int regroup(lockstep_t *lockstep, int *group, int count)
+{
+    int kept = 0;
+    for(int i = 0; i < count; i++)
+    {
+        if(lockstep->running[group[i]])
+            group[kept++] = group[i];
+    }
+    for(int i = 1; i < kept; i++)
+    {
+        if(lockstep->program_counter[group[i]] != lockstep->program_counter[group[0]])
+            return 0;
+    }
+    return kept;
+}
+
+/*
+ * A group runs straight-line code together until a branch or jump. It
+ * carries on if every running lane is in it and they all went the same
+ * way; otherwise it is rebuilt from the lanes at the lowest program
+ * counter. Lanes stop at their own instruction boundaries exactly as the
+ * interpreter's run loop does.
+ */
+void lockstep_run(lockstep_t *lockstep, uint64_t max_instructions, uint64_t max_cycles)
+{
+    int lanes = lockstep->lanes;
+    int *group = lockstep->group;
+    for(int lane = 0; lane < lanes; lane++)
+    {
+        uint64_t cycles = lockstep->cycles[lane];
+        lockstep->deadline[lane] = (max_cycles > UINT64_MAX - cycles) ? UINT64_MAX : cycles + max_cycles;
+        lockstep->instructions[lane] = max_instructions;
+        lockstep->running[lane] = true;
+    }
+
+    int count = 0;
+    // Running lanes left out of the group when it was built
+    int waiting = 0;
+    uint16_t pc = 0;
+    while(true)
+    {
+        if(count == 0)
+        {
+            int running = 0;
+            for(int lane = 0; lane < lanes; lane++)
+            {
+                if(lockstep->running[lane] && (running++ == 0 || lockstep->program_counter[lane] < pc))
+                    pc = lockstep->program_counter[lane];
+            }
+            if(running == 0)
+                return;
+            for(int lane = 0; lane < lanes; lane++)
+            {
+                if(lockstep->running[lane] && lockstep->program_counter[lane] == pc)
+                    group[count++] = lane;
+            }
+            waiting = running - count;
+        }
+
+#ifdef LOCKSTEP_VECTOR
+        if(count > 1 && count * WIDE_SHARE >= lanes && run_wide(lockstep, group, count, pc) > 0)
+        {
+            count = 0;
+            continue;
+        }
+#endif
+
+        const uint8_t *opcodes = &lockstep->memory[(size_t)pc * lockstep->stride];
+        uint8_t code = opcodes[group[0]];
+        bool split = false;
+        int ready = 0;
+        for(int i = 0; i < count; i++)
+        {
+            int lane = group[i];
+            if(opcodes[lane] != code)
+                split = true;
+            else if(lockstep->cycles[lane] >= lockstep->deadline[lane])
+                stop(lockstep, lane, STOP_CYCLE_LIMIT);
+            else if(lockstep->instructions[lane]-- == 0)
+                stop(lockstep, lane, STOP_INSTRUCTION_LIMIT);
+            else
+                group[ready++] = lane;
+        }
+        if(ready == 0 || split)
+        {
+            // Lanes with another opcode here wait for the next rebuild
+            if(ready > 0)
+                (handlers[code] != NULL ? handlers[code] : step_illegal)(lockstep, group, ready);
+            count = 0;
+            continue;
+        }
+
+        group_handler_t handler = handlers[code] != NULL ? handlers[code] : step_illegal;
+        count = ready;
+        if(handler(lockstep, group, ready))
+            count = waiting == 0 ? regroup(lockstep, group, ready) : 0;
+        if(count > 0)
+            pc = lockstep->program_counter[group[0]];
+    }
+}
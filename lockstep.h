@@ -0,0 +1,71 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/*
+ * Many copies of a program run together, one lane each. Registers are
+ * kept one array per register and memory is interleaved, the byte at
+ * address for lane l living at memory[address * stride + l], so lanes
+ * running the same instruction touch neighbouring bytes. Lanes sharing a
+ * program counter and opcode are decoded once and stepped as a group;
+ * after a branch or jump they regroup by program counter, the lowest
+ * first so lanes that went ahead wait for the rest to catch up. Large
+ * groups run 16 lanes to a vector with GCC's vector extensions, which
+ * build to SSE2 on x86-64 and NEON on ARM; with -DLOCKSTEP_NO_VECTOR or
+ * other compilers every lane steps on its own.
+ *
+ * Each lane runs exactly as cpu_run_for() on a plain init_cpu() CPU would:
+ * 64KB of flat memory, no bus handlers and no interrupt lines.
+ */
+struct lockstep
+{
+    int lanes;
+    // lanes rounded up to whole vectors; the length of each array and memory row
+    int stride;
+    uint8_t *reg_a;
+    uint8_t *reg_x;
+    uint8_t *reg_y;
+    uint8_t *reg_status;
+    uint8_t *stack_pointer;
+    uint16_t *program_counter;
+    uint64_t *cycles;
+    bool *stop_on_brk;
+    // Why each lane stopped in the last lockstep_run()
+    enum CPUStopReason *reasons;
+
+    uint64_t *deadline;
+    uint64_t *instructions;
+    bool *running;
+    // Lanes stepping through the current instruction
+    int *group;
+    // 0xFF for each lane of a group running in vectors
+    uint8_t *mask;
+    // Operands gathered lane by lane, and where from
+    uint8_t *scratch;
+    uint16_t *addresses;
+    uint8_t *memory;
+};
+
+typedef struct lockstep lockstep_t;
+
+// Returns NULL on allocation failure
+lockstep_t *lockstep_create(int lanes);
+
+void lockstep_free(lockstep_t *lockstep);
+
+// Copies the registers, cycles and memory of cpu into lane; pending interrupts are not carried
+void lockstep_load(lockstep_t *lockstep, int lane, const cpu_t *cpu);
+
+// Copies lane back into cpu's registers and memory
+void lockstep_store(const lockstep_t *lockstep, int lane, cpu_t *cpu);
+
+/*
+ * Runs every lane as cpu_run_for(cpu, max_instructions, max_cycles)
+ * would, until each has stopped; reasons holds why.
+ */
+void lockstep_run(lockstep_t *lockstep, uint64_t max_instructions, uint64_t max_cycles);
+
+#endif
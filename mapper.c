@@ -0,0 +1,246 @@
+#include <stddef.h>
+#include "cartridge.h"
+#include "mapper.h"
+#include "scheduler.h"
+
+/* Mapper 0: NROM. 16KB or 32KB PRG, 8KB CHR, no registers. */
+
+static void nrom_power_on(cartridge_t *cart)
+{
+    cartridge_map_prg(cart, 0x8000, PRG_BANK_SIZE, 0);
+    cartridge_map_prg(cart, 0xC000, PRG_BANK_SIZE, -1);
+}
+
+/* Mapper 1: MMC1. Registers are loaded one bit per write through a 5-bit shift register. */
+
+static void mmc1_update_banks(cartridge_t *cart)
+{
+    uint8_t control = cart->state.mmc1.control;
+    uint8_t prg_bank = cart->state.mmc1.prg_bank & 0x0F;
+
+    static const enum Mirroring mirroring[4] = {
+        MIRROR_SINGLE_LOW, MIRROR_SINGLE_HIGH, MIRROR_VERTICAL, MIRROR_HORIZONTAL
+    };
+    if(cart->mirroring != MIRROR_FOUR_SCREEN)
+        cart->mirroring = mirroring[control & 0x03];
+
+    switch((control >> 2) & 0x03)
+    {
+        case 0:
+        case 1:
+            cartridge_map_prg(cart, 0x8000, 2 * PRG_BANK_SIZE, prg_bank >> 1);
+            break;
+        case 2:
+            cartridge_map_prg(cart, 0x8000, PRG_BANK_SIZE, 0);
+            cartridge_map_prg(cart, 0xC000, PRG_BANK_SIZE, prg_bank);
+            break;
+        case 3:
+            cartridge_map_prg(cart, 0x8000, PRG_BANK_SIZE, prg_bank);
+            cartridge_map_prg(cart, 0xC000, PRG_BANK_SIZE, -1);
+            break;
+    }
+
+    if(control & 0x10)
+    {
+        cartridge_map_chr(cart, 0x0000, 0x1000, cart->state.mmc1.chr_bank[0]);
+        cartridge_map_chr(cart, 0x1000, 0x1000, cart->state.mmc1.chr_bank[1]);
+    }
+    else
+    {
+        cartridge_map_chr(cart, 0x0000, CHR_BANK_SIZE, cart->state.mmc1.chr_bank[0] >> 1);
+    }
+}
+
+static void mmc1_power_on(cartridge_t *cart)
+{
+    cart->state.mmc1.shift = 0;
+    cart->state.mmc1.shift_count = 0;
+    cart->state.mmc1.control = 0x0C;
+    cart->state.mmc1.chr_bank[0] = 0;
+    cart->state.mmc1.chr_bank[1] = 0;
+    cart->state.mmc1.prg_bank = 0;
+    mmc1_update_banks(cart);
+}
+
+static void mmc1_write(cartridge_t *cart, uint16_t address, uint8_t data)
+{
+    if(data & 0x80)
+    {
+        cart->state.mmc1.shift = 0;
+        cart->state.mmc1.shift_count = 0;
+        cart->state.mmc1.control |= 0x0C;
+        mmc1_update_banks(cart);
+        return;
+    }
+
+    cart->state.mmc1.shift |= (data & 1) << cart->state.mmc1.shift_count;
+    cart->state.mmc1.shift_count += 1;
+    if(cart->state.mmc1.shift_count < 5)
+        return;
+
+    uint8_t value = cart->state.mmc1.shift;
+    switch((address >> 13) & 0x03)
+    {
+        case 0:
+            cart->state.mmc1.control = value;
+            break;
+        case 1:
+            cart->state.mmc1.chr_bank[0] = value;
+            break;
+        case 2:
+            cart->state.mmc1.chr_bank[1] = value;
+            break;
+        case 3:
+            cart->state.mmc1.prg_bank = value;
+            break;
+    }
+    cart->state.mmc1.shift = 0;
+    cart->state.mmc1.shift_count = 0;
+    mmc1_update_banks(cart);
+}
+
+/* Mapper 2: UxROM. Switchable 16KB at $8000, last bank fixed at $C000. */
+
+static void uxrom_write(cartridge_t *cart, uint16_t address, uint8_t data)
+{
+    cartridge_map_prg(cart, 0x8000, PRG_BANK_SIZE, data);
+}
+
+/* Mapper 3: CNROM. Fixed PRG, switchable 8KB CHR. */
+
+static void cnrom_write(cartridge_t *cart, uint16_t address, uint8_t data)
+{
+    cartridge_map_chr(cart, 0x0000, CHR_BANK_SIZE, data);
+}
+
+/* Mapper 4: MMC3. 8KB PRG and 1KB/2KB CHR banks, plus a scanline IRQ counter. */
+
+static void mmc3_update_banks(cartridge_t *cart)
+{
+    uint8_t *banks = cart->state.mmc3.banks;
+    uint8_t bank_select = cart->state.mmc3.bank_select;
+
+    if(bank_select & 0x40)
+    {
+        cartridge_map_prg(cart, 0x8000, 0x2000, -2);
+        cartridge_map_prg(cart, 0xC000, 0x2000, banks[6]);
+    }
+    else
+    {
+        cartridge_map_prg(cart, 0x8000, 0x2000, banks[6]);
+        cartridge_map_prg(cart, 0xC000, 0x2000, -2);
+    }
+    cartridge_map_prg(cart, 0xA000, 0x2000, banks[7]);
+    cartridge_map_prg(cart, 0xE000, 0x2000, -1);
+
+    // A12 inversion swaps the 2KB and 1KB halves of the pattern tables
+    uint16_t invert = (bank_select & 0x80) ? 0x1000 : 0x0000;
+    cartridge_map_chr(cart, 0x0000 ^ invert, 0x800, banks[0] >> 1);
+    cartridge_map_chr(cart, 0x0800 ^ invert, 0x800, banks[1] >> 1);
+    cartridge_map_chr(cart, 0x1000 ^ invert, 0x400, banks[2]);
+    cartridge_map_chr(cart, 0x1400 ^ invert, 0x400, banks[3]);
+    cartridge_map_chr(cart, 0x1800 ^ invert, 0x400, banks[4]);
+    cartridge_map_chr(cart, 0x1C00 ^ invert, 0x400, banks[5]);
+}
+
+// The cartridge's IRQ output drives the CPU's IRQ line
+static void mmc3_set_irq(cartridge_t *cart, bool level)
+{
+    cart->irq = level;
+    if(cart->cpu != NULL)
+        cpu_irq(cart->cpu, IRQ_MAPPER, level);
+}
+
+static void mmc3_power_on(cartridge_t *cart)
+{
+    static const uint8_t initial_banks[8] = {0, 2, 4, 5, 6, 7, 0, 1};
+    for(int i = 0; i < 8; i++)
+        cart->state.mmc3.banks[i] = initial_banks[i];
+    cart->state.mmc3.bank_select = 0;
+    cart->state.mmc3.irq_latch = 0;
+    cart->state.mmc3.irq_counter = 0;
+    cart->state.mmc3.irq_reload = false;
+    cart->state.mmc3.irq_enabled = false;
+    mmc3_set_irq(cart, false);
+    mmc3_update_banks(cart);
+}
+
+static void mmc3_write(cartridge_t *cart, uint16_t address, uint8_t data)
+{
+    bool odd = address & 1;
+    switch(address & 0xE000)
+    {
+        case 0x8000:
+            if(odd)
+                cart->state.mmc3.banks[cart->state.mmc3.bank_select & 0x07] = data;
+            else
+                cart->state.mmc3.bank_select = data;
+            mmc3_update_banks(cart);
+            break;
+        case 0xA000:
+            if(!odd && cart->mirroring != MIRROR_FOUR_SCREEN)
+                cart->mirroring = (data & 1) ? MIRROR_HORIZONTAL : MIRROR_VERTICAL;
+            break;
+        case 0xC000:
+            if(odd)
+            {
+                cart->state.mmc3.irq_counter = 0;
+                cart->state.mmc3.irq_reload = true;
+            }
+            else
+            {
+                cart->state.mmc3.irq_latch = data;
+            }
+            break;
+        case 0xE000:
+            cart->state.mmc3.irq_enabled = odd;
+            if(!odd)
+                mmc3_set_irq(cart, false);
+            break;
+    }
+    if(address >= 0xC000 && cart->cpu != NULL)
+        scheduler_reschedule(cart->cpu->scheduler, SOURCE_MAPPER_IRQ);
+}
+
+static void mmc3_scanline(cartridge_t *cart)
+{
+    if(cart->state.mmc3.irq_counter == 0 || cart->state.mmc3.irq_reload)
+    {
+        cart->state.mmc3.irq_counter = cart->state.mmc3.irq_latch;
+        cart->state.mmc3.irq_reload = false;
+    }
+    else
+    {
+        cart->state.mmc3.irq_counter -= 1;
+    }
+    if(cart->state.mmc3.irq_counter == 0 && cart->state.mmc3.irq_enabled)
+        mmc3_set_irq(cart, true);
+}
+
+// The counter reloads on the clock after reaching 0 and raises the IRQ when it reaches 0 again
+static int mmc3_irq_clocks(const cartridge_t *cart)
+{
+    if(!cart->state.mmc3.irq_enabled)
+        return 0;
+    if(cart->state.mmc3.irq_counter == 0 || cart->state.mmc3.irq_reload)
+        return cart->state.mmc3.irq_latch + 1;
+    return cart->state.mmc3.irq_counter;
+}
+
+static const struct mapper mappers[] = {
+    {0, "NROM", nrom_power_on, NULL, NULL, NULL},
+    {1, "MMC1", mmc1_power_on, mmc1_write, NULL, NULL},
+    {2, "UxROM", nrom_power_on, uxrom_write, NULL, NULL},
+    {3, "CNROM", nrom_power_on, cnrom_write, NULL, NULL},
+    {4, "MMC3", mmc3_power_on, mmc3_write, mmc3_scanline, mmc3_irq_clocks},
+};
+
+const struct mapper *mapper_find(uint16_t number)
+{
+    for(size_t i = 0; i < sizeof(mappers) / sizeof(mappers[0]); i++)
+    {
+        if(mappers[i].number == number)
+            return &mappers[i];
+    }
+    return NULL;
+}
@@ -0,0 +1,28 @@
+#ifndef MAPPER_H
+#define MAPPER_H
+
+#include <stdint.h>
+
+struct cartridge;
+
+/*
+ * Bank switching is done by repointing bus pages and CHR bank pointers on
+ * register writes, so reads from banked PRG stay plain pointer loads.
+ * scanline and irq_clocks are NULL for boards without a scanline counter;
+ * irq_clocks returns how many more scanline clocks raise the IRQ, 0 if
+ * none will.
+ */
+struct mapper
+{
+    uint16_t number;
+    const char *name;
+    void (*power_on)(struct cartridge *cart);
+    void (*write)(struct cartridge *cart, uint16_t address, uint8_t data);
+    void (*scanline)(struct cartridge *cart);
+    int (*irq_clocks)(const struct cartridge *cart);
+};
+
+// Returns NULL for unsupported mapper numbers
+const struct mapper *mapper_find(uint16_t number);
+
+#endif
@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include "nes.h"
+
+// $4000-$40FF: APU and I/O registers, with OAM DMA at $4014
+static uint8_t io_read(void *context, uint16_t address)
+{
+    nes_t *nes = context;
+    if(address == 0x4015)
+        return apu_read_status(&nes->apu);
+    return 0;
+}
+
+static void io_write(void *context, uint16_t address, uint8_t data)
+{
+    nes_t *nes = context;
+    if(address == 0x4014)
+        ppu_oam_dma(&nes->ppu, data);
+    else if(address <= 0x4013 || address == 0x4015 || address == 0x4017)
+        apu_write(&nes->apu, address, data);
+}
+
+// Only $4015 changes without a write; the rest read as 0
+static uint64_t io_stable(void *context, uint16_t address)
+{
+    nes_t *nes = context;
+    if(address == 0x4015)
+        return apu_status_stable_until(&nes->apu);
+    return UINT64_MAX;
+}
+
+static void sync_ppu(void *context)
+{
+    ppu_catch_up(context);
+}
+
+static uint64_t next_vblank(void *context)
+{
+    return ppu_next_event(context);
+}
+
+static uint64_t next_mapper_irq(void *context)
+{
+    return ppu_next_mapper_irq(context);
+}
+
+static void sync_apu(void *context)
+{
+    apu_catch_up(context);
+}
+
+static uint64_t next_apu_irq(void *context)
+{
+    return apu_next_event(context);
+}
+
+nes_t *nes_create(cartridge_t *cart)
+{
+    nes_t *nes = (nes_t *)calloc(1, sizeof(nes_t));
+    if(nes == NULL)
+        return NULL;
+    nes->cpu = init_cpu();
+    if(nes->cpu == NULL)
+    {
+        free(nes);
+        return NULL;
+    }
+    nes->cpu->stop_on_brk = false;
+    nes->cart = cart;
+    cartridge_insert(cart, nes->cpu);
+    ppu_init(&nes->ppu, nes->cpu, cart);
+    apu_init(&nes->apu, nes->cpu);
+    bus_map_handler(&nes->cpu->bus, 0x4000, 0x100, io_read, io_write, nes);
+    bus_map_stable(&nes->cpu->bus, 0x4000, 0x100, io_stable);
+    // The PPU clocks the mapper, so catching it up also raises the mapper's IRQ
+    scheduler_init(&nes->scheduler, nes->cpu);
+    scheduler_set(&nes->scheduler, SOURCE_PPU, &nes->ppu, sync_ppu, next_vblank);
+    scheduler_set(&nes->scheduler, SOURCE_APU, &nes->apu, sync_apu, next_apu_irq);
+    scheduler_set(&nes->scheduler, SOURCE_MAPPER_IRQ, &nes->ppu, sync_ppu, next_mapper_irq);
+    nes->cpu->scheduler = &nes->scheduler;
+    return nes;
+}
+
+void nes_free(nes_t *nes)
+{
+    free_cpu(nes->cpu);
+    free(nes);
+}
+
+// Runs until cpu->cycles reaches deadline, or a frame completes if stop_at_frame is set
+static enum CPUStopReason run_until(nes_t *nes, uint64_t deadline, bool stop_at_frame)
+{
+    cpu_t *cpu = nes->cpu;
+    uint64_t frame = nes->ppu.frames;
+    // Callers may have changed devices directly since the last run
+    for(int source = 0; source < SCHEDULER_SOURCES; source++)
+        scheduler_reschedule(&nes->scheduler, source);
+    enum CPUStopReason reason = STOP_CYCLE_LIMIT;
+    while(true)
+    {
+        scheduler_run_due(&nes->scheduler);
+        if((stop_at_frame && nes->ppu.frames != frame) || cpu->cycles >= deadline)
+            break;
+        uint64_t next = scheduler_next_due(&nes->scheduler);
+        if(deadline < next)
+            next = deadline;
+        reason = cpu_run_for(cpu, CPU_UNLIMITED, next - cpu->cycles);
+        if(reason != STOP_CYCLE_LIMIT)
+            break;
+    }
+    scheduler_sync_all(&nes->scheduler);
+    apu_flush(&nes->apu);
+    return reason;
+}
+
+enum CPUStopReason nes_run_frame(nes_t *nes)
+{
+    return run_until(nes, UINT64_MAX, true);
+}
+
+enum CPUStopReason nes_run_cycles(nes_t *nes, uint64_t cycles)
+{
+    uint64_t now = nes->cpu->cycles;
+    return run_until(nes, (cycles > UINT64_MAX - now) ? UINT64_MAX : now + cycles, false);
+}
@@ -0,0 +1,41 @@
+#ifndef NES_H
+#define NES_H
+
+#include "apu.h"
+#include "cartridge.h"
+#include "cpu.h"
+#include "ppu.h"
+#include "scheduler.h"
+
+/*
+ * A whole console: CPU, PPU, APU and a cartridge. The CPU runs in slices
+ * that end at the next device event in scheduler, so no device costs
+ * anything per instruction.
+ */
+struct nes
+{
+    cpu_t *cpu;
+    cartridge_t *cart;
+    ppu_t ppu;
+    apu_t apu;
+    scheduler_t scheduler;
+};
+
+typedef struct nes nes_t;
+
+// Inserts cart into a new console and powers it on; the cartridge is not owned. NULL if out of memory
+nes_t *nes_create(cartridge_t *cart);
+
+void nes_free(nes_t *nes);
+
+/*
+ * Runs until the PPU completes a frame, leaving it in ppu.framebuffer and
+ * the frame's audio in the APU's ring, if one is set. Returns
+ * STOP_CYCLE_LIMIT normally, or why the CPU stopped early.
+ */
+enum CPUStopReason nes_run_frame(nes_t *nes);
+
+// Runs for at least cycles CPU cycles, stopping early only if the CPU does
+enum CPUStopReason nes_run_cycles(nes_t *nes, uint64_t cycles);
+
+#endif
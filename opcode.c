@@ -1,6 +1,6 @@
 #include "opcode.h"
 
-opcode_t opcode_new(uint8_t code, char *name, int len, int cycles, enum AddressingMode mode)
+opcode_t opcode_new(uint8_t code, const char *name, int len, int cycles, enum AddressingMode mode)
 {
     opcode_t op;
     op.code = code;
@@ -11,165 +11,13 @@ opcode_t opcode_new(uint8_t code, char *name, int len, int cycles, enum Addressi
     return op;
 }
 
-static opcode_t codes[256];
+static const opcode_t codes[256] CACHE_ALIGNED = {
+#define OPCODE(c, n, l, cy, m) [c] = { .code = c, .len = l, .cycles = cy, .mode = m, .name = #n },
+#include "opcode_list.h"
+#undef OPCODE
+};
 
-void fill_codes()
+const opcode_t *opcode_lookup(uint8_t code)
 {
-    codes[0x00] = opcode_new(0x00, "BRK", 1, 7, NONE_ADDRESSING);
-    codes[0xea] = opcode_new(0xea, "NOP", 1, 2, NONE_ADDRESSING);
-    codes[0x69] = opcode_new(0x69, "ADC", 2, 2, IMMEDIATE);
-    codes[0x65] = opcode_new(0x65, "ADC", 2, 3, ZERO_PAGE);
-    codes[0x75] = opcode_new(0x75, "ADC", 2, 4, ZERO_PAGE_X);
-    codes[0x6d] = opcode_new(0x6d, "ADC", 3, 4, ABSOLUTE);
-    codes[0x7d] = opcode_new(0x7d, "ADC", 3, 4, ABSOLUTE_X);
-    codes[0x79] = opcode_new(0x79, "ADC", 3, 4, ABSOLUTE_Y);
-    codes[0x61] = opcode_new(0x61, "ADC", 2, 6, INDIRECT_X);
-    codes[0x71] = opcode_new(0x71, "ADC", 2, 5, INDIRECT_Y);
-    codes[0x29] = opcode_new(0x29, "AND", 2, 2, IMMEDIATE);
-    codes[0x25] = opcode_new(0x25, "AND", 2, 3, ZERO_PAGE);
-    codes[0x35] = opcode_new(0x35, "AND", 2, 4, ZERO_PAGE_X);
-    codes[0x2d] = opcode_new(0x2d, "AND", 3, 4, ABSOLUTE);
-    codes[0x3d] = opcode_new(0x3d, "AND", 3, 4, ABSOLUTE_X);
-    codes[0x39] = opcode_new(0x39, "AND", 3, 4, ABSOLUTE_Y);
-    codes[0x21] = opcode_new(0x21, "AND", 2, 6, INDIRECT_X);
-    codes[0x31] = opcode_new(0x31, "AND", 2, 5, INDIRECT_Y);
-    codes[0x0a] = opcode_new(0x0a, "ASL", 1, 2, NONE_ADDRESSING);
-    codes[0x06] = opcode_new(0x06, "ASL", 2, 5, ZERO_PAGE);
-    codes[0x16] = opcode_new(0x16, "ASL", 2, 6, ZERO_PAGE_X);
-    codes[0x0e] = opcode_new(0x0e, "ASL", 3, 6, ABSOLUTE);
-    codes[0x1e] = opcode_new(0x1e, "ASL", 3, 7, ABSOLUTE_X);
-    codes[0x90] = opcode_new(0x90, "BCC", 2, 2, NONE_ADDRESSING);
-    codes[0xb0] = opcode_new(0xb0, "BCS", 2, 2, NONE_ADDRESSING);
-    codes[0xf0] = opcode_new(0xf0, "BEQ", 2, 2, NONE_ADDRESSING);
-    codes[0x24] = opcode_new(0x24, "BIT", 2, 3, ZERO_PAGE);
-    codes[0x2c] = opcode_new(0x2c, "BIT", 3, 4, ABSOLUTE);
-    codes[0x30] = opcode_new(0x30, "BMI", 2, 2, NONE_ADDRESSING);
-    codes[0xd0] = opcode_new(0xd0, "BNE", 2, 2, NONE_ADDRESSING);
-    codes[0x10] = opcode_new(0x10, "BPL", 2, 2, NONE_ADDRESSING);
-    codes[0x50] = opcode_new(0x50, "BVC", 2, 2, NONE_ADDRESSING);
-    codes[0x70] = opcode_new(0x70, "BVS", 2, 2, NONE_ADDRESSING);
-    codes[0x18] = opcode_new(0x18, "CLC", 1, 2, NONE_ADDRESSING);
-    codes[0xd8] = opcode_new(0xd8, "CLD", 1, 2, NONE_ADDRESSING);
-    codes[0x58] = opcode_new(0x58, "CLI", 1, 2, NONE_ADDRESSING);
-    codes[0xb8] = opcode_new(0xb8, "CLV", 1, 2, NONE_ADDRESSING);
-    codes[0xc9] = opcode_new(0xc9, "CMP", 2, 2, IMMEDIATE);
-    codes[0xc5] = opcode_new(0xc5, "CMP", 2, 3, ZERO_PAGE);
-    codes[0xd5] = opcode_new(0xd5, "CMP", 2, 4, ZERO_PAGE_X);
-    codes[0xcd] = opcode_new(0xcd, "CMP", 3, 4, ABSOLUTE);
-    codes[0xdd] = opcode_new(0xdd, "CMP", 3, 4, ABSOLUTE_X);
-    codes[0xd9] = opcode_new(0xd9, "CMP", 3, 4, ABSOLUTE_Y);
-    codes[0xc1] = opcode_new(0xc1, "CMP", 2, 6, INDIRECT_X);
-    codes[0xd1] = opcode_new(0xd1, "CMP", 2, 5, INDIRECT_Y);
-    codes[0xe0] = opcode_new(0xe0, "CPX", 2, 2, IMMEDIATE);
-    codes[0xe4] = opcode_new(0xe4, "CPX", 2, 3, ZERO_PAGE);
-    codes[0xec] = opcode_new(0xec, "CPX", 3, 4, ABSOLUTE);
-    codes[0xc0] = opcode_new(0xc0, "CPY", 2, 2, IMMEDIATE);
-    codes[0xc4] = opcode_new(0xc4, "CPY", 2, 3, ZERO_PAGE);
-    codes[0xcc] = opcode_new(0xcc, "CPY", 3, 4, ABSOLUTE);
-    codes[0xc6] = opcode_new(0xc6, "DEC", 2, 5, ZERO_PAGE);
-    codes[0xd6] = opcode_new(0xd6, "DEC", 2, 6, ZERO_PAGE_X);
-    codes[0xce] = opcode_new(0xce, "DEC", 3, 6, ABSOLUTE);
-    codes[0xde] = opcode_new(0xde, "DEC", 3, 7, ABSOLUTE_X);
-    codes[0xca] = opcode_new(0xca, "DEX", 1, 2, NONE_ADDRESSING);
-    codes[0x88] = opcode_new(0x88, "DEY", 1, 2, NONE_ADDRESSING);
-    codes[0x49] = opcode_new(0x49, "EOR", 2, 2, IMMEDIATE);
-    codes[0x45] = opcode_new(0x45, "EOR", 2, 3, ZERO_PAGE);
-    codes[0x55] = opcode_new(0x55, "EOR", 2, 4, ZERO_PAGE_X);
-    codes[0x4d] = opcode_new(0x4d, "EOR", 3, 4, ABSOLUTE);
-    codes[0x5d] = opcode_new(0x5d, "EOR", 3, 4, ABSOLUTE_X);
-    codes[0x59] = opcode_new(0x59, "EOR", 3, 4, ABSOLUTE_Y);
-    codes[0x41] = opcode_new(0x41, "EOR", 2, 6, INDIRECT_X);
-    codes[0x51] = opcode_new(0x51, "EOR", 2, 5, INDIRECT_Y);
-    codes[0xe6] = opcode_new(0xe6, "INC", 2, 5, ZERO_PAGE);
-    codes[0xf6] = opcode_new(0xf6, "INC", 2, 6, ZERO_PAGE_X);
-    codes[0xee] = opcode_new(0xee, "INC", 3, 6, ABSOLUTE);
-    codes[0xfe] = opcode_new(0xfe, "INC", 3, 7, ABSOLUTE_X);
-    codes[0xe8] = opcode_new(0xe8, "INX", 1, 2, NONE_ADDRESSING);
-    codes[0xc8] = opcode_new(0xc8, "INY", 1, 2, NONE_ADDRESSING);
-    codes[0x4c] = opcode_new(0x4c, "JMP", 3, 3, ABSOLUTE);
-    codes[0x6c] = opcode_new(0x6c, "JMP", 3, 5, INDIRECT);
-    codes[0x20] = opcode_new(0x20, "JSR", 3, 6, ABSOLUTE);
-    codes[0xa9] = opcode_new(0xa9, "LDA", 2, 2, IMMEDIATE);
-    codes[0xa5] = opcode_new(0xa5, "LDA", 2, 3, ZERO_PAGE);
-    codes[0xb5] = opcode_new(0xb5, "LDA", 2, 4, ZERO_PAGE_X);
-    codes[0xad] = opcode_new(0xad, "LDA", 3, 4, ABSOLUTE);
-    codes[0xbd] = opcode_new(0xbd, "LDA", 3, 4, ABSOLUTE_X);
-    codes[0xb9] = opcode_new(0xb9, "LDA", 3, 4, ABSOLUTE_Y);
-    codes[0xa1] = opcode_new(0xa1, "LDA", 2, 6, INDIRECT_X);
-    codes[0xb1] = opcode_new(0xb1, "LDA", 2, 5, INDIRECT_Y);
-    codes[0xa2] = opcode_new(0xa2, "LDX", 2, 2, IMMEDIATE);
-    codes[0xa6] = opcode_new(0xa6, "LDX", 2, 3, ZERO_PAGE);
-    codes[0xb6] = opcode_new(0xb6, "LDX", 2, 4, ZERO_PAGE_Y);
-    codes[0xae] = opcode_new(0xae, "LDX", 3, 4, ABSOLUTE);
-    codes[0xbe] = opcode_new(0xbe, "LDX", 3, 4, ABSOLUTE_Y);
-    codes[0xa0] = opcode_new(0xa0, "LDY", 2, 2, IMMEDIATE);
-    codes[0xa4] = opcode_new(0xa4, "LDY", 2, 3, ZERO_PAGE);
-    codes[0xb4] = opcode_new(0xb4, "LDY", 2, 4, ZERO_PAGE_X);
-    codes[0xac] = opcode_new(0xac, "LDY", 3, 4, ABSOLUTE);
-    codes[0xbc] = opcode_new(0xbc, "LDY", 3, 4, ABSOLUTE_X);
-    codes[0x4a] = opcode_new(0x4a, "LSR", 1, 2, NONE_ADDRESSING);
-    codes[0x46] = opcode_new(0x46, "LSR", 2, 5, ZERO_PAGE);
-    codes[0x56] = opcode_new(0x56, "LSR", 2, 6, ZERO_PAGE_X);
-    codes[0x4e] = opcode_new(0x4e, "LSR", 3, 6, ABSOLUTE);
-    codes[0x5e] = opcode_new(0x5e, "LSR", 3, 7, ABSOLUTE_X);
-    codes[0x09] = opcode_new(0x09, "ORA", 2, 2, IMMEDIATE);
-    codes[0x05] = opcode_new(0x05, "ORA", 2, 3, ZERO_PAGE);
-    codes[0x15] = opcode_new(0x15, "ORA", 2, 4, ZERO_PAGE_X);
-    codes[0x0d] = opcode_new(0x0d, "ORA", 3, 4, ABSOLUTE);
-    codes[0x1d] = opcode_new(0x1d, "ORA", 3, 4, ABSOLUTE_X);
-    codes[0x19] = opcode_new(0x19, "ORA", 3, 4, ABSOLUTE_Y);
-    codes[0x01] = opcode_new(0x01, "ORA", 2, 6, INDIRECT_X);
-    codes[0x11] = opcode_new(0x11, "ORA", 2, 5, INDIRECT_Y);
-    codes[0x48] = opcode_new(0x48, "PHA", 1, 3, NONE_ADDRESSING);
-    codes[0x08] = opcode_new(0x08, "PHP", 1, 3, NONE_ADDRESSING);
-    codes[0x68] = opcode_new(0x68, "PLA", 1, 4, NONE_ADDRESSING);
-    codes[0x28] = opcode_new(0x28, "PLP", 1, 4, NONE_ADDRESSING);
-    codes[0x2a] = opcode_new(0x2a, "ROL", 1, 2, NONE_ADDRESSING);
-    codes[0x26] = opcode_new(0x26, "ROL", 2, 5, ZERO_PAGE);
-    codes[0x36] = opcode_new(0x36, "ROL", 2, 6, ZERO_PAGE_X);
-    codes[0x2e] = opcode_new(0x2e, "ROL", 3, 6, ABSOLUTE);
-    codes[0x3e] = opcode_new(0x3e, "ROL", 3, 7, ABSOLUTE_X);
-    codes[0x6a] = opcode_new(0x6a, "ROR", 1, 2, NONE_ADDRESSING);
-    codes[0x66] = opcode_new(0x66, "ROR", 2, 5, ZERO_PAGE);
-    codes[0x76] = opcode_new(0x76, "ROR", 2, 6, ZERO_PAGE_X);
-    codes[0x6e] = opcode_new(0x6e, "ROR", 3, 6, ABSOLUTE);
-    codes[0x7e] = opcode_new(0x7e, "ROR", 3, 7, ABSOLUTE_X);
-    codes[0x40] = opcode_new(0x40, "RTI", 1, 6, NONE_ADDRESSING);
-    codes[0x60] = opcode_new(0x60, "RTS", 1, 6, NONE_ADDRESSING);
-    codes[0xe9] = opcode_new(0xe9, "SBC", 2, 2, IMMEDIATE);
-    codes[0xe5] = opcode_new(0xe5, "SBC", 2, 3, ZERO_PAGE);
-    codes[0xf5] = opcode_new(0xf5, "SBC", 2, 4, ZERO_PAGE_X);
-    codes[0xed] = opcode_new(0xed, "SBC", 3, 4, ABSOLUTE);
-    codes[0xfd] = opcode_new(0xfd, "SBC", 3, 4, ABSOLUTE_X);
-    codes[0xf9] = opcode_new(0xf9, "SBC", 3, 4, ABSOLUTE_Y);
-    codes[0xe1] = opcode_new(0xe1, "SBC", 2, 6, INDIRECT_X);
-    codes[0xf1] = opcode_new(0xf1, "SBC", 2, 5, INDIRECT_Y);
-    codes[0x38] = opcode_new(0x38, "SEC", 1, 2, NONE_ADDRESSING);
-    codes[0xf8] = opcode_new(0xf8, "SED", 1, 2, NONE_ADDRESSING);
-    codes[0x78] = opcode_new(0x78, "SEI", 1, 2, NONE_ADDRESSING);
-    codes[0x85] = opcode_new(0x85, "STA", 2, 3, ZERO_PAGE);
-    codes[0x95] = opcode_new(0x95, "STA", 2, 4, ZERO_PAGE_X);
-    codes[0x8d] = opcode_new(0x8d, "STA", 3, 4, ABSOLUTE);
-    codes[0x9d] = opcode_new(0x9d, "STA", 3, 5, ABSOLUTE_X);
-    codes[0x99] = opcode_new(0x99, "STA", 3, 5, ABSOLUTE_Y);
-    codes[0x81] = opcode_new(0x81, "STA", 2, 6, INDIRECT_X);
-    codes[0x91] = opcode_new(0x91, "STA", 2, 6, INDIRECT_Y);
-    codes[0x86] = opcode_new(0x86, "STX", 2, 3, ZERO_PAGE);
-    codes[0x96] = opcode_new(0x96, "STX", 2, 4, ZERO_PAGE_Y);
-    codes[0x8e] = opcode_new(0x8e, "STX", 3, 4, ABSOLUTE);
-    codes[0x84] = opcode_new(0x84, "STY", 2, 3, ZERO_PAGE);
-    codes[0x94] = opcode_new(0x94, "STY", 2, 4, ZERO_PAGE_X);
-    codes[0x8c] = opcode_new(0x8c, "STY", 3, 4, ABSOLUTE);
-    codes[0xaa] = opcode_new(0xaa, "TAX", 1, 2, NONE_ADDRESSING);
-    codes[0xa8] = opcode_new(0xa8, "TAY", 1, 2, NONE_ADDRESSING);
-    codes[0xba] = opcode_new(0xba, "TSX", 1, 2, NONE_ADDRESSING);
-    codes[0x8a] = opcode_new(0x8a, "TXA", 1, 2, NONE_ADDRESSING);
-    codes[0x9a] = opcode_new(0x9a, "TXS", 1, 2, NONE_ADDRESSING);
-    codes[0x98] = opcode_new(0x98, "TYA", 1, 2, NONE_ADDRESSING);
+    return &codes[code];
 }
-
-opcode_t opcode_lookup(uint8_t code)
-{
-    fill_codes();
-    return codes[code];
-}
\ No newline at end of file
@@ -1,6 +1,15 @@
+#ifndef OPCODE_H
+#define OPCODE_H
+
 #include <stdint.h>
 #include <string.h>
 
+#if defined(__GNUC__)
+#define CACHE_ALIGNED __attribute__((aligned(64)))
+#else
+#define CACHE_ALIGNED
+#endif
+
 enum AddressingMode
 {
     IMMEDIATE,
@@ -16,15 +25,29 @@ enum AddressingMode
     NONE_ADDRESSING
 };
 
+// The instruction of each row of opcode_list.h, as MN_##mnemonic
+enum Mnemonic {
+    MN_NONE,
+    MN_ADC, MN_AND, MN_ASL, MN_BCC, MN_BCS, MN_BEQ, MN_BIT, MN_BMI, MN_BNE, MN_BPL, MN_BRK, MN_BVC,
+    MN_BVS, MN_CLC, MN_CLD, MN_CLI, MN_CLV, MN_CMP, MN_CPX, MN_CPY, MN_DEC, MN_DEX, MN_DEY, MN_EOR,
+    MN_INC, MN_INX, MN_INY, MN_JMP, MN_JSR, MN_LDA, MN_LDX, MN_LDY, MN_LSR, MN_NOP, MN_ORA, MN_PHA,
+    MN_PHP, MN_PLA, MN_PLP, MN_ROL, MN_ROR, MN_RTI, MN_RTS, MN_SBC, MN_SEC, MN_SED, MN_SEI, MN_STA,
+    MN_STX, MN_STY, MN_TAX, MN_TAY, MN_TSX, MN_TXA, MN_TXS, MN_TYA
+};
+
+// Packed to 16 bytes so four entries share a cache line
 typedef struct OpCode
 {
     uint8_t code;
-    char *name;
-    int len;
-    int cycles;
+    uint8_t len;
+    uint8_t cycles;
     enum AddressingMode mode;
+    const char *name;
 } opcode_t;
 
-opcode_t opcode_new(uint8_t code, char *name, int len, int cycles, enum AddressingMode mode);
+opcode_t opcode_new(uint8_t code, const char *name, int len, int cycles, enum AddressingMode mode);
+
+// Unimplemented opcodes return an entry with a NULL name and a code of 0x00
+const opcode_t *opcode_lookup(uint8_t code);
 
-opcode_t opcode_lookup(uint8_t code);
\ No newline at end of file
+#endif
@@ -0,0 +1,571 @@
+#include <string.h>
+#include "ppu.h"
+#include "scheduler.h"
+
+#define SPRITE_BEHIND 0x40
+#define SPRITE_ZERO 0x80
+
+/*
+ * Tile rows are decoded eight pixels at a time in a uint64_t, one byte per
+ * pixel in screen order. spread_plane() moves bit n of a pattern byte into
+ * the low bit of byte n's slot, picked by `order`.
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define PIXEL_ORDER 0x8040201008040201ULL
+#define PIXEL_ORDER_FLIPPED 0x0102040810204080ULL
+#else
+#define PIXEL_ORDER 0x0102040810204080ULL
+#define PIXEL_ORDER_FLIPPED 0x8040201008040201ULL
+#endif
+#define EACH_BYTE(x) ((x) * 0x0101010101010101ULL)
+
+static inline uint64_t spread_plane(uint8_t bits, uint64_t order)
+{
+    uint64_t selected = EACH_BYTE((uint64_t)bits) & order;
+    return ((selected + EACH_BYTE(0x7FULL)) >> 7) & EACH_BYTE(1ULL);
+}
+
+// Palette-relative color (palette << 2 | pixel) of each pixel; transparent pixels are 0
+static inline uint64_t decode_tile_row(uint8_t low, uint8_t high, uint8_t palette, bool flip)
+{
+    uint64_t order = flip ? PIXEL_ORDER_FLIPPED : PIXEL_ORDER;
+    uint64_t pixels = spread_plane(low, order) | (spread_plane(high, order) << 1);
+    uint64_t opaque = spread_plane(low | high, order) * 0xFF;
+    return pixels | (EACH_BYTE((uint64_t)palette << 2) & opaque);
+}
+
+static inline uint8_t *nametable(ppu_t *ppu, uint16_t address)
+{
+    static const uint8_t layout[5][4] = {
+        [MIRROR_HORIZONTAL] = {0, 0, 1, 1},
+        [MIRROR_VERTICAL] = {0, 1, 0, 1},
+        [MIRROR_FOUR_SCREEN] = {0, 1, 2, 3},
+        [MIRROR_SINGLE_LOW] = {0, 0, 0, 0},
+        [MIRROR_SINGLE_HIGH] = {1, 1, 1, 1},
+    };
+    int table = layout[ppu->cart->mirroring][(address >> 10) & 3];
+    return &ppu->vram[table * 0x400 + (address & 0x3FF)];
+}
+
+static inline uint8_t chr_read(ppu_t *ppu, uint16_t address)
+{
+    return ppu->cart->chr_banks[address >> 10][address & 0x3FF];
+}
+
+// $3F10/$3F14/$3F18/$3F1C are mirrors of $3F00/$3F04/$3F08/$3F0C
+static inline int palette_index(uint16_t address)
+{
+    int index = address & 0x1F;
+    if((index & 0x13) == 0x10)
+        index &= ~0x10;
+    return index;
+}
+
+uint8_t ppu_read(ppu_t *ppu, uint16_t address)
+{
+    address &= 0x3FFF;
+    if(address < 0x2000)
+        return chr_read(ppu, address);
+    if(address < 0x3F00)
+        return *nametable(ppu, address);
+    return ppu->palette[palette_index(address)];
+}
+
+void ppu_write(ppu_t *ppu, uint16_t address, uint8_t data)
+{
+    address &= 0x3FFF;
+    if(address < 0x2000)
+    {
+        if(ppu->cart->chr_rom == NULL)
+            ppu->cart->chr_banks[address >> 10][address & 0x3FF] = data;
+    }
+    else if(address < 0x3F00)
+    {
+        *nametable(ppu, address) = data;
+    }
+    else
+    {
+        ppu->palette[palette_index(address)] = data & 0x3F;
+    }
+}
+
+static inline bool rendering_enabled(const ppu_t *ppu)
+{
+    return (ppu->mask & (MASK_BACKGROUND | MASK_SPRITES)) != 0;
+}
+
+// The row of the background tile at v that the current line shows
+static inline uint64_t background_tile(ppu_t *ppu, uint16_t v)
+{
+    uint16_t table = (ppu->ctrl & CTRL_BACKGROUND_TABLE) ? 0x1000 : 0x0000;
+    uint8_t tile = *nametable(ppu, 0x2000 | (v & 0x0FFF));
+    uint8_t attribute = *nametable(ppu, 0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07));
+    uint8_t palette = (attribute >> (((v >> 4) & 4) | (v & 2))) & 3;
+    uint16_t pattern = table + tile * 16 + ((v >> 12) & 7);
+    return decode_tile_row(chr_read(ppu, pattern), chr_read(ppu, pattern + 8), palette, false);
+}
+
+// Moves v right by count tiles, wrapping into the next horizontal nametable
+static inline uint16_t increment_x(uint16_t v, int count)
+{
+    int coarse_x = (v & 0x001F) + count;
+    if(coarse_x >= 32)
+        return ((v & ~0x001F) ^ 0x0400) | (coarse_x - 32);
+    return (v & ~0x001F) | coarse_x;
+}
+
+// Fills line with 256 background pixels starting at the scroll position in v
+static void render_background(ppu_t *ppu, uint8_t *line)
+{
+    uint8_t tiles[33 * 8];
+    uint16_t v = ppu->v;
+    for(int i = 0; i < 33; i++)
+    {
+        uint64_t pixels = background_tile(ppu, v);
+        memcpy(&tiles[i * 8], &pixels, 8);
+        v = increment_x(v, 1);
+    }
+    memcpy(line, &tiles[ppu->fine_x], PPU_WIDTH);
+}
+
+// Row row of sprite, counted down from its top before flipping
+static inline uint64_t sprite_row(ppu_t *ppu, const uint8_t *sprite, int row, int height)
+{
+    uint8_t tile = sprite[1];
+    uint8_t attributes = sprite[2];
+    if(attributes & 0x80)
+        row = height - 1 - row;
+    uint16_t pattern;
+    if(height == 16)
+        pattern = (tile & 1) * 0x1000 + (tile & 0xFE) * 16 + (row & 8) * 2 + (row & 7);
+    else
+        pattern = ((ppu->ctrl & CTRL_SPRITE_TABLE) ? 0x1000 : 0x0000) + tile * 16 + row;
+    return decode_tile_row(chr_read(ppu, pattern), chr_read(ppu, pattern + 8),
+                           4 | (attributes & 3), attributes & 0x40);
+}
+
+/*
+ * Evaluates and draws the first eight sprites on scanline y into line.
+ * Each pixel is 0x10 | palette-relative color, plus SPRITE_BEHIND and
+ * SPRITE_ZERO flags; earlier sprites win over later ones.
+ */
+static void render_sprites(ppu_t *ppu, int y, uint8_t *line)
+{
+    int height = (ppu->ctrl & CTRL_SPRITE_8X16) ? 16 : 8;
+    int count = 0;
+    memset(line, 0, PPU_WIDTH);
+    for(int i = 0; i < 64; i++)
+    {
+        const uint8_t *sprite = &ppu->oam[i * 4];
+        // Sprites are drawn one line below their OAM Y coordinate
+        int row = y - 1 - sprite[0];
+        if(row < 0 || row >= height)
+            continue;
+        if(count == 8)
+        {
+            ppu->status |= STATUS_SPRITE_OVERFLOW;
+            break;
+        }
+        count += 1;
+
+        uint64_t row_pixels = sprite_row(ppu, sprite, row, height);
+        uint8_t pixels[8];
+        memcpy(pixels, &row_pixels, 8);
+        uint8_t flags = ((sprite[2] & 0x20) ? SPRITE_BEHIND : 0) | (i == 0 ? SPRITE_ZERO : 0);
+        for(int p = 0; p < 8 && sprite[3] + p < PPU_WIDTH; p++)
+        {
+            if(pixels[p] != 0 && line[sprite[3] + p] == 0)
+                line[sprite[3] + p] = pixels[p] | flags;
+        }
+    }
+}
+
+/*
+ * What drawing line y would show the game, without drawing it: sprite
+ * overflow, and sprite 0 hit from only the background pixels under
+ * sprite 0.
+ */
+static void evaluate_scanline(ppu_t *ppu, int y)
+{
+    if(!(ppu->mask & MASK_SPRITES))
+        return;
+    int height = (ppu->ctrl & CTRL_SPRITE_8X16) ? 16 : 8;
+    int count = 0;
+    for(int i = 0; i < 64 && !(ppu->status & STATUS_SPRITE_OVERFLOW); i++)
+    {
+        int row = y - 1 - ppu->oam[i * 4];
+        if(row < 0 || row >= height)
+            continue;
+        if(count == 8)
+            ppu->status |= STATUS_SPRITE_OVERFLOW;
+        count += 1;
+    }
+
+    const uint8_t *sprite = ppu->oam;
+    int row = y - 1 - sprite[0];
+    if(!(ppu->mask & MASK_BACKGROUND) || (ppu->status & STATUS_SPRITE_ZERO_HIT) || row < 0 || row >= height)
+        return;
+    uint64_t row_pixels = sprite_row(ppu, sprite, row, height);
+    uint8_t pixels[8];
+    memcpy(pixels, &row_pixels, 8);
+    bool clip_left = (ppu->mask & (MASK_BACKGROUND_LEFT | MASK_SPRITES_LEFT)) !=
+                     (MASK_BACKGROUND_LEFT | MASK_SPRITES_LEFT);
+    int loaded = -1;
+    uint8_t tile[8];
+    for(int p = 0; p < 8 && sprite[3] + p < PPU_WIDTH - 1; p++)
+    {
+        int x = sprite[3] + p;
+        if(pixels[p] == 0 || (x < 8 && clip_left))
+            continue;
+        int column = ppu->fine_x + x;
+        if(column / 8 != loaded)
+        {
+            uint64_t tile_pixels = background_tile(ppu, increment_x(ppu->v, column / 8));
+            memcpy(tile, &tile_pixels, 8);
+            loaded = column / 8;
+        }
+        if(tile[column % 8] != 0)
+        {
+            ppu->status |= STATUS_SPRITE_ZERO_HIT;
+            return;
+        }
+    }
+}
+
+static void render_scanline(ppu_t *ppu, int y)
+{
+    if(ppu->skip_pixels)
+    {
+        evaluate_scanline(ppu, y);
+        return;
+    }
+    uint8_t *out = ppu->framebuffer[y];
+    uint8_t grey = (ppu->mask & MASK_GREYSCALE) ? 0x30 : 0x3F;
+    if(!rendering_enabled(ppu))
+    {
+        memset(out, ppu->palette[0] & grey, PPU_WIDTH);
+        return;
+    }
+
+    uint8_t background[PPU_WIDTH] = {0};
+    uint8_t sprites[PPU_WIDTH] = {0};
+    if(ppu->mask & MASK_BACKGROUND)
+    {
+        render_background(ppu, background);
+        if(!(ppu->mask & MASK_BACKGROUND_LEFT))
+            memset(background, 0, 8);
+    }
+    if(ppu->mask & MASK_SPRITES)
+    {
+        render_sprites(ppu, y, sprites);
+        if(!(ppu->mask & MASK_SPRITES_LEFT))
+            memset(sprites, 0, 8);
+    }
+
+    for(int x = 0; x < PPU_WIDTH; x++)
+    {
+        uint8_t bg = background[x];
+        uint8_t sprite = sprites[x];
+        int color = bg;
+        if(sprite != 0)
+        {
+            if((sprite & SPRITE_ZERO) && bg != 0 && x != 255)
+                ppu->status |= STATUS_SPRITE_ZERO_HIT;
+            if(!(sprite & SPRITE_BEHIND) || bg == 0)
+                color = sprite & 0x1F;
+        }
+        out[x] = ppu->palette[color] & grey;
+    }
+}
+
+// Moves v down one pixel row, wrapping into the next vertical nametable after row 29
+static void increment_y(ppu_t *ppu)
+{
+    if((ppu->v & 0x7000) != 0x7000)
+    {
+        ppu->v += 0x1000;
+        return;
+    }
+    ppu->v &= ~0x7000;
+    int coarse_y = (ppu->v & 0x03E0) >> 5;
+    if(coarse_y == 29)
+    {
+        coarse_y = 0;
+        ppu->v ^= 0x0800;
+    }
+    else if(coarse_y == 31)
+    {
+        coarse_y = 0;
+    }
+    else
+    {
+        coarse_y += 1;
+    }
+    ppu->v = (ppu->v & ~0x03E0) | (coarse_y << 5);
+}
+
+// The pre-render line is one dot short on odd frames while rendering
+static inline int scanline_length(const ppu_t *ppu)
+{
+    if(ppu->scanline == PPU_PRERENDER_SCANLINE && (ppu->frames & 1) && rendering_enabled(ppu))
+        return PPU_DOTS_PER_SCANLINE - 1;
+    return PPU_DOTS_PER_SCANLINE;
+}
+
+// Dot 1: vertical blank starts on line 241 and ends on the pre-render line
+static void start_scanline(ppu_t *ppu)
+{
+    if(ppu->scanline == PPU_VBLANK_SCANLINE)
+    {
+        ppu->status |= STATUS_VBLANK;
+        ppu->frames += 1;
+        if(ppu->ctrl & CTRL_NMI_ENABLE)
+            cpu_nmi(ppu->cpu);
+    }
+    else if(ppu->scanline == PPU_PRERENDER_SCANLINE)
+    {
+        ppu->status &= ~(STATUS_VBLANK | STATUS_SPRITE_ZERO_HIT | STATUS_SPRITE_OVERFLOW);
+    }
+}
+
+static void end_scanline(ppu_t *ppu)
+{
+    bool visible = ppu->scanline < PPU_HEIGHT;
+    if(visible)
+        render_scanline(ppu, ppu->scanline);
+    if(rendering_enabled(ppu))
+    {
+        if(visible)
+        {
+            increment_y(ppu);
+            ppu->v = (ppu->v & ~0x041F) | (ppu->t & 0x041F);
+        }
+        else if(ppu->scanline == PPU_PRERENDER_SCANLINE)
+        {
+            ppu->v = ppu->t;
+        }
+        if(visible || ppu->scanline == PPU_PRERENDER_SCANLINE)
+            cartridge_scanline(ppu->cart);
+    }
+    ppu->dot = 0;
+    ppu->scanline = (ppu->scanline + 1) % PPU_SCANLINES;
+}
+
+void ppu_catch_up(ppu_t *ppu)
+{
+    uint64_t target = ppu->cpu->cycles * PPU_DOTS_PER_CPU_CYCLE;
+    while(ppu->dots < target)
+    {
+        int event = (ppu->dot < 1) ? 1 : scanline_length(ppu);
+        uint64_t event_dots = ppu->dots + (uint64_t)(event - ppu->dot);
+        if(event_dots > target)
+        {
+            ppu->dot += (int)(target - ppu->dots);
+            ppu->dots = target;
+            return;
+        }
+        ppu->dots = event_dots;
+        ppu->dot = event;
+        if(event == 1)
+            start_scanline(ppu);
+        else
+            end_scanline(ppu);
+    }
+}
+
+uint64_t ppu_next_event(const ppu_t *ppu)
+{
+    // Lines are assumed one dot short, so this never overshoots dot 1 of line 241
+    int lines = PPU_VBLANK_SCANLINE - ppu->scanline;
+    if(lines < 0 || (lines == 0 && ppu->dot >= 1))
+        lines += PPU_SCANLINES;
+    uint64_t target = ppu->dots + (uint64_t)lines * (PPU_DOTS_PER_SCANLINE - 1) + 1 - (uint64_t)ppu->dot;
+    return (target + PPU_DOTS_PER_CPU_CYCLE - 1) / PPU_DOTS_PER_CPU_CYCLE;
+}
+
+uint64_t ppu_next_mapper_irq(ppu_t *ppu)
+{
+    int clocks = cartridge_irq_clocks(ppu->cart);
+    if(clocks == 0 || !rendering_enabled(ppu))
+        return PPU_NEVER;
+    ppu_catch_up(ppu);
+    // The mapper is clocked at the end of each visible line and of the pre-render line
+    int scanline = ppu->scanline;
+    int dot = ppu->dot;
+    uint64_t dots = ppu->dots;
+    uint64_t frames = ppu->frames;
+    while(true)
+    {
+        if(scanline == PPU_VBLANK_SCANLINE && dot < 1)
+            frames += 1;
+        int length = PPU_DOTS_PER_SCANLINE;
+        if(scanline == PPU_PRERENDER_SCANLINE && (frames & 1))
+            length -= 1;
+        dots += (uint64_t)(length - dot);
+        if((scanline < PPU_HEIGHT || scanline == PPU_PRERENDER_SCANLINE) && --clocks == 0)
+            break;
+        dot = 0;
+        scanline = (scanline + 1) % PPU_SCANLINES;
+    }
+    return (dots + PPU_DOTS_PER_CPU_CYCLE - 1) / PPU_DOTS_PER_CPU_CYCLE;
+}
+
+static uint8_t register_read(void *context, uint16_t address)
+{
+    ppu_t *ppu = context;
+    ppu_catch_up(ppu);
+    uint8_t data = ppu->open_bus;
+    switch(address & 7)
+    {
+        case 2:
+            data = (ppu->status & 0xE0) | (ppu->open_bus & 0x1F);
+            ppu->status &= ~STATUS_VBLANK;
+            ppu->w = false;
+            break;
+        case 4:
+            data = ppu->oam[ppu->oam_addr];
+            break;
+        case 7:
+            // Reads lag one behind through read_buffer, except palette reads
+            if((ppu->v & 0x3FFF) >= 0x3F00)
+            {
+                data = (ppu_read(ppu, ppu->v) & 0x3F) | (ppu->open_bus & 0xC0);
+                ppu->read_buffer = ppu_read(ppu, ppu->v - 0x1000);
+            }
+            else
+            {
+                data = ppu->read_buffer;
+                ppu->read_buffer = ppu_read(ppu, ppu->v);
+            }
+            ppu->v = (ppu->v + ((ppu->ctrl & CTRL_INCREMENT_32) ? 32 : 1)) & 0x7FFF;
+            break;
+    }
+    ppu->open_bus = data;
+    return data;
+}
+
+/*
+ * $2002 changes when vertical blank starts or ends and, while a visible
+ * line renders, when it sets sprite 0 hit or overflow at the line's end.
+ * The rest keep reading the same until a write, except $2007.
+ */
+static uint64_t register_stable(void *context, uint16_t address)
+{
+    ppu_t *ppu = context;
+    if((address & 7) == 7)
+        return 0;
+    if((address & 7) != 2)
+        return UINT64_MAX;
+    ppu_catch_up(ppu);
+    bool flags_pending = rendering_enabled(ppu) &&
+                         (ppu->status & (STATUS_SPRITE_ZERO_HIT | STATUS_SPRITE_OVERFLOW)) !=
+                         (STATUS_SPRITE_ZERO_HIT | STATUS_SPRITE_OVERFLOW);
+    int scanline = ppu->scanline;
+    int dot = ppu->dot;
+    uint64_t dots = ppu->dots;
+    while(true)
+    {
+        if(dot < 1 && (scanline == PPU_VBLANK_SCANLINE || scanline == PPU_PRERENDER_SCANLINE))
+        {
+            dots += 1 - dot;
+            break;
+        }
+        // Frames only advance at line 241, so the pre-render line reached here is the current frame's
+        int length = PPU_DOTS_PER_SCANLINE;
+        if(scanline == PPU_PRERENDER_SCANLINE && (ppu->frames & 1) && rendering_enabled(ppu))
+            length -= 1;
+        dots += (uint64_t)(length - dot);
+        if(scanline < PPU_HEIGHT && flags_pending)
+            break;
+        dot = 0;
+        scanline = (scanline + 1) % PPU_SCANLINES;
+    }
+    return (dots + PPU_DOTS_PER_CPU_CYCLE - 1) / PPU_DOTS_PER_CPU_CYCLE;
+}
+
+static void register_write(void *context, uint16_t address, uint8_t data)
+{
+    ppu_t *ppu = context;
+    ppu_catch_up(ppu);
+    ppu->open_bus = data;
+    switch(address & 7)
+    {
+        case 0: {
+            bool nmi_was_enabled = ppu->ctrl & CTRL_NMI_ENABLE;
+            ppu->ctrl = data;
+            ppu->t = (ppu->t & ~0x0C00) | ((data & CTRL_NAMETABLE) << 10);
+            // Enabling NMI during vertical blank raises one immediately
+            if(!nmi_was_enabled && (data & CTRL_NMI_ENABLE) && (ppu->status & STATUS_VBLANK))
+                cpu_nmi(ppu->cpu);
+            break; }
+        case 1: {
+            bool was_rendering = rendering_enabled(ppu);
+            ppu->mask = data;
+            // Mappers only count scanlines while the PPU renders
+            if(rendering_enabled(ppu) != was_rendering)
+                scheduler_reschedule(ppu->cpu->scheduler, SOURCE_MAPPER_IRQ);
+            break; }
+        case 3:
+            ppu->oam_addr = data;
+            break;
+        case 4:
+            ppu->oam[ppu->oam_addr++] = data;
+            break;
+        case 5:
+            if(!ppu->w)
+            {
+                ppu->t = (ppu->t & ~0x001F) | (data >> 3);
+                ppu->fine_x = data & 7;
+            }
+            else
+            {
+                ppu->t = (ppu->t & ~0x73E0) | ((data & 0x07) << 12) | ((data & 0xF8) << 2);
+            }
+            ppu->w = !ppu->w;
+            break;
+        case 6:
+            if(!ppu->w)
+            {
+                ppu->t = (ppu->t & 0x00FF) | ((data & 0x3F) << 8);
+            }
+            else
+            {
+                ppu->t = (ppu->t & 0xFF00) | data;
+                ppu->v = ppu->t;
+            }
+            ppu->w = !ppu->w;
+            break;
+        case 7:
+            ppu_write(ppu, ppu->v, data);
+            ppu->v = (ppu->v + ((ppu->ctrl & CTRL_INCREMENT_32) ? 32 : 1)) & 0x7FFF;
+            break;
+    }
+}
+
+void ppu_oam_dma(ppu_t *ppu, uint8_t page)
+{
+    cpu_t *cpu = ppu->cpu;
+    ppu_catch_up(ppu);
+    const uint8_t *memory = cpu->bus.read_pages[page];
+    if(memory != NULL && ppu->oam_addr == 0)
+    {
+        memcpy(ppu->oam, memory, sizeof(ppu->oam));
+    }
+    else
+    {
+        for(int i = 0; i < 256; i++)
+            ppu->oam[(uint8_t)(ppu->oam_addr + i)] = bus_read(&cpu->bus, ((uint16_t)page << 8) | i);
+    }
+    // One extra cycle to align when the transfer starts on an odd cycle
+    cpu->cycles += OAM_DMA_CYCLES + (cpu->cycles & 1);
+}
+
+void ppu_init(ppu_t *ppu, cpu_t *cpu, cartridge_t *cart)
+{
+    memset(ppu, 0, sizeof(*ppu));
+    ppu->cpu = cpu;
+    ppu->cart = cart;
+    ppu->dots = cpu->cycles * PPU_DOTS_PER_CPU_CYCLE;
+    bus_map_handler(&cpu->bus, 0x2000, 0x2000, register_read, register_write, ppu);
+    bus_map_stable(&cpu->bus, 0x2000, 0x2000, register_stable);
+}
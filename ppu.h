@@ -0,0 +1,116 @@
+#ifndef PPU_H
+#define PPU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cartridge.h"
+#include "cpu.h"
+
+#define PPU_WIDTH 256
+#define PPU_HEIGHT 240
+#define PPU_DOTS_PER_SCANLINE 341
+#define PPU_SCANLINES 262
+#define PPU_VBLANK_SCANLINE 241
+#define PPU_PRERENDER_SCANLINE 261
+#define PPU_DOTS_PER_CPU_CYCLE 3
+#define OAM_DMA_CYCLES 513
+#define PPU_NEVER UINT64_MAX
+
+enum PPUCtrl {
+    CTRL_NAMETABLE = 0x03,
+    CTRL_INCREMENT_32 = 0x04,
+    CTRL_SPRITE_TABLE = 0x08,
+    CTRL_BACKGROUND_TABLE = 0x10,
+    CTRL_SPRITE_8X16 = 0x20,
+    CTRL_NMI_ENABLE = 0x80
+};
+
+enum PPUMask {
+    MASK_GREYSCALE = 0x01,
+    MASK_BACKGROUND_LEFT = 0x02,
+    MASK_SPRITES_LEFT = 0x04,
+    MASK_BACKGROUND = 0x08,
+    MASK_SPRITES = 0x10
+};
+
+enum PPUStatus {
+    STATUS_SPRITE_OVERFLOW = 0x20,
+    STATUS_SPRITE_ZERO_HIT = 0x40,
+    STATUS_VBLANK = 0x80
+};
+
+/*
+ * 2C02 picture processing unit. It is not stepped per dot: register
+ * accesses and the machine loop call ppu_catch_up(), which advances it to
+ * the CPU's cycle count a scanline at a time and renders each visible line
+ * in one pass when the line ends.
+ */
+struct ppu
+{
+    cpu_t *cpu;
+    cartridge_t *cart;
+
+    uint8_t ctrl;
+    uint8_t mask;
+    uint8_t status;
+    uint8_t oam_addr;
+    // Loopy registers: current and temporary VRAM address, fine X scroll and the write toggle
+    uint16_t v;
+    uint16_t t;
+    uint8_t fine_x;
+    bool w;
+    uint8_t read_buffer;
+    // Last value written to any register, returned by reads of write-only bits
+    uint8_t open_bus;
+
+    // Position of the next dot to run
+    int scanline;
+    int dot;
+    // Dots run since power-on; always PPU_DOTS_PER_CPU_CYCLE * the CPU cycle caught up to
+    uint64_t dots;
+    // Frames completed, counted at the start of vertical blank
+    uint64_t frames;
+    /*
+     * Leaves the framebuffer alone, working out only the sprite 0 hit and
+     * overflow flags the game can see; timing is unchanged. Checked at
+     * every line, so it can be set between one nes_run_frame() and the next.
+     */
+    bool skip_pixels;
+
+    uint8_t oam[256];
+    // 2KB of nametable RAM, plus 2KB more for four-screen boards
+    uint8_t vram[0x1000];
+    uint8_t palette[32];
+    // Master palette index (0-63) of every pixel of the last completed frame
+    uint8_t framebuffer[PPU_HEIGHT][PPU_WIDTH];
+};
+
+typedef struct ppu ppu_t;
+
+/*
+ * Powers on the PPU and maps its registers over $2000-$3FFF. The cartridge
+ * must already be inserted into cpu.
+ */
+void ppu_init(ppu_t *ppu, cpu_t *cpu, cartridge_t *cart);
+
+// Runs the PPU up to the CPU's current cycle
+void ppu_catch_up(ppu_t *ppu);
+
+/*
+ * CPU cycle by which the PPU next has to run on its own, for the start of
+ * vertical blank. Everything else waits for the next register access.
+ */
+uint64_t ppu_next_event(const ppu_t *ppu);
+
+// CPU cycle of the scanline clock on which the mapper raises its IRQ, or PPU_NEVER
+uint64_t ppu_next_mapper_irq(ppu_t *ppu);
+
+// Copies page `page` of CPU memory into OAM and stalls the CPU for the transfer
+void ppu_oam_dma(ppu_t *ppu, uint8_t page);
+
+// Reads and writes the PPU's own address space ($0000-$3FFF)
+uint8_t ppu_read(ppu_t *ppu, uint16_t address);
+
+void ppu_write(ppu_t *ppu, uint16_t address, uint8_t data);
+
+#endif
@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nes.h"
+#include "profile.h"
+#include "rewind.h"
+
+#define NMI_HANDLER 0x100
+
+// NROM-128 with CHR RAM; program at $8000, NMI handler at $8100
+static uint8_t *build_image(const uint8_t *program, size_t program_size,
+                            const uint8_t *nmi_handler, size_t nmi_handler_size, size_t *image_size)
+{
+    *image_size = INES_HEADER_SIZE + PRG_BANK_SIZE;
+    uint8_t *image = calloc(1, *image_size);
+    memcpy(image, "NES\x1a", 4);
+    image[4] = 1;
+    image[6] = 0x01;
+    uint8_t *prg = image + INES_HEADER_SIZE;
+    memcpy(prg, program, program_size);
+    memcpy(prg + NMI_HANDLER, nmi_handler, nmi_handler_size);
+    prg[0x3ffa] = 0x00;
+    prg[0x3ffb] = 0x81;
+    prg[0x3ffc] = 0x00;
+    prg[0x3ffd] = 0x80;
+    return image;
+}
+
+// loop: JMP loop
+static uint8_t idle_program[] = {0x4c, 0x00, 0x80};
+static uint8_t rti_handler[] = {0x40};
+
+static void set_address(cpu_t *cpu, uint16_t address)
+{
+    bus_write(&cpu->bus, 0x2006, address >> 8);
+    bus_write(&cpu->bus, 0x2006, address & 0xff);
+}
+
+void test_ppu_vram_access()
+{
+    size_t size;
+    uint8_t *image = build_image(idle_program, sizeof(idle_program), rti_handler, sizeof(rti_handler), &size);
+    cartridge_t *cart = cartridge_from_image(image, size);
+    nes_t *nes = nes_create(cart);
+    cpu_t *cpu = nes->cpu;
+
+    set_address(cpu, 0x2123);
+    bus_write(&cpu->bus, 0x2007, 0x55);
+    bus_write(&cpu->bus, 0x2007, 0x66);
+    // Vertical mirroring: $2900 is the same RAM as $2100
+    set_address(cpu, 0x2923);
+    bus_read(&cpu->bus, 0x2007);
+    if(bus_read(&cpu->bus, 0x2007) != 0x55 || bus_read(&cpu->bus, 0x2007) != 0x66)
+    {
+        fprintf(stderr, "ppu_vram_access failure: buffered nametable reads not correct\n");
+        exit(1);
+    }
+
+    set_address(cpu, 0x3f10);
+    bus_write(&cpu->bus, 0x2007, 0x2a);
+    set_address(cpu, 0x3f00);
+    if(bus_read(&cpu->bus, 0x2007) != 0x2a)
+    {
+        fprintf(stderr, "ppu_vram_access failure: palette mirror not correct\n");
+        exit(1);
+    }
+
+    bus_write(&cpu->bus, 0x2000, CTRL_INCREMENT_32);
+    set_address(cpu, 0x0000);
+    bus_write(&cpu->bus, 0x2007, 0x11);
+    bus_write(&cpu->bus, 0x2007, 0x22);
+    if(cart->chr_ram[0] != 0x11 || cart->chr_ram[32] != 0x22)
+    {
+        fprintf(stderr, "ppu_vram_access failure: CHR RAM writes not correct\n");
+        exit(1);
+    }
+    nes_free(nes);
+    cartridge_close(cart);
+    free(image);
+}
+
+void test_ppu_vblank_nmi()
+{
+    // LDA #$80; STA $2000; loop: JMP loop; NMI: INC $10; RTI
+    uint8_t program[] = {0xa9, 0x80, 0x8d, 0x00, 0x20, 0x4c, 0x05, 0x80};
+    uint8_t handler[] = {0xe6, 0x10, 0x40};
+    size_t size;
+    uint8_t *image = build_image(program, sizeof(program), handler, sizeof(handler), &size);
+    cartridge_t *cart = cartridge_from_image(image, size);
+    nes_t *nes = nes_create(cart);
+
+    nes_run_frame(nes);
+    uint64_t first = nes->cpu->cycles;
+    nes_run_frame(nes);
+    uint64_t second = nes->cpu->cycles;
+    nes_run_frame(nes);
+    uint64_t frame_cycles = second - first;
+    if(nes->ppu.frames != 3 || frame_cycles < 29780 - 7 || frame_cycles > 29781 + 7)
+    {
+        fprintf(stderr, "ppu_vblank_nmi failure: frame took %llu cycles\n", (unsigned long long)frame_cycles);
+        exit(1);
+    }
+    // The third NMI is still pending when nes_run_frame() returns
+    if(nes->cpu->memory[0x10] != 2)
+    {
+        fprintf(stderr, "ppu_vblank_nmi failure: %d NMIs handled\n", nes->cpu->memory[0x10]);
+        exit(1);
+    }
+    if(!(bus_read(&nes->cpu->bus, 0x2002) & STATUS_VBLANK) || (bus_read(&nes->cpu->bus, 0x2002) & STATUS_VBLANK))
+    {
+        fprintf(stderr, "ppu_vblank_nmi failure: reading $2002 did not clear vblank\n");
+        exit(1);
+    }
+    nes_free(nes);
+    cartridge_close(cart);
+    free(image);
+}
+
+// Renders a background tile at the top left with sprite 0 over it on line 1
+static void draw_sprite_zero_scene(cpu_t *cpu, cartridge_t *cart)
+{
+    // Tile 1 is solid color 1; tile 2 is color 2 in its left half
+    memset(cart->chr_ram + 16, 0xff, 8);
+    memset(cart->chr_ram + 32 + 8, 0xf0, 8);
+    set_address(cpu, 0x2000);
+    bus_write(&cpu->bus, 0x2007, 1);
+    set_address(cpu, 0x3f00);
+    bus_write(&cpu->bus, 0x2007, 0x0f);
+    bus_write(&cpu->bus, 0x2007, 0x16);
+    set_address(cpu, 0x3f12);
+    bus_write(&cpu->bus, 0x2007, 0x30);
+    // Sprite 0: tile 2 at x = 4 on line 1, over the background tile
+    uint8_t sprite[] = {0x00, 0x02, 0x00, 0x04};
+    bus_write(&cpu->bus, 0x2003, 0);
+    for(int i = 0; i < 4; i++)
+        bus_write(&cpu->bus, 0x2004, sprite[i]);
+    for(int i = 4; i < 256; i++)
+        bus_write(&cpu->bus, 0x2004, 0xff);
+    bus_write(&cpu->bus, 0x2000, 0);
+    bus_write(&cpu->bus, 0x2005, 0);
+    bus_write(&cpu->bus, 0x2005, 0);
+    bus_write(&cpu->bus, 0x2001, MASK_BACKGROUND | MASK_SPRITES | MASK_BACKGROUND_LEFT | MASK_SPRITES_LEFT);
+}
+
+void test_ppu_render()
+{
+    size_t size;
+    uint8_t *image = build_image(idle_program, sizeof(idle_program), rti_handler, sizeof(rti_handler), &size);
+    cartridge_t *cart = cartridge_from_image(image, size);
+    nes_t *nes = nes_create(cart);
+    cpu_t *cpu = nes->cpu;
+
+    draw_sprite_zero_scene(cpu, cart);
+
+    nes_run_frame(nes);
+    nes_run_frame(nes);
+    uint8_t (*frame)[PPU_WIDTH] = nes->ppu.framebuffer;
+    if(frame[0][0] != 0x16 || frame[0][7] != 0x16 || frame[0][8] != 0x0f || frame[239][255] != 0x0f)
+    {
+        fprintf(stderr, "ppu_render failure: background not correct\n");
+        exit(1);
+    }
+    if(frame[0][4] != 0x16 || frame[1][3] != 0x16 || frame[1][4] != 0x30 || frame[1][7] != 0x30 || frame[1][8] != 0x0f)
+    {
+        fprintf(stderr, "ppu_render failure: sprite not correct\n");
+        exit(1);
+    }
+    if(!(bus_read(&cpu->bus, 0x2002) & STATUS_SPRITE_ZERO_HIT))
+    {
+        fprintf(stderr, "ppu_render failure: no sprite 0 hit\n");
+        exit(1);
+    }
+
+    // Fine X scroll of 4 moves the tile half off the left edge
+    bus_write(&cpu->bus, 0x2005, 4);
+    bus_write(&cpu->bus, 0x2005, 0);
+    nes_run_frame(nes);
+    if(frame[0][3] != 0x16 || frame[0][4] != 0x0f)
+    {
+        fprintf(stderr, "ppu_render failure: fine X scroll not correct\n");
+        exit(1);
+    }
+    nes_free(nes);
+    cartridge_close(cart);
+    free(image);
+}
+
+void test_ppu_oam_dma()
+{
+    size_t size;
+    uint8_t *image = build_image(idle_program, sizeof(idle_program), rti_handler, sizeof(rti_handler), &size);
+    cartridge_t *cart = cartridge_from_image(image, size);
+    nes_t *nes = nes_create(cart);
+    cpu_t *cpu = nes->cpu;
+    for(int i = 0; i < 256; i++)
+        cpu->memory[0x200 + i] = i ^ 0x5a;
+
+    uint64_t cycles = cpu->cycles;
+    bus_write(&cpu->bus, 0x4014, 0x02);
+    for(int i = 0; i < 256; i++)
+    {
+        if(nes->ppu.oam[i] != (i ^ 0x5a))
+        {
+            fprintf(stderr, "ppu_oam_dma failure: OAM byte %d not copied\n", i);
+            exit(1);
+        }
+    }
+    if(cpu->cycles - cycles != OAM_DMA_CYCLES)
+    {
+        fprintf(stderr, "ppu_oam_dma failure: CPU not stalled\n");
+        exit(1);
+    }
+    nes_free(nes);
+    cartridge_close(cart);
+    free(image);
+}
+
+void test_ppu_idle_loops_skip_exactly()
+{
+    // Wait for vblank, then for sprite 0 hit to clear and be set again, then acknowledge the APU frame IRQ and wait for the next
+    uint8_t program[] = {
+        0xad, 0x02, 0x20, 0x10, 0xfb,             // LDA $2002; BPL -5
+        0xe6, 0x10,                               // INC $10
+        0xad, 0x02, 0x20, 0x29, 0x40, 0xd0, 0xf9, // LDA $2002; AND #$40; BNE -7
+        0xad, 0x02, 0x20, 0x29, 0x40, 0xf0, 0xf9, // LDA $2002; AND #$40; BEQ -7
+        0xe6, 0x11,                               // INC $11
+        0xad, 0x15, 0x40,                         // LDA $4015
+        0xad, 0x15, 0x40, 0x29, 0x40, 0xf0, 0xf9, // LDA $4015; AND #$40; BEQ -7
+        0xe6, 0x12,                               // INC $12
+        0x4c, 0x00, 0x80                          // JMP $8000
+    };
+    size_t size;
+    uint8_t *image = build_image(program, sizeof(program), rti_handler, sizeof(rti_handler), &size);
+    cartridge_t *carts[2];
+    nes_t *nes[2];
+    for(int i = 0; i < 2; i++)
+    {
+        carts[i] = cartridge_from_image(image, size);
+        nes[i] = nes_create(carts[i]);
+        nes[i]->cpu->skip_idle_loops = i == 0;
+        draw_sprite_zero_scene(nes[i]->cpu, carts[i]);
+    }
+    profile_t *profile = profile_create();
+    profile_attach(profile, nes[0]->cpu);
+    for(int frame = 0; frame < 8; frame++)
+    {
+        nes_run_frame(nes[0]);
+        nes_run_frame(nes[1]);
+        cpu_t *skipped = nes[0]->cpu;
+        cpu_t *stepped = nes[1]->cpu;
+        if(skipped->cycles != stepped->cycles || skipped->program_counter != stepped->program_counter ||
+           skipped->reg_a != stepped->reg_a || skipped->reg_status != stepped->reg_status ||
+           memcmp(&skipped->memory[0x10], &stepped->memory[0x10], 3) != 0)
+        {
+            fprintf(stderr, "ppu_idle_loops_skip_exactly failure: frame %d differs\n", frame);
+            exit(1);
+        }
+    }
+    profile_detach(nes[0]->cpu);
+    if(nes[0]->cpu->memory[0x11] < 3 || nes[0]->cpu->memory[0x12] < 3 || profile->idle_loop_count != 4 ||
+       profile->idle_cycles < 6 * 29780)
+    {
+        fprintf(stderr, "ppu_idle_loops_skip_exactly failure: loops not skipped\n");
+        exit(1);
+    }
+    profile_free(profile);
+    for(int i = 0; i < 2; i++)
+    {
+        nes_free(nes[i]);
+        cartridge_close(carts[i]);
+    }
+    free(image);
+}
+
+void test_ppu_mapper_irq_scheduled()
+{
+    uint8_t program[] = {
+        0xa9, 0x40, 0x8d, 0x17, 0x40, // LDA #$40; STA $4017 (no frame IRQ)
+        0xa9, 0x14, 0x8d, 0x00, 0xc0, // LDA #20; STA $C000 (latch)
+        0x8d, 0x01, 0xc0,             // STA $C001 (reload)
+        0x8d, 0x01, 0xe0,             // STA $E001 (enable)
+        0x58,                         // CLI
+        0xa9, 0x18, 0x8d, 0x01, 0x20, // LDA #$18; STA $2001
+        0xe8, 0x4c, 0x16, 0x80        // loop: INX; JMP loop
+    };
+    // INC $10; STA $E000; STA $E001; RTI
+    uint8_t handler[] = {0xe6, 0x10, 0x8d, 0x00, 0xe0, 0x8d, 0x01, 0xe0, 0x40};
+    size_t size;
+    uint8_t *image = build_image(program, sizeof(program), handler, sizeof(handler), &size);
+    // MMC3, whose two 8KB banks of PRG map as NROM's do; IRQs go to the same handler as NMIs
+    image[6] |= 0x40;
+    image[INES_HEADER_SIZE + 0x3ffe] = 0x00;
+    image[INES_HEADER_SIZE + 0x3fff] = 0x81;
+    cartridge_t *carts[2];
+    nes_t *nes[2];
+    for(int i = 0; i < 2; i++)
+    {
+        carts[i] = cartridge_from_image(image, size);
+        nes[i] = nes_create(carts[i]);
+    }
+    // The reference syncs every device after each instruction
+    for(int frame = 0; frame < 4; frame++)
+    {
+        nes_run_frame(nes[0]);
+        while(nes[1]->cpu->cycles < nes[0]->cpu->cycles)
+            nes_run_cycles(nes[1], 1);
+        cpu_t *scheduled = nes[0]->cpu;
+        cpu_t *stepped = nes[1]->cpu;
+        if(scheduled->cycles != stepped->cycles || scheduled->reg_x != stepped->reg_x ||
+           scheduled->memory[0x10] != stepped->memory[0x10])
+        {
+            fprintf(stderr, "ppu_mapper_irq_scheduled failure: frame %d differs\n", frame);
+            exit(1);
+        }
+    }
+    // A reload every 21 scanline clocks, 241 clocks a frame
+    if(nes[0]->cpu->memory[0x10] < 3 * 241 / 21)
+    {
+        fprintf(stderr, "ppu_mapper_irq_scheduled failure: %d IRQs\n", nes[0]->cpu->memory[0x10]);
+        exit(1);
+    }
+    for(int i = 0; i < 2; i++)
+    {
+        nes_free(nes[i]);
+        cartridge_close(carts[i]);
+    }
+    free(image);
+}
+
+void test_ppu_skip_pixels()
+{
+    size_t size;
+    uint8_t *image = build_image(idle_program, sizeof(idle_program), rti_handler, sizeof(rti_handler), &size);
+    cartridge_t *carts[2];
+    nes_t *nes[2];
+    for(int i = 0; i < 2; i++)
+    {
+        carts[i] = cartridge_from_image(image, size);
+        nes[i] = nes_create(carts[i]);
+    }
+    nes[1]->ppu.skip_pixels = true;
+    // Random scenes, drawn by one console and only evaluated by the other
+    uint32_t seed = 1;
+    int hits = 0;
+    int overflows = 0;
+    for(int frame = 0; frame < 200; frame++)
+    {
+        uint8_t oam[256];
+        uint8_t vram[0x800];
+        uint8_t chr[CHR_BANK_SIZE];
+        for(size_t i = 0; i < sizeof(oam); i++)
+            oam[i] = (seed = seed * 1103515245 + 12345) >> 16;
+        // Sprite 0 at the left edge, where clipping matters
+        if(frame % 4 == 0)
+            oam[3] &= 0x07;
+        for(size_t i = 0; i < sizeof(vram); i++)
+            vram[i] = (seed = seed * 1103515245 + 12345) >> 16;
+        // Sparse patterns, so that sprite 0 often misses
+        for(size_t i = 0; i < sizeof(chr); i++)
+            chr[i] = (seed = seed * 1103515245 + 12345) >> 16 & (frame & 1 ? 0x81 : 0xff);
+        uint32_t random = (seed = seed * 1103515245 + 12345) >> 8;
+        for(int i = 0; i < 2; i++)
+        {
+            ppu_t *ppu = &nes[i]->ppu;
+            memcpy(ppu->oam, oam, sizeof(oam));
+            memcpy(ppu->vram, vram, sizeof(vram));
+            memcpy(carts[i]->chr_ram, chr, sizeof(chr));
+            ppu->ctrl = random & (CTRL_NAMETABLE | CTRL_SPRITE_TABLE | CTRL_BACKGROUND_TABLE | CTRL_SPRITE_8X16);
+            ppu->mask = (random >> 8) & (MASK_BACKGROUND | MASK_SPRITES | MASK_BACKGROUND_LEFT | MASK_SPRITES_LEFT);
+            ppu->fine_x = (random >> 13) & 7;
+            ppu->t = (random >> 16) & 0x7FFF;
+            nes_run_frame(nes[i]);
+        }
+        uint8_t flags = STATUS_SPRITE_ZERO_HIT | STATUS_SPRITE_OVERFLOW;
+        if(nes[0]->cpu->cycles != nes[1]->cpu->cycles || (nes[0]->ppu.status & flags) != (nes[1]->ppu.status & flags))
+        {
+            fprintf(stderr, "ppu_skip_pixels failure: frame %d differs\n", frame);
+            exit(1);
+        }
+        hits += (nes[0]->ppu.status & STATUS_SPRITE_ZERO_HIT) != 0;
+        overflows += (nes[0]->ppu.status & STATUS_SPRITE_OVERFLOW) != 0;
+    }
+    if(hits < 20 || hits > 180 || overflows < 10)
+    {
+        fprintf(stderr, "ppu_skip_pixels failure: %d hits and %d overflows\n", hits, overflows);
+        exit(1);
+    }
+    if(nes[1]->ppu.framebuffer[0][0] != 0 || memcmp(nes[1]->ppu.framebuffer, nes[1]->ppu.framebuffer[0] + 1,
+                                                     sizeof(nes[1]->ppu.framebuffer) - 1) != 0)
+    {
+        fprintf(stderr, "ppu_skip_pixels failure: framebuffer drawn\n");
+        exit(1);
+    }
+    // Drawing again from the next frame on
+    nes[1]->ppu.skip_pixels = false;
+    nes_run_frame(nes[0]);
+    nes_run_frame(nes[1]);
+    if(memcmp(nes[0]->ppu.framebuffer, nes[1]->ppu.framebuffer, sizeof(nes[0]->ppu.framebuffer)) != 0)
+    {
+        fprintf(stderr, "ppu_skip_pixels failure: frame not drawn after skipping\n");
+        exit(1);
+    }
+    for(int i = 0; i < 2; i++)
+    {
+        nes_free(nes[i]);
+        cartridge_close(carts[i]);
+    }
+    free(image);
+}
+
+void test_ppu_rewind_refuses_console()
+{
+    size_t size;
+    uint8_t *image = build_image(idle_program, sizeof(idle_program), rti_handler, sizeof(rti_handler), &size);
+    cartridge_t *cart = cartridge_from_image(image, size);
+    nes_t *nes = nes_create(cart);
+    // Rewinding only the CPU would leave the PPU and APU ahead of it
+    if(rewind_create(nes->cpu, 1 << 20, 8, 4) != NULL)
+    {
+        fprintf(stderr, "ppu_rewind_refuses_console failure: rewind created for a console CPU\n");
+        exit(1);
+    }
+    nes->cpu->scheduler = NULL;
+    rewind_buffer_t *buffer = rewind_create(nes->cpu, 1 << 20, 8, 4);
+    bool captured = buffer != NULL && rewind_capture(buffer);
+    nes->cpu->scheduler = &nes->scheduler;
+    if(!captured || rewind_capture(buffer) || rewind_step_back(buffer))
+    {
+        fprintf(stderr, "ppu_rewind_refuses_console failure: rewind ran with a scheduler attached\n");
+        exit(1);
+    }
+    rewind_free(buffer);
+    nes_free(nes);
+    cartridge_close(cart);
+    free(image);
+}
+
+int main()
+{
+    test_ppu_vram_access();
+    test_ppu_vblank_nmi();
+    test_ppu_render();
+    test_ppu_oam_dma();
+    test_ppu_idle_loops_skip_exactly();
+    test_ppu_mapper_irq_scheduled();
+    test_ppu_skip_pixels();
+    test_ppu_rewind_refuses_console();
+    printf("All tests passed!\n");
+    return 0;
+}
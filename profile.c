@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+#include "opcode.h"
+#include "profile.h"
+
+static const char *mode_names[] = {
+    [IMMEDIATE] = "imm",
+    [ZERO_PAGE] = "zp",
+    [ZERO_PAGE_X] = "zp,x",
+    [ZERO_PAGE_Y] = "zp,y",
+    [ABSOLUTE] = "abs",
+    [ABSOLUTE_X] = "abs,x",
+    [ABSOLUTE_Y] = "abs,y",
+    [INDIRECT] = "ind",
+    [INDIRECT_X] = "(ind,x)",
+    [INDIRECT_Y] = "(ind),y",
+    [NONE_ADDRESSING] = ""
+};
+
+static const char *frame_prefixes[] = {
+    [FRAME_ROOT] = "root",
+    [FRAME_CALL] = "sub",
+    [FRAME_NMI] = "nmi",
+    [FRAME_IRQ] = "irq"
+};
+
+profile_t *profile_create()
+{
+    return calloc(1, sizeof(profile_t));
+}
+
+void profile_free(profile_t *profile)
+{
+    free(profile);
+}
+
+void profile_attach(profile_t *profile, cpu_t *cpu)
+{
+    memset(profile, 0, sizeof(profile_t));
+    profile->last_cycles = cpu->cycles;
+    profile->node_start = cpu->cycles;
+    profile->node_count = 1;
+    profile->nodes[0].address = cpu->program_counter;
+    profile->nodes[0].frame = FRAME_ROOT;
+    profile->nodes[0].parent = -1;
+    profile->nodes[0].first_child = -1;
+    profile->nodes[0].next_sibling = -1;
+    cpu->profile = profile;
+}
+
+void profile_detach(cpu_t *cpu)
+{
+    if(cpu->profile != NULL)
+    {
+        profile_charge(cpu->profile, cpu);
+        profile_charge_node(cpu->profile, cpu->cycles);
+    }
+    cpu->profile = NULL;
+}
+
+static const uint64_t *sort_key;
+
+// Sorts indices by descending sort_key, then ascending index
+static int compare_descending(const void *a, const void *b)
+{
+    int left = *(const int *)a;
+    int right = *(const int *)b;
+    if(sort_key[left] != sort_key[right])
+        return sort_key[left] < sort_key[right] ? 1 : -1;
+    return left - right;
+}
+
+// Fills indices with every i below count whose counts[i] is non-zero, sorted by keys
+static int sorted_indices(int *indices, const uint64_t *counts, const uint64_t *keys, int count)
+{
+    int used = 0;
+    for(int i = 0; i < count; i++)
+    {
+        if(counts[i] != 0)
+            indices[used++] = i;
+    }
+    sort_key = keys;
+    qsort(indices, used, sizeof(int), compare_descending);
+    return used;
+}
+
+void profile_report(const profile_t *profile, FILE *out, int top_addresses)
+{
+    uint64_t total_cycles = 0;
+    uint64_t total_count = 0;
+    for(int i = 0; i < 256; i++)
+    {
+        total_cycles += profile->opcode_cycles[i];
+        total_count += profile->opcode_count[i];
+    }
+    double percent = total_cycles > 0 ? 100.0 / total_cycles : 0;
+
+    int opcodes[256];
+    int used = sorted_indices(opcodes, profile->opcode_count, profile->opcode_cycles, 256);
+    fprintf(out, "%llu instructions, %llu cycles\n\n", (unsigned long long)total_count,
+            (unsigned long long)total_cycles);
+    fprintf(out, "opcode  name  mode           count        cycles  cycles%%\n");
+    for(int i = 0; i < used; i++)
+    {
+        int code = opcodes[i];
+        const opcode_t *op = opcode_lookup(code);
+        fprintf(out, "    %02X  %-4s  %-8s %12llu  %12llu  %6.2f\n", code, op->name != NULL ? op->name : "???",
+                op->name != NULL ? mode_names[op->mode] : "", (unsigned long long)profile->opcode_count[code],
+                (unsigned long long)profile->opcode_cycles[code], profile->opcode_cycles[code] * percent);
+    }
+
+    int *addresses = malloc(0x10000 * sizeof(int));
+    if(addresses == NULL)
+        return;
+    used = sorted_indices(addresses, profile->pc_count, profile->pc_cycles, 0x10000);
+    if(top_addresses < used)
+        used = top_addresses;
+    fprintf(out, "\naddress        count        cycles  cycles%%\n");
+    for(int i = 0; i < used; i++)
+    {
+        int pc = addresses[i];
+        fprintf(out, "   $%04X %12llu  %12llu  %6.2f\n", pc, (unsigned long long)profile->pc_count[pc],
+                (unsigned long long)profile->pc_cycles[pc], profile->pc_cycles[pc] * percent);
+    }
+    free(addresses);
+
+    if(profile->idle_loop_count == 0)
+        return;
+    fprintf(out, "\n%llu cycles fast-forwarded in idle loops\n", (unsigned long long)profile->idle_cycles);
+    fprintf(out, "loop               skips  instructions        cycles\n");
+    for(int i = 0; i < profile->idle_loop_count; i++)
+    {
+        const struct profile_idle_loop *loop = &profile->idle_loops[i];
+        fprintf(out, "   $%04X-$%04X %9llu  %12llu  %12llu\n", loop->head, loop->end - 1,
+                (unsigned long long)loop->skips, (unsigned long long)loop->instructions,
+                (unsigned long long)loop->cycles);
+    }
+}
+
+// Writes the frames from the root down to node, separated by semicolons
+static void write_stack(const profile_t *profile, int32_t node, FILE *out)
+{
+    const struct profile_node *frame = &profile->nodes[node];
+    if(frame->parent >= 0)
+    {
+        write_stack(profile, frame->parent, out);
+        fputc(';', out);
+    }
+    if(frame->frame == FRAME_ROOT)
+        fputs(frame_prefixes[FRAME_ROOT], out);
+    else
+        fprintf(out, "%s_%04X", frame_prefixes[frame->frame], frame->address);
+}
+
+void profile_write_folded(const profile_t *profile, FILE *out)
+{
+    for(int32_t node = 0; node < profile->node_count; node++)
+    {
+        if(profile->nodes[node].cycles == 0)
+            continue;
+        write_stack(profile, node, out);
+        fprintf(out, " %llu\n", (unsigned long long)profile->nodes[node].cycles);
+    }
+}
@@ -0,0 +1,213 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu.h"
+
+#define PROFILE_MAX_NODES 0x10000
+#define PROFILE_MAX_DEPTH 256
+#define PROFILE_MAX_IDLE_LOOPS 64
+
+enum ProfileFrame {
+    FRAME_ROOT,
+    FRAME_CALL,
+    FRAME_NMI,
+    FRAME_IRQ
+};
+
+enum ProfileEffect {
+    EFFECT_NONE,
+    EFFECT_CALL,
+    EFFECT_BRK,
+    EFFECT_RETURN
+};
+
+// One call stack: the code entered at address from the parent's stack
+struct profile_node
+{
+    uint16_t address;
+    uint8_t frame;
+    uint16_t depth;
+    int32_t parent;
+    int32_t first_child;
+    int32_t next_sibling;
+    uint64_t cycles;
+};
+
+// An idle loop the CPU fast-forwarded through, from its first instruction to the end of its last
+struct profile_idle_loop
+{
+    uint16_t head;
+    uint16_t end;
+    uint64_t skips;
+    uint64_t instructions;
+    uint64_t cycles;
+};
+
+/*
+ * Execution counts and cycles per opcode and per address, plus a call tree
+ * rebuilt from JSR/RTS and interrupts/RTI. An instruction's cycles are
+ * known once the next one starts, so each is charged to its opcode,
+ * address and call stack then; that includes DMA stalls and other cycles
+ * devices add while it runs.
+ */
+struct cpu_profile
+{
+    uint64_t opcode_count[256];
+    uint64_t opcode_cycles[256];
+    uint64_t pc_count[0x10000];
+    uint64_t pc_cycles[0x10000];
+
+    uint16_t last_pc;
+    uint8_t last_opcode;
+    uint8_t last_effect;
+    uint64_t last_cycles;
+
+    int32_t node;
+    // Cycle the current node was entered or last charged at
+    uint64_t node_start;
+    int32_t node_count;
+    // Calls made while the tree was full or too deep; returns unwind these first
+    uint32_t overflow;
+    struct profile_node nodes[PROFILE_MAX_NODES];
+
+    // Instructions and cycles skipped in idle loops are counted here instead of per opcode and address
+    int32_t idle_loop_count;
+    uint64_t idle_cycles;
+    struct profile_idle_loop idle_loops[PROFILE_MAX_IDLE_LOOPS];
+};
+
+typedef struct cpu_profile profile_t;
+
+profile_t *profile_create();
+
+void profile_free(profile_t *profile);
+
+// Starts counting on cpu; the call tree's root is the code running now
+void profile_attach(profile_t *profile, cpu_t *cpu);
+
+// Stops counting, charging the last instruction run
+void profile_detach(cpu_t *cpu);
+
+// Opcodes, the top addresses, each sorted by cycles, and idle loops
+void profile_report(const profile_t *profile, FILE *out, int top_addresses);
+
+// One "root;sub_8000;nmi_C000 cycles" line per call stack, for flamegraph.pl
+void profile_write_folded(const profile_t *profile, FILE *out);
+
+// Charges the current node the cycles spent in it since node_start
+static inline void profile_charge_node(profile_t *profile, uint64_t cycles)
+{
+    profile->nodes[profile->node].cycles += cycles - profile->node_start;
+    profile->node_start = cycles;
+}
+
+static inline void profile_enter(profile_t *profile, uint16_t address, uint8_t frame, uint64_t cycles)
+{
+    profile_charge_node(profile, cycles);
+    if(profile->overflow > 0 || profile->node_count == PROFILE_MAX_NODES ||
+       profile->nodes[profile->node].depth == PROFILE_MAX_DEPTH)
+    {
+        profile->overflow += 1;
+        return;
+    }
+    int32_t child = profile->nodes[profile->node].first_child;
+    while(child >= 0 && (profile->nodes[child].address != address || profile->nodes[child].frame != frame))
+        child = profile->nodes[child].next_sibling;
+    if(child < 0)
+    {
+        child = profile->node_count++;
+        struct profile_node *node = &profile->nodes[child];
+        node->address = address;
+        node->frame = frame;
+        node->depth = profile->nodes[profile->node].depth + 1;
+        node->parent = profile->node;
+        node->first_child = -1;
+        node->next_sibling = profile->nodes[profile->node].first_child;
+        node->cycles = 0;
+        profile->nodes[profile->node].first_child = child;
+    }
+    profile->node = child;
+}
+
+static inline void profile_leave(profile_t *profile, uint64_t cycles)
+{
+    profile_charge_node(profile, cycles);
+    if(profile->overflow > 0)
+        profile->overflow -= 1;
+    else if(profile->node != 0)
+        profile->node = profile->nodes[profile->node].parent;
+}
+
+// Charges the previous instruction the cycles since it started and applies its call or return
+static inline void profile_charge(profile_t *profile, const cpu_t *cpu)
+{
+    uint64_t spent = cpu->cycles - profile->last_cycles;
+    profile->opcode_cycles[profile->last_opcode] += spent;
+    profile->pc_cycles[profile->last_pc] += spent;
+    profile->last_cycles = cpu->cycles;
+    if(profile->last_effect == EFFECT_CALL)
+        profile_enter(profile, cpu->program_counter, FRAME_CALL, cpu->cycles);
+    else if(profile->last_effect == EFFECT_BRK)
+        profile_enter(profile, cpu->program_counter, FRAME_IRQ, cpu->cycles);
+    else if(profile->last_effect == EFFECT_RETURN)
+        profile_leave(profile, cpu->cycles);
+    profile->last_effect = EFFECT_NONE;
+}
+
+// Run by the profiled engine before each instruction
+static inline void profile_instruction(profile_t *profile, const cpu_t *cpu)
+{
+    profile_charge(profile, cpu);
+    uint16_t pc = cpu->program_counter;
+    const uint8_t *page = cpu->bus.read_pages[pc >> 8];
+    uint8_t opcode = page != NULL ? page[pc & 0xFF] : 0;
+    profile->opcode_count[opcode] += 1;
+    profile->pc_count[pc] += 1;
+    profile->last_pc = pc;
+    profile->last_opcode = opcode;
+    if(opcode == 0x20)
+        profile->last_effect = EFFECT_CALL;
+    else if(opcode == 0x00 && !cpu->stop_on_brk)
+        profile->last_effect = EFFECT_BRK;
+    else if(opcode == 0x60 || opcode == 0x40)
+        profile->last_effect = EFFECT_RETURN;
+}
+
+// Run after the CPU skips whole iterations of the idle loop [head, end)
+static inline void profile_idle_loop(profile_t *profile, uint16_t head, uint16_t end, uint64_t instructions,
+                                     uint64_t cycles)
+{
+    // Keeps the skipped cycles off the loop's last instruction, charged when the next one starts
+    profile->last_cycles += cycles;
+    profile->idle_cycles += cycles;
+    int32_t i = 0;
+    while(i < profile->idle_loop_count && (profile->idle_loops[i].head != head || profile->idle_loops[i].end != end))
+        i++;
+    if(i == PROFILE_MAX_IDLE_LOOPS)
+        return;
+    if(i == profile->idle_loop_count)
+    {
+        profile->idle_loop_count += 1;
+        profile->idle_loops[i].head = head;
+        profile->idle_loops[i].end = end;
+    }
+    profile->idle_loops[i].skips += 1;
+    profile->idle_loops[i].instructions += instructions;
+    profile->idle_loops[i].cycles += cycles;
+}
+
+// Run before an interrupt is taken; the handler becomes a new frame
+static inline void profile_interrupt(profile_t *profile, const cpu_t *cpu, uint16_t vector, uint8_t frame)
+{
+    profile_charge(profile, cpu);
+    const uint8_t *page = cpu->bus.read_pages[vector >> 8];
+    uint16_t handler = page != NULL ? page[vector & 0xFF] | (uint16_t)page[(vector + 1) & 0xFF] << 8 : 0;
+    profile_enter(profile, handler, frame, cpu->cycles);
+    // The entry cycles count towards the handler's frame but no instruction
+    profile->last_cycles += INTERRUPT_CYCLES;
+}
+
+#endif
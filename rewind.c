@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <string.h>
+#include "rewind.h"
+#include "state.h"
+
+// Page index, 16-bit length and the worst case of (skip, count, literal) runs
+#define PAGE_ENCODED_MAX (3 + BUS_PAGE_SIZE / 2 * 3 + 2)
+#define RECORD_MAX (STATE_CPU_SIZE + 2 + BUS_PAGE_COUNT * PAGE_ENCODED_MAX)
+
+static const uint8_t zero_page[BUS_PAGE_SIZE];
+
+rewind_buffer_t *rewind_create(cpu_t *cpu, size_t budget, size_t max_frames, int keyframe_interval)
+{
+    if(cpu->scheduler != NULL)
+        return NULL;
+    rewind_buffer_t *buffer = calloc(1, sizeof(rewind_buffer_t));
+    if(buffer == NULL)
+        return NULL;
+    buffer->cpu = cpu;
+    buffer->arena = malloc(budget);
+    buffer->arena_size = budget;
+    buffer->records = malloc(max_frames * sizeof(struct rewind_record));
+    buffer->record_capacity = max_frames;
+    buffer->scratch = malloc(RECORD_MAX);
+    buffer->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+    if(buffer->arena == NULL || buffer->records == NULL || buffer->scratch == NULL || max_frames == 0)
+    {
+        rewind_free(buffer);
+        return NULL;
+    }
+    cpu_unshare(cpu);
+    bus_track_writes(&cpu->bus, cpu->memory, sizeof(cpu->memory));
+    return buffer;
+}
+
+void rewind_free(rewind_buffer_t *buffer)
+{
+    if(buffer->cpu->bus.tracked_memory == buffer->cpu->memory)
+        bus_track_writes(&buffer->cpu->bus, NULL, 0);
+    free(buffer->scratch);
+    free(buffer->records);
+    free(buffer->arena);
+    free(buffer);
+}
+
+/*
+ * Writes page XOR reference as runs of a skip count, a literal count and
+ * the literals, after the page number and encoded length. Returns the
+ * bytes written, or 0 when the pages are equal.
+ */
+static size_t encode_page(uint8_t *out, int page_number, const uint8_t *page, const uint8_t *reference)
+{
+    if(memcmp(page, reference, BUS_PAGE_SIZE) == 0)
+        return 0;
+    size_t length = 3;
+    int i = 0;
+    while(i < BUS_PAGE_SIZE)
+    {
+        int skip = 0;
+        while(i < BUS_PAGE_SIZE && skip < 255 && page[i] == reference[i])
+        {
+            i++;
+            skip++;
+        }
+        if(i == BUS_PAGE_SIZE)
+            break;
+        uint8_t *literals = out + length + 2;
+        int count = 0;
+        while(i < BUS_PAGE_SIZE && count < 255 && page[i] != reference[i])
+        {
+            literals[count++] = page[i] ^ reference[i];
+            i++;
+        }
+        out[length] = skip;
+        out[length + 1] = count;
+        length += 2 + count;
+    }
+    out[0] = page_number;
+    out[1] = (length - 3) & 0xFF;
+    out[2] = (length - 3) >> 8;
+    return length;
+}
+
+// XORs the pages of an encoded record into memory
+static void apply_pages(uint8_t *memory, const uint8_t *in)
+{
+    int pages = in[0] | in[1] << 8;
+    in += 2;
+    for(int i = 0; i < pages; i++)
+    {
+        uint8_t *out = memory + in[0] * BUS_PAGE_SIZE;
+        const uint8_t *end = in + 3 + (in[1] | in[2] << 8);
+        in += 3;
+        while(in < end)
+        {
+            out += in[0];
+            int count = in[1];
+            in += 2;
+            for(int j = 0; j < count; j++)
+                out[j] ^= in[j];
+            out += count;
+            in += count;
+        }
+    }
+}
+
+// Encodes the CPU into scratch as a keyframe or a frame against the keyframe
+static size_t encode(rewind_buffer_t *buffer, bool keyframe)
+{
+    cpu_t *cpu = buffer->cpu;
+    uint8_t *out = buffer->scratch;
+    cpu_save_registers(cpu, out);
+    size_t length = STATE_CPU_SIZE + 2;
+    int pages = 0;
+    for(int page = 0; page < BUS_PAGE_COUNT; page++)
+    {
+        if(!keyframe && !((buffer->changed[page >> 6] >> (page & 63)) & 1))
+            continue;
+        const uint8_t *reference = keyframe ? zero_page : &buffer->keyframe[page * BUS_PAGE_SIZE];
+        size_t page_length = encode_page(out + length, page, &cpu->memory[page * BUS_PAGE_SIZE], reference);
+        if(page_length > 0)
+        {
+            length += page_length;
+            pages += 1;
+        }
+    }
+    out[STATE_CPU_SIZE] = pages & 0xFF;
+    out[STATE_CPU_SIZE + 1] = pages >> 8;
+    return length;
+}
+
+static void drop_oldest_group(rewind_buffer_t *buffer)
+{
+    do
+    {
+        buffer->used -= buffer->records[buffer->first].length;
+        buffer->first = (buffer->first + 1) % buffer->record_capacity;
+        buffer->count -= 1;
+    } while(buffer->count > 0 && !buffer->records[buffer->first].keyframe);
+}
+
+/*
+ * Copies scratch into the arena after the newest record, dropping the
+ * oldest groups in the way. A frame is refused rather than dropping its
+ * own keyframe.
+ */
+static bool store(rewind_buffer_t *buffer, size_t length, bool keyframe)
+{
+    if(length > buffer->arena_size)
+        return false;
+    size_t end_of_newest = 0;
+    if(buffer->count > 0)
+    {
+        struct rewind_record *newest = &buffer->records[(buffer->first + buffer->count - 1) % buffer->record_capacity];
+        end_of_newest = newest->offset + newest->length;
+    }
+    size_t offset = end_of_newest;
+    bool wrapped = offset + length > buffer->arena_size;
+    if(wrapped)
+        offset = 0;
+    while(buffer->count > 0)
+    {
+        struct rewind_record *oldest = &buffer->records[buffer->first];
+        bool full = buffer->count == buffer->record_capacity;
+        bool overlaps = oldest->offset < offset + length && oldest->offset + oldest->length > offset;
+        // Records past the newest one are the oldest; wrapping leaves them behind
+        bool stranded = wrapped && oldest->offset >= end_of_newest;
+        if(!full && !overlaps && !stranded)
+            break;
+        if(!keyframe && buffer->first == buffer->key_index)
+            return false;
+        drop_oldest_group(buffer);
+    }
+    if(buffer->count == 0)
+        buffer->first = 0;
+
+    size_t index = (buffer->first + buffer->count) % buffer->record_capacity;
+    struct rewind_record *record = &buffer->records[index];
+    record->offset = offset;
+    record->length = length;
+    record->keyframe = keyframe;
+    memcpy(buffer->arena + offset, buffer->scratch, length);
+    buffer->count += 1;
+    buffer->used += length;
+    if(keyframe)
+        buffer->key_index = index;
+    return true;
+}
+
+static bool capture_keyframe(rewind_buffer_t *buffer)
+{
+    memcpy(buffer->keyframe, buffer->cpu->memory, sizeof(buffer->keyframe));
+    memset(buffer->changed, 0, sizeof(buffer->changed));
+    buffer->since_keyframe = 1;
+    return store(buffer, encode(buffer, true), true);
+}
+
+bool rewind_capture(rewind_buffer_t *buffer)
+{
+    if(buffer->cpu->scheduler != NULL)
+        return false;
+    bus_t *bus = &buffer->cpu->bus;
+    for(int i = 0; i < BUS_PAGE_COUNT / 64; i++)
+        buffer->changed[i] |= bus->dirty[i];
+    bus_clear_dirty(bus);
+
+    if(buffer->count == 0 || buffer->since_keyframe >= buffer->keyframe_interval)
+        return capture_keyframe(buffer);
+    if(!store(buffer, encode(buffer, false), false))
+        return capture_keyframe(buffer);
+    buffer->since_keyframe += 1;
+    return true;
+}
+
+bool rewind_step_back(rewind_buffer_t *buffer)
+{
+    if(buffer->count == 0 || buffer->cpu->scheduler != NULL)
+        return false;
+    cpu_t *cpu = buffer->cpu;
+    size_t capacity = buffer->record_capacity;
+    size_t newest = (buffer->first + buffer->count - 1) % capacity;
+    const uint8_t *frame = buffer->arena + buffer->records[newest].offset;
+    const uint8_t *keyframe = buffer->arena + buffer->records[buffer->key_index].offset;
+
+    cpu_unshare(cpu);
+    memset(cpu->memory, 0, sizeof(cpu->memory));
+    apply_pages(cpu->memory, keyframe + STATE_CPU_SIZE);
+    if(newest != buffer->key_index)
+        apply_pages(cpu->memory, frame + STATE_CPU_SIZE);
+    cpu_load_registers(cpu, frame);
+
+    buffer->used -= buffer->records[newest].length;
+    buffer->count -= 1;
+    if(newest == buffer->key_index && buffer->count > 0)
+    {
+        do
+            buffer->key_index = (buffer->key_index + capacity - 1) % capacity;
+        while(!buffer->records[buffer->key_index].keyframe);
+    }
+    // Memory was rewritten behind the bus, so start over from a keyframe
+    buffer->since_keyframe = buffer->keyframe_interval;
+    memset(buffer->changed, 0, sizeof(buffer->changed));
+    bus_clear_dirty(&cpu->bus);
+    return true;
+}
@@ -0,0 +1,69 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+struct rewind_record
+{
+    size_t offset;
+    size_t length;
+    bool keyframe;
+};
+
+/*
+ * The last frames of a CPU in a fixed byte budget. A keyframe holds all of
+ * memory; the frames after it hold only the pages that differ from it,
+ * XORed against it and run-length encoded. Which pages to compare comes
+ * from the bus's write tracking, so a frame costs in proportion to the
+ * pages the program wrote. Records sit in a ring arena; when it fills, the
+ * oldest keyframe is dropped along with the frames that depend on it.
+ *
+ * Only the CPU's registers and memory are recorded, so only a bare cpu_t
+ * can be rewound. The devices of a console would stay ahead of a cycle
+ * count that went back, so CPUs with a scheduler attached are refused.
+ */
+struct rewind_buffer
+{
+    cpu_t *cpu;
+    uint8_t *arena;
+    size_t arena_size;
+    size_t used;
+
+    struct rewind_record *records;
+    size_t record_capacity;
+    size_t first;
+    size_t count;
+    // Index of the newest keyframe in records
+    size_t key_index;
+
+    int keyframe_interval;
+    int since_keyframe;
+    // Pages written since the newest keyframe
+    uint64_t changed[BUS_PAGE_COUNT / 64];
+    // Memory as of the newest keyframe
+    uint8_t keyframe[0x10000];
+    // Room to encode one record before it is copied into the arena
+    uint8_t *scratch;
+};
+
+typedef struct rewind_buffer rewind_buffer_t;
+
+/*
+ * Keeps up to max_frames frames of cpu in budget bytes, with a keyframe
+ * every keyframe_interval frames. Starts tracking writes on cpu's bus.
+ * Returns NULL on allocation failure or if cpu has a scheduler.
+ */
+rewind_buffer_t *rewind_create(cpu_t *cpu, size_t budget, size_t max_frames, int keyframe_interval);
+
+void rewind_free(rewind_buffer_t *buffer);
+
+// Records the CPU as it is now; call once per frame. False if a keyframe does not fit the budget or cpu has since got a scheduler.
+bool rewind_capture(rewind_buffer_t *buffer);
+
+// Restores the newest recorded frame and drops it; false when there are none left or cpu has since got a scheduler
+bool rewind_step_back(rewind_buffer_t *buffer);
+
+#endif
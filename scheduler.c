@@ -0,0 +1,96 @@
+#include "scheduler.h"
+
+static void swap(scheduler_t *scheduler, int a, int b)
+{
+    int source = scheduler->heap[a];
+    scheduler->heap[a] = scheduler->heap[b];
+    scheduler->heap[b] = source;
+    scheduler->sources[scheduler->heap[a]].slot = a;
+    scheduler->sources[scheduler->heap[b]].slot = b;
+}
+
+static inline uint64_t due_at(const scheduler_t *scheduler, int slot)
+{
+    return scheduler->sources[scheduler->heap[slot]].due;
+}
+
+// Moves the source at slot up or down until the heap is ordered again
+static void sift(scheduler_t *scheduler, int slot)
+{
+    while(slot > 0 && due_at(scheduler, slot) < due_at(scheduler, (slot - 1) / 2))
+    {
+        swap(scheduler, slot, (slot - 1) / 2);
+        slot = (slot - 1) / 2;
+    }
+    while(true)
+    {
+        int least = slot;
+        int child = 2 * slot + 1;
+        if(child < SCHEDULER_SOURCES && due_at(scheduler, child) < due_at(scheduler, least))
+            least = child;
+        if(child + 1 < SCHEDULER_SOURCES && due_at(scheduler, child + 1) < due_at(scheduler, least))
+            least = child + 1;
+        if(least == slot)
+            return;
+        swap(scheduler, slot, least);
+        slot = least;
+    }
+}
+
+static void schedule(scheduler_t *scheduler, struct scheduler_source *source)
+{
+    source->due = source->next != NULL ? source->next(source->context) : SCHEDULER_NEVER;
+    sift(scheduler, source->slot);
+}
+
+void scheduler_init(scheduler_t *scheduler, cpu_t *cpu)
+{
+    scheduler->cpu = cpu;
+    for(int i = 0; i < SCHEDULER_SOURCES; i++)
+    {
+        struct scheduler_source *source = &scheduler->sources[i];
+        source->context = NULL;
+        source->sync = NULL;
+        source->next = NULL;
+        source->due = SCHEDULER_NEVER;
+        source->slot = i;
+        scheduler->heap[i] = i;
+    }
+}
+
+void scheduler_set(scheduler_t *scheduler, enum SchedulerSource source, void *context,
+                   scheduler_sync_t sync, scheduler_next_t next)
+{
+    scheduler->sources[source].context = context;
+    scheduler->sources[source].sync = sync;
+    scheduler->sources[source].next = next;
+    schedule(scheduler, &scheduler->sources[source]);
+}
+
+void scheduler_reschedule(scheduler_t *scheduler, enum SchedulerSource source)
+{
+    if(scheduler == NULL)
+        return;
+    schedule(scheduler, &scheduler->sources[source]);
+    cpu_stop_at(scheduler->cpu, scheduler_next_due(scheduler));
+}
+
+void scheduler_run_due(scheduler_t *scheduler)
+{
+    while(scheduler_next_due(scheduler) <= scheduler->cpu->cycles)
+    {
+        struct scheduler_source *source = &scheduler->sources[scheduler->heap[0]];
+        source->sync(source->context);
+        schedule(scheduler, source);
+    }
+}
+
+void scheduler_sync_all(scheduler_t *scheduler)
+{
+    for(int i = 0; i < SCHEDULER_SOURCES; i++)
+    {
+        struct scheduler_source *source = &scheduler->sources[i];
+        if(source->sync != NULL)
+            source->sync(source->context);
+    }
+}
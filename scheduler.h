@@ -0,0 +1,79 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+#define SCHEDULER_NEVER UINT64_MAX
+
+// The devices of a console with events the CPU has to stop for
+enum SchedulerSource {
+    // Start of vertical blank, raising NMI and completing a frame
+    SOURCE_PPU,
+    // Frame counter and DMC IRQs
+    SOURCE_APU,
+    // The scanline clock on which a mapper raises its IRQ
+    SOURCE_MAPPER_IRQ,
+    SCHEDULER_SOURCES
+};
+
+// Brings a device up to cpu->cycles, handling whatever fell due
+typedef void (*scheduler_sync_t)(void *context);
+
+// The CPU cycle at which the device next needs a sync, or SCHEDULER_NEVER
+typedef uint64_t (*scheduler_next_t)(void *context);
+
+struct scheduler_source
+{
+    void *context;
+    scheduler_sync_t sync;
+    scheduler_next_t next;
+    uint64_t due;
+    // Position in heap
+    int slot;
+};
+
+/*
+ * Orders device events by the CPU cycle they fall due at, so the CPU runs
+ * uninterrupted up to the earliest and only the devices due then are
+ * synced; the rest stay behind until the CPU touches their registers or
+ * their own event comes round. A register write that moves an event calls
+ * scheduler_reschedule(), which ends the CPU's current run early if the
+ * event now falls before it.
+ */
+struct scheduler
+{
+    cpu_t *cpu;
+    struct scheduler_source sources[SCHEDULER_SOURCES];
+    // Sources as a binary min-heap on due
+    int heap[SCHEDULER_SOURCES];
+};
+
+typedef struct scheduler scheduler_t;
+
+// Every source starts out with no device behind it and never falls due
+void scheduler_init(scheduler_t *scheduler, cpu_t *cpu);
+
+// Puts a device behind source and schedules its first event
+void scheduler_set(scheduler_t *scheduler, enum SchedulerSource source, void *context,
+                   scheduler_sync_t sync, scheduler_next_t next);
+
+/*
+ * Asks source for its next event again after a register write changed it;
+ * may be called from bus handlers while the CPU runs. scheduler may be
+ * NULL, for devices running without a console.
+ */
+void scheduler_reschedule(scheduler_t *scheduler, enum SchedulerSource source);
+
+static inline uint64_t scheduler_next_due(const scheduler_t *scheduler)
+{
+    return scheduler->sources[scheduler->heap[0]].due;
+}
+
+// Syncs every source due at or before cpu->cycles and schedules its next event
+void scheduler_run_due(scheduler_t *scheduler);
+
+// Syncs every source, due or not
+void scheduler_sync_all(scheduler_t *scheduler);
+
+#endif
@@ -0,0 +1,141 @@
+#include <string.h>
+#include "state.h"
+
+static inline void put_u16(uint8_t *out, uint16_t value)
+{
+    out[0] = value & 0xFF;
+    out[1] = value >> 8;
+}
+
+static inline void put_u32(uint8_t *out, uint32_t value)
+{
+    put_u16(out, value & 0xFFFF);
+    put_u16(out + 2, value >> 16);
+}
+
+static inline void put_u64(uint8_t *out, uint64_t value)
+{
+    put_u32(out, value & 0xFFFFFFFF);
+    put_u32(out + 4, value >> 32);
+}
+
+static inline uint16_t get_u16(const uint8_t *in)
+{
+    return in[0] | (uint16_t)in[1] << 8;
+}
+
+static inline uint32_t get_u32(const uint8_t *in)
+{
+    return get_u16(in) | (uint32_t)get_u16(in + 2) << 16;
+}
+
+static inline uint64_t get_u64(const uint8_t *in)
+{
+    return get_u32(in) | (uint64_t)get_u32(in + 4) << 32;
+}
+
+// Writes a chunk header at out and returns where its data starts
+static inline uint8_t *put_chunk(uint8_t *out, uint32_t tag, uint32_t length)
+{
+    put_u32(out, tag);
+    put_u32(out + 4, length);
+    return out + STATE_CHUNK_HEADER_SIZE;
+}
+
+void cpu_save_registers(const cpu_t *cpu, uint8_t *out)
+{
+    out[0] = cpu->reg_a;
+    out[1] = cpu->reg_x;
+    out[2] = cpu->reg_y;
+    out[3] = cpu->reg_status;
+    put_u16(out + 4, cpu->program_counter);
+    out[6] = cpu->stack_pointer;
+    out[7] = cpu->nmi_pending;
+    put_u64(out + 8, cpu->cycles);
+    out[16] = cpu->irq_lines;
+}
+
+void cpu_load_registers(cpu_t *cpu, const uint8_t *in)
+{
+    cpu->reg_a = in[0];
+    cpu->reg_x = in[1];
+    cpu->reg_y = in[2];
+    cpu->reg_status = in[3];
+    cpu->program_counter = get_u16(in + 4);
+    cpu->stack_pointer = in[6];
+    cpu->nmi_pending = in[7];
+    cpu->cycles = get_u64(in + 8);
+    cpu->irq_lines = in[16];
+}
+
+size_t cpu_state_size(const cpu_t *cpu)
+{
+    return CPU_STATE_SIZE;
+}
+
+size_t cpu_save_state(const cpu_t *cpu, void *buffer, size_t buffer_size)
+{
+    if(buffer_size < CPU_STATE_SIZE)
+        return 0;
+    uint8_t *out = buffer;
+    memcpy(out, STATE_MAGIC, 4);
+    put_u16(out + 4, STATE_VERSION);
+    put_u16(out + 6, 2);
+    put_u32(out + 8, CPU_STATE_SIZE);
+
+    uint8_t *regs = put_chunk(out + STATE_HEADER_SIZE, STATE_CHUNK_CPU, STATE_CPU_SIZE);
+    cpu_save_registers(cpu, regs);
+
+    uint8_t *ram = put_chunk(regs + STATE_CPU_SIZE, STATE_CHUNK_RAM, sizeof(cpu->memory));
+    if(cpu->cow == NULL)
+        memcpy(ram, cpu->memory, sizeof(cpu->memory));
+    else
+    {
+        for(int page = 0; page < BUS_PAGE_COUNT; page++)
+            memcpy(ram + page * BUS_PAGE_SIZE, cpu_page(cpu, page), BUS_PAGE_SIZE);
+    }
+    return CPU_STATE_SIZE;
+}
+
+bool cpu_load_state(cpu_t *cpu, const void *buffer, size_t size)
+{
+    const uint8_t *in = buffer;
+    if(size < STATE_HEADER_SIZE || memcmp(in, STATE_MAGIC, 4) != 0 ||
+       get_u16(in + 4) == 0 || get_u16(in + 4) > STATE_VERSION)
+        return false;
+    uint32_t total = get_u32(in + 8);
+    if(total < STATE_HEADER_SIZE || total > size)
+        return false;
+
+    // Zero-filled past the chunk of an earlier version
+    uint8_t regs[STATE_CPU_SIZE] = {0};
+    bool have_regs = false;
+    const uint8_t *ram = NULL;
+    size_t offset = STATE_HEADER_SIZE;
+    int chunks = get_u16(in + 6);
+    for(int i = 0; i < chunks; i++)
+    {
+        if(total - offset < STATE_CHUNK_HEADER_SIZE)
+            return false;
+        uint32_t tag = get_u32(in + offset);
+        uint32_t length = get_u32(in + offset + 4);
+        offset += STATE_CHUNK_HEADER_SIZE;
+        if(total - offset < length)
+            return false;
+        if(tag == STATE_CHUNK_CPU && (length == STATE_CPU_SIZE || length == STATE_CPU_V1_SIZE))
+        {
+            memcpy(regs, in + offset, length);
+            have_regs = true;
+        }
+        else if(tag == STATE_CHUNK_RAM && length == sizeof(cpu->memory))
+            ram = in + offset;
+        offset += length;
+    }
+    if(!have_regs || ram == NULL)
+        return false;
+
+    cpu_load_registers(cpu, regs);
+    cpu_unshare(cpu);
+    memcpy(cpu->memory, ram, sizeof(cpu->memory));
+    return true;
+}
@@ -0,0 +1,55 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/*
+ * Save states are a header followed by tagged chunks:
+ *
+ *   "CNES" | u16 version | u16 chunk count | u32 total size
+ *   u32 tag | u32 length | length bytes      (repeated)
+ *
+ * All integers are little-endian. Loaders skip chunks they do not know,
+ * so devices can add their own chunks without a version bump. Memory is
+ * stored as one block and copied with memcpy in both directions.
+ */
+#define STATE_MAGIC "CNES"
+#define STATE_VERSION 2
+#define STATE_HEADER_SIZE 12
+#define STATE_CHUNK_HEADER_SIZE 8
+
+#define STATE_TAG(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+#define STATE_CHUNK_CPU STATE_TAG('C', 'P', 'U', ' ')
+#define STATE_CHUNK_RAM STATE_TAG('R', 'A', 'M', ' ')
+
+#define STATE_CPU_SIZE 17
+// Version 1 CPU chunks end before the IRQ lines, which load as 0
+#define STATE_CPU_V1_SIZE 16
+#define CPU_STATE_SIZE (STATE_HEADER_SIZE + 2 * STATE_CHUNK_HEADER_SIZE + STATE_CPU_SIZE + 0x10000)
+
+// The CPU chunk: registers, cycle count, pending NMI and IRQ lines in STATE_CPU_SIZE bytes
+void cpu_save_registers(const cpu_t *cpu, uint8_t *out);
+void cpu_load_registers(cpu_t *cpu, const uint8_t *in);
+
+// Bytes needed to save cpu; the same for every CPU
+size_t cpu_state_size(const cpu_t *cpu);
+
+/*
+ * Saves registers, cycle count, pending interrupts and the 64KB of memory
+ * into buffer without allocating. Returns the bytes written, or 0 if
+ * buffer_size is smaller than cpu_state_size().
+ */
+size_t cpu_save_state(const cpu_t *cpu, void *buffer, size_t buffer_size);
+
+/*
+ * Restores a state saved by cpu_save_state(), of this version or an
+ * earlier one. Returns false, leaving cpu untouched, if the buffer is not
+ * a valid state of a known version. Bus
+ * mappings, the engine and stop_on_brk are configuration and are kept.
+ */
+bool cpu_load_state(cpu_t *cpu, const void *buffer, size_t size);
+
+#endif
@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <string.h>
+#include "opcode.h"
+#include "trace.h"
+
+#if defined(_WIN32)
+
+// Without mmap the ring lives on the heap and reaches the file on trace_close()
+static void *map_ring(tracer_t *tracer, const char *path)
+{
+    tracer->ring_file = fopen(path, "wb");
+    if(tracer->ring_file == NULL)
+        return NULL;
+    return calloc(1, tracer->map_size);
+}
+
+static void unmap_ring(tracer_t *tracer)
+{
+    if(tracer->header != NULL)
+    {
+        fwrite(tracer->header, 1, tracer->map_size, tracer->ring_file);
+        free(tracer->header);
+    }
+    if(tracer->ring_file != NULL)
+        fclose(tracer->ring_file);
+}
+
+#else
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static void *map_ring(tracer_t *tracer, const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return NULL;
+    void *map = MAP_FAILED;
+    if(ftruncate(fd, tracer->map_size) == 0)
+        map = mmap(NULL, tracer->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return map != MAP_FAILED ? map : NULL;
+}
+
+static void unmap_ring(tracer_t *tracer)
+{
+    if(tracer->header != NULL)
+        munmap(tracer->header, tracer->map_size);
+}
+
+#endif
+
+// Reads memory without side effects; handler pages read as 0
+static uint8_t peek(const cpu_t *cpu, uint16_t address)
+{
+    const uint8_t *page = cpu->bus.read_pages[address >> 8];
+    return page != NULL ? page[address & 0xFF] : 0;
+}
+
+static void record_cpu(struct trace_record *record, const cpu_t *cpu)
+{
+    uint16_t pc = cpu->program_counter;
+    for(int i = 0; i < 3; i++)
+        record->bytes[i] = peek(cpu, pc + i);
+    record->cycles = cpu->cycles;
+    record->pc = pc;
+    record->a = cpu->reg_a;
+    record->x = cpu->reg_x;
+    record->y = cpu->reg_y;
+    record->p = cpu_status(cpu);
+    record->sp = cpu->stack_pointer;
+    memset(record->reserved, 0, sizeof(record->reserved));
+}
+
+static void trace_text(void *context, const cpu_t *cpu)
+{
+    tracer_t *tracer = context;
+    struct trace_record record;
+    char line[TRACE_LINE_SIZE];
+    record_cpu(&record, cpu);
+    trace_format(&record, cpu, line, sizeof(line));
+    fputs(line, tracer->text);
+    fputc('\n', tracer->text);
+}
+
+static void trace_ring(void *context, const cpu_t *cpu)
+{
+    tracer_t *tracer = context;
+    uint64_t count = tracer->header->count;
+    record_cpu(&tracer->records[count % tracer->header->capacity], cpu);
+    tracer->header->count = count + 1;
+}
+
+tracer_t *trace_open_text(FILE *file)
+{
+    tracer_t *tracer = calloc(1, sizeof(tracer_t));
+    if(tracer == NULL)
+        return NULL;
+    tracer->text = file;
+    return tracer;
+}
+
+tracer_t *trace_open_ring(const char *path, uint64_t capacity)
+{
+    if(capacity == 0)
+        return NULL;
+    tracer_t *tracer = calloc(1, sizeof(tracer_t));
+    if(tracer == NULL)
+        return NULL;
+    tracer->map_size = sizeof(struct trace_ring_header) + capacity * sizeof(struct trace_record);
+    tracer->header = map_ring(tracer, path);
+    if(tracer->header == NULL)
+    {
+        trace_close(tracer);
+        return NULL;
+    }
+    tracer->records = (struct trace_record *)(tracer->header + 1);
+    memcpy(tracer->header->magic, TRACE_RING_MAGIC, 4);
+    tracer->header->version = TRACE_RING_VERSION;
+    tracer->header->record_size = sizeof(struct trace_record);
+    tracer->header->capacity = capacity;
+    tracer->header->count = 0;
+    return tracer;
+}
+
+void trace_close(tracer_t *tracer)
+{
+    unmap_ring(tracer);
+    if(tracer->text != NULL)
+        fflush(tracer->text);
+    free(tracer);
+}
+
+void trace_attach(tracer_t *tracer, cpu_t *cpu)
+{
+    cpu->trace = tracer->header != NULL ? trace_ring : trace_text;
+    cpu->trace_context = tracer;
+}
+
+void trace_detach(cpu_t *cpu)
+{
+    cpu->trace = NULL;
+    cpu->trace_context = NULL;
+}
+
+static uint16_t peek_16(const cpu_t *cpu, uint16_t address, uint16_t high_address)
+{
+    return peek(cpu, address) | (uint16_t)peek(cpu, high_address) << 8;
+}
+
+// The operand as nestest prints it, with the address and value it resolves to when cpu is known
+static void format_operand(const struct trace_record *record, const opcode_t *op, const cpu_t *cpu,
+                           char *out, size_t size)
+{
+    uint8_t low = record->bytes[1];
+    uint16_t absolute = low | (uint16_t)record->bytes[2] << 8;
+    bool jump = strcmp(op->name, "JMP") == 0 || strcmp(op->name, "JSR") == 0;
+    switch(op->mode)
+    {
+        case IMMEDIATE:
+            snprintf(out, size, "#$%02X", low);
+            return;
+        case ZERO_PAGE:
+            if(cpu != NULL)
+                snprintf(out, size, "$%02X = %02X", low, peek(cpu, low));
+            else
+                snprintf(out, size, "$%02X", low);
+            return;
+        case ZERO_PAGE_X:
+        case ZERO_PAGE_Y: {
+            char index = op->mode == ZERO_PAGE_X ? 'X' : 'Y';
+            uint8_t address = low + (op->mode == ZERO_PAGE_X ? record->x : record->y);
+            if(cpu != NULL)
+                snprintf(out, size, "$%02X,%c @ %02X = %02X", low, index, address, peek(cpu, address));
+            else
+                snprintf(out, size, "$%02X,%c", low, index);
+            return; }
+        case ABSOLUTE:
+            if(cpu != NULL && !jump)
+                snprintf(out, size, "$%04X = %02X", absolute, peek(cpu, absolute));
+            else
+                snprintf(out, size, "$%04X", absolute);
+            return;
+        case ABSOLUTE_X:
+        case ABSOLUTE_Y: {
+            char index = op->mode == ABSOLUTE_X ? 'X' : 'Y';
+            uint16_t address = absolute + (op->mode == ABSOLUTE_X ? record->x : record->y);
+            if(cpu != NULL)
+                snprintf(out, size, "$%04X,%c @ %04X = %02X", absolute, index, address, peek(cpu, address));
+            else
+                snprintf(out, size, "$%04X,%c", absolute, index);
+            return; }
+        case INDIRECT:
+            // The 6502 fetches the high byte without carrying into the pointer's page
+            if(cpu != NULL)
+                snprintf(out, size, "($%04X) = %04X", absolute,
+                         peek_16(cpu, absolute, (absolute & 0xFF00) | ((absolute + 1) & 0xFF)));
+            else
+                snprintf(out, size, "($%04X)", absolute);
+            return;
+        case INDIRECT_X: {
+            uint8_t pointer = low + record->x;
+            if(cpu != NULL)
+            {
+                uint16_t address = peek_16(cpu, pointer, (uint8_t)(pointer + 1));
+                snprintf(out, size, "($%02X,X) @ %02X = %04X = %02X", low, pointer, address, peek(cpu, address));
+            }
+            else
+                snprintf(out, size, "($%02X,X)", low);
+            return; }
+        case INDIRECT_Y:
+            if(cpu != NULL)
+            {
+                uint16_t base = peek_16(cpu, low, (uint8_t)(low + 1));
+                uint16_t address = base + record->y;
+                snprintf(out, size, "($%02X),Y = %04X @ %04X = %02X", low, base, address, peek(cpu, address));
+            }
+            else
+                snprintf(out, size, "($%02X),Y", low);
+            return;
+        case NONE_ADDRESSING:
+            if(op->len == 2)
+                snprintf(out, size, "$%04X", (uint16_t)(record->pc + 2 + (int8_t)low));
+            else if(strcmp(op->name, "ASL") == 0 || strcmp(op->name, "LSR") == 0 ||
+                    strcmp(op->name, "ROL") == 0 || strcmp(op->name, "ROR") == 0)
+                snprintf(out, size, "A");
+            else
+                out[0] = '\0';
+            return;
+    }
+    out[0] = '\0';
+}
+
+void trace_format(const struct trace_record *record, const cpu_t *cpu, char *line, size_t size)
+{
+    const opcode_t *op = opcode_lookup(record->bytes[0]);
+    char bytes[9];
+    char disassembly[40];
+    if(op->name == NULL)
+    {
+        snprintf(bytes, sizeof(bytes), "%02X", record->bytes[0]);
+        snprintf(disassembly, sizeof(disassembly), "???");
+    }
+    else
+    {
+        int length = 0;
+        for(int i = 0; i < op->len; i++)
+            length += snprintf(bytes + length, sizeof(bytes) - length, i == 0 ? "%02X" : " %02X", record->bytes[i]);
+        char operand[32];
+        format_operand(record, op, cpu, operand, sizeof(operand));
+        snprintf(disassembly, sizeof(disassembly), operand[0] != '\0' ? "%s %s" : "%s", op->name, operand);
+    }
+    snprintf(line, size, "%04X  %-8s  %-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu",
+             record->pc, bytes, disassembly, record->a, record->x, record->y, record->p, record->sp,
+             (unsigned long long)record->cycles);
+}
+
+bool trace_dump_ring(const char *path, FILE *out)
+{
+    FILE *file = fopen(path, "rb");
+    if(file == NULL)
+        return false;
+    struct trace_ring_header header;
+    if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_RING_MAGIC, 4) != 0 ||
+       header.version != TRACE_RING_VERSION || header.record_size != sizeof(struct trace_record) ||
+       header.capacity == 0)
+    {
+        fclose(file);
+        return false;
+    }
+    uint64_t first = header.count > header.capacity ? header.count - header.capacity : 0;
+    char line[TRACE_LINE_SIZE];
+    fseek(file, sizeof(header) + (first % header.capacity) * sizeof(struct trace_record), SEEK_SET);
+    for(uint64_t i = first; i < header.count; i++)
+    {
+        struct trace_record record;
+        if(i % header.capacity == 0 && i != first)
+            fseek(file, sizeof(header), SEEK_SET);
+        if(fread(&record, sizeof(record), 1, file) != 1)
+            break;
+        trace_format(&record, NULL, line, sizeof(line));
+        fprintf(out, "%s\n", line);
+    }
+    fclose(file);
+    return true;
+}
@@ -0,0 +1,83 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu.h"
+
+#define TRACE_LINE_SIZE 96
+#define TRACE_RING_MAGIC "CNTR"
+#define TRACE_RING_VERSION 1
+
+// The CPU as it was before one instruction
+struct trace_record
+{
+    uint64_t cycles;
+    uint16_t pc;
+    uint8_t bytes[3];
+    uint8_t a;
+    uint8_t x;
+    uint8_t y;
+    uint8_t p;
+    uint8_t sp;
+    uint8_t reserved[4];
+};
+
+/*
+ * Header of a ring file, followed by capacity records. The record for
+ * instruction n is at n % capacity, so the last min(count, capacity)
+ * records are the newest.
+ */
+struct trace_ring_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t capacity;
+    uint64_t count;
+};
+
+/*
+ * Instruction tracer. Text mode writes one nestest.log line per
+ * instruction to a stream; ring mode appends fixed-size records to a
+ * memory-mapped file and never calls into stdio. On Windows the ring is
+ * kept in memory and only written out by trace_close(). While attached the CPU
+ * runs a traced copy of the threaded engine whatever its engine setting;
+ * detached, the untraced engines run unchanged.
+ */
+struct tracer
+{
+    FILE *text;
+    // Windows only, which has no mmap: where the heap ring is written on close
+    FILE *ring_file;
+    struct trace_ring_header *header;
+    struct trace_record *records;
+    size_t map_size;
+};
+
+typedef struct tracer tracer_t;
+
+tracer_t *trace_open_text(FILE *file);
+
+// Creates or truncates path as a ring of capacity records; NULL on failure
+tracer_t *trace_open_ring(const char *path, uint64_t capacity);
+
+void trace_close(tracer_t *tracer);
+
+void trace_attach(tracer_t *tracer, cpu_t *cpu);
+
+void trace_detach(cpu_t *cpu);
+
+/*
+ * Formats record in nestest.log style, without the PPU column. Operand
+ * values ("= 00") are looked up in cpu's directly mapped pages when cpu is
+ * not NULL, reading no device registers.
+ */
+void trace_format(const struct trace_record *record, const cpu_t *cpu, char *line, size_t size);
+
+// Writes the records of a ring file as text lines, oldest first
+bool trace_dump_ring(const char *path, FILE *out);
+
+#endif
@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <string.h>
+#include "wav.h"
+
+#define WAV_HEADER_SIZE 44
+
+static void put_u16(uint8_t *out, uint16_t value)
+{
+    out[0] = value & 0xFF;
+    out[1] = value >> 8;
+}
+
+static void put_u32(uint8_t *out, uint32_t value)
+{
+    put_u16(out, value & 0xFFFF);
+    put_u16(out + 2, value >> 16);
+}
+
+static void write_header(wav_sink_t *wav)
+{
+    uint32_t data_size = wav->samples_written * 2;
+    uint8_t header[WAV_HEADER_SIZE];
+    memcpy(header, "RIFF", 4);
+    put_u32(header + 4, 36 + data_size);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_u32(header + 16, 16);
+    put_u16(header + 20, 1);
+    put_u16(header + 22, 1);
+    put_u32(header + 24, wav->sample_rate);
+    put_u32(header + 28, wav->sample_rate * 2);
+    put_u16(header + 32, 2);
+    put_u16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    put_u32(header + 40, data_size);
+    fseek(wav->file, 0, SEEK_SET);
+    fwrite(header, 1, sizeof(header), wav->file);
+}
+
+wav_sink_t *wav_open(const char *path, uint32_t sample_rate)
+{
+    FILE *file = fopen(path, "wb");
+    if(file == NULL)
+        return NULL;
+    wav_sink_t *wav = (wav_sink_t *)calloc(1, sizeof(wav_sink_t));
+    wav->file = file;
+    wav->sample_rate = sample_rate;
+    write_header(wav);
+    return wav;
+}
+
+void wav_write(wav_sink_t *wav, const int16_t *samples, size_t count)
+{
+    uint8_t bytes[512];
+    while(count > 0)
+    {
+        size_t chunk = count < sizeof(bytes) / 2 ? count : sizeof(bytes) / 2;
+        for(size_t i = 0; i < chunk; i++)
+            put_u16(bytes + i * 2, (uint16_t)samples[i]);
+        fwrite(bytes, 2, chunk, wav->file);
+        wav->samples_written += chunk;
+        samples += chunk;
+        count -= chunk;
+    }
+}
+
+size_t wav_drain(wav_sink_t *wav, audio_ring_t *ring)
+{
+    int16_t samples[1024];
+    size_t total = 0;
+    size_t count;
+    while((count = audio_ring_read(ring, samples, 1024)) > 0)
+    {
+        wav_write(wav, samples, count);
+        total += count;
+    }
+    return total;
+}
+
+void wav_close(wav_sink_t *wav)
+{
+    write_header(wav);
+    fclose(wav->file);
+    free(wav);
+}
@@ -0,0 +1,28 @@
+#ifndef WAV_H
+#define WAV_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "audio_ring.h"
+
+// Mono 16-bit PCM WAV file for headless runs; the header is patched on close
+struct wav_sink
+{
+    FILE *file;
+    uint32_t sample_rate;
+    uint32_t samples_written;
+};
+
+typedef struct wav_sink wav_sink_t;
+
+// Returns NULL if the file cannot be created
+wav_sink_t *wav_open(const char *path, uint32_t sample_rate);
+
+void wav_write(wav_sink_t *wav, const int16_t *samples, size_t count);
+
+// Moves every sample currently in ring into the file and returns how many
+size_t wav_drain(wav_sink_t *wav, audio_ring_t *ring);
+
+void wav_close(wav_sink_t *wav);
+
+#endif